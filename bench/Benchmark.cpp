@@ -0,0 +1,107 @@
+#include "Benchmark.h"
+#include "BufferPool.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <new>
+
+using namespace std;
+
+static atomic<size_t> g_allocations_(0);
+
+void* operator new(size_t size) {
+	g_allocations_.fetch_add(1, memory_order_relaxed);
+
+	if (void* pointer = malloc(size ? size : 1))
+		return pointer;
+
+	throw bad_alloc();
+}
+
+void* operator new[](size_t size) {
+	return operator new(size);
+}
+
+void operator delete(void* pointer) noexcept {
+	free(pointer);
+}
+
+void operator delete[](void* pointer) noexcept {
+	free(pointer);
+}
+
+void operator delete(void* pointer, size_t) noexcept {
+	free(pointer);
+}
+
+void operator delete[](void* pointer, size_t) noexcept {
+	free(pointer);
+}
+
+size_t allocationCount() {
+	auto stats = BufferPool::getStats();
+
+	return g_allocations_.load(memory_order_relaxed) + stats.misses_ + stats.unpooled_;
+}
+
+Benchmark::Benchmark(double min_time, const string& filter) : min_time_(min_time), filter_(filter) {}
+
+const vector<BenchmarkResult>& Benchmark::getResults() const {
+	return results_;
+}
+
+void Benchmark::print(const map<string, BenchmarkResult>& baseline) const {
+	printf("%-40s %12s %12s %10s", "benchmark", "ns/op", "MB/s", "allocs/op");
+
+	if (!baseline.empty())
+		printf(" %12s %8s", "baseline", "change");
+
+	printf("\n");
+
+	for (auto& result : results_) {
+		printf("%-40s %12.1f %12.1f %10.2f", result.name_.c_str(), result.nanoseconds_, result.bytes_per_second_ / 1024 / 1024, result.allocations_);
+
+		auto iterator = baseline.find(result.name_);
+
+		if (iterator != baseline.end() && iterator->second.nanoseconds_ > 0)
+			printf(" %12.1f %+7.1f%%", iterator->second.nanoseconds_, (result.nanoseconds_ / iterator->second.nanoseconds_ - 1) * 100);
+
+		printf("\n");
+	}
+}
+
+bool Benchmark::save(const string& path, const vector<BenchmarkResult>& results) {
+	ofstream file(path);
+
+	if (!file.is_open())
+		return false;
+
+	file << "# name ns/op bytes/s allocs/op\n";
+
+	for (auto& result : results)
+		file << result.name_ << " " << result.nanoseconds_ << " " << result.bytes_per_second_ << " " << result.allocations_ << "\n";
+
+	return file.good();
+}
+
+map<string, BenchmarkResult> Benchmark::load(const string& path) {
+	map<string, BenchmarkResult> results;
+	ifstream file(path);
+	string line;
+
+	while (getline(file, line)) {
+		if (line.empty() || line.front() == '#')
+			continue;
+
+		istringstream stream(line);
+		BenchmarkResult result;
+
+		if (stream >> result.name_ >> result.nanoseconds_ >> result.bytes_per_second_ >> result.allocations_)
+			results[result.name_] = result;
+	}
+
+	return results;
+}
@@ -0,0 +1,98 @@
+#pragma once
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+
+// Keeps the compiler from optimizing away what a benchmark computes
+template<class T>
+inline void doNotOptimize(const T& value) {
+#if defined(__GNUC__)
+	asm volatile("" : : "g"(&value) : "memory");
+#else
+	static volatile const void* sink;
+	sink = &value;
+#endif
+}
+
+struct BenchmarkResult {
+	std::string name_;
+	double nanoseconds_		= 0;
+	double bytes_per_second_	= 0;
+	double allocations_		= 0;
+};
+
+// Heap allocations so far, operator new and packet memory the buffer pool had to allocate
+size_t allocationCount();
+
+// Runs each benchmark for about min_time seconds, values are per op where one call may do several ops
+class Benchmark {
+public:
+	Benchmark(double min_time, const std::string& filter);
+
+	template<class Function>
+	void run(const std::string& name, size_t ops, size_t bytes, Function&& function);
+
+	const std::vector<BenchmarkResult>& getResults() const;
+
+	// Baseline is optional, differences in time per op are printed next to it
+	void print(const std::map<std::string, BenchmarkResult>& baseline) const;
+
+	static bool save(const std::string& path, const std::vector<BenchmarkResult>& results);
+	static std::map<std::string, BenchmarkResult> load(const std::string& path);
+
+private:
+	double min_time_;
+	std::string filter_;
+
+	std::vector<BenchmarkResult> results_;
+};
+
+template<class Function>
+void Benchmark::run(const std::string& name, size_t ops, size_t bytes, Function&& function) {
+	if (!filter_.empty() && name.find(filter_) == std::string::npos)
+		return;
+
+	// Warm up caches and the buffer pool, then find how many calls take a tenth of the time
+	function();
+
+	size_t iterations = 1;
+
+	while (true) {
+		auto start = std::chrono::steady_clock::now();
+
+		for (size_t i = 0; i < iterations; i++)
+			function();
+
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+		if (elapsed.count() >= min_time_ / 10)
+			break;
+
+		iterations *= 2;
+	}
+
+	iterations *= 10;
+
+	auto allocations = allocationCount();
+	auto start = std::chrono::steady_clock::now();
+
+	for (size_t i = 0; i < iterations; i++)
+		function();
+
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	allocations = allocationCount() - allocations;
+
+	BenchmarkResult result;
+	result.name_ = name;
+	result.nanoseconds_ = elapsed.count() * 1e9 / (iterations * ops);
+	result.bytes_per_second_ = bytes * iterations / elapsed.count();
+	result.allocations_ = static_cast<double>(allocations) / (iterations * ops);
+
+	results_.push_back(result);
+}
+
+#endif
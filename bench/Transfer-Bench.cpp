@@ -0,0 +1,283 @@
+#include "Benchmark.h"
+#include "Packet.h"
+#include "PacketView.h"
+#include "PacketCreator.h"
+#include "PartialPacket.h"
+#include "NetworkCommunication.h"
+#include "BufferPool.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+using namespace std;
+
+static const size_t FIELDS = 64;
+
+// What the network hands to the packet thread, read position at the header
+static Packet received(const Packet& packet) {
+	return Packet(packet.getData() + 4, packet.getSize() - 4);
+}
+
+template<class Add>
+static void encode(Benchmark& benchmark, const string& name, size_t fields, size_t field_size, Add&& add) {
+	benchmark.run("packet/encode/" + name, fields, fields * field_size, [&] {
+		Packet packet(fields * (field_size + 4) + 8);
+		packet.addHeader(0);
+
+		for (size_t i = 0; i < fields; i++)
+			add(packet, i);
+
+		packet.finalize();
+		doNotOptimize(packet.getData());
+	});
+}
+
+template<class Get>
+static void decode(Benchmark& benchmark, const string& name, const Packet& source, size_t fields, size_t field_size, Get&& get) {
+	auto prepared = received(source);
+	prepared.getByte();
+
+	benchmark.run("packet/decode/" + name, fields, fields * field_size, [&] {
+		// Copies share the buffer, only the read position is reset
+		Packet packet = prepared;
+
+		for (size_t i = 0; i < fields; i++)
+			get(packet);
+	});
+}
+
+static void packets(Benchmark& benchmark) {
+	string small_string(16, 's');
+	string large_string(1024, 'l');
+	vector<unsigned char> bytes(64 * 1024, 'b');
+
+	encode(benchmark, "int", FIELDS, 4, [] (Packet& packet, size_t i) { packet.addInt(i); });
+	encode(benchmark, "bool", FIELDS, 1, [] (Packet& packet, size_t i) { packet.addBool(i & 1); });
+	encode(benchmark, "float", FIELDS, 4, [] (Packet& packet, size_t i) { packet.addFloat(i * 0.5f); });
+	encode(benchmark, "string16", FIELDS, small_string.size(), [&] (Packet& packet, size_t) { packet.addString(small_string); });
+	encode(benchmark, "string1k", FIELDS, large_string.size(), [&] (Packet& packet, size_t) { packet.addString(large_string); });
+	encode(benchmark, "bytes64k", 16, bytes.size(), [&] (Packet& packet, size_t) { packet.addBytes({ bytes.size(), bytes.data() }); });
+
+	auto source = [] (size_t fields, size_t field_size, auto&& add) {
+		Packet packet(fields * (field_size + 4) + 8);
+		packet.addHeader(0);
+
+		for (size_t i = 0; i < fields; i++)
+			add(packet, i);
+
+		packet.finalize();
+
+		return packet;
+	};
+
+	auto ints = source(FIELDS, 4, [] (Packet& packet, size_t i) { packet.addInt(i); });
+	auto bools = source(FIELDS, 1, [] (Packet& packet, size_t i) { packet.addBool(i & 1); });
+	auto floats = source(FIELDS, 4, [] (Packet& packet, size_t i) { packet.addFloat(i * 0.5f); });
+	auto small_strings = source(FIELDS, small_string.size(), [&] (Packet& packet, size_t) { packet.addString(small_string); });
+	auto large_strings = source(FIELDS, large_string.size(), [&] (Packet& packet, size_t) { packet.addString(large_string); });
+	auto chunks = source(16, bytes.size(), [&] (Packet& packet, size_t) { packet.addBytes({ bytes.size(), bytes.data() }); });
+
+	decode(benchmark, "int", ints, FIELDS, 4, [] (Packet& packet) { doNotOptimize(packet.getInt()); });
+	decode(benchmark, "bool", bools, FIELDS, 1, [] (Packet& packet) { doNotOptimize(packet.getBool()); });
+	decode(benchmark, "float", floats, FIELDS, 4, [] (Packet& packet) { doNotOptimize(packet.getFloat()); });
+	decode(benchmark, "string16", small_strings, FIELDS, small_string.size(), [] (Packet& packet) { doNotOptimize(packet.getString()); });
+	decode(benchmark, "string1k", large_strings, FIELDS, large_string.size(), [] (Packet& packet) { doNotOptimize(packet.getString()); });
+	decode(benchmark, "bytes64k", chunks, 16, bytes.size(), [] (Packet& packet) { doNotOptimize(packet.getBytes()); });
+
+	// Views into the packet instead of copies
+	auto view = [&] (const string& name, const Packet& source, size_t field_size) {
+		auto prepared = received(source);
+		prepared.getByte();
+
+		benchmark.run("packetview/decode/" + name, FIELDS, FIELDS * field_size, [&] {
+			PacketView view(prepared);
+
+			for (size_t i = 0; i < FIELDS; i++)
+				doNotOptimize(view.getString());
+		});
+	};
+
+	view("string16", small_strings, small_string.size());
+	view("string1k", large_strings, large_string.size());
+}
+
+static void creator(Benchmark& benchmark) {
+	vector<unsigned char> chunk(8 * 1024 * 1024, 'c');
+	vector<string> addresses = { "192.168.1.10", "10.0.0.5", "fe80::1", "shm:0123456789abcdef:/tmp/transfer-client-1-30500.sock" };
+
+	benchmark.run("creator/send/64k", 1, 64 * 1024, [&] {
+		doNotOptimize(PacketCreator::send("receiver", "file.bin", "directory/", { 64 * 1024, chunk.data() }, false, true, 1, 7));
+	});
+
+	benchmark.run("creator/send/8m", 1, chunk.size(), [&] {
+		doNotOptimize(PacketCreator::send("receiver", "file.bin", "directory/", { chunk.size(), chunk.data() }, false, true, 1, 7));
+	});
+
+	benchmark.run("creator/sendResult", 1, 0, [] {
+		doNotOptimize(PacketCreator::sendResult(1, true, 7));
+	});
+
+	benchmark.run("creator/inform", 1, 0, [] {
+		doNotOptimize(PacketCreator::inform("receiver", "file.bin", "directory/", true));
+	});
+
+	benchmark.run("creator/informResult", 1, 0, [&] {
+		doNotOptimize(PacketCreator::informResult(true, 1, 30500, addresses));
+	});
+
+	benchmark.run("creator/credit", 1, 0, [] {
+		doNotOptimize(PacketCreator::credit(1024 * 1024));
+	});
+
+	benchmark.run("creator/join", 1, 0, [] {
+		doNotOptimize(PacketCreator::join("receiver"));
+	});
+}
+
+// Framed packets back to back like on the wire, with where each one ends
+struct Stream {
+	vector<unsigned char> data_;
+	vector<size_t> ends_;
+};
+
+static Stream stream(size_t packets, size_t payload) {
+	Stream stream;
+	vector<unsigned char> bytes(payload, 'p');
+
+	for (size_t i = 0; i < packets; i++) {
+		auto packet = PacketCreator::send("", "file.bin", "", { bytes.size(), bytes.data() }, false, true, 1, i + 1);
+
+		stream.data_.insert(stream.data_.end(), packet.getData(), packet.getData() + packet.getSize());
+		stream.ends_.push_back(stream.data_.size());
+	}
+
+	return stream;
+}
+
+static void reassembly(Benchmark& benchmark) {
+	vector<pair<string, Stream>> streams;
+	streams.emplace_back("small", stream(1024, 64));
+	streams.emplace_back("chunks", stream(4, 1024 * 1024));
+
+	vector<pair<string, size_t>> fragments = { { "1b", 1 }, { "7b", 7 }, { "mss", 1460 }, { "64k", 64 * 1024 }, { "whole", 0 } };
+
+	for (auto& input : streams) {
+		auto& data = input.second.data_;
+
+		for (auto& fragment : fragments) {
+			// Byte at a time through megabytes takes too long to be useful
+			if (input.first == "chunks" && fragment.second == 1)
+				continue;
+
+			auto fragment_size = fragment.second == 0 ? data.size() : fragment.second;
+
+			benchmark.run("partialpacket/" + input.first + "/" + fragment.first, input.second.ends_.size(), data.size(), [&] {
+				PartialPacket partial_packet;
+
+				for (size_t offset = 0; offset < data.size();) {
+					auto size = min(fragment_size, data.size() - offset);
+
+					for (size_t used = 0; used < size;) {
+						auto adding = min<size_t>(size - used, partial_packet.getRemaining());
+
+						partial_packet.addData(data.data() + offset + used, adding);
+						used += adding;
+
+						if (partial_packet.isFinished()) {
+							Packet packet(move(partial_packet));
+							doNotOptimize(packet.getData());
+
+							partial_packet = PartialPacket();
+						}
+					}
+
+					offset += size;
+				}
+			});
+		}
+	}
+}
+
+// The receive thread's framing, through the incoming queue to waitForPackets()
+static void receive(Benchmark& benchmark) {
+	auto framing = [&] (const string& name, const Stream& input, size_t read_size) {
+		NetworkCommunication network;
+		vector<Packet> packets;
+
+		benchmark.run("receive/" + name, input.ends_.size(), input.data_.size(), [&] {
+			size_t popped = 0;
+
+			for (size_t offset = 0; offset < input.data_.size();) {
+				auto size = min(read_size, input.data_.size() - offset);
+
+				network.processReceived(input.data_.data() + offset, size);
+				offset += size;
+
+				// Drain what completed, the queue only holds PACKET_QUEUE_SIZE packets
+				auto completed = upper_bound(input.ends_.begin(), input.ends_.end(), offset) - input.ends_.begin();
+
+				while (popped < size_t(completed)) {
+					popped += network.waitForPackets(packets);
+					packets.clear();
+				}
+			}
+		});
+	};
+
+	framing("small/4k-reads", stream(1024, 64), 4 * 1024);
+	framing("chunks/64k-reads", stream(4, 1024 * 1024), 64 * 1024);
+	framing("chunks/1m-reads", stream(4, 1024 * 1024), 1024 * 1024);
+}
+
+static void usage() {
+	printf("Transfer-Bench [filter] [--time seconds] [--save file] [--compare file]\n");
+	printf("  filter     only runs benchmarks with this in their name\n");
+	printf("  --time     seconds per benchmark, default 0.5\n");
+	printf("  --save     writes the results as a baseline\n");
+	printf("  --compare  prints the change against a saved baseline\n");
+}
+
+int main(int argc, char** argv) {
+	string filter;
+	string save;
+	string compare;
+	double time = 0.5;
+
+	for (int i = 1; i < argc; i++) {
+		string argument = argv[i];
+
+		if (argument == "--time" && i + 1 < argc) {
+			time = atof(argv[++i]);
+		} else if (argument == "--save" && i + 1 < argc) {
+			save = argv[++i];
+		} else if (argument == "--compare" && i + 1 < argc) {
+			compare = argv[++i];
+		} else if (argument.front() == '-') {
+			usage();
+
+			return argument == "-h" || argument == "--help" ? 0 : 1;
+		} else {
+			filter = argument;
+		}
+	}
+
+	BufferPool::setLimit(256 * 1024 * 1024);
+
+	Benchmark benchmark(time, filter);
+
+	packets(benchmark);
+	creator(benchmark);
+	reassembly(benchmark);
+	receive(benchmark);
+
+	benchmark.print(compare.empty() ? map<string, BenchmarkResult>() : Benchmark::load(compare));
+
+	if (!save.empty() && !Benchmark::save(save, benchmark.getResults())) {
+		printf("Could not save the results to %s\n", save.c_str());
+
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,549 @@
+#include "IO.h"
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+
+#ifndef WIN32
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <limits.h>
+#endif
+
+using namespace std;
+
+#ifndef WIN32
+struct Usage {
+	double user_ = 0;
+	double system_ = 0;
+	long max_rss_kb_ = 0;
+};
+
+struct Workload {
+	string name_;
+	string path_;
+	size_t files_ = 0;
+	size_t bytes_ = 0;
+
+	// Relative to the data folder, the file the sender starts with
+	string first_file_;
+};
+
+struct Options {
+	vector<string> workloads_ = { "large", "tiny", "tree" };
+	vector<string> modes_ = { "relay", "direct" };
+	size_t large_mb_ = 1024;
+	size_t tiny_files_ = 100000;
+	size_t tree_files_ = 512;
+	vector<string> config_;
+	string output_;
+	string work_;
+	bool keep_ = false;
+	double timeout_ = 600;
+};
+
+static double seconds(chrono::steady_clock::duration duration) {
+	return chrono::duration<double>(duration).count();
+}
+
+static vector<string> split(const string& input, char delimiter) {
+	vector<string> tokens;
+	stringstream stream(input);
+	string token;
+
+	while (getline(stream, token, delimiter))
+		if (!token.empty())
+			tokens.push_back(token);
+
+	return tokens;
+}
+
+static bool writeFile(const string& path, size_t size, uint64_t seed) {
+	ofstream file(path, ios::binary);
+	vector<uint64_t> block(8 * 1024);
+
+	// Not compressible and not sparse, like real data
+	for (size_t written = 0; written < size;) {
+		for (auto& value : block) {
+			seed ^= seed << 13;
+			seed ^= seed >> 7;
+			seed ^= seed << 17;
+			value = seed;
+		}
+
+		auto amount = min(size - written, block.size() * sizeof(uint64_t));
+		file.write(reinterpret_cast<const char*>(block.data()), amount);
+		written += amount;
+	}
+
+	return file.good();
+}
+
+static bool fileSize(const string& path, size_t& size) {
+	struct stat stats;
+
+	if (stat(path.c_str(), &stats) != 0)
+		return false;
+
+	size = stats.st_size;
+
+	return true;
+}
+
+// Files and bytes below path, hidden files are skipped like the sender does
+static void count(const string& path, size_t& files, size_t& bytes) {
+	if (!IO::isDirectory(path)) {
+		size_t size = 0;
+
+		if (fileSize(path, size)) {
+			files++;
+			bytes += size;
+		}
+
+		return;
+	}
+
+	for (auto& entry : IO::listDirectory(path))
+		if (entry.front() != '.')
+			count(path + "/" + entry, files, bytes);
+}
+
+// Same order as the sender walks directories
+static string firstFile(const string& base, const string& relative) {
+	auto path = base + "/" + relative;
+
+	if (!IO::isDirectory(path))
+		return relative;
+
+	for (auto& entry : IO::listDirectory(path)) {
+		if (entry.front() == '.')
+			continue;
+
+		auto first = firstFile(base, relative + "/" + entry);
+
+		if (!first.empty())
+			return first;
+	}
+
+	return "";
+}
+
+static Workload generate(const string& name, const string& data, const Options& options) {
+	Workload workload;
+	workload.name_ = name;
+	workload.path_ = data + "/" + name;
+
+	auto marker = workload.path_ + ".done";
+	size_t size = 0;
+
+	// Reused between runs with the same work folder
+	if (!fileSize(marker, size)) {
+		fprintf(stderr, "Generating %s workload\n", name.c_str());
+
+		if (name == "large") {
+			writeFile(workload.path_, options.large_mb_ * 1024 * 1024, 1);
+		} else if (name == "tiny") {
+			IO::createDirectory(workload.path_ + "/");
+
+			for (size_t i = 0; i < options.tiny_files_; i++)
+				writeFile(workload.path_ + "/" + to_string(i), i % 1024 + 1, i + 1);
+		} else if (name == "tree") {
+			// Sizes from 1 KiB to 2 MiB spread over folders, like a source tree with some assets
+			for (size_t i = 0; i < options.tree_files_; i++) {
+				auto folder = workload.path_ + "/folder" + to_string(i % 16) + "/sub" + to_string(i % 3);
+
+				IO::createDirectory(folder + "/");
+				writeFile(folder + "/file" + to_string(i), size_t(1024) << (i % 12), i + 1);
+			}
+		}
+
+		ofstream(marker) << "done\n";
+	}
+
+	count(workload.path_, workload.files_, workload.bytes_);
+	workload.first_file_ = firstFile(data, name);
+
+	return workload;
+}
+
+static string directoryOf(const string& path) {
+	auto slash = path.find_last_of('/');
+
+	return slash == string::npos ? "." : path.substr(0, slash);
+}
+
+// Binaries next to this one
+static string binaryDirectory(const char* argv0) {
+	char buffer[PATH_MAX];
+	auto length = readlink("/proc/self/exe", buffer, sizeof(buffer) - 1);
+
+	if (length > 0) {
+		buffer[length] = '\0';
+
+		return directoryOf(buffer);
+	}
+
+	return directoryOf(argv0);
+}
+
+static pid_t spawn(const string& directory, const string& binary, const vector<string>& arguments) {
+	auto pid = fork();
+
+	if (pid != 0)
+		return pid;
+
+	if (chdir(directory.c_str()) != 0)
+		_exit(127);
+
+	// Output goes to a log next to the config
+	int log = open("log", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (log >= 0) {
+		dup2(log, STDOUT_FILENO);
+		dup2(log, STDERR_FILENO);
+		close(log);
+	}
+
+	vector<char*> argv;
+	argv.push_back(const_cast<char*>(binary.c_str()));
+
+	for (auto& argument : arguments)
+		argv.push_back(const_cast<char*>(argument.c_str()));
+
+	argv.push_back(nullptr);
+	execv(binary.c_str(), argv.data());
+
+	_exit(127);
+}
+
+// Linux carries the peak RSS of the forked harness over exec, it is kept small for the numbers to mean something
+static bool reap(pid_t pid, bool block, int& status, Usage& usage) {
+	rusage resources;
+	auto result = wait4(pid, &status, block ? 0 : WNOHANG, &resources);
+
+	if (result != pid)
+		return false;
+
+	usage.user_ = resources.ru_utime.tv_sec + resources.ru_utime.tv_usec / 1e6;
+	usage.system_ = resources.ru_stime.tv_sec + resources.ru_stime.tv_usec / 1e6;
+	usage.max_rss_kb_ = resources.ru_maxrss;
+
+	return true;
+}
+
+static Usage stop(pid_t pid) {
+	Usage usage;
+	int status;
+
+	kill(pid, SIGTERM);
+	reap(pid, true, status, usage);
+
+	return usage;
+}
+
+static unsigned short freePort() {
+	int probe = socket(AF_INET, SOCK_STREAM, 0);
+	sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	socklen_t length = sizeof(address);
+	unsigned short port = 0;
+
+	if (::bind(probe, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0 && getsockname(probe, reinterpret_cast<sockaddr*>(&address), &length) == 0)
+		port = ntohs(address.sin_port);
+
+	close(probe);
+
+	return port;
+}
+
+template<class Condition>
+static bool waitFor(double timeout, Condition&& condition) {
+	auto deadline = chrono::steady_clock::now() + chrono::duration<double>(timeout);
+
+	while (!condition()) {
+		if (chrono::steady_clock::now() >= deadline)
+			return false;
+
+		this_thread::sleep_for(chrono::milliseconds(5));
+	}
+
+	return true;
+}
+
+static bool listening(unsigned short port) {
+	int probe = socket(AF_INET, SOCK_STREAM, 0);
+	sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons(port);
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	auto result = connect(probe, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0;
+	close(probe);
+
+	return result;
+}
+
+static bool logContains(const string& path, const string& text) {
+	ifstream file(path);
+	stringstream contents;
+	contents << file.rdbuf();
+
+	return contents.str().find(text) != string::npos;
+}
+
+static void writeConfig(const string& path, const string& contents, const Options& options) {
+	ofstream file(path);
+	file << contents;
+
+	for (auto& line : options.config_)
+		file << line << "\n";
+}
+
+static string usageJson(const Usage& usage) {
+	char buffer[256];
+	snprintf(buffer, sizeof(buffer), "{ \"cpu_user\": %.3f, \"cpu_system\": %.3f, \"max_rss_kb\": %ld }", usage.user_, usage.system_, usage.max_rss_kb_);
+
+	return buffer;
+}
+
+// One workload in one mode with a fresh server, receiver and sender. Returns the result as JSON
+static string run(const Workload& workload, const string& mode, const string& work, const string& binaries, const Options& options) {
+	auto base = work + "/" + workload.name_ + "-" + mode;
+	auto server_folder = base + "/server";
+	auto receiver_folder = base + "/receiver";
+	auto sender_folder = base + "/sender";
+
+	if (system(("rm -rf '" + base + "'").c_str())) {}
+
+	IO::createDirectory(server_folder + "/");
+	IO::createDirectory(receiver_folder + "/");
+	IO::createDirectory(sender_folder + "/");
+
+	auto port = freePort();
+	auto direct = mode == "direct" ? "1" : "0";
+	auto client = "host: 127.0.0.1\nport: " + to_string(port) + "\ndirect: " + direct + "\n";
+
+	writeConfig(server_folder + "/config", "port: " + to_string(port) + "\nstats_interval: 0\n", Options());
+	writeConfig(receiver_folder + "/config", "name: loopback-receiver\noutput_folder: files\n" + client, options);
+	writeConfig(sender_folder + "/config", "name: loopback-sender\n" + client, options);
+
+	string error;
+	double elapsed = 0;
+	double first_byte = -1;
+	int status = -1;
+	size_t files = 0;
+	size_t bytes = 0;
+	Usage sender_usage, receiver_usage, server_usage;
+
+	auto server = spawn(server_folder, binaries + "/Transfer-Server", {});
+	pid_t receiver = -1;
+
+	if (!waitFor(10, [port] { return listening(port); })) {
+		error = "server did not start";
+	} else {
+		receiver = spawn(receiver_folder, binaries + "/Transfer-Client", { "-m" });
+
+		if (!waitFor(10, [&receiver_folder] { return logContains(receiver_folder + "/log", "Accepted at Server"); }))
+			error = "receiver did not register";
+	}
+
+	if (error.empty()) {
+		auto first_path = receiver_folder + "/files/" + workload.first_file_;
+		auto start = chrono::steady_clock::now();
+		auto sender = spawn(sender_folder, binaries + "/Transfer-Client", { "-r", "-s", workload.path_, "-t", "loopback-receiver" });
+		bool exited = false;
+
+		// Time to first byte is when the first file has data at the receiver
+		while (!exited) {
+			size_t size = 0;
+
+			if (first_byte < 0 && fileSize(first_path, size) && size > 0)
+				first_byte = seconds(chrono::steady_clock::now() - start);
+
+			exited = reap(sender, false, status, sender_usage);
+
+			if (!exited) {
+				if (seconds(chrono::steady_clock::now() - start) > options.timeout_) {
+					sender_usage = stop(sender);
+					error = "timeout";
+
+					break;
+				}
+
+				this_thread::sleep_for(chrono::microseconds(first_byte < 0 ? 100 : 2000));
+			}
+		}
+
+		elapsed = seconds(chrono::steady_clock::now() - start);
+
+		// The receiver answers before it flushes, give it a moment to finish writing
+		if (error.empty()) {
+			waitFor(30, [&] {
+				files = 0;
+				bytes = 0;
+
+				count(receiver_folder + "/files/" + workload.name_, files, bytes);
+
+				return files == workload.files_ && bytes == workload.bytes_;
+			});
+
+			if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+				error = "sender failed";
+			else if (files != workload.files_ || bytes != workload.bytes_)
+				error = "received " + to_string(files) + " files and " + to_string(bytes) + " bytes";
+		}
+	}
+
+	if (receiver > 0)
+		receiver_usage = stop(receiver);
+
+	server_usage = stop(server);
+
+	if (!options.keep_ && error.empty())
+		if (system(("rm -rf '" + receiver_folder + "/files'").c_str())) {}
+
+	fprintf(stderr, "%s/%s: %.3f s%s%s\n", workload.name_.c_str(), mode.c_str(), elapsed, error.empty() ? "" : ", ", error.c_str());
+
+	char buffer[1024];
+	snprintf(buffer, sizeof(buffer),
+		"    { \"workload\": \"%s\", \"mode\": \"%s\", \"ok\": %s, \"error\": \"%s\", \"files\": %zu, \"bytes\": %zu, \"seconds\": %.3f, "
+		"\"mb_per_second\": %.1f, \"files_per_second\": %.1f, \"time_to_first_byte_ms\": %.2f,\n",
+		workload.name_.c_str(), mode.c_str(), error.empty() ? "true" : "false", error.c_str(), workload.files_, workload.bytes_, elapsed,
+		elapsed > 0 ? workload.bytes_ / 1024.0 / 1024 / elapsed : 0, elapsed > 0 ? workload.files_ / elapsed : 0, first_byte < 0 ? -1 : first_byte * 1000);
+
+	return string(buffer) + "      \"sender\": " + usageJson(sender_usage) + ",\n      \"receiver\": " + usageJson(receiver_usage) + ",\n      \"server\": " + usageJson(server_usage) + " }";
+}
+
+static void usage() {
+	fprintf(stderr, "Transfer-Loopback [options], runs transfers through a local Transfer-Server and prints the results as JSON\n");
+	fprintf(stderr, "  --workloads list   large,tiny,tree (default all)\n");
+	fprintf(stderr, "  --modes list       relay,direct (default both)\n");
+	fprintf(stderr, "  --large-mb n       size of the large file, default 1024\n");
+	fprintf(stderr, "  --tiny-files n     number of tiny files, default 100000\n");
+	fprintf(stderr, "  --tree-files n     number of files in the tree, default 512\n");
+	fprintf(stderr, "  --config line      extra client config, e.g \"buffer_size: 8388608\", can be repeated\n");
+	fprintf(stderr, "  --work folder      where data and runs are kept, data is reused (default a new folder in /tmp)\n");
+	fprintf(stderr, "  --output file      JSON output file instead of stdout\n");
+	fprintf(stderr, "  --timeout seconds  per run, default 600\n");
+	fprintf(stderr, "  --keep             keep the received files\n");
+}
+#endif
+
+int main(int argc, char** argv) {
+#ifdef WIN32
+	if (argc || argv) {}
+
+	fprintf(stderr, "Transfer-Loopback needs fork() and wait4(), not supported on Windows\n");
+
+	return 1;
+#else
+	Options options;
+
+	for (int i = 1; i < argc; i++) {
+		string argument = argv[i];
+		bool value = i + 1 < argc;
+
+		if (argument == "--workloads" && value) {
+			options.workloads_ = split(argv[++i], ',');
+		} else if (argument == "--modes" && value) {
+			options.modes_ = split(argv[++i], ',');
+		} else if (argument == "--large-mb" && value) {
+			options.large_mb_ = strtoul(argv[++i], nullptr, 10);
+		} else if (argument == "--tiny-files" && value) {
+			options.tiny_files_ = strtoul(argv[++i], nullptr, 10);
+		} else if (argument == "--tree-files" && value) {
+			options.tree_files_ = strtoul(argv[++i], nullptr, 10);
+		} else if (argument == "--config" && value) {
+			options.config_.push_back(argv[++i]);
+		} else if (argument == "--work" && value) {
+			options.work_ = argv[++i];
+		} else if (argument == "--output" && value) {
+			options.output_ = argv[++i];
+		} else if (argument == "--timeout" && value) {
+			options.timeout_ = atof(argv[++i]);
+		} else if (argument == "--keep") {
+			options.keep_ = true;
+		} else {
+			usage();
+
+			return argument == "-h" || argument == "--help" ? 0 : 1;
+		}
+	}
+
+	// A receiver which is gone should not take the harness with it
+	signal(SIGPIPE, SIG_IGN);
+
+	if (options.work_.empty()) {
+		char folder[] = "/tmp/transfer-loopback-XXXXXX";
+
+		if (mkdtemp(folder) == nullptr) {
+			fprintf(stderr, "Could not create a work folder\n");
+
+			return 1;
+		}
+
+		options.work_ = folder;
+	}
+
+	char absolute[PATH_MAX];
+	IO::createDirectory(options.work_ + "/data/");
+
+	if (realpath(options.work_.c_str(), absolute) != nullptr)
+		options.work_ = absolute;
+
+	auto binaries = binaryDirectory(argv[0]);
+	auto data = options.work_ + "/data";
+
+	fprintf(stderr, "Work folder %s\n", options.work_.c_str());
+
+	vector<string> results;
+
+	for (auto& name : options.workloads_) {
+		if (name != "large" && name != "tiny" && name != "tree") {
+			fprintf(stderr, "Unknown workload %s\n", name.c_str());
+
+			return 1;
+		}
+
+		auto workload = generate(name, data, options);
+
+		for (auto& mode : options.modes_)
+			results.push_back(run(workload, mode, options.work_, binaries, options));
+	}
+
+	stringstream json;
+	json << "{\n  \"results\": [\n";
+
+	for (size_t i = 0; i < results.size(); i++)
+		json << results.at(i) << (i + 1 < results.size() ? ",\n" : "\n");
+
+	json << "  ]\n}\n";
+
+	if (options.output_.empty()) {
+		printf("%s", json.str().c_str());
+	} else {
+		ofstream(options.output_) << json.str();
+	}
+
+	return 0;
+#endif
+}
@@ -12,6 +12,12 @@ rm -rf build/
 
 # clean cross platform binaries
 rm -f bin/Transfer-Client*
+rm -f bin/Transfer-Server*
+rm -f bin/Transfer-Bench*
+rm -f bin/Transfer-Loopback*
+
+# clean the core library
+rm -f bin/libTransfer-Core.a
 
 # clean rel_bin
 rm -rf rel_bin/linux/
@@ -34,6 +34,10 @@ else
 		cd ../
 		mkdir -p rel_bin/linux/
 		cp bin/* rel_bin/linux/
+		rm -f rel_bin/linux/Transfer-Server*
+		rm -f rel_bin/linux/Transfer-Bench*
+		rm -f rel_bin/linux/Transfer-Loopback*
+		rm -f rel_bin/linux/libTransfer-Core.a
 		cd rel_bin/linux/
 		zip ../transfer_client_linux.zip *
 		cd ../../
@@ -53,6 +57,10 @@ else
 		cd ../
 		mkdir -p rel_bin/windows/
 		cp bin/* rel_bin/windows/
+		rm -f rel_bin/windows/Transfer-Server*
+		rm -f rel_bin/windows/Transfer-Bench*
+		rm -f rel_bin/windows/Transfer-Loopback*
+		rm -f rel_bin/windows/libTransfer-Core.a
 		cd rel_bin/windows/
 		zip ../transfer_client_windows.zip *
 		cd ../../
@@ -0,0 +1,397 @@
+#include "RelayServer.h"
+#include "Log.h"
+#include "Packet.h"
+#include "PacketView.h"
+#include "Trace.h"
+
+#include <chrono>
+#include <cstring>
+#include <vector>
+#include <iomanip>
+
+using namespace std;
+
+// Layouts of the answers the server sends, clients read these field by field. Messages sent unasked
+// are declared with the client's messages
+using InitializeAnswerMessage = Message<HEADER_INITIALIZE, Field::Bool>;
+using UnsupportedVersionMessage = Message<HEADER_INITIALIZE, Field::Bool, Field::Int, Field::String, Field::String, Field::String>;
+using JoinAnswerMessage = Message<HEADER_JOIN, Field::Bool>;
+using InformDeclinedMessage = Message<HEADER_INFORM, Field::Bool>;
+using InformAnswerMessage = Message<HEADER_INFORM, Field::Bool, Field::Bool, Field::Int, Field::Int, Field::Int, Field::Strings>;
+// With the correlation ID of the inform last, only for encoding
+using CorrelatedInformDeclinedMessage = Message<HEADER_INFORM, Field::Bool, Field::Int>;
+using CorrelatedInformAnswerMessage = Message<HEADER_INFORM, Field::Bool, Field::Bool, Field::Int, Field::Int, Field::Int, Field::Strings, Field::Int>;
+// Inform results are read up to their counted addresses, a correlation ID might follow them
+using InformResultCountMessage = Message<HEADER_INFORM_RESULT, Field::Bool, Field::Int, Field::Int, Field::Int>;
+using SendReceiverMessage = Message<HEADER_SEND, Field::String>;
+
+// Clients only run the auto-update for ERROR_OLD_PROTOCOL (0), this server has nothing to update with
+static const int ERROR_UNSUPPORTED_VERSION = 1;
+
+static const array<const char*, HEADER_JOB> g_header_names_ = {{
+	"JOIN", "AVAILABLE", "INFORM", "SEND", "SEND_RESULT", "INITIALIZE", "INFORM_RESULT", "CLIENT_DISCONNECT", "CREDIT"
+}};
+
+RelayServer::RelayServer(const string& protocol) : protocol_(protocol) {}
+
+void RelayServer::run(unsigned short port, size_t stats_interval) {
+	auto host_socket = NetworkCommunication::hostServer(port);
+
+	if (host_socket < 0) {
+		Log(ERROR) << "Could not host at port " << port << endl;
+
+		return;
+	}
+
+	Log(INFORMATION) << "Relay server listening at port " << port << endl;
+
+	thread stats_thread(&RelayServer::statsThread, this, stats_interval);
+	stats_thread.detach();
+
+	while (true) {
+		auto socket = NetworkCommunication::acceptClient(host_socket);
+
+		if (socket < 0) {
+			Log(ERROR) << "accept() failed, stopping\n";
+
+			break;
+		}
+
+		auto client = make_shared<RelayClient>();
+		client->network_ = make_shared<NetworkCommunication>();
+
+		{
+			lock_guard<mutex> lock(clients_mutex_);
+			client->id_ = next_id_++;
+			clients_[client->id_] = client;
+		}
+
+		Log(DEBUG) << "Client " << client->id_ << " connected\n";
+
+		client->network_->adopt(socket);
+		client->thread_ = thread(&RelayServer::serve, this, client);
+	}
+}
+
+void RelayServer::serve(shared_ptr<RelayClient> client) {
+	vector<Packet> packets;
+	Trace::nameThread("relay");
+
+	while (client->network_->waitForPackets(packets) > 0) {
+		for (auto& packet : packets) {
+			TraceSpan span("relay", packet.getSize());
+			process(*client, packet);
+		}
+
+		packets.clear();
+	}
+
+	disconnect(*client);
+
+	lock_guard<mutex> lock(finished_mutex_);
+	finished_.push_back(client);
+}
+
+void RelayServer::process(RelayClient& client, Packet& packet) {
+	auto start = chrono::steady_clock::now();
+	auto size = packet.getSize();
+	auto header = packet.getByte();
+
+	switch (header) {
+		case HEADER_INITIALIZE: handleInitialize(client, packet);
+			break;
+
+		case HEADER_JOIN: handleJoin(client, packet);
+			break;
+
+		case HEADER_AVAILABLE: handleAvailable(client);
+			break;
+
+		case HEADER_INFORM: handleInform(client, packet);
+			break;
+
+		case HEADER_INFORM_RESULT: handleInformResult(client, packet);
+			break;
+
+		case HEADER_SEND: handleSend(client, packet);
+			break;
+
+		case HEADER_SEND_RESULT: handleSendResult(packet);
+			break;
+
+		default:
+			Log(WARNING) << "Unknown packet header " << (int)header << " from client " << client.id_ << endl;
+
+			return;
+	}
+
+	auto& counters = counters_.at(header);
+	counters.packets_++;
+	counters.bytes_ += size;
+	counters.nanoseconds_ += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+}
+
+void RelayServer::handleInitialize(RelayClient& client, Packet& packet) {
+	string version;
+
+	if (InitializeMessage::decode(packet, version) && version == protocol_) {
+		client.network_->send(InitializeAnswerMessage::encode(true));
+
+		return;
+	}
+
+	Log(WARNING) << "Client " << client.id_ << " uses protocol " << version << ", expected " << protocol_ << endl;
+
+	client.network_->send(UnsupportedVersionMessage::encode(false, ERROR_UNSUPPORTED_VERSION, "", "", ""));
+}
+
+void RelayServer::handleJoin(RelayClient& client, Packet& packet) {
+	string name;
+	bool accepted = false;
+
+	if (JoinMessage::decode(packet, name) && !name.empty()) {
+		lock_guard<mutex> lock(clients_mutex_);
+		auto iterator = names_.find(name);
+
+		if (iterator == names_.end() || iterator->second == client.id_) {
+			if (!client.name_.empty())
+				names_.erase(client.name_);
+
+			client.name_ = name;
+			names_[name] = client.id_;
+			accepted = true;
+		}
+	}
+
+	Log(DEBUG) << "Client " << client.id_ << (accepted ? " joined as " : " could not join as ") << name << endl;
+
+	client.network_->send(JoinAnswerMessage::encode(accepted));
+}
+
+void RelayServer::handleAvailable(RelayClient& client) {
+	lock_guard<mutex> lock(clients_mutex_);
+
+	Packet packet;
+	packet.addHeader(HEADER_AVAILABLE);
+	packet.addInt(names_.size());
+
+	for (auto& name : names_) {
+		packet.addInt(name.second);
+		packet.addString(name.first);
+	}
+
+	packet.finalize();
+	client.network_->send(packet);
+}
+
+void RelayServer::handleInform(RelayClient& client, Packet& packet) {
+	string to, file, directory;
+	bool direct;
+
+	if (!InformMessage::decode(packet, to, file, directory, direct)) {
+		Log(WARNING) << "Malformed inform from client " << client.id_ << endl;
+
+		return;
+	}
+
+	// Newer clients add a correlation ID, which goes to the receiver and back in its answer
+	auto correlation = packet.getRemaining() >= 4 ? packet.getInt() : 0;
+	shared_ptr<RelayClient> receiver;
+
+	{
+		lock_guard<mutex> lock(clients_mutex_);
+		auto iterator = names_.find(to);
+
+		if (iterator != names_.end())
+			receiver = clients_.at(iterator->second);
+	}
+
+	if (!receiver) {
+		client.network_->send(correlation > 0 ? CorrelatedInformDeclinedMessage::encode(false, correlation) : InformDeclinedMessage::encode(false));
+
+		return;
+	}
+
+	// The receiver answers with its addresses, which are passed back to the sender
+	if (correlation > 0)
+		receiver->network_->send(CorrelatedInformForwardMessage::encode(client.id_, file, directory, direct, correlation));
+	else
+		receiver->network_->send(InformForwardMessage::encode(client.id_, file, directory, direct));
+}
+
+void RelayServer::handleInformResult(RelayClient& client, Packet& packet) {
+	PacketView view(packet);
+	bool accept = false;
+	int sender_id = 0, amount = 0, port = 0;
+	vector<string> addresses;
+
+	if (InformResultCountMessage::decode(view, accept, sender_id, amount, port))
+		for (int i = 0; i < amount && !view.failed(); i++)
+			addresses.emplace_back(view.getString());
+
+	if (view.failed()) {
+		Log(WARNING) << "Malformed inform result from client " << client.id_ << endl;
+
+		return;
+	}
+
+	auto correlation = view.getRemaining() >= 4 ? view.getInt() : 0;
+	auto sender = find(sender_id);
+
+	if (!sender)
+		return;
+
+	if (correlation > 0)
+		sender->network_->send(CorrelatedInformAnswerMessage::encode(accept, !addresses.empty(), addresses.size(), port, sender_id, addresses, correlation));
+	else
+		sender->network_->send(InformAnswerMessage::encode(accept, !addresses.empty(), addresses.size(), port, sender_id, addresses));
+}
+
+void RelayServer::handleSend(RelayClient& client, Packet& packet) {
+	PacketView view(packet);
+	string_view to;
+
+	if (!SendReceiverMessage::decode(view, to)) {
+		Log(WARNING) << "Malformed chunk from client " << client.id_ << endl;
+
+		return;
+	}
+
+	shared_ptr<RelayClient> receiver;
+
+	{
+		lock_guard<mutex> lock(clients_mutex_);
+		auto iterator = names_.find(string(to));
+
+		if (iterator != names_.end())
+			receiver = clients_.at(iterator->second);
+	}
+
+	if (!receiver) {
+		// The chunk's correlation ID is last, without it the sender fails whichever chunk waited longest
+		PacketView chunk = view;
+		chunk.getString();
+		chunk.getString();
+		chunk.getBytes();
+		chunk.getBool();
+
+		auto correlation = chunk.getRemaining() >= 4 ? chunk.getInt() : 0;
+		client.network_->send(PacketCreator::sendResult(client.id_, false, chunk.failed() ? 0 : correlation));
+
+		return;
+	}
+
+	// Same chunk with the receiver name replaced by the sender ID, the rest is copied as is
+	auto remaining = view.getRemaining();
+	Packet forward(1 + 4 + remaining);
+	forward.addHeader(HEADER_SEND);
+	forward.addInt(client.id_);
+	memcpy(forward.extend(remaining), view.getReadPointer(), remaining);
+	forward.finalize();
+
+	receiver->network_->send(forward);
+}
+
+void RelayServer::handleSendResult(Packet& packet) {
+	int sender_id = packet.getInt();
+	auto sender = find(sender_id);
+
+	if (!sender)
+		return;
+
+	// Passed on unchanged, including a correlation ID if there is one
+	Packet forward(packet.getData(), packet.getSize());
+	forward.finalize();
+
+	sender->network_->send(forward);
+}
+
+shared_ptr<RelayClient> RelayServer::find(int id) {
+	lock_guard<mutex> lock(clients_mutex_);
+	auto iterator = clients_.find(id);
+
+	return iterator == clients_.end() ? nullptr : iterator->second;
+}
+
+void RelayServer::disconnect(RelayClient& client) {
+	vector<shared_ptr<RelayClient>> others;
+
+	{
+		lock_guard<mutex> lock(clients_mutex_);
+		clients_.erase(client.id_);
+
+		if (!client.name_.empty())
+			names_.erase(client.name_);
+
+		for (auto& other : clients_)
+			others.push_back(other.second);
+	}
+
+	Log(DEBUG) << "Client " << client.id_ << " disconnected\n";
+
+	// Receivers close the streams of files from this client
+	auto packet = DisconnectMessage::encode(client.id_);
+
+	for (auto& other : others)
+		other->network_->send(packet);
+}
+
+void RelayServer::reapClients() {
+	list<shared_ptr<RelayClient>> finished;
+
+	{
+		lock_guard<mutex> lock(finished_mutex_);
+		finished.swap(finished_);
+	}
+
+	for (auto& client : finished)
+		if (client->thread_.joinable())
+			client->thread_.join();
+}
+
+void RelayServer::statsThread(size_t interval) {
+	array<uint64_t, HEADER_JOB> last_packets = {};
+	array<uint64_t, HEADER_JOB> last_bytes = {};
+	array<uint64_t, HEADER_JOB> last_nanoseconds = {};
+
+	while (true) {
+		this_thread::sleep_for(chrono::seconds(interval > 0 ? interval : 1));
+
+		reapClients();
+
+		if (interval == 0)
+			continue;
+
+		size_t clients;
+
+		{
+			lock_guard<mutex> lock(clients_mutex_);
+			clients = clients_.size();
+		}
+
+		LogLine line(INFORMATION);
+		auto& log = line.stream();
+		log << "Relay: " << clients << " client(s)";
+
+		for (size_t i = 0; i < counters_.size(); i++) {
+			auto packets = counters_[i].packets_.load();
+			auto bytes = counters_[i].bytes_.load();
+			auto nanoseconds = counters_[i].nanoseconds_.load();
+			auto delta_packets = packets - last_packets[i];
+
+			if (delta_packets > 0) {
+				auto delta_bytes = bytes - last_bytes[i];
+
+				log << fixed << setprecision(1) << ", " << g_header_names_[i] << " " << delta_packets << " packets "
+					<< static_cast<double>(delta_bytes) / 1024 / 1024 / interval << " MB/s "
+					<< static_cast<double>(nanoseconds - last_nanoseconds[i]) / delta_packets / 1000 << " us handling";
+			}
+
+			last_packets[i] = packets;
+			last_bytes[i] = bytes;
+			last_nanoseconds[i] = nanoseconds;
+		}
+
+		log << endl;
+	}
+}
@@ -0,0 +1,75 @@
+#pragma once
+#ifndef RELAY_SERVER_H
+#define RELAY_SERVER_H
+
+#include "NetworkCommunication.h"
+#include "PacketCreator.h"
+
+#include <string>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <array>
+#include <list>
+#include <unordered_map>
+
+class Packet;
+
+struct RelayClient {
+	int id_;
+	std::string name_;
+
+	std::shared_ptr<NetworkCommunication> network_;
+	std::thread thread_;
+};
+
+// Per message type, what came in and how long it took to handle and forward
+struct RelayCounters {
+	std::atomic<uint64_t> packets_{0};
+	std::atomic<uint64_t> bytes_{0};
+	std::atomic<uint64_t> nanoseconds_{0};
+};
+
+// Minimal server for the client protocol: registration, listing, and forwarding informs, chunks and
+// their results between clients. Meant for measuring the relay path on one machine
+class RelayServer {
+public:
+	explicit RelayServer(const std::string& protocol);
+
+	// Accepts clients until the listening socket fails, statistics are logged every stats_interval seconds
+	void run(unsigned short port, size_t stats_interval);
+
+private:
+	void serve(std::shared_ptr<RelayClient> client);
+	void process(RelayClient& client, Packet& packet);
+
+	void handleInitialize(RelayClient& client, Packet& packet);
+	void handleJoin(RelayClient& client, Packet& packet);
+	void handleAvailable(RelayClient& client);
+	void handleInform(RelayClient& client, Packet& packet);
+	void handleInformResult(RelayClient& client, Packet& packet);
+	void handleSend(RelayClient& client, Packet& packet);
+	void handleSendResult(Packet& packet);
+
+	std::shared_ptr<RelayClient> find(int id);
+	void disconnect(RelayClient& client);
+
+	void statsThread(size_t interval);
+	void reapClients();
+
+	std::string protocol_;
+
+	std::mutex clients_mutex_;
+	std::unordered_map<int, std::shared_ptr<RelayClient>> clients_;
+	std::unordered_map<std::string, int> names_;
+	int next_id_ = 0;
+
+	// Disconnected clients, their threads are joined by the stats thread
+	std::mutex finished_mutex_;
+	std::list<std::shared_ptr<RelayClient>> finished_;
+
+	std::array<RelayCounters, HEADER_JOB> counters_;
+};
+
+#endif
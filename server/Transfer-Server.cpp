@@ -0,0 +1,58 @@
+#include "RelayServer.h"
+#include "NetworkCommunication.h"
+#include "SocketProfile.h"
+#include "BufferPool.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include "Config.h"
+#include "Log.h"
+
+#include <signal.h>
+#include <cstdlib>
+
+using namespace std;
+
+#ifdef WIN32
+constexpr auto quick_exit = _exit; // mingw32 does not support quick_exit for now
+#endif
+
+static void handler(int unused) {
+	if (unused) {}
+	
+	quick_exit(0);
+}
+
+int main() {
+	signal(SIGINT, handler);
+	signal(SIGTERM, handler);
+	
+	Log(NONE) << "Transfer-Server [reference relay] [" << __DATE__ << " @ " << __TIME__ << "]\n";
+	
+	Config config;
+	config.parse("config");
+	
+	Log::setDebug(config.get<bool>("debug", false));
+	
+	auto log_file = config.get<string>("log_file", "");
+	
+	if (!log_file.empty())
+		Log::setFile(log_file, config.get<size_t>("log_file_size", 10485760), config.get<size_t>("log_file_count", 3));
+	
+	BufferPool::setLimit(config.get<size_t>("buffer_pool_size", 128 * 1024 * 1024));
+	NetworkCommunication::setSocketProfile(SocketProfile::get(config.get<string>("socket_profile", "default"), config));
+	
+	auto metrics_file = config.get<string>("metrics_file", "");
+	
+	if (!metrics_file.empty())
+		Metrics::start(metrics_file, Metrics::getFormat(config.get<string>("metrics_format", "json")), config.get<size_t>("metrics_interval", 10));
+	
+	auto trace_file = config.get<string>("trace_file", "");
+	
+	if (!trace_file.empty())
+		Trace::start(trace_file, config.get<size_t>("trace_max_events", 1000000));
+	
+	RelayServer server(config.get<string>("protocol", "a10"));
+	server.run(config.get<unsigned short>("port", 12000), config.get<size_t>("stats_interval", 10));
+	
+	return 0;
+}
\ No newline at end of file
@@ -6,7 +6,6 @@
 
 Config Base::config_;
 NetworkCommunication Base::network_;
-CLI Base::cli_;
 Parameter Base::parameter_;
 
 Config& Base::config() {
@@ -17,10 +16,13 @@ NetworkCommunication& Base::network() {
 	return network_;
 }
 
+// Never destroyed since its workers might be handling packets at exit
 CLI& Base::cli() {
-	return cli_;
+	static CLI* cli = new CLI(config_, network_);
+	
+	return *cli;
 }
 
 Parameter& Base::parameter() {
 	return parameter_;
-}
\ No newline at end of file
+}
@@ -7,6 +7,7 @@ class NetworkCommunication;
 class CLI;
 class Parameter;
 
+// What the Transfer-Client executable shares, embedders create their own with TransferSession
 class Base {
 public:
 	static Config& config();
@@ -17,8 +18,7 @@ public:
 private:
 	static Config config_;
 	static NetworkCommunication network_;
-	static CLI cli_;
 	static Parameter parameter_;
 };
 
-#endif
\ No newline at end of file
+#endif
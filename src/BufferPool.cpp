@@ -0,0 +1,211 @@
+#include "BufferPool.h"
+#include "Log.h"
+
+#include <mutex>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+
+using namespace std;
+
+enum {
+	SMALLEST_CLASS = 256,
+	LARGEST_CLASS = 64 * 1024 * 1024,
+	HUGE_PAGE_SIZE = 2 * 1024 * 1024
+};
+
+// Four classes per power of two keeps the waste below 25 %, so a full chunk with its header does not end up in twice the size
+static vector<size_t> createClasses() {
+	vector<size_t> classes;
+	
+	for (size_t size = SMALLEST_CLASS; size < LARGEST_CLASS; size *= 2)
+		for (size_t step = 0; step < 4; step++)
+			classes.push_back(size + step * size / 4);
+			
+	classes.push_back(LARGEST_CLASS);
+	
+	return classes;
+}
+
+struct Pool {
+	mutex mutex_;
+	vector<size_t> classes_ = createClasses();
+	vector<vector<PacketBuffer*>> free_ = vector<vector<PacketBuffer*>>(classes_.size());
+	
+	size_t limit_ = 128 * 1024 * 1024;
+	BufferPoolStats stats_;
+};
+
+static atomic<bool> g_huge_pages_(false);
+
+// Never destroyed since Packets in static objects might be released after the pool otherwise would be
+static Pool& pool() {
+	static Pool* pool = new Pool();
+	
+	return *pool;
+}
+
+void* allocatePacketMemory(size_t size) {
+	void* pointer = nullptr;
+	
+#ifndef WIN32
+	if (g_huge_pages_ && size >= HUGE_PAGE_SIZE) {
+		if (posix_memalign(&pointer, HUGE_PAGE_SIZE, size) != 0)
+			throw bad_alloc();
+			
+#ifdef MADV_HUGEPAGE
+		madvise(pointer, size, MADV_HUGEPAGE);
+#endif
+
+		return pointer;
+	}
+#endif
+
+	pointer = malloc(size);
+	
+	if (pointer == nullptr)
+		throw bad_alloc();
+		
+	return pointer;
+}
+
+void freePacketMemory(void* pointer, size_t size) {
+	if (size) {}
+	
+	free(pointer);
+}
+
+shared_ptr<PacketBuffer> BufferPool::acquire(size_t size) {
+	auto& current = pool();
+	size = max(size, (size_t)SMALLEST_CLASS);
+	
+	if (size > LARGEST_CLASS) {
+		auto* buffer = new PacketBuffer();
+		buffer->reserve(size);
+		
+		lock_guard<mutex> lock(current.mutex_);
+		current.stats_.unpooled_++;
+		
+		return shared_ptr<PacketBuffer>(buffer);
+	}
+	
+	auto index = lower_bound(current.classes_.begin(), current.classes_.end(), size) - current.classes_.begin();
+	auto class_size = current.classes_.at(index);
+	PacketBuffer* buffer = nullptr;
+	
+	{
+		lock_guard<mutex> lock(current.mutex_);
+		auto& free = current.free_.at(index);
+		
+		if (free.empty()) {
+			current.stats_.misses_++;
+		} else {
+			buffer = free.back();
+			free.pop_back();
+			
+			current.stats_.hits_++;
+			current.stats_.cached_bytes_ -= class_size;
+			current.stats_.outstanding_bytes_ += buffer->capacity();
+			current.stats_.outstanding_peak_ = max(current.stats_.outstanding_peak_, current.stats_.outstanding_bytes_);
+		}
+	}
+	
+	// Allocate outside the lock, then count the capacity release() will subtract
+	if (buffer == nullptr) {
+		buffer = new PacketBuffer();
+		buffer->reserve(class_size);
+		
+		lock_guard<mutex> lock(current.mutex_);
+		current.stats_.outstanding_bytes_ += buffer->capacity();
+		current.stats_.outstanding_peak_ = max(current.stats_.outstanding_peak_, current.stats_.outstanding_bytes_);
+	}
+	
+	return shared_ptr<PacketBuffer>(buffer, release);
+}
+
+void BufferPool::release(PacketBuffer* buffer) {
+	auto& current = pool();
+	auto capacity = buffer->capacity();
+	
+	// Someone grew the buffer beyond its class, find the class it fits now
+	auto index = upper_bound(current.classes_.begin(), current.classes_.end(), capacity) - current.classes_.begin() - 1;
+	auto class_size = index >= 0 ? current.classes_.at(index) : 0;
+	
+	buffer->clear();
+	
+	{
+		lock_guard<mutex> lock(current.mutex_);
+		
+		current.stats_.outstanding_bytes_ -= min(current.stats_.outstanding_bytes_, capacity);
+		
+		if (index >= 0 && current.stats_.cached_bytes_ + class_size <= current.limit_) {
+			current.free_.at(index).push_back(buffer);
+			current.stats_.cached_bytes_ += class_size;
+			current.stats_.cached_peak_ = max(current.stats_.cached_peak_, current.stats_.cached_bytes_);
+			
+			return;
+		}
+		
+		current.stats_.dropped_++;
+	}
+	
+	delete buffer;
+}
+
+void BufferPool::setLimit(size_t bytes) {
+	auto& current = pool();
+	vector<PacketBuffer*> removed;
+	
+	{
+		lock_guard<mutex> lock(current.mutex_);
+		current.limit_ = bytes;
+		
+		// Trim cached buffers, largest classes first
+		for (size_t i = current.free_.size(); i-- > 0 && current.stats_.cached_bytes_ > current.limit_;) {
+			auto& free = current.free_.at(i);
+			
+			while (!free.empty() && current.stats_.cached_bytes_ > current.limit_) {
+				removed.push_back(free.back());
+				free.pop_back();
+				
+				current.stats_.cached_bytes_ -= current.classes_.at(i);
+			}
+		}
+	}
+	
+	for (auto* buffer : removed)
+		delete buffer;
+}
+
+void BufferPool::setHugePages(bool status) {
+#ifdef WIN32
+	if (status)
+		Log(WARNING) << "Huge pages are not supported on Windows\n";
+#else
+	g_huge_pages_ = status;
+#endif
+}
+
+bool BufferPool::hugePages() {
+	return g_huge_pages_;
+}
+
+BufferPoolStats BufferPool::getStats() {
+	auto& current = pool();
+	lock_guard<mutex> lock(current.mutex_);
+	
+	return current.stats_;
+}
+
+void BufferPool::logStats() {
+	auto stats = getStats();
+	auto requests = stats.hits_ + stats.misses_;
+	
+	Log(DEBUG) << "Buffer pool: " << stats.hits_ << " hits, " << stats.misses_ << " misses (" << (requests ? 100.0 * stats.hits_ / requests : 0.0) << " % hit rate), " << stats.unpooled_ << " unpooled, " << stats.dropped_ << " dropped\n";
+	Log(DEBUG) << "Buffer pool: peak " << stats.outstanding_peak_ / 1024 << " KB in use, peak " << stats.cached_peak_ / 1024 << " KB cached\n";
+}
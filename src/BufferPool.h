@@ -0,0 +1,36 @@
+#pragma once
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include "PacketBuffer.h"
+
+struct BufferPoolStats {
+	size_t hits_				= 0;
+	size_t misses_				= 0;
+	size_t unpooled_			= 0;
+	size_t dropped_				= 0;
+	
+	size_t outstanding_bytes_	= 0;
+	size_t outstanding_peak_	= 0;
+	size_t cached_bytes_		= 0;
+	size_t cached_peak_			= 0;
+};
+
+// Size-classed pool of packet buffers, buffers return to the pool when the last Packet referencing them is gone
+class BufferPool {
+public:
+	// Returns an empty buffer with at least size bytes of capacity
+	static std::shared_ptr<PacketBuffer> acquire(size_t size);
+	
+	static void setLimit(size_t bytes);
+	static void setHugePages(bool status);
+	static bool hugePages();
+	
+	static BufferPoolStats getStats();
+	static void logStats();
+	
+private:
+	static void release(PacketBuffer* buffer);
+};
+
+#endif
@@ -1,18 +1,24 @@
 #include "CLI.h"
-#include "Base.h"
-#include "Parameter.h"
 #include "Config.h"
 #include "NetworkCommunication.h"
 #include "PacketCreator.h"
 #include "Packet.h"
 #include "Timer.h"
 #include "IO.h"
+#include "BufferPool.h"
+#include "PacketView.h"
+#include "ChunkWindow.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include "PacketPump.h"
+#include "Executor.h"
 
 #include <algorithm>
+#include <deque>
+#include <cstring>
+#include <iomanip>
 
 // Network
-#include <sys/stat.h>
-
 #ifdef WIN32
 #include <winsock2.h>
 #include <ws2tcpip.h>
@@ -25,21 +31,10 @@
 using namespace std;
 
 #ifdef WIN32
-constexpr auto quick_exit = _exit; // mingw32 does not support quick_exit for now
-
 #pragma comment(lib, "IPHLPAPI.lib")
 #endif
 
-extern string g_protocol_standard;
-
-static void monitoring() {
-	auto name = Base::config().get<string>("name", "");
-
-	// Register at Server as monitoring with certain name
-	Base::network().send(PacketCreator::join(name));
-
-	Log(INFORMATION) << "Registering at Server..\n";
-}
+string g_protocol_standard = "a10";
 
 static void splitBaseFile(string input, string& base, string& file) {
 	size_t pos = 0;
@@ -79,7 +74,7 @@ static vector<string> getIPAddresses() {
 	vector<string> addresses;
 
 #ifdef WIN32
-	ULONG family = AF_INET;
+	ULONG family = AF_UNSPEC;
 	ULONG flags = GAA_FLAG_INCLUDE_PREFIX;
 	ULONG buffer_size = 30000;
 	PIP_ADAPTER_ADDRESSES p_addresses = (IP_ADAPTER_ADDRESSES*)malloc(buffer_size);
@@ -101,6 +96,17 @@ static vector<string> getIPAddresses() {
 		        char str_buffer[INET_ADDRSTRLEN] = {0};
 		        inet_ntop(AF_INET, &(ipv4->sin_addr), str_buffer, INET_ADDRSTRLEN);
 				addresses.push_back(str_buffer);
+			} else if (family == AF_INET6) {
+				SOCKADDR_IN6* ipv6 = reinterpret_cast<SOCKADDR_IN6*>(address->Address.lpSockaddr);
+
+				// Link-local addresses need a scope to be usable from the other side
+				if (!IN6_IS_ADDR_LINKLOCAL(&ipv6->sin6_addr)) {
+					char str_buffer[INET6_ADDRSTRLEN] = {0};
+					DWORD str_size = INET6_ADDRSTRLEN;
+
+					if (WSAAddressToStringA(address->Address.lpSockaddr, address->Address.iSockaddrLength, NULL, str_buffer, &str_size) == 0)
+						addresses.push_back(str_buffer);
+				}
 			}
 
 			address = address->Next;
@@ -117,10 +123,21 @@ static vector<string> getIPAddresses() {
 		auto* temp = interfaces;
 
 		while (temp != NULL) {
-			// Add as an IP if the interface belongs to AF_INET
-			if (temp->ifa_addr != NULL)
-				if (temp->ifa_addr->sa_family == AF_INET)
+			// Add as an IP if the interface belongs to AF_INET or AF_INET6
+			if (temp->ifa_addr != NULL) {
+				if (temp->ifa_addr->sa_family == AF_INET) {
 					addresses.push_back(inet_ntoa(((struct sockaddr_in*)temp->ifa_addr)->sin_addr));
+				} else if (temp->ifa_addr->sa_family == AF_INET6) {
+					auto* ipv6 = reinterpret_cast<sockaddr_in6*>(temp->ifa_addr);
+
+					// Link-local addresses need a scope to be usable from the other side
+					if (!IN6_IS_ADDR_LINKLOCAL(&ipv6->sin6_addr)) {
+						char str_buffer[INET6_ADDRSTRLEN] = {0};
+						inet_ntop(AF_INET6, &ipv6->sin6_addr, str_buffer, INET6_ADDRSTRLEN);
+						addresses.push_back(str_buffer);
+					}
+				}
+			}
 
 			temp = temp->ifa_next;
 		}
@@ -176,7 +193,36 @@ static void sortMostLikelyIP(const vector<string>& own_ips, vector<string>& remo
 	});
 }
 
-void CLI::sendFile(const string& to, string file, string directory, string base) {
+static void countFile(SendResult& result, ReceiverResult& receiver, bool sent) {
+	(sent ? receiver.files_sent_ : receiver.files_failed_)++;
+	(sent ? result.files_sent_ : result.files_failed_)++;
+
+	Metrics::add(sent ? METRIC_FILES_SENT : METRIC_FILES_FAILED);
+}
+
+bool SendResult::success() const {
+	return files_failed_ == 0;
+}
+
+void CLI::failFile(SendState& state, const string& file) {
+	for (auto& receiver : state.result_.receivers_)
+		countFile(state.result_, receiver, false);
+
+	reportProgress(state, file);
+}
+
+void CLI::reportProgress(SendState& state, const string& file) {
+	if (!state.options_.progress_)
+		return;
+
+	state.progress_.file_ = file;
+	state.progress_.files_sent_ = state.result_.files_sent_;
+	state.progress_.files_failed_ = state.result_.files_failed_;
+
+	state.options_.progress_(state.progress_);
+}
+
+void CLI::sendFile(SendState& state, string file, string directory, string base) {
 	string full_path = base + directory + file;
 
 	if (directory.empty())
@@ -189,156 +235,191 @@ void CLI::sendFile(const string& to, string file, string directory, string base)
 	} catch (...) {
 		Log(WARNING) << "File " << full_path << " does not exist, skipping\n";
 
+		failFile(state, file);
 		return;
 	}
 
 	if (is_directory) {
-		auto recursive = Base::parameter().has("-r");
-
-		if (!recursive) {
+		if (!state.options_.recursive_) {
 			// We're not doing recursive sending
 			Log(WARNING) << "Recursive sending is disabled\n";
 
+			failFile(state, file);
 			return;
 		}
 
 		Log(DEBUG) << file << " is a folder, doing recursion\n";
 
 		// List contents of directory and sendFile on each of them
-		auto contents = IO::listDirectory(full_path);
+		vector<string> contents;
+
+		{
+			TraceSpan span("list directory");
+			contents = IO::listDirectory(full_path);
+		}
 
 		for (auto& recursive_file : contents) {
 			// Ignore hidden files (Linux)
 			if (recursive_file.front() == '.')
 				continue;
 
-			string path = recursive_file;
-			string new_base = "";
-
-			sendFile(to, path, directory + file + "/", base);
+			sendFile(state, recursive_file, directory + file + "/", base);
 		}
 
 		// We're done with this file
 		return;
 	}
 
-	// See if we already have an active connection to "to"
-	if (active_direct_connection_ != nullptr) {
-		Log(DEBUG) << "Using already active direct connection to send files\n";
-	} else {
-		// Inform target of file transfer
-		Base::network().send(PacketCreator::inform(to, file, directory, Base::config().get<bool>("direct", true)));
-		auto answer = Base::cli().waitForAnswer();
-		auto accepted = answer.getBool();
+	size_t size;
 
-		if (!accepted) {
-			Log(ERROR) << "Receiving side did not accept the file transfer or is not connected\n";
+	try {
+		size = IO::getSize(full_path);
+	} catch (...) {
+		failFile(state, file);
+		return;
+	}
 
-			return;
-		}
+	Log(DEBUG) << "Sending the file " << base << " + " << directory << " + " << file << "\n";
 
-		auto try_direct = answer.getBool();
-		auto num_addresses = answer.getInt();
-		auto port = answer.getInt();
-		client_id_ = answer.getInt();
+	ifstream file_stream;
 
-		Log(DEBUG) << "Local ID " << client_id_ << endl;
+	{
+		TraceSpan span("open file");
+		file_stream.open(full_path, ios_base::binary); // It's valid since getSize() did not throw
+	}
 
-		vector<string> remote_addresses;
+	sendData(state, file, directory, size, [&file_stream, &full_path] (unsigned char* data, size_t position, size_t amount) -> long long {
+		{
+			TraceSpan span("disk read", amount);
+			file_stream.read((char*)data, amount);
+		}
 
-		Log(DEBUG) << "Direct connection is " << (try_direct ? "enabled" : "disabled") << endl;
+		auto actually_read = file_stream.gcount();
 
-		if (try_direct) {
-			Log(DEBUG) << "Receiving client is waiting at port " << port << endl;
+		if (actually_read > 0 && !file_stream.fail() && !file_stream.bad())
+			return actually_read;
 
-			for (int i = 0; i < num_addresses; i++) {
-				auto ip = answer.getString();
-				remote_addresses.push_back(ip);
+		// Something went wrong during read
+		Log(WARNING) << "Something went wrong during reading the file " << full_path << "\n";
+		Log(DEBUG) << "Attempting to re-open the file..\n";
 
-				Log(DEBUG) << "Remote address " << ip << endl;
-			}
+		file_stream.close();
+		file_stream.open(full_path, ios_base::binary);
 
-			// Sort local IPs based on most likely to be connected
-			sortMostLikelyIP(getIPAddresses(), remote_addresses);
+		if (!file_stream.is_open()) {
+			Log(DEBUG) << "Failed to open file again, ignoring this file\n";
 
-			for (size_t i = 0; i < remote_addresses.size(); i++) {
-				auto& ip = remote_addresses.at(i);
+			return -1;
+		}
 
-				// See if this IP is unreachable
-				auto unreachable = connect_results_.find(ip);
+		Log(DEBUG) << "Successfully re-opened the file, continue file transfer\n";
 
-				if (unreachable != connect_results_.end()) {
-					Log(DEBUG) << "Skipping IP " << ip << endl;
+		// Move to actual read position and read the chunk again
+		file_stream.seekg(position);
 
-					continue;
-				}
+		return 0;
+	});
+}
 
-				Log(DEBUG) << "Trying " << ip << endl;
+void CLI::sendData(SendState& state, const string& file, const string& directory, size_t size, const function<long long(unsigned char*, size_t, size_t)>& source) {
+	auto& receivers = state.result_.receivers_;
 
-				active_direct_connection_ = make_shared<NetworkCommunication>();
+	// Where the chunks go, per receiver which accepted the file
+	deque<Route> routes;
+	vector<Route*> attempts;
 
-				if (active_direct_connection_->start(ip, port, true)) {
-					// Start packet thread and save it in CLI
-					active_packet_thread_ = make_shared<thread>(packetThread, ref(*active_direct_connection_), -1, false);
+	for (size_t i = 0; i < receivers.size(); i++) {
+		routes.emplace_back();
 
-					// Works
-					break;
-				} else {
-					active_direct_connection_ = nullptr;
+		auto& route = routes.back();
+		route.result_ = i;
+		route.to_ = receivers.at(i).to_;
 
-					// Add to known IPs to fail
-					connect_results_[ip] = false;
-				}
-			}
-		}
-	}
+		bool started_attempt = false;
 
-	// What network to use?
-	NetworkCommunication* use_network_;
-	bool direct_connected = false;
+		if (!prepareRoute(state, route, file, directory, started_attempt)) {
+			countFile(state.result_, receivers.at(i), false);
+			routes.pop_back();
 
-	if (active_direct_connection_ == nullptr) {
-		// Use relay, no direct connection succeeded
-		use_network_ = &Base::network();
-	} else {
-		// Use direct connection
-		use_network_ = active_direct_connection_.get();
-		direct_connected = true;
+			continue;
+		}
 
-		// Set terminate on network kill
-		use_network_->setTerminateOnKill(true);
+		if (started_attempt)
+			attempts.push_back(&route);
 	}
 
-	size_t size;
+	if (routes.empty()) {
+		reportProgress(state, file);
 
-	try {
-		size = IO::getSize(full_path);
-	} catch (...) {
 		return;
 	}
 
-	Log(DEBUG) << "Sending the file " << base << " + " << directory << " + " << file << endl;
+	// A quick direct path is used from the first chunk, otherwise the transfer starts on the relay.
+	// Only transfers which started an attempt wait for it, and the attempts run at the same time
+	auto deadline = chrono::steady_clock::now() + chrono::milliseconds(config_.get<size_t>("direct_wait", 100));
+
+	for (auto* route : attempts) {
+		auto wait = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now());
+		auto connection = upgradeDirect(state, route->to_, max(wait, chrono::milliseconds(0)));
+
+		if (connection)
+			useDirect(state, *route, connection);
+	}
+
+	Log(DEBUG) << "Sending " << directory << file << " to " << routes.size() << " receiver(s)\n";
 	Log(DEBUG) << "File size " << size << " bytes\n";
 
-	ifstream file_stream(full_path, ios_base::binary); // It's valid since getSize() did not throw
 	Timer timer;
 
+	// Every receiver sends from its own thread, a slow one only holds back the others once the window is full
+	ChunkWindow window(routes.size(), config_.get<size_t>("fanout_window", 8));
+	vector<thread> senders;
+	vector<char> results(routes.size(), false);
+
+	for (size_t i = 0; i < routes.size(); i++) {
+		senders.emplace_back([this, &state, &routes, &window, &results, &file, &directory, i] {
+			Trace::nameThread("sender");
+			results.at(i) = sendChunks(state, routes.at(i), i, window, file, directory);
+			window.leave(i);
+		});
+	}
+
+	bool read_failed = false;
+	size_t buffer_size = config_.get<size_t>("buffer_size", 4 * 1024 * 1024); // 4 MB default
+
 	for (size_t i = 0; i < size;) {
-		size_t buffer_size = Base::config().get<size_t>("buffer_size", 4 * 1024 * 1024); // 4 MB default
+		{
+			TraceSpan span("wait window");
+
+			if (!window.waitForRoom())
+				break;
+		}
+
+		TraceSpan chunk_span("build chunk");
+
 		size_t read_amount = min(buffer_size, size - i);
 
-		// Create Packet inplace for speed
-		Packet packet;
+		// The chunk is addressed by ID when a receiver is connected directly, so every direct receiver
+		// sends the same packet. Otherwise it is addressed to the first receiver on the relay
+		Chunk chunk;
+		chunk.direct_ = any_of(routes.begin(), routes.end(), [] (auto& route) { return route.direct_.load(); });
+		chunk.to_ = chunk.direct_ ? "" : routes.front().to_;
+		chunk.first_ = i == 0;
+		chunk.id_ = requests_.reserve();
+
+		// Create Packet inplace for speed, with the whole chunk taken from the buffer pool at once
+		auto& packet = chunk.packet_;
+		packet = Packet(read_amount + chunk.to_.size() + file.size() + directory.size() + 32);
 		packet.addHeader(HEADER_SEND);
 
 		if (client_id_ < 0)
 			Log(WARNING) << "Trying to send packet as client " << client_id_ << endl;
 
 		// Bypass server changes to the packets
-		if (direct_connected)
+		if (chunk.direct_)
 			packet.addInt(client_id_);
 		else
-			packet.addString(to);
+			packet.addString(chunk.to_);
 
 		packet.addString(file);
 		packet.addString(directory);
@@ -348,36 +429,18 @@ void CLI::sendFile(const string& to, string file, string directory, string base)
 		auto old_size = data->size();
 		data->resize(data->size() + read_amount + 4);
 
-		unsigned char* data_pointer = data->data() + old_size + 4;
-
-		file_stream.read((char*)data_pointer, read_amount);
-		auto actually_read = file_stream.gcount();
-
-		auto fail = file_stream.fail();
-		auto bad = file_stream.bad();
-
-		if (actually_read <= 0 || fail || bad) {
-			// Something went wrong during read
-			Log(WARNING) << "Something went wrong during reading the file " << full_path << "\n";
-			Log(DEBUG) << "Attempting to re-open the file..\n";
-
-			file_stream.close();
-			file_stream.open(full_path, ios_base::binary);
-
-			if (!file_stream.is_open()) {
-				Log(DEBUG) << "Failed to open file again, ignoring this file\n";
-
-				return;
-			} else {
-				Log(DEBUG) << "Successfully re-opened the file, continue file transfer\n";
+		auto actually_read = source(data->data() + old_size + 4, i, read_amount);
 
-				// Move to actual read position and continue the loop
-				file_stream.seekg(i);
-				continue;
-			}
+		if (actually_read < 0) {
+			read_failed = true;
+			break;
 		}
 
-		if (actually_read != (long)read_amount)
+		// Try the same chunk again
+		if (actually_read == 0)
+			continue;
+
+		if (actually_read != (long long)read_amount)
 			data->resize(old_size + actually_read + 4);
 
 		int nbr = actually_read;
@@ -387,21 +450,18 @@ void CLI::sendFile(const string& to, string file, string directory, string base)
 	    data->at(old_size + 2) = (nbr >> 8) & 0xFF;
 	    data->at(old_size + 3) = nbr & 0xFF;
 
-		packet.addBool(i == 0);
+		chunk.bytes_ = { actually_read, data->data() + old_size + 4 };
+
+		packet.addBool(chunk.first_);
+		packet.addInt(chunk.id_);
 		packet.finalize();
+		chunk_span.setBytes(actually_read);
 
-		use_network_->send(packet);
+		window.push(move(chunk));
 		i += actually_read;
 
-		auto answer = Base::cli().waitForAnswer();
-		answer.getInt();
-		auto accepted = answer.getBool();
-
-		if (!accepted) {
-			Log(WARNING) << "Something went wrong during file transfer\n";
-
-			return;
-		}
+		state.progress_.bytes_ += actually_read;
+		reportProgress(state, file);
 
 		if (buffer_size < size) {
 			auto elapsed_time = timer.elapsedTime();
@@ -410,288 +470,718 @@ void CLI::sendFile(const string& to, string file, string directory, string base)
 		}
 	}
 
-	// Tell the receiver that we're done
-	use_network_->send(PacketCreator::send(to, file, directory, { 0, nullptr }, false, direct_connected, client_id_));
+	window.finish(read_failed);
 
-	auto answer = Base::cli().waitForAnswer();
-	answer.getInt();
-	auto accepted = answer.getBool();
+	for (auto& sender : senders)
+		sender.join();
 
 	auto elapsed_time = timer.restart();
 
-	if (accepted)
-		Log(DEBUG) << "File successfully sent\n";
-	else
-		Log(ERROR) << "File could not be sent\n";
+	for (size_t i = 0; i < routes.size(); i++) {
+		auto& receiver = receivers.at(routes.at(i).result_);
+
+		if (results.at(i))
+			Log(DEBUG) << "File successfully sent to " << receiver.to_ << "\n";
+		else
+			Log(ERROR) << "File could not be sent to " << receiver.to_ << "\n";
+
+		countFile(state.result_, receiver, results.at(i));
+	}
+
+	reportProgress(state, file);
 
 	Log(DEBUG) << "Elapsed time: " << elapsed_time << " seconds\n";
 	Log(DEBUG) << "Speed: " << (static_cast<double>(size) / 1024 / 1024) / elapsed_time << " MB/s\n";
+
+	BufferPool::logStats();
 }
 
-static void sendFiles(const string& to) {
-	auto& files = Base::parameter().get("-s");
+bool CLI::prepareRoute(SendState& state, Route& route, const string& file, const string& directory, bool& started_attempt) {
+	auto& to = route.to_;
 
-	for (auto& file : files) {
-		auto file_copy = file;
+	route.network_ = &server_;
+	route.flow_ = getFlow(state, server_, nullptr);
 
-		// Remove / or \ at the end if there is one
-		if (file_copy.back() == '/' || file_copy.back() == '\\')
-			file_copy.pop_back();
+	{
+		// Other transfers and shutdown() might be looking at the connections
+		lock_guard<mutex> lock(direct_mutex_);
 
-		string base = "";
-		splitBaseFile(file_copy, base, file_copy);
+		// A warm connection might have died since the last transfer
+		auto direct_connection = direct_connections_.find(to);
 
-		Base::cli().sendFile(to, file_copy, "", base);
+		if (direct_connection != direct_connections_.end() && !direct_connection->second.network_->isAlive()) {
+			Log(DEBUG) << "Direct connection to " << to << " is closed, reconnecting\n";
+
+			direct_connection->second.pump_->wait();
+			direct_connections_.erase(direct_connection);
+			direct_connection = direct_connections_.end();
+		}
+
+		// See if we already have an active connection to "to"
+		if (direct_connection != direct_connections_.end()) {
+			Log(DEBUG) << "Using already active direct connection to send files\n";
+
+			useDirect(state, route, direct_connection->second.network_);
+
+			return true;
+		}
+
+		if (direct_attempts_.count(to) > 0) {
+			Log(DEBUG) << "Direct connection to " << to << " is still being set up\n";
+
+			return true;
+		}
+	}
+
+	// Requests on a closed connection are never answered
+	if (!server_.isAlive())
+		return false;
+
+	// Inform target of file transfer
+	Packet answer;
+
+	{
+		// Receivers answer through the server in any order, answers without an ID are matched in the
+		// order sent, so only one inform is out at a time until the server is known to repeat the ID
+		unique_lock<mutex> lock(inform_mutex_, defer_lock);
+
+		if (!inform_correlated_)
+			lock.lock();
+
+		auto request = requests_.addOrdered(HEADER_INFORM, &server_);
+		server_.send(PacketCreator::inform(to, file, directory, config_.get<bool>("direct", true), request.getId()));
+		answer = waitForAnswer(request);
+	}
+
+	auto accepted = answer.getBool();
+
+	if (!accepted) {
+		Log(ERROR) << "Receiving side " << to << " did not accept the file transfer or is not connected\n";
+
+		return false;
+	}
+
+	auto try_direct = answer.getBool();
+	auto num_addresses = answer.getInt();
+	auto port = answer.getInt();
+	client_id_ = answer.getInt();
+
+	Log(DEBUG) << "Local ID " << client_id_ << endl;
+	Log(DEBUG) << "Direct connection is " << (try_direct ? "enabled" : "disabled") << endl;
+
+	if (!try_direct)
+		return true;
+
+	Log(DEBUG) << "Receiving client is waiting at port " << port << endl;
+
+	vector<string> remote_addresses;
+
+	for (int i = 0; i < num_addresses; i++) {
+		auto ip = answer.getString();
+		remote_addresses.push_back(ip);
+
+		Log(DEBUG) << "Remote address " << ip << endl;
+	}
+
+	// Sort local IPs based on most likely to be connected
+	sortMostLikelyIP(getIPAddresses(), remote_addresses);
+
+	vector<string> candidates;
+	lock_guard<mutex> lock(direct_mutex_);
+
+	for (auto& ip : remote_addresses) {
+		// See if this IP is unreachable
+		auto unreachable = connect_results_.find(ip);
+
+		if (unreachable != connect_results_.end()) {
+			Log(DEBUG) << "Skipping IP " << ip << endl;
+
+			continue;
+		}
+
+		candidates.push_back(ip);
+	}
+
+	if (!candidates.empty()) {
+		Log(DEBUG) << "Trying " << candidates.size() << " addresses at once\n";
+
+		started_attempt = startDirectAttempt(to, candidates, port);
 	}
+
+	return true;
 }
 
-// Various test functions for development
-static void test() {
-	auto addresses = getIPAddresses();
+void CLI::useDirect(SendState& state, Route& route, const shared_ptr<NetworkCommunication>& connection) {
+	route.connection_ = connection;
+	route.network_ = connection.get();
+	route.flow_ = getFlow(state, *connection, connection);
+	route.direct_ = true;
+}
 
-	for (auto& address : addresses)
-		Log(DEBUG) << "Local address: " << address << endl;
+int CLI::getFlow(SendState& state, NetworkCommunication& network, const shared_ptr<NetworkCommunication>& connection) {
+	lock_guard<mutex> lock(state.flows_mutex_);
+
+	// The connection is kept by the flow, so the address is not reused by another one
+	for (auto& flow : state.flows_)
+		if (flow.network_ == &network)
+			return flow.id_;
+
+	state.flows_.push_back({ &network, connection, network.openFlow(state.options_.priority_, state.options_.weight_) });
+
+	return state.flows_.back().id_;
 }
 
-void CLI::start() {
-	// TODO: Remove test
-	test();
+bool CLI::sendChunks(SendState& state, Route& route, size_t receiver, ChunkWindow& window, const string& file, const string& directory) {
+	// Chunks sent but not acknowledged yet, the receiver answers them in order
+	auto chunks_in_flight = max<size_t>(1, config_.get<size_t>("chunks_in_flight", 4));
 
-	// Remove old update files if they exist
-	remove("client.zip");
-#ifndef WIN32
-	remove("update.sh");
-#endif
+	struct InFlight {
+		PendingRequest request_;
+		chrono::steady_clock::time_point sent_;
+	};
 
-	// Register at Server
-	Base::network().send(PacketCreator::initialize(g_protocol_standard));
-	auto packet = waitForAnswer();
-	auto accepted = packet.getBool();
+	deque<InFlight> in_flight;
 
-	if (accepted) {
-		Log(DEBUG) << "Server accepted our protocol version\n";
-	} else {
-		auto code = packet.getInt();
+	// Latency is from when the chunk is queued, waiting for flow control credits is not part of it
+	auto sent = [&in_flight, &route] (size_t bytes) {
+		in_flight.back().sent_ = chrono::steady_clock::now();
 
-		Log(ERROR) << "Client was not accepted, code " << code << "\n";
+		Metrics::add(METRIC_CHUNKS_IN_FLIGHT);
 
-		if (code == ERROR_OLD_PROTOCOL) {
-			// Auto-update
-			auto url = packet.getString();
-			auto url_script = packet.getString();
-			auto url_windows = packet.getString();
+		if (bytes > 0) {
+			Metrics::add(METRIC_CHUNKS_SENT);
+			Metrics::add(route.direct_ ? METRIC_DIRECT_BYTES : METRIC_RELAY_BYTES, bytes);
+		}
+	};
 
-			Log(INFORMATION) << "Downloading new binaries\n";
+	// Each receiver has its own sender thread, so its result is only touched from here
+	auto& ack_latency = state.result_.receivers_.at(route.result_).ack_latency_;
 
-#ifdef WIN32
-			Log(INFORMATION) << "If the download fail due to Powershell being below version 3.0, the URL is " << url_windows << endl;
+	auto acknowledged = [this, &in_flight, &ack_latency] {
+		TraceSpan span("wait ack");
+		auto answer = waitForAnswer(in_flight.front().request_);
+		auto latency = chrono::steady_clock::now() - in_flight.front().sent_;
 
-			IO::download(url_windows, "client.zip");
+		ack_latency.record(latency);
+		Metrics::record(METRIC_ACK_LATENCY, latency);
+		Metrics::add(METRIC_CHUNKS_IN_FLIGHT, -1);
 
-			Log(INFORMATION) << "Auto-update for Windows is not available for now, the new binaries are in client.zip\n";
-#else
-			IO::download(url, "client.zip");
-			IO::download(url_script, "update.sh");
+		in_flight.pop_front();
 
-			Log(INFORMATION) << "Initiating auto-update\n";
+		answer.getInt();
 
-			// Make update script executable
-			chmod("update.sh", 0755);
+		return answer.getBool();
+	};
 
-			// Don't need to call it in background since it's possible to overwrite running files
-			if (system("./update.sh")) {}
-#endif
+	// Chunks left when giving up are not in flight anymore
+	auto failed = [&in_flight, &route] {
+		Metrics::add(METRIC_CHUNKS_IN_FLIGHT, -static_cast<int64_t>(in_flight.size()));
+
+		Log(WARNING) << "Something went wrong during file transfer to " << route.to_ << "\n";
+
+		return false;
+	};
+
+	auto drained = [&in_flight, &acknowledged] {
+		while (!in_flight.empty())
+			if (!acknowledged())
+				return false;
+
+		return true;
+	};
+
+	Chunk chunk;
+
+	for (size_t index = 0; window.get(index, chunk); index++) {
+		// Move to the direct connection once it is up. Chunks on the relay are written first, the receiver
+		// finds the file by name whichever path the next chunk takes
+		if (!route.direct_) {
+			auto upgraded = upgradeDirect(state, route.to_, chrono::milliseconds(0));
+
+			if (upgraded) {
+				if (!drained())
+					return failed();
+
+				Log(DEBUG) << "Continuing on the direct connection to " << route.to_ << " after " << index << " chunk(s)\n";
+
+				useDirect(state, route, upgraded);
+			}
+		}
+
+		// The shared packet is sent as is when it has our format, otherwise the bytes are copied into our own
+		if (chunk.direct_ == route.direct_ && (route.direct_ || chunk.to_ == route.to_)) {
+			in_flight.push_back({ requests_.add(HEADER_SEND_RESULT, route.network_, chunk.id_), {} });
+			route.network_->send(chunk.packet_, route.flow_);
+		} else {
+			in_flight.push_back({ requests_.add(HEADER_SEND_RESULT, route.network_), {} });
+
+			auto packet = [&] {
+				TraceSpan span("build packet", chunk.bytes_.first);
+
+				return PacketCreator::send(route.to_, file, directory, chunk.bytes_, chunk.first_, route.direct_, client_id_, in_flight.back().request_.getId());
+			}();
+
+			route.network_->send(packet, route.flow_);
 		}
 
-		quick_exit(-1);
+		sent(chunk.bytes_.first);
+		window.release(receiver, index + 1);
+
+		// Requests added after the connection closed are not answered by networkClosed()
+		if (!route.network_->isAlive() || (in_flight.size() >= chunks_in_flight && !acknowledged()))
+			return failed();
 	}
 
-	// Check options
-	// Monitoring mode, wait for packets
-	if (Base::parameter().has("-m")) {
-		monitoring();
+	if (!drained())
+		return failed();
 
-		// Wait for packets, terminating this thread
-		return;
+	// The file could not be read to the end
+	if (window.failed())
+		return false;
+
+	// Tell the receiver that we're done
+	in_flight.push_back({ requests_.add(HEADER_SEND_RESULT, route.network_), {} });
+	route.network_->send(PacketCreator::send(route.to_, file, directory, { 0, nullptr }, false, route.direct_, client_id_, in_flight.back().request_.getId()), route.flow_);
+	sent(0);
+
+	if (!route.network_->isAlive())
+		return failed();
+
+	return acknowledged();
+}
+
+bool CLI::startDirectAttempt(const string& to, const vector<string>& candidates, unsigned short port) {
+	// UDP is meant for long fat or lossy links where TCP falls behind
+	auto transport = config_.get<string>("transport", "tcp") == "udp" ? TRANSPORT_UDP : TRANSPORT_TCP;
+	auto retry = chrono::milliseconds(config_.get<size_t>("direct_retry", 10000));
+
+	// Another transfer to the receiver got there first
+	if (direct_attempts_.count(to) > 0 || direct_connections_.count(to) > 0)
+		return false;
+
+	auto& attempt = direct_attempts_[to];
+	attempt.network_ = make_shared<NetworkCommunication>();
+	attempt.candidates_ = candidates;
+
+	// All candidates are raced, in the sorted order with a small head start each. A path which is not
+	// reachable yet might be soon, e.g an interface coming up, so rounds are repeated until retry has passed
+	attempt.connected_ = async(launch::async, [network = attempt.network_, candidates, port, transport, retry] {
+		auto deadline = chrono::steady_clock::now() + retry;
+
+		while (!network->start(candidates, port, true, transport)) {
+			if (chrono::steady_clock::now() >= deadline)
+				return false;
+
+			this_thread::sleep_for(chrono::milliseconds(500));
+		}
+
+		return true;
+	}).share();
+
+	return true;
+}
+
+shared_ptr<NetworkCommunication> CLI::upgradeDirect(SendState& state, const string& to, chrono::milliseconds wait) {
+	// Another transfer to the receiver might have connected already
+	auto connected = [this, &to] () -> shared_ptr<NetworkCommunication> {
+		auto connection = direct_connections_.find(to);
+
+		if (connection == direct_connections_.end() || !connection->second.network_->isAlive())
+			return nullptr;
+
+		return connection->second.network_;
+	};
+
+	shared_ptr<NetworkCommunication> network;
+	shared_future<bool> result;
+
+	{
+		lock_guard<mutex> lock(direct_mutex_);
+		auto attempt = direct_attempts_.find(to);
+
+		if (closed_)
+			return nullptr;
+
+		if (attempt == direct_attempts_.end())
+			return connected();
+
+		network = attempt->second.network_;
+		result = attempt->second.connected_;
 	}
 
-	// List available hosts
-	if (Base::parameter().has("-l")) {
-		Base::network().send(PacketCreator::available());
+	// Without the lock, so the other receivers' transfers are not held up by this attempt
+	if (result.wait_for(wait) != future_status::ready)
+		return nullptr;
 
-		Log(DEBUG) << "Asking for available hosts\n";
+	lock_guard<mutex> lock(direct_mutex_);
+	auto attempt = direct_attempts_.find(to);
 
-		return;
+	if (closed_)
+		return nullptr;
+
+	// Someone else installed it, or gave up on it, while we waited
+	if (attempt == direct_attempts_.end() || attempt->second.network_ != network)
+		return connected();
+
+	if (!attempt->second.connected_.get()) {
+		Log(DEBUG) << "No direct connection to " << to << ", staying on the relay\n";
+
+		// Add to known IPs to fail
+		for (auto& ip : attempt->second.candidates_)
+			connect_results_[ip] = false;
+
+		direct_attempts_.erase(attempt);
+
+		return nullptr;
 	}
 
-	// Send files
-	if (Base::parameter().has("-s")) {
-		// We need a receiver
-		if (!Base::parameter().has("-t")) {
-			Log(ERROR) << "Specify receiver with \"-t\" option\n";
+	direct_attempts_.erase(attempt);
+	Log(DEBUG) << "Direct connection to " << to << " up after " << Histogram::format(network->getConnectTime()) << "\n";
+	network->enableFlowControl(config_.get<size_t>("receive_window", 64 * 1024 * 1024));
 
-			quick_exit(-1);
-		}
+	// Set terminate on network kill once for the connection, a daemon reconnects on the next transfer instead.
+	// With several receivers only the transfers to the one which is gone fail
+	network->setTerminateOnKill(!persistent_ && state.result_.receivers_.size() == 1);
+
+	// Start packet thread and save it in CLI, kept for later transfers to the same receiver
+	auto& connection = direct_connections_[to];
+	connection.network_ = network;
+	connection.pump_ = PacketPump::start(*this, network);
+
+	return network;
+}
+
+SendResult CLI::sendFiles(const vector<string>& receivers, const vector<string>& files, bool recursive) {
+	vector<SendSource> sources(files.size());
+
+	for (size_t i = 0; i < files.size(); i++)
+		sources.at(i).path_ = files.at(i);
+
+	SendOptions options;
+	options.recursive_ = recursive;
+
+	return sendFiles(receivers, sources, options);
+}
+
+SendResult CLI::sendFiles(const vector<string>& receivers, const vector<SendSource>& sources, const SendOptions& options) {
+	SendState state;
+	state.options_ = options;
+
+	auto& results = state.result_.receivers_;
+
+	for (auto& to : receivers) {
+		if (any_of(results.begin(), results.end(), [&to] (auto& result) { return result.to_ == to; }))
+			continue;
+
+		results.emplace_back();
+		results.back().to_ = to;
+	}
+
+	for (auto& source : sources) {
+		auto file_copy = source.path_;
+
+		// Remove / or \ at the end if there is one
+		if (file_copy.back() == '/' || file_copy.back() == '\\')
+			file_copy.pop_back();
+
+		string base = "";
+		splitBaseFile(file_copy, base, file_copy);
 
-		// Set terminate on network kill
-		Base::network().setTerminateOnKill(true);
+		if (source.data_ == nullptr) {
+			sendFile(state, file_copy, "", base);
+
+			continue;
+		}
 
-		// To whom?
-		string to = Base::parameter().get("-t").front();
-		sendFiles(to);
+		// The path of memory is where the receiver puts it
+		sendData(state, file_copy, base, source.size_, [&source] (unsigned char* data, size_t position, size_t amount) -> long long {
+			memcpy(data, source.data_ + position, amount);
 
-		quick_exit(0);
+			return amount;
+		});
 	}
 
-	// If no option has been specified at the end, default to monitoring mode
-	monitoring();
+	// What is still queued is sent before the flows go
+	for (auto& flow : state.flows_)
+		flow.network_->closeFlow(flow.id_);
+
+	state.result_.bytes_ = state.progress_.bytes_;
+
+	if (results.size() > 1)
+		for (auto& result : results)
+			Log(INFORMATION) << result.to_ << ": " << result.files_sent_ << " file(s) sent, " << result.files_failed_ << " failed\n";
+
+	for (auto& result : results)
+		if (result.ack_latency_.count() > 0)
+			Log(INFORMATION) << "Acknowledgement latency to " << result.to_ << ": " << result.ack_latency_.summary() << "\n";
+
+	return move(state.result_);
 }
 
-Packet CLI::waitForAnswer() {
-	unique_lock<mutex> lock(answer_mutex_);
-	answer_cv_.wait(lock, [this] { return answer_packet_ != nullptr; });
+vector<ConnectionState> CLI::getConnections() {
+	vector<ConnectionState> connections;
+
+	connections.push_back({ "server", server_.getOutgoingState() });
+
+	lock_guard<mutex> lock(direct_mutex_);
 
-	// Make copy and return it
-	Packet packet = *answer_packet_;
+	for (auto& connection : direct_connections_)
+		connections.push_back({ connection.first, connection.second.network_->getOutgoingState() });
 
-	// Reset pointer
-	answer_packet_ = nullptr;
+	return connections;
+}
 
-	return packet;
+// Various test functions for development
+static void test() {
+	auto addresses = getIPAddresses();
+
+	for (auto& address : addresses)
+		Log(DEBUG) << "Local address: " << address << endl;
 }
 
-void CLI::removeOldNetworks(int id) {
-	lock_guard<mutex> lock(old_networks_mutex_);
+CLI::CLI(Config& config, NetworkCommunication& server) : config_(config), server_(server) {
+	// Waited on for every chunk, not looked up each time
+	request_timeout_ = chrono::milliseconds(config_.get<size_t>("request_timeout", 300000));
+}
 
-	while (!old_networks_.empty()) {
-		auto& network = old_networks_.front();
+CLI::~CLI() = default;
 
-		if (network.id_ == id)
-			break;
+Executor& CLI::executor() {
+	call_once(executor_started_, [this] {
+		executor_ = make_unique<Executor>(config_.get<size_t>("packet_threads", Executor::defaultThreads()));
+	});
 
-		// Kill
-		network.network_->kill(true);
+	return *executor_;
+}
 
-		// Join exiting packet thread
-		network.packet_thread_->join();
+void CLI::setPersistent(bool status) {
+	persistent_ = status;
+}
 
-		// Erase
-		old_networks_.pop_front();
+Packet CLI::initialize() {
+	// TODO: Remove test
+	test();
+
+	// Register at Server
+	auto request = requests_.addOrdered(HEADER_INITIALIZE, &server_);
+	server_.send(PacketCreator::initialize(g_protocol_standard));
+
+	return waitForAnswer(request);
+}
+
+bool CLI::join() {
+	auto name = config_.get<string>("name", "");
+
+	Log(INFORMATION) << "Registering at Server..\n";
+
+	// Register at Server as monitoring with certain name
+	auto request = requests_.addOrdered(HEADER_JOIN, &server_);
+	server_.send(PacketCreator::join(name));
+	auto answer = waitForAnswer(request);
+
+	if (!answer.getBool()) {
+		Log(WARNING) << "Server did not accept our connection\n";
+
+		return false;
 	}
+
+	Log(INFORMATION) << "Accepted at Server\n";
+
+	return true;
+}
+
+vector<pair<int, string>> CLI::listHosts() {
+	Log(DEBUG) << "Asking for available hosts\n";
+
+	auto request = requests_.addOrdered(HEADER_AVAILABLE, &server_);
+	server_.send(PacketCreator::available());
+	auto answer = waitForAnswer(request);
+
+	// A failure answer reads as a negative amount
+	vector<pair<int, string>> hosts;
+	auto size = answer.getInt();
+
+	for (int i = 0; i < size; i++) {
+		auto id = answer.getInt();
+		hosts.emplace_back(id, answer.getString());
+	}
+
+	return hosts;
+}
+
+// Read past the length and header like a received answer, reads as a failed send or a declined request
+static Packet failureAnswer() {
+	auto answer = PacketCreator::sendResult(-1, false);
+	answer.getInt();
+	answer.getByte();
+
+	return answer;
+}
+
+Packet CLI::waitForAnswer(PendingRequest& request) {
+	Packet answer;
+
+	if (!request.wait(answer, request_timeout_)) {
+		Log(WARNING) << "No answer to request " << request.getId() << " in time\n";
+
+		return failureAnswer();
+	}
+
+	return answer;
 }
 
 void CLI::shutdown() {
-	// Kill all existing networks before shutdown
+	closed_ = true;
 
-	while (!networks_.empty()) {
-		auto& network = networks_.front();
+	// Transfers on the direct connections fail, the connections are kept until the CLI is gone since a
+	// sender might still be using them
+	{
+		lock_guard<mutex> lock(direct_mutex_);
 
-		network.network_->kill(true);
-		network.packet_thread_->join();
+		for (auto& connection : direct_connections_) {
+			connection.second.network_->kill();
+			connection.second.pump_->wait();
+		}
+	}
+
+	// Kill all existing networks before shutdown, waited for outside the lock since their packets might need it
+	list<HostNetwork> networks;
 
-		networks_.pop_front();
+	{
+		lock_guard<mutex> lock(networks_mutex_);
+		networks.swap(networks_);
+	}
+
+	for (auto& network : networks) {
+		network.network_->kill(true);
+		network.pump_->wait();
 	}
 }
 
+// Called by every packet thread at once, the handlers lock what they share
 void CLI::process(NetworkCommunication& network, Packet& packet) {
 	auto header = packet.getByte();
 
-	packet_ = &packet;
-	network_ = &network;
-
 	switch (header) {
-		case HEADER_JOIN: handleJoin();
+		case HEADER_JOIN: handleJoin(network, packet);
 			break;
 
-		case HEADER_AVAILABLE: handleAvailable();
+		case HEADER_AVAILABLE: handleAvailable(network, packet);
 			break;
 
-		case HEADER_INFORM: handleInform();
+		case HEADER_INFORM: handleInform(network, packet);
 			break;
 
-		case HEADER_SEND: handleSend();
+		case HEADER_SEND: handleSend(network, packet);
 			break;
 
-		case HEADER_SEND_RESULT: handleSendResult();
+		case HEADER_SEND_RESULT: handleSendResult(network, packet);
 			break;
 
-		case HEADER_INITIALIZE: handleInitialize();
+		case HEADER_INITIALIZE: handleInitialize(network, packet);
 			break;
 
-		case HEADER_INFORM_RESULT: handleInformResult();
+		case HEADER_INFORM_RESULT: handleInformResult(packet);
 			break;
 
-		case HEADER_CLIENT_DISCONNECT: handleClientDisconnect();
+		case HEADER_CLIENT_DISCONNECT: handleClientDisconnect(packet);
 			break;
 
 		default: {
-			Log(WARNING) << "Unknown packet header ";
-			printf("%02X", header);
-			Log(NONE) << "\n";
+			Log(WARNING) << "Unknown packet header " << hex << setw(2) << setfill('0') << static_cast<int>(header) << "\n";
 		}
 	}
 }
 
-void CLI::notifyWaiting() {
-	lock_guard<mutex> lock(answer_mutex_);
-	answer_packet_ = make_shared<Packet>(*packet_);
-	answer_cv_.notify_one();
-}
-
-void CLI::handleJoin() {
-	auto result = packet_->getBool();
+// The correlation ID of an inform answer follows the receiver's addresses, if the server repeats it
+static int informCorrelation(const Packet& packet) {
+	PacketView view(packet);
 
-	if (result)
-		Log(INFORMATION) << "Accepted at Server\n";
-	else {
-		Log(WARNING) << "Server did not accept our connection\n";
+	if (view.getBool()) {
+		view.getBool();
+		auto addresses = view.getInt();
+		view.getInt();
+		view.getInt();
 
-		quick_exit(-1);
+		for (int i = 0; i < addresses && !view.failed(); i++)
+			view.getString();
 	}
+
+	return !view.failed() && view.getRemaining() >= 4 ? view.getInt() : 0;
 }
 
-void CLI::handleAvailable() {
-	auto size = packet_->getInt();
+void CLI::completeRequest(unsigned char header, NetworkCommunication& network, Packet& packet) {
+	int correlation = 0;
 
-	Log(DEBUG) << "Hosts:\n";
+	// Answers to chunks repeat the correlation ID of the chunk, if the receiver knows about it
+	if (header == HEADER_SEND_RESULT) {
+		PacketView view(packet);
+		int id;
+		bool result;
 
-	for (int i = 0; i < size; i++) {
-		auto id = packet_->getInt();
-		auto name = packet_->getString();
+		if (SendResultMessage::decode(view, id, result) && view.getRemaining() >= 4)
+			correlation = view.getInt();
+	} else if (header == HEADER_INFORM) {
+		correlation = informCorrelation(packet);
 
-		Log(DEBUG) << "Host " << id << " : " << name << endl;
+		if (correlation > 0 && !inform_correlated_.exchange(true))
+			Log(DEBUG) << "Server repeats inform IDs, informs are sent without waiting for each other\n";
 	}
 
-	// Quit since it's CLI
-	quick_exit(0);
+	if (!requests_.complete(header, correlation, &network, packet))
+		Log(DEBUG) << "Dropping answer " << (int)header << " nobody waits for\n";
+}
+
+void CLI::networkClosed(NetworkCommunication& network) {
+	// Requests sent on the network are answered with a failure instead of waiting for the timeout
+	if (requests_.completeAll(&network, failureAnswer()) > 0)
+		Log(WARNING) << "Connection closed during file transfer\n";
 }
 
-void CLI::handleInform() {
-	notifyWaiting();
+void CLI::handleJoin(NetworkCommunication& network, Packet& packet) {
+	completeRequest(HEADER_JOIN, network, packet);
 }
 
-void CLI::handleInformResult() {
-	auto id = packet_->getInt();
-	auto file = packet_->getString();
-	auto directory = packet_->getString();
-	auto direct_possible = packet_->getBool();
+void CLI::handleAvailable(NetworkCommunication& network, Packet& packet) {
+	completeRequest(HEADER_AVAILABLE, network, packet);
+}
+
+void CLI::handleInform(NetworkCommunication& network, Packet& packet) {
+	completeRequest(HEADER_INFORM, network, packet);
+}
+
+void CLI::handleInformResult(Packet& packet) {
+	if (closed_)
+		return;
+
+	int id;
+	string_view file;
+	string_view directory;
+	bool direct_possible;
+
+	if (!InformForwardMessage::decode(packet, id, file, directory, direct_possible)) {
+		Log(WARNING) << "Malformed inform from the server, ignoring it\n";
+
+		return;
+	}
+
+	// Newer senders add a correlation ID for the answer
+	auto correlation = packet.getRemaining() >= 4 ? packet.getInt() : 0;
 
 	// Return a list of available local IPs to see if the clients might be on the same network
 	auto addresses = getIPAddresses();
 	int port = 30500;
+	auto direct = config_.get<bool>("direct", true) && direct_possible;
+	HostNetwork host;
 
-	if (Base::config().get<bool>("direct", true) && direct_possible) {
+	if (direct) {
 		// Find available port
 		while (true) {
-			networks_.emplace_back();
-			networks_.back().network_ = make_shared<NetworkCommunication>();
-
-			auto& network = networks_.back().network_;
+			host.network_ = make_shared<NetworkCommunication>();
 
-			if (!network->start("", port, false, true)) {
+			if (!host.network_->start("", port, false, true)) {
 				Log(ERROR) << "Hosting failed at port " << port << "\n";
 
-				networks_.pop_back();
 				port++;
 			} else {
 				Log(DEBUG) << "Hosting successful at port " << port << "\n";
@@ -699,131 +1189,245 @@ void CLI::handleInformResult() {
 				break;
 			}
 		}
+
+		// Only usable by a sender on the same machine, others skip it
+		auto& shm_address = host.network_->getSharedMemoryAddress();
+
+		if (!shm_address.empty())
+			addresses.push_back(shm_address);
 	} else {
 		// Signal direct connection is disabled by giving no bind addresses
 		addresses.clear();
 	}
 
-	Base::network().send(PacketCreator::informResult(true /* accept or decline */, id, port, addresses));
+	server_.send(PacketCreator::informResult(true /* accept or decline */, id, port, addresses, correlation));
 
-	if (Base::config().get<bool>("direct", true) && direct_possible) {
-		auto& network = networks_.back().network_;
+	if (direct) {
+		host.id_ = id;
+		host.network_->enableFlowControl(config_.get<size_t>("receive_window", 64 * 1024 * 1024));
+		host.pump_ = PacketPump::start(*this, host.network_, true);
 
-		networks_.back().id_ = id;
-		networks_.back().packet_thread_ = make_shared<thread>(packetThread, ref(*network), networks_.back().id_, true);
+		lock_guard<mutex> lock(networks_mutex_);
+		networks_.push_back(host);
 	}
 }
 
-void CLI::handleSend() {
-	// TODO: Receive file here
-	auto id = packet_->getInt();
-	auto file = packet_->getString();
-	auto directory = packet_->getString();
-	auto bytes = packet_->getBytes();
-	auto first = packet_->getBool();
+shared_ptr<SenderShard> CLI::getShard(int id) {
+	lock_guard<mutex> lock(receiving_mutex_);
+
+	auto& shard = shards_[id];
+
+	if (!shard)
+		shard = make_shared<SenderShard>();
+
+	return shard;
+}
+
+void CLI::releasePath(const string& file) {
+	lock_guard<mutex> lock(receiving_mutex_);
+
+	paths_.erase(file);
+}
+
+void CLI::setReceiveHandler(const function<void(const ReceivedFile&)>& handler) {
+	receive_handler_ = handler;
+}
+
+bool CLI::receiveInto(const string& name, unsigned char* buffer, size_t capacity) {
+	lock_guard<mutex> lock(receiving_mutex_);
+
+	return buffers_.emplace(name, make_pair(buffer, capacity)).second;
+}
+
+bool CLI::cancelReceive(const string& name) {
+	lock_guard<mutex> lock(receiving_mutex_);
+
+	return buffers_.erase(name) > 0;
+}
+
+void CLI::received(int id, const ReceivingFile& file, bool complete) {
+	if (!receive_handler_)
+		return;
+
+	ReceivedFile result;
+	result.sender_ = id;
+	result.path_ = file.buffer_ != nullptr ? file.name_ : file.path_;
+	result.buffer_ = file.buffer_;
+	result.bytes_ = file.bytes_;
+	result.complete_ = complete;
+
+	receive_handler_(result);
+}
+
+void CLI::dropFile(SenderShard& shard, int id, const shared_ptr<ReceivingFile>& file) {
+	if (shard.active_stream_.stream_ == file)
+		shard.active_stream_ = ActiveStream();
+
+	file->stream_.close();
+	shard.files_.erase(file->path_);
+	releasePath(file->path_);
+
+	received(id, *file, false);
+}
+
+void CLI::handleSend(NetworkCommunication& network, Packet& packet) {
+	int id;
+	string_view file_name;
+	string_view directory;
+	pair<size_t, const unsigned char*> bytes;
+	bool first;
+
+	// Views into the packet, nothing is allocated unless a new file starts
+	if (!SendByIdMessage::decode(packet, id, file_name, directory, bytes, first)) {
+		Log(WARNING) << "Malformed file chunk, ignoring it\n";
+
+		return;
+	}
+
+	// Newer senders add a correlation ID for the answer
+	auto correlation = packet.getRemaining() >= 4 ? packet.getInt() : 0;
+
+	// Chunks of one sender might come on both the relay and the direct connection, they are written in order
+	auto shard = getShard(id);
+	lock_guard<mutex> lock(shard->mutex_);
+	auto& active_stream = shard->active_stream_;
+
+	if (shard->closed_) {
+		Log(DEBUG) << "Dropping chunk from disconnected sender " << id << "\n";
+
+		return;
+	}
+
+	if (!first && bytes.first > 0 && active_stream.stream_ && active_stream.file_ == file_name && active_stream.directory_ == directory) {
+		auto current = active_stream.stream_;
+
+		if (!writeChunk(network, *current, id, correlation, bytes))
+			dropFile(*shard, id, current);
+
+		return;
+	}
+
+	// Add directory, memory to receive into is found by this name
+	string name;
+	name.reserve(directory.size() + file_name.size());
+	name.append(directory).append(file_name);
 
-	// Add directory
-	file = directory + file;
-	auto original_file = file;
+	auto file = name;
 
 	// Add folder ID if the option is enabled
-	if (Base::config().has("output_folder"))
-		file = Base::config().get<string>("output_folder", "") + "/" + file;
+	if (config_.has("output_folder"))
+		file = config_.get<string>("output_folder", "") + "/" + file;
 
 	if (bytes.first == 0) {
 		Log(DEBUG) << "Removing from cache, sending ID " << id << "\n";
 
 		// Remove from cache
-		auto iterator = file_streams_.find(file);
+		auto iterator = shard->files_.find(file);
 
 		// Extra check
-		if (iterator != file_streams_.end()) {
-			if (iterator->second->fail())
+		if (iterator != shard->files_.end()) {
+			if (iterator->second->stream_.fail())
 				Log(WARNING) << "Fail bit set\n";
 
-			if (iterator->second->bad())
+			if (iterator->second->stream_.bad())
 				Log(WARNING) << "Bad bit set\n";
 
-			if (iterator->second->eof())
+			if (iterator->second->stream_.eof())
 				Log(WARNING) << "Eof bit set\n";
 		}
 
+		if (active_stream.file_ == file_name && active_stream.directory_ == directory)
+			active_stream = ActiveStream();
+
 		// Send result that we're done before flushing
-		network_->send(PacketCreator::sendResult(id, true));
+		network.send(PacketCreator::sendResult(id, true, correlation));
 
-		if (iterator != file_streams_.end()) {
+		if (iterator != shard->files_.end()) {
 			Log(DEBUG) << "Flushing..\n";
 
-			iterator->second->flush();
-			iterator->second->close();
-
-			file_streams_.erase(file);
-
-			Log(DEBUG) << "Done\n";
-		}
+			{
+				TraceSpan span("disk flush");
+				iterator->second->stream_.flush();
+				iterator->second->stream_.close();
+			}
 
-		// Remove from file_id_connections_
-		auto id_iterator = file_id_connections_.find(id);
+			Log(DEBUG) << "Disk writes for " << file << ": " << iterator->second->write_latency_.summary() << "\n";
 
-		if (id_iterator != file_id_connections_.end()) {
-			auto& files = id_iterator->second;
+			auto done = iterator->second;
+			shard->files_.erase(iterator);
+			releasePath(file);
+			Metrics::add(METRIC_FILES_RECEIVED);
+			received(id, *done, true);
 
-			files.erase(remove_if(files.begin(), files.end(), [&file] (auto& element) { return file == element; }), files.end());
+			Log(DEBUG) << "Done\n";
 		}
 
 		return;
 	}
 
-	shared_ptr<ofstream> file_stream;
+	shared_ptr<ReceivingFile> file_stream;
 
 	if (first) {
 		Log(DEBUG) << "Removing existing files and preparing stream for ID " << id << " and file " << file << "\n";
 
-		// Create folder if it does not exist
-		if (Base::config().has("output_folder"))
-			IO::createDirectory(Base::config().get<string>("output_folder", ""));
+		// See if the file is already being written, by this sender or another one
+		bool claimed;
+		pair<unsigned char*, size_t> buffer(nullptr, 0);
+
+		{
+			lock_guard<mutex> paths_lock(receiving_mutex_);
+			claimed = paths_.insert(file).second;
 
-		// Create directory if it does not exist
-		IO::createDirectory(Base::config().get<string>("output_folder", "") + "/" + directory);
+			auto expected = buffers_.find(name);
 
-		// See if file stream already exists, if it does we should not try to write to the same file
-		auto iterator = file_streams_.find(file);
+			if (claimed && expected != buffers_.end()) {
+				buffer = expected->second;
+				buffers_.erase(expected);
+			}
+		}
 
-		if (iterator != file_streams_.end()) {
+		if (!claimed) {
 			Log(WARNING) << "File " << file << " already exists, disabling write\n";
 
-			network_->send(PacketCreator::sendResult(id, false));
+			network.send(PacketCreator::sendResult(id, false, correlation));
 			return;
 		}
 
-		// Remove any existing files
-		remove(file.c_str());
-
-		shared_ptr<ofstream> stream_pointer = make_shared<ofstream>(file, ios::binary);
+		auto stream_pointer = make_shared<ReceivingFile>();
+		stream_pointer->path_ = file;
+		stream_pointer->name_ = name;
+		stream_pointer->buffer_ = buffer.first;
+		stream_pointer->capacity_ = buffer.second;
 
-		// Add file stream to cache
-		file_streams_[file] = stream_pointer;
+		if (buffer.first == nullptr) {
+			// Create folder if it does not exist
+			if (config_.has("output_folder"))
+				IO::createDirectory(config_.get<string>("output_folder", ""));
 
-		// Add file to file_id_connections_
-		auto id_iterator = file_id_connections_.find(id);
+			// Create directory if it does not exist
+			IO::createDirectory(config_.get<string>("output_folder", "") + "/" + string(directory));
 
-		if (id_iterator == file_id_connections_.end()) {
-			// Add vector with file
-			file_id_connections_[id] = vector<string>({ file });
+			// Remove any existing files
+			remove(file.c_str());
 
-			Log(DEBUG) << "Add file stream with ID " << id << " and file " << file << endl;
-		} else {
-			// Add to vector
-			file_id_connections_[id].push_back(file);
+			stream_pointer->stream_.open(file, ios::binary);
 		}
+
+		// Add file stream to the sender's files
+		shard->files_[file] = stream_pointer;
+
+		Log(DEBUG) << "Add file stream with ID " << id << " and file " << file << endl;
 	}
 
 	// Find stream in cache
-	auto iterator = file_streams_.find(file);
+	auto iterator = shard->files_.find(file);
 
-	if (iterator == file_streams_.end())
+	if (iterator == shard->files_.end()) {
 		Log(WARNING) << "Could not find file stream\n";
 
+		return;
+	}
+
 	file_stream = iterator->second;
 
 	if (!file_stream) {
@@ -832,75 +1436,127 @@ void CLI::handleSend() {
 		return;
 	}
 
-	if (file_stream->fail())
+	Log(DEBUG) << "Writing file " << file << " with " << bytes.first << " bytes\n";
+
+	active_stream.directory_.assign(directory);
+	active_stream.file_.assign(file_name);
+	active_stream.stream_ = file_stream;
+
+	if (!writeChunk(network, *file_stream, id, correlation, bytes))
+		dropFile(*shard, id, file_stream);
+}
+
+bool CLI::writeChunk(NetworkCommunication& network, ReceivingFile& file, int id, int correlation, const pair<size_t, const unsigned char*>& bytes) {
+	if (file.buffer_ != nullptr) {
+		if (bytes.first > file.capacity_ - file.bytes_) {
+			Log(WARNING) << "File " << file.name_ << " does not fit its buffer of " << file.capacity_ << " bytes\n";
+
+			network.send(PacketCreator::sendResult(id, false, correlation));
+			return false;
+		}
+
+		memcpy(file.buffer_ + file.bytes_, bytes.second, bytes.first);
+		file.bytes_ += bytes.first;
+		Metrics::add(METRIC_CHUNKS_WRITTEN);
+
+		network.send(PacketCreator::sendResult(id, true, correlation));
+		return true;
+	}
+
+	auto& file_stream = file.stream_;
+
+	if (file_stream.fail())
 		Log(WARNING) << "Fail bit set\n";
 
-	if (file_stream->bad())
+	if (file_stream.bad())
 		Log(WARNING) << "Bad bit set\n";
 
-	if (file_stream->eof())
+	if (file_stream.eof())
 		Log(WARNING) << "Eof bit set\n";
 
-	Log(DEBUG) << "Writing file " << file << " with " << bytes.first << " bytes\n";
+	Timer timer;
+
+	{
+		TraceSpan span("disk write", bytes.first);
+		file_stream.write((const char*)bytes.second, bytes.first);
+	}
 
-	file_stream->write((const char*)bytes.second, bytes.first);
+	auto latency = timer.elapsedDuration();
+	file.write_latency_.record(latency);
+	file.bytes_ += bytes.first;
+	Metrics::record(METRIC_DISK_WRITE_LATENCY, latency);
+	Metrics::add(METRIC_CHUNKS_WRITTEN);
 
 	// Send OK to sender
-	network_->send(PacketCreator::sendResult(id, true));
+	network.send(PacketCreator::sendResult(id, true, correlation));
+
+	return true;
 }
 
-void CLI::handleSendResult() {
-	notifyWaiting();
+void CLI::handleSendResult(NetworkCommunication& network, Packet& packet) {
+	completeRequest(HEADER_SEND_RESULT, network, packet);
 }
 
-void CLI::handleInitialize() {
-	notifyWaiting();
+void CLI::handleInitialize(NetworkCommunication& network, Packet& packet) {
+	completeRequest(HEADER_INITIALIZE, network, packet);
 }
 
-void CLI::handleClientDisconnect() {
-	auto id = packet_->getInt();
+void CLI::handleClientDisconnect(Packet& packet) {
+	int id;
 
-	networks_.erase(remove_if(networks_.begin(), networks_.end(), [this, &id] (auto& network) {
-		if (id != network.id_)
-			return false;
+	if (!DisconnectMessage::decode(packet, id)) {
+		Log(WARNING) << "Malformed disconnect from the server, ignoring it\n";
 
-		Log(DEBUG) << "Disconnecting user " << id << endl;
-
-		// We have a network connected to id
-		network.network_->kill();
+		return;
+	}
 
-		lock_guard<mutex> lock(old_networks_mutex_);
-		old_networks_.push_back(network);
+	{
+		lock_guard<mutex> lock(networks_mutex_);
 
-		return true;
-	}), networks_.end());
+		// The pump keeps the network until its last packet is handled, nothing has to be joined here
+		networks_.remove_if([&id] (auto& network) {
+			if (id != network.id_)
+				return false;
 
-	// Iterate through file_id_connections_ to close all streams associated with this ID
-	auto iterator = file_id_connections_.find(id);
+			Log(DEBUG) << "Disconnecting user " << id << endl;
 
-	if (iterator == file_id_connections_.end()) {
-		Log(DEBUG) << "No files associated with " << id << endl;
+			// We have a network connected to id
+			network.network_->kill();
 
-		return;
+			return true;
+		});
 	}
 
-	for (auto& file : iterator->second) {
-		auto stream_iterator = file_streams_.find(file);
+	shared_ptr<SenderShard> shard;
 
-		if (stream_iterator == file_streams_.end()) {
-			Log(WARNING) << "Can't find file stream " << file << endl;
+	{
+		lock_guard<mutex> lock(receiving_mutex_);
+		auto iterator = shards_.find(id);
 
-			continue;
+		if (iterator == shards_.end()) {
+			Log(DEBUG) << "No files associated with " << id << endl;
+
+			return;
 		}
 
-		Log(DEBUG) << "Flushing and erasing file " << file << endl;
+		shard = iterator->second;
+		shards_.erase(iterator);
+	}
+
+	// Waits for a chunk from the sender which is being written, close all streams associated with this ID
+	lock_guard<mutex> lock(shard->mutex_);
+
+	for (auto& file : shard->files_) {
+		Log(DEBUG) << "Flushing and erasing file " << file.first << endl;
 
-		stream_iterator->second->flush();
-		stream_iterator->second->close();
+		file.second->stream_.flush();
+		file.second->stream_.close();
 
-		file_streams_.erase(file);
+		releasePath(file.first);
+		received(id, *file.second, false);
 	}
 
-	// Remove ID from map
-	file_id_connections_.erase(id);
-}
\ No newline at end of file
+	shard->files_.clear();
+	shard->active_stream_ = ActiveStream();
+	shard->closed_ = true;
+}
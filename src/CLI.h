@@ -2,82 +2,339 @@
 #ifndef CLI_H
 #define CLI_H
 
+#include "RequestTable.h"
+#include "Histogram.h"
+#include "NetworkCommunication.h"
+
 #include <condition_variable>
 #include <mutex>
 #include <memory>
 #include <unordered_map>
+#include <unordered_set>
 #include <fstream>
 #include <vector>
 #include <thread>
 #include <list>
+#include <atomic>
+#include <future>
+#include <chrono>
+#include <functional>
 
 enum {
 	ERROR_OLD_PROTOCOL
 };
 
 class Packet;
-class NetworkCommunication;
+class ChunkWindow;
+class PacketPump;
+class Config;
+class Executor;
+
+struct DirectConnection {
+	std::shared_ptr<NetworkCommunication> network_;
+	std::shared_ptr<PacketPump> pump_;
+};
+
+// Direct connection still being set up, transfers go over the relay until it is up
+struct DirectAttempt {
+	std::shared_ptr<NetworkCommunication> network_;
+	std::vector<std::string> candidates_;
+	std::shared_future<bool> connected_;
+};
+
+// File being received, with how long its chunks took to write
+struct ReceivingFile {
+	std::ofstream stream_;
+	Histogram write_latency_;
+	size_t bytes_ = 0;
+	
+	// Where it is written, and the directory and name from the sender
+	std::string path_;
+	std::string name_;
+	
+	// Written to memory from receiveInto() instead of the stream when set
+	unsigned char* buffer_ = nullptr;
+	size_t capacity_ = 0;
+};
+
+// A file which was received, or given up on
+struct ReceivedFile {
+	int sender_ = -1;
+	
+	// Where it was written, or the name given to receiveInto()
+	std::string path_;
+	unsigned char* buffer_ = nullptr;
+	size_t bytes_ = 0;
+	bool complete_ = false;
+};
+
+// Stream the last chunk was written to, chunks of one file arrive in a row so the path only has to be
+// built for the first one
+struct ActiveStream {
+	std::string directory_;
+	std::string file_;
+	std::shared_ptr<ReceivingFile> stream_;
+};
+
+// Files being received from one sender. Chunks from the same sender are written in order under its lock,
+// different senders do not wait for each other
+struct SenderShard {
+	std::mutex mutex_;
+	std::unordered_map<std::string, std::shared_ptr<ReceivingFile>> files_;
+	ActiveStream active_stream_;
+	
+	// Set when the sender disconnected, chunks still being handled are dropped
+	bool closed_ = false;
+};
+
+// Files sent to one receiver by a sendFiles() call
+struct ReceiverResult {
+	std::string to_;
+	size_t files_sent_ = 0;
+	size_t files_failed_ = 0;
+	
+	// Time from sending a chunk until the receiver acknowledged it
+	Histogram ack_latency_;
+};
+
+// What sendFiles() reads, a file or directory on disk or, when data_ is set, memory sent as a file named
+// path_. The memory has to stay valid until sendFiles() returns
+struct SendSource {
+	std::string path_;
+	const unsigned char* data_ = nullptr;
+	size_t size_ = 0;
+};
+
+// How far sendFiles() has come, bytes are counted once read for all receivers
+struct SendProgress {
+	std::string file_;
+	size_t bytes_ = 0;
+	size_t files_sent_ = 0;
+	size_t files_failed_ = 0;
+};
+
+struct SendOptions {
+	bool recursive_ = false;
+	
+	// Transfers running at the same time share the connections, the highest priority is sent first and
+	// transfers of the same priority get bandwidth by weight
+	int priority_ = 0;
+	unsigned weight_ = 1;
+	
+	// Called by the thread calling sendFiles() after every chunk
+	std::function<void(const SendProgress&)> progress_;
+};
+
+struct SendResult {
+	std::vector<ReceiverResult> receivers_;
+	size_t files_sent_ = 0;
+	size_t files_failed_ = 0;
+	size_t bytes_ = 0;
+	
+	// Every file reached every receiver
+	bool success() const;
+};
+
+// Outgoing flow of a sendFiles() call on one connection, the connection is kept until the call returns
+struct SendFlow {
+	NetworkCommunication* network_ = nullptr;
+	std::shared_ptr<NetworkCommunication> connection_;
+	int id_ = 0;
+};
+
+// State of one sendFiles() call, several calls can run at once
+struct SendState {
+	SendOptions options_;
+	SendResult result_;
+	SendProgress progress_;
+	
+	// Opened by the receivers' sender threads as they move to direct connections
+	std::mutex flows_mutex_;
+	std::vector<SendFlow> flows_;
+};
+
+// Where the chunks of the file being sent go for one receiver
+struct Route {
+	size_t result_ = 0;
+	std::string to_;
+	NetworkCommunication* network_ = nullptr;
+	
+	// Keeps a direct connection alive while it is used, and the flow the chunks are queued on
+	std::shared_ptr<NetworkCommunication> connection_;
+	int flow_ = 0;
+	
+	// Read by the file reader while the receiver's sender moves to a direct connection
+	std::atomic<bool> direct_{false};
+};
+
+// What a connection has queued, the server connection is named "server" and direct ones by receiver
+struct ConnectionState {
+	std::string name_;
+	OutgoingState outgoing_;
+};
 
 struct HostNetwork {
 	std::shared_ptr<NetworkCommunication> network_;
-	std::shared_ptr<std::thread> packet_thread_;
+	std::shared_ptr<PacketPump> pump_;
 	
 	int id_;
 };
 
 class CLI {
 public:
-	void start();
+	// Both have to outlive the CLI, the server connection is started by the caller
+	CLI(Config& config, NetworkCommunication& server);
+	~CLI();
+	
+	CLI(const CLI&) = delete;
+	CLI& operator=(const CLI&) = delete;
+	
+	// Registers at the server, the answer is read past its header and starts with whether our protocol
+	// was accepted
+	Packet initialize();
+	
+	// Registers as a receiver under the configured name, false if the server did not accept it
+	bool join();
+	
+	// Receivers registered at the server, by ID and name
+	std::vector<std::pair<int, std::string>> listHosts();
+	
+	// Lost connections fail the transfers on them instead of ending the process, for daemons and embedders
+	void setPersistent(bool status);
+	
 	void process(NetworkCommunication& network, Packet& packet);
 	
-	Packet waitForAnswer();
+	// Waits for the answer to a request, read past its header. A timeout or a closed connection
+	// gives a failure answer instead
+	Packet waitForAnswer(PendingRequest& request);
 	
-	void removeOldNetworks(int id);
+	// Closes the direct connections, and the hosted ones once what they queued is sent
 	void shutdown();
 	
-	void sendFile(const std::string& to, std::string file, std::string directory, std::string base);
+	// Each file is read once for all receivers. Several threads can send at once, their chunks share the
+	// connections by the options' priority and weight
+	SendResult sendFiles(const std::vector<std::string>& receivers, const std::vector<std::string>& files, bool recursive);
+	SendResult sendFiles(const std::vector<std::string>& receivers, const std::vector<SendSource>& sources, const SendOptions& options);
+	
+	// The server connection and the direct connections to receivers
+	std::vector<ConnectionState> getConnections();
+	
+	// Called from a packet worker for every file which is done or given up on, must not block. Set before
+	// the first file comes
+	void setReceiveHandler(const std::function<void(const ReceivedFile&)>& handler);
+	
+	// The next file with this name, directory included, is written to the buffer instead of the disk. False
+	// if the name already has a buffer
+	bool receiveInto(const std::string& name, unsigned char* buffer, size_t capacity);
+	bool cancelReceive(const std::string& name);
+	
+	// Called once the network is gone and its last packet handled
+	void networkClosed(NetworkCommunication& network);
+	
+	// Handles the packets of every connection, started on first use
+	Executor& executor();
 	
 private:
-	void handleJoin();
-	void handleAvailable();
-	void handleInform();
-	void handleSend();
-	void handleSendResult();
-	void handleInitialize();
-	void handleInformResult();
-	void handleClientDisconnect();
+	void handleJoin(NetworkCommunication& network, Packet& packet);
+	void handleAvailable(NetworkCommunication& network, Packet& packet);
+	void handleInform(NetworkCommunication& network, Packet& packet);
+	void handleSend(NetworkCommunication& network, Packet& packet);
+	void handleSendResult(NetworkCommunication& network, Packet& packet);
+	void handleInitialize(NetworkCommunication& network, Packet& packet);
+	void handleInformResult(Packet& packet);
+	void handleClientDisconnect(Packet& packet);
 	
-	void notifyWaiting();
+	// Sends to the receivers of the sendFiles() call
+	void sendFile(SendState& state, std::string file, std::string directory, std::string base);
 	
-	Packet* packet_ 				= nullptr;
-	NetworkCommunication* network_	= nullptr;
+	// Informs the receiver unless there already is a direct connection, or an attempt, to it. False if declined
+	bool prepareRoute(SendState& state, Route& route, const std::string& file, const std::string& directory, bool& started_attempt);
+	void useDirect(SendState& state, Route& route, const std::shared_ptr<NetworkCommunication>& connection);
 	
-	std::condition_variable answer_cv_;
-	std::mutex answer_mutex_;
-	std::shared_ptr<Packet> answer_packet_ = nullptr;
+	// The flow of the call on the network, opened on first use
+	int getFlow(SendState& state, NetworkCommunication& network, const std::shared_ptr<NetworkCommunication>& connection);
 	
-	std::unordered_map<std::string, std::shared_ptr<std::ofstream>> file_streams_;
-	std::unordered_map<int, std::vector<std::string>> file_id_connections_;
+	// Sends the chunks from the window to one receiver, run by a thread per receiver
+	bool sendChunks(SendState& state, Route& route, size_t receiver, ChunkWindow& window, const std::string& file, const std::string& directory);
 	
-	std::list<HostNetwork> networks_;
+	// Keeps connecting to the receiver in the background, for up to direct_retry milliseconds. Called with
+	// direct_mutex_ held, false if another transfer already connected or is connecting to it
+	bool startDirectAttempt(const std::string& to, const std::vector<std::string>& candidates, unsigned short port);
+	
+	// The direct connection to the receiver once the attempt, or another transfer's, has succeeded. Waits at
+	// most wait for an attempt
+	std::shared_ptr<NetworkCommunication> upgradeDirect(SendState& state, const std::string& to, std::chrono::milliseconds wait);
 	
-	// Packet threads to be killed, but couldn't since they were processing the packet which killed them
-	// Needs to be joined by another thread
-	std::mutex old_networks_mutex_;
-	std::list<HostNetwork> old_networks_;
+	// Reads the chunks of a file from source, which returns the bytes read, 0 to try again or -1 when it failed
+	void sendData(SendState& state, const std::string& file, const std::string& directory, size_t size, const std::function<long long(unsigned char*, size_t, size_t)>& source);
 	
-	// What direct connected IPs was successful
+	// Counts the file as failed for every receiver
+	void failFile(SendState& state, const std::string& file);
+	void reportProgress(SendState& state, const std::string& file);
+	
+	// False when the chunk does not fit the receiving buffer
+	bool writeChunk(NetworkCommunication& network, ReceivingFile& file, int id, int correlation, const std::pair<size_t, const unsigned char*>& bytes);
+	
+	// Gives up on a file of the sender, with the shard locked
+	void dropFile(SenderShard& shard, int id, const std::shared_ptr<ReceivingFile>& file);
+	void received(int id, const ReceivingFile& file, bool complete);
+	
+	// Created on the first chunk from the sender
+	std::shared_ptr<SenderShard> getShard(int id);
+	void releasePath(const std::string& file);
+	
+	// Hands the packet to the request waiting for it
+	void completeRequest(unsigned char header, NetworkCommunication& network, Packet& packet);
+	
+	// Requests sent but not answered yet, on any network
+	RequestTable requests_;
+	
+	// Only held to find a shard or claim a path, never while writing to disk
+	std::mutex receiving_mutex_;
+	std::unordered_map<int, std::shared_ptr<SenderShard>> shards_;
+	
+	// Paths being written by any sender, a file is only written by one transfer at a time
+	std::unordered_set<std::string> paths_;
+	
+	// Names to receive into memory, taken by the first chunk
+	std::unordered_map<std::string, std::pair<unsigned char*, size_t>> buffers_;
+	std::function<void(const ReceivedFile&)> receive_handler_;
+	
+	// Direct connections hosted for senders
+	std::mutex networks_mutex_;
+	std::list<HostNetwork> networks_;
+	
+	// What direct connected IPs was successful, under direct_mutex_
 	std::unordered_map<std::string, bool> connect_results_;
 	
-	// Active direct connection to the receiving side, to avoid re-opening the connection for every file
-	std::shared_ptr<NetworkCommunication> active_direct_connection_ = nullptr;
-	std::shared_ptr<std::thread> active_packet_thread_ = nullptr;
+	// Active direct connections per receiver, to avoid re-opening the connection for every file
+	// Senders of different receivers move to their direct connections at the same time
+	std::mutex direct_mutex_;
+	std::unordered_map<std::string, DirectConnection> direct_connections_;
+	std::unordered_map<std::string, DirectAttempt> direct_attempts_;
+	
+	// Older servers answer informs without their ID, then one transfer at a time asks the server. Set
+	// once an answer repeats its ID
+	std::mutex inform_mutex_;
+	std::atomic<bool> inform_correlated_{false};
+	
+	bool persistent_				= false;
 	
 	// Our client ID from the server
-	int client_id_ = -1;
+	std::atomic<int> client_id_{-1};
+	
+	// From request_timeout, zero waits forever
+	std::chrono::milliseconds request_timeout_{0};
+	
+	// Set by shutdown(), no more connections are made
+	std::atomic<bool> closed_{false};
+	
+	Config& config_;
+	NetworkCommunication& server_;
+	
+	// Last so it is gone first, what the closed connections queued is handled before the rest goes
+	std::once_flag executor_started_;
+	std::unique_ptr<Executor> executor_;
 };
 
-// Start different packetThreads for direct connections
-void packetThread(NetworkCommunication& network, int id, bool do_accept);
-
 #endif
\ No newline at end of file
@@ -0,0 +1,22 @@
+#pragma once
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include <cstddef>
+
+// Reliable byte stream used by NetworkCommunication instead of a TCP socket
+class Channel {
+public:
+	virtual ~Channel() {}
+
+	// Blocks until data is available, returns <= 0 when the channel is closed
+	virtual int receive(unsigned char* buffer, size_t size) = 0;
+
+	// Blocks until all data is accepted by the channel, returns <= 0 when the channel is closed
+	virtual int send(const unsigned char* buffer, size_t size) = 0;
+
+	// Flushes what has been sent and wakes any blocked receive() or send()
+	virtual void close() = 0;
+};
+
+#endif
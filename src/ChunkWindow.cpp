@@ -0,0 +1,88 @@
+#include "ChunkWindow.h"
+
+#include <algorithm>
+
+using namespace std;
+
+ChunkWindow::ChunkWindow(size_t receivers, size_t window) : window_(max<size_t>(1, window)), positions_(receivers, 0), left_(receivers, false) {}
+
+bool ChunkWindow::waitForRoom() {
+	unique_lock<mutex> lock(mutex_);
+
+	changed_.wait(lock, [this] { return chunks_.size() < window_ || find(left_.begin(), left_.end(), false) == left_.end(); });
+
+	return find(left_.begin(), left_.end(), false) != left_.end();
+}
+
+void ChunkWindow::push(Chunk&& chunk) {
+	{
+		lock_guard<mutex> lock(mutex_);
+		chunks_.push_back(move(chunk));
+	}
+
+	changed_.notify_all();
+}
+
+void ChunkWindow::finish(bool failed) {
+	{
+		lock_guard<mutex> lock(mutex_);
+		finished_ = true;
+		failed_ = failed;
+	}
+
+	changed_.notify_all();
+}
+
+bool ChunkWindow::get(size_t index, Chunk& chunk) {
+	unique_lock<mutex> lock(mutex_);
+
+	changed_.wait(lock, [this, index] { return index < base_ + chunks_.size() || finished_; });
+
+	if (index >= base_ + chunks_.size())
+		return false;
+
+	// Shares the packet buffer
+	chunk = chunks_.at(index - base_);
+
+	return true;
+}
+
+void ChunkWindow::release(size_t receiver, size_t index) {
+	{
+		lock_guard<mutex> lock(mutex_);
+		positions_.at(receiver) = index;
+		evict();
+	}
+
+	changed_.notify_all();
+}
+
+void ChunkWindow::leave(size_t receiver) {
+	{
+		lock_guard<mutex> lock(mutex_);
+		left_.at(receiver) = true;
+		evict();
+	}
+
+	changed_.notify_all();
+}
+
+bool ChunkWindow::failed() {
+	lock_guard<mutex> lock(mutex_);
+
+	return failed_;
+}
+
+void ChunkWindow::evict() {
+	// Receivers which left do not hold back the others
+	auto slowest = base_ + chunks_.size();
+
+	for (size_t i = 0; i < positions_.size(); i++)
+		if (!left_.at(i))
+			slowest = min(slowest, positions_.at(i));
+
+	while (base_ < slowest) {
+		chunks_.pop_front();
+		base_++;
+	}
+}
@@ -0,0 +1,67 @@
+#pragma once
+#ifndef CHUNK_WINDOW_H
+#define CHUNK_WINDOW_H
+
+#include "Packet.h"
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+// A chunk of the file being sent, read once. The packet is complete for receivers of its format,
+// others build their own packet around bytes_, which points into it
+struct Chunk {
+	Packet packet_;
+	bool direct_ = false;
+	std::string to_;
+
+	std::pair<size_t, const unsigned char*> bytes_;
+	bool first_ = false;
+	int id_ = 0;
+};
+
+// Chunks shared by every receiver of a file. The reader waits while the slowest receiver is window
+// chunks behind, so a slow receiver only holds back the others once the window is full
+class ChunkWindow {
+public:
+	ChunkWindow(size_t receivers, size_t window);
+
+	// Reader side, false when every receiver has left
+	bool waitForRoom();
+	void push(Chunk&& chunk);
+
+	// No more chunks, failed when the file could not be read to the end
+	void finish(bool failed);
+
+	// Receiver side, waits for the chunk at index. False when there are no more chunks
+	bool get(size_t index, Chunk& chunk);
+
+	// The receiver is done with the chunks before index
+	void release(size_t receiver, size_t index);
+
+	// The receiver does not take any more chunks
+	void leave(size_t receiver);
+
+	bool failed();
+
+private:
+	void evict();
+
+	std::mutex mutex_;
+	std::condition_variable changed_;
+
+	std::deque<Chunk> chunks_;
+	size_t base_ = 0;
+	size_t window_;
+
+	// Next chunk per receiver
+	std::vector<size_t> positions_;
+	std::vector<bool> left_;
+
+	bool finished_ = false;
+	bool failed_ = false;
+};
+
+#endif
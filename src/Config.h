@@ -34,6 +34,15 @@ public:
 		return value;
 	}
 	
+	// Replaces the values of key, for configs built in code instead of parsed
+	template<class T>
+	void set(const std::string& key, const T& value) {
+		std::ostringstream stream;
+		stream << value;
+		
+		configs_[key] = { stream.str() };
+	}
+	
 	template<class T>
 	std::vector<T> getAll(const std::string& key, const std::vector<T>& default_value) {
 		auto iterator = configs_.find(key);
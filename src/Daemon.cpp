@@ -0,0 +1,279 @@
+#include "Daemon.h"
+#include "TransferSession.h"
+#include "Histogram.h"
+#include "Log.h"
+#include "Packet.h"
+#include "PartialPacket.h"
+#include "PacketCreator.h"
+
+#include <cstring>
+#include <cstdlib>
+#include <climits>
+#include <errno.h>
+#include <array>
+
+#ifndef WIN32
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+#ifndef WIN32
+static string g_socket_path_;
+
+static void removeSocket() {
+	if (!g_socket_path_.empty())
+		unlink(g_socket_path_.c_str());
+}
+
+static bool writePacket(int socket, const Packet& packet) {
+	size_t written = 0;
+
+	while (written < packet.getSize()) {
+		auto result = write(socket, packet.getData() + written, packet.getSize() - written);
+
+		if (result <= 0)
+			return false;
+
+		written += result;
+	}
+
+	return true;
+}
+
+// Reads one framed packet, reading starts at the header byte just like packets from the network
+static bool readPacket(int socket, Packet& packet) {
+	PartialPacket partial_packet;
+	array<unsigned char, 4> header;
+
+	while (!partial_packet.isFinished()) {
+		ssize_t received;
+
+		if (partial_packet.hasHeader()) {
+			received = read(socket, partial_packet.getWritePointer(), partial_packet.getRemaining());
+
+			if (received > 0)
+				partial_packet.addReceived(received);
+		} else {
+			received = read(socket, header.data(), partial_packet.getRemaining());
+
+			if (received > 0)
+				partial_packet.addData(header.data(), received);
+		}
+
+		if (received <= 0)
+			return false;
+	}
+
+	packet = Packet(move(partial_packet));
+
+	return true;
+}
+
+static int openSocket(const string& path, bool host) {
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+
+	if (path.size() >= sizeof(address.sun_path)) {
+		Log(ERROR) << "Daemon socket path " << path << " is too long\n";
+
+		return -1;
+	}
+
+	strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+
+	int unix_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	if (unix_socket < 0) {
+		Log(ERROR) << "socket() failed for the daemon socket\n";
+
+		return -1;
+	}
+
+	if (host) {
+		// A previous daemon might not have cleaned up
+		unlink(path.c_str());
+
+		if (::bind(unix_socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 || listen(unix_socket, 16) < 0) {
+			Log(ERROR) << "Could not listen at daemon socket " << path << ": " << strerror(errno) << endl;
+
+			close(unix_socket);
+			return -1;
+		}
+	} else if (connect(unix_socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+		Log(ERROR) << "Could not connect to daemon socket " << path << ": " << strerror(errno) << endl;
+
+		close(unix_socket);
+		return -1;
+	}
+
+	return unix_socket;
+}
+
+// Queues the job, the client is answered and closed once it is done
+static void handleJob(TransferSession& session, int client) {
+	Packet packet;
+
+	unsigned char header = 0;
+
+	if (!readPacket(client, packet) || ((header = packet.getByte()) != HEADER_JOB && header != HEADER_PRIORITIZED_JOB)) {
+		Log(WARNING) << "Invalid job on daemon socket\n";
+
+		close(client);
+		return;
+	}
+
+	bool recursive;
+	int receivers_amount;
+	int files_amount;
+	vector<string> names;
+	int priority = 0;
+
+	bool valid = header == HEADER_JOB ? JobMessage::decode(packet, recursive, receivers_amount, files_amount, names) :
+		PrioritizedJobMessage::decode(packet, priority, recursive, receivers_amount, files_amount, names);
+
+	if (!valid || receivers_amount <= 0 || files_amount < 0 || names.size() != size_t(receivers_amount) + files_amount) {
+		Log(WARNING) << "Malformed job on daemon socket\n";
+
+		close(client);
+		return;
+	}
+
+	TransferJob job;
+	job.receivers_.assign(names.begin(), names.begin() + receivers_amount);
+	job.recursive_ = recursive;
+	job.priority_ = priority;
+
+	for (auto iterator = names.begin() + receivers_amount; iterator != names.end(); iterator++) {
+		job.sources_.emplace_back();
+		job.sources_.back().path_ = *iterator;
+	}
+
+	Log(INFORMATION) << "Job: sending " << job.sources_.size() << " path(s) to " << job.receivers_.size() << " receiver(s), priority " << priority << "\n";
+
+	job.done_ = [client] (const TransferResult& result) {
+		Log(DEBUG) << "Job done in " << Histogram::format(result.time_) << "\n";
+
+		vector<string> report;
+
+		for (auto& receiver : result.receivers_)
+			report.push_back(receiver.to_ + ": " + to_string(receiver.files_sent_) + " sent, " + to_string(receiver.files_failed_) + " failed");
+
+		writePacket(client, PacketCreator::jobResult(result.success_, result.files_sent_, result.files_failed_, report));
+		close(client);
+	};
+
+	session.send(move(job));
+}
+#endif
+
+void Daemon::run(const Config& config, const string& path) {
+#ifdef WIN32
+	(void)config;
+
+	Log(ERROR) << "Daemon mode needs Unix domain sockets, not supported on Windows\n";
+#else
+	// Sends on a connection of its own, not joined as a receiver
+	TransferSession session(config);
+
+	if (!session.start()) {
+		Log(ERROR) << "Daemon could not start its session\n";
+
+		return;
+	}
+
+	auto host_socket = openSocket(path, true);
+
+	if (host_socket < 0)
+		return;
+
+	// Every job would fail without the connection, let a supervisor restart us like for the receiving one
+	session.setTerminateOnKill(true);
+
+	g_socket_path_ = path;
+	at_quick_exit(removeSocket);
+	atexit(removeSocket);
+
+	Log(INFORMATION) << "Daemon waiting for jobs at " << path << endl;
+
+	// Reading a job is quick, the session runs it while the next client is accepted
+	while (true) {
+		int client = accept(host_socket, nullptr, nullptr);
+
+		if (client < 0) {
+			if (errno == EINTR)
+				continue;
+
+			Log(ERROR) << "accept() failed on daemon socket: " << strerror(errno) << endl;
+
+			break;
+		}
+
+		handleJob(session, client);
+	}
+
+	// Keeps receiving without jobs, closing the session is not a lost connection
+	session.setTerminateOnKill(false);
+
+	close(host_socket);
+	removeSocket();
+#endif
+}
+
+bool Daemon::submit(const string& path, const vector<string>& receivers, const vector<string>& files, bool recursive, int priority) {
+#ifdef WIN32
+	Log(ERROR) << "Daemon mode needs Unix domain sockets, not supported on Windows\n";
+
+	return false;
+#else
+	// The daemon runs somewhere else, it needs absolute paths
+	vector<string> absolute_files;
+
+	for (auto& file : files) {
+		char resolved[PATH_MAX];
+
+		if (realpath(file.c_str(), resolved) == nullptr) {
+			Log(WARNING) << "File " << file << " does not exist, skipping\n";
+
+			continue;
+		}
+
+		absolute_files.push_back(resolved);
+	}
+
+	auto client = openSocket(path, false);
+
+	if (client < 0)
+		return false;
+
+	Packet answer;
+
+	if (!writePacket(client, PacketCreator::job(receivers, absolute_files, recursive, priority)) || !readPacket(client, answer) || answer.getByte() != HEADER_JOB_RESULT) {
+		Log(ERROR) << "Daemon did not answer the job\n";
+
+		close(client);
+		return false;
+	}
+
+	close(client);
+
+	bool result = false;
+	int sent = 0;
+	int failed = 0;
+	vector<string> report;
+
+	JobResultMessage::decode(answer, result, sent, failed, report);
+
+	Log(INFORMATION) << "Daemon sent " << sent << " file(s), " << failed << " failed\n";
+
+	if (report.size() > 1)
+		for (auto& line : report)
+			Log(INFORMATION) << line << endl;
+
+	return result && absolute_files.size() == files.size();
+#endif
+}
@@ -0,0 +1,23 @@
+#pragma once
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <string>
+#include <vector>
+
+class Config;
+
+// Keeps a server session and the direct connections between transfers, send jobs are submitted over a Unix
+// domain socket using the normal packet framing. Not available on Windows
+class Daemon {
+public:
+	// Jobs run on a TransferSession with a server connection of its own, scheduled by priority and job_concurrency.
+	// Losing that connection ends the process like losing the receiving one. Only returns if the session or the
+	// socket could not be set up
+	static void run(const Config& config, const std::string& path);
+
+	// Client side, returns true when every file was sent to every receiver
+	static bool submit(const std::string& path, const std::vector<std::string>& receivers, const std::vector<std::string>& files, bool recursive, int priority = 0);
+};
+
+#endif
@@ -0,0 +1,151 @@
+#include "Executor.h"
+#include "Trace.h"
+
+#include <algorithm>
+
+using namespace std;
+
+struct ExecutorWorker {
+	mutex mutex_;
+	deque<function<void()>> tasks_;
+};
+
+// Set on the workers, so what they post stays on their own deque
+static thread_local Executor* g_current_executor_ = nullptr;
+static thread_local size_t g_current_worker_ = 0;
+
+Executor::Executor(size_t threads) {
+	threads = max<size_t>(1, threads);
+
+	for (size_t i = 0; i < threads; i++)
+		workers_.push_back(make_unique<ExecutorWorker>());
+
+	for (size_t i = 0; i < threads; i++)
+		threads_.emplace_back(&Executor::run, this, i);
+}
+
+Executor::~Executor() {
+	stopping_ = true;
+	waiter_.wake();
+
+	for (auto& thread : threads_)
+		thread.join();
+}
+
+size_t Executor::defaultThreads() {
+	return max<size_t>(2, thread::hardware_concurrency());
+}
+
+size_t Executor::size() const {
+	return workers_.size();
+}
+
+void Executor::post(function<void()> task) {
+	auto index = g_current_executor_ == this ? g_current_worker_ : next_.fetch_add(1, memory_order_relaxed) % workers_.size();
+	auto& worker = *workers_.at(index);
+
+	{
+		lock_guard<mutex> lock(worker.mutex_);
+		worker.tasks_.push_back(move(task));
+		pending_.fetch_add(1);
+	}
+
+	waiter_.notify();
+}
+
+// The oldest of our own tasks, or the newest of another worker's
+bool Executor::take(size_t index, function<void()>& task) {
+	for (size_t i = 0; i < workers_.size(); i++) {
+		auto& worker = *workers_.at((index + i) % workers_.size());
+		lock_guard<mutex> lock(worker.mutex_);
+
+		if (worker.tasks_.empty())
+			continue;
+
+		if (i == 0) {
+			task = move(worker.tasks_.front());
+			worker.tasks_.pop_front();
+		} else {
+			task = move(worker.tasks_.back());
+			worker.tasks_.pop_back();
+		}
+
+		pending_.fetch_sub(1);
+
+		return true;
+	}
+
+	return false;
+}
+
+void Executor::run(size_t index) {
+	g_current_executor_ = this;
+	g_current_worker_ = index;
+	Trace::nameThread("worker");
+
+	function<void()> task;
+
+	while (true) {
+		if (take(index, task)) {
+			task();
+			task = nullptr;
+
+			continue;
+		}
+
+		waiter_.wait([this] { return pending_ > 0 || stopping_; });
+
+		if (stopping_ && pending_ == 0)
+			return;
+	}
+}
+
+Strand::Strand(Executor& executor) : executor_(executor) {}
+
+void Strand::post(function<void()> task) {
+	{
+		lock_guard<mutex> lock(mutex_);
+		tasks_.push_back(move(task));
+
+		if (running_)
+			return;
+
+		running_ = true;
+	}
+
+	executor_.post([self = shared_from_this()] { self->run(); });
+}
+
+// Runs what was queued when it started, then gives the worker to other strands before continuing
+void Strand::run() {
+	size_t count;
+
+	{
+		lock_guard<mutex> lock(mutex_);
+		count = tasks_.size();
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		function<void()> task;
+
+		{
+			lock_guard<mutex> lock(mutex_);
+			task = move(tasks_.front());
+			tasks_.pop_front();
+		}
+
+		task();
+	}
+
+	{
+		lock_guard<mutex> lock(mutex_);
+
+		if (tasks_.empty()) {
+			running_ = false;
+
+			return;
+		}
+	}
+
+	executor_.post([self = shared_from_this()] { self->run(); });
+}
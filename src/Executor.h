@@ -0,0 +1,64 @@
+#pragma once
+#ifndef EXECUTOR_H
+#define EXECUTOR_H
+
+#include "RingQueue.h"
+
+#include <functional>
+#include <memory>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <atomic>
+
+struct ExecutorWorker;
+
+// Fixed pool of threads, each with its own task deque. A worker which runs out of tasks steals from the
+// others, tasks posted from a worker stay on it
+class Executor {
+public:
+	explicit Executor(size_t threads);
+	~Executor();
+
+	Executor(const Executor&) = delete;
+	Executor& operator=(const Executor&) = delete;
+
+	void post(std::function<void()> task);
+	size_t size() const;
+
+	// One per hardware thread, at least two so a slow disk write does not hold back every connection
+	static size_t defaultThreads();
+
+private:
+	void run(size_t index);
+	bool take(size_t index, std::function<void()>& task);
+
+	std::vector<std::unique_ptr<ExecutorWorker>> workers_;
+	std::vector<std::thread> threads_;
+
+	// Tasks in all deques, changed with the deque lock held
+	std::atomic<size_t> pending_{0};
+	std::atomic<size_t> next_{0};
+	std::atomic<bool> stopping_{false};
+	QueueWaiter waiter_;
+};
+
+// Runs its tasks one at a time and in the order they were posted, on whichever worker is free
+class Strand : public std::enable_shared_from_this<Strand> {
+public:
+	explicit Strand(Executor& executor);
+
+	void post(std::function<void()> task);
+
+private:
+	void run();
+
+	Executor& executor_;
+
+	std::mutex mutex_;
+	std::deque<std::function<void()>> tasks_;
+	bool running_ = false;
+};
+
+#endif
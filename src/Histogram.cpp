@@ -0,0 +1,95 @@
+#include "Histogram.h"
+
+#include <cstdio>
+#include <cmath>
+
+using namespace std;
+
+void Histogram::merge(const Histogram& other) {
+	if (other.count_ == 0)
+		return;
+
+	for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+		buckets_[i] += other.buckets_[i];
+
+	min_ = count_ == 0 ? other.min_ : std::min(min_, other.min_);
+	max_ = count_ == 0 ? other.max_ : std::max(max_, other.max_);
+	count_ += other.count_;
+	sum_ += other.sum_;
+}
+
+void Histogram::clear() {
+	*this = Histogram();
+}
+
+uint64_t Histogram::count() const {
+	return count_;
+}
+
+int64_t Histogram::min() const {
+	return min_;
+}
+
+int64_t Histogram::max() const {
+	return max_;
+}
+
+int64_t Histogram::sum() const {
+	return sum_;
+}
+
+double Histogram::mean() const {
+	return count_ == 0 ? 0 : static_cast<double>(sum_) / count_;
+}
+
+// Highest value which falls in the bucket
+int64_t Histogram::bucketValue(size_t bucket) {
+	if (bucket < HISTOGRAM_SUB_BUCKETS)
+		return bucket;
+
+	size_t top = bucket / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKET_BITS - 1;
+	size_t shift = top - HISTOGRAM_SUB_BUCKET_BITS;
+	int64_t first = static_cast<int64_t>(bucket % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS) << shift;
+
+	return first + (int64_t(1) << shift) - 1;
+}
+
+int64_t Histogram::percentile(double p) const {
+	if (count_ == 0)
+		return 0;
+
+	auto wanted = static_cast<uint64_t>(ceil(p / 100 * count_));
+	wanted = std::max<uint64_t>(1, std::min(wanted, count_));
+
+	uint64_t seen = 0;
+
+	for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		seen += buckets_[i];
+
+		// The bucket bound might be beyond what was actually recorded
+		if (seen >= wanted)
+			return std::max(min_, std::min(bucketValue(i), max_));
+	}
+
+	return max_;
+}
+
+string Histogram::format(int64_t nanoseconds) {
+	char buffer[32];
+
+	if (nanoseconds < 1000)
+		snprintf(buffer, sizeof(buffer), "%lld ns", static_cast<long long>(nanoseconds));
+	else if (nanoseconds < 1000000)
+		snprintf(buffer, sizeof(buffer), "%.1f us", nanoseconds / 1e3);
+	else if (nanoseconds < 1000000000)
+		snprintf(buffer, sizeof(buffer), "%.2f ms", nanoseconds / 1e6);
+	else
+		snprintf(buffer, sizeof(buffer), "%.2f s", nanoseconds / 1e9);
+
+	return buffer;
+}
+
+string Histogram::summary() const {
+	return "n " + to_string(count_) + ", p50 " + format(percentile(50)) + ", p99 " + format(percentile(99)) +
+		", p999 " + format(percentile(99.9)) + ", max " + format(max_);
+}
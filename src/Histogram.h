@@ -0,0 +1,99 @@
+#pragma once
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <array>
+#include <string>
+#include <chrono>
+#include <cstdint>
+
+enum HistogramConstants {
+	// Every power of two is split in 16 linear buckets, so a percentile is off by at most 1/16
+	HISTOGRAM_SUB_BUCKET_BITS = 4,
+	HISTOGRAM_SUB_BUCKETS = 1 << HISTOGRAM_SUB_BUCKET_BITS,
+
+	// Nanoseconds up to 2^44, about 4.9 hours, larger values are counted as the largest bucket
+	HISTOGRAM_MAX_BITS = 44,
+	HISTOGRAM_BUCKETS = (HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS
+};
+
+// Log-linear (HDR style) latency histogram in nanoseconds. Recording is a few instructions and
+// merging adds the buckets, neither allocates. Not thread safe
+class Histogram {
+public:
+	void record(int64_t nanoseconds);
+	void record(std::chrono::steady_clock::duration duration);
+	void merge(const Histogram& other);
+	void clear();
+
+	uint64_t count() const;
+	int64_t min() const;
+	int64_t max() const;
+	int64_t sum() const;
+	double mean() const;
+
+	// Nanoseconds which p percent (0 - 100) of the values are at or below
+	int64_t percentile(double p) const;
+
+	// "n 123, p50 1.2 ms, p99 3.4 ms, p999 5.6 ms, max 7.8 ms"
+	std::string summary() const;
+
+	static size_t bucket(int64_t nanoseconds);
+	static int64_t bucketValue(size_t bucket);
+
+	// "1.23 ms"
+	static std::string format(int64_t nanoseconds);
+	static std::string format(std::chrono::steady_clock::duration duration);
+
+private:
+	std::array<uint64_t, HISTOGRAM_BUCKETS> buckets_ = {};
+	uint64_t count_ = 0;
+	int64_t sum_ = 0;
+	int64_t min_ = 0;
+	int64_t max_ = 0;
+};
+
+inline size_t Histogram::bucket(int64_t nanoseconds) {
+	if (nanoseconds < HISTOGRAM_SUB_BUCKETS)
+		return nanoseconds < 0 ? 0 : static_cast<size_t>(nanoseconds);
+
+	if (nanoseconds >= (int64_t(1) << HISTOGRAM_MAX_BITS))
+		return HISTOGRAM_BUCKETS - 1;
+
+	auto value = static_cast<uint64_t>(nanoseconds);
+
+#ifdef __GNUC__
+	size_t top = 63 - __builtin_clzll(value);
+#else
+	size_t top = 0;
+
+	while (value >> (top + 1))
+		top++;
+#endif
+
+	// The top bit picks the power of two, the bits below it the linear bucket inside
+	return (top - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS + ((value >> (top - HISTOGRAM_SUB_BUCKET_BITS)) - HISTOGRAM_SUB_BUCKETS);
+}
+
+inline void Histogram::record(int64_t nanoseconds) {
+	buckets_[bucket(nanoseconds)]++;
+
+	if (count_ == 0 || nanoseconds < min_)
+		min_ = nanoseconds;
+
+	if (count_ == 0 || nanoseconds > max_)
+		max_ = nanoseconds;
+
+	count_++;
+	sum_ += nanoseconds;
+}
+
+inline void Histogram::record(std::chrono::steady_clock::duration duration) {
+	record(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count());
+}
+
+inline std::string Histogram::format(std::chrono::steady_clock::duration duration) {
+	return format(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count());
+}
+
+#endif
@@ -1,59 +1,413 @@
 #include "Log.h"
 
-#define PRINT_STREAM	(std::cout)
-#define FLUSH_STREAM	(std::flush)
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <streambuf>
+
+#define PRINT_STREAM	(stdout)
 
 using namespace std;
 
-mutex Log::print_mutex_;
-bool Log::enable_debug_ = true;
+enum LogConstants {
+	LOG_RING_SIZE = 256 * 1024,
+	LOG_POLL_INTERVAL = 10
+};
+
+atomic<bool> Log::enable_debug_(true);
+
+// Appends to a string which keeps its capacity between lines
+class LogBuffer : public streambuf {
+public:
+	string text_;
+
+protected:
+	int_type overflow(int_type character) override {
+		if (character != traits_type::eof())
+			text_.push_back(static_cast<char>(character));
+
+		return character;
+	}
+
+	streamsize xsputn(const char* data, streamsize size) override {
+		text_.append(data, size);
+
+		return size;
+	}
+};
+
+struct LogStream {
+	LogBuffer buffer_;
+	ostream stream_;
+	bool in_use_ = false;
+
+	LogStream() : stream_(&buffer_) {}
+
+	void reset() {
+		buffer_.text_.clear();
+
+		stream_.clear();
+		stream_.flags(ios_base::dec | ios_base::skipws);
+		stream_.precision(6);
+		stream_.width(0);
+		stream_.fill(' ');
+	}
+};
+
+struct LogRecordHeader {
+	uint64_t sequence_;
+	uint32_t size_;
+	int32_t level_;
+};
+
+// Single producer, the owning thread, and single consumer, whoever holds the drain lock
+struct LogRing {
+	vector<char> data_ = vector<char>(LOG_RING_SIZE);
+	atomic<size_t> head_{0};
+	atomic<size_t> tail_{0};
+	atomic<bool> retired_{false};
 
-Log::Log() {
-	level_ = NONE;
+	void write(size_t position, const void* data, size_t size) {
+		auto offset = position % LOG_RING_SIZE;
+		auto first = min(size, LOG_RING_SIZE - offset);
+
+		memcpy(data_.data() + offset, data, first);
+		memcpy(data_.data(), static_cast<const char*>(data) + first, size - first);
+	}
+
+	void read(size_t position, void* data, size_t size) const {
+		auto offset = position % LOG_RING_SIZE;
+		auto first = min(size, LOG_RING_SIZE - offset);
+
+		memcpy(data, data_.data() + offset, first);
+		memcpy(static_cast<char*>(data) + first, data_.data(), size - first);
+	}
+};
+
+struct LogRecord {
+	uint64_t sequence_;
+	int level_;
+	size_t offset_;
+	size_t size_;
+};
+
+struct LogWriter {
+	mutex rings_mutex_;
+	vector<shared_ptr<LogRing>> rings_;
+
+	atomic<uint64_t> sequence_{0};
+
+	// The writer polls while lines keep coming and sleeps until woken when idle, so busy threads do not
+	// pay for waking it on every line
+	mutex wake_mutex_;
+	condition_variable wake_;
+	atomic<bool> idle_{false};
+
+	// Held while draining, everything below is only used then
+	mutex drain_mutex_;
+	vector<char> scratch_;
+	vector<LogRecord> records_;
+	string output_;
+
+	FILE* file_ = nullptr;
+	string path_;
+	size_t max_size_ = 0;
+	size_t count_ = 0;
+	size_t file_size_ = 0;
+};
+
+// Never destroyed since threads might log during static destruction
+static LogWriter& writer() {
+	static LogWriter* writer = new LogWriter();
+
+	return *writer;
 }
 
-Log::Log(int level) {
-	level_ = level;
+// Registered on first use, the writer drops the ring once the thread is gone and everything is written
+struct LogRingOwner {
+	shared_ptr<LogRing> ring_ = make_shared<LogRing>();
+
+	LogRingOwner() {
+		auto& current = writer();
+		lock_guard<mutex> lock(current.rings_mutex_);
+
+		current.rings_.push_back(ring_);
+	}
+
+	~LogRingOwner() {
+		ring_->retired_ = true;
+	}
+};
+
+static const char* prefix(int level) {
+	switch (level) {
+		case NONE: return "";
+		case DEBUG: return "[DEBUG] ";
+		case INFORMATION: return "[INFORMATION] ";
+		case ERROR: return "[ERROR] ";
+		case WARNING: return "[WARNING] ";
+		case NETWORK: return "[NETWORK] ";
+		case GAME: return "[GAME] ";
+		default: return "[UNKNOWN ENUM] ";
+	}
+}
+
+static void rotate(LogWriter& current) {
+	fclose(current.file_);
+
+	if (current.count_ > 0) {
+		for (size_t i = current.count_ - 1; i > 0; i--)
+			rename((current.path_ + "." + to_string(i)).c_str(), (current.path_ + "." + to_string(i + 1)).c_str());
+
+		rename(current.path_.c_str(), (current.path_ + ".1").c_str());
+	}
+
+	current.file_ = fopen(current.path_.c_str(), "w");
+	current.file_size_ = 0;
 }
 
-// TODO: Add functionality for writing to file, etc.
-Log::~Log() {
-	if (level_ == DEBUG && !enable_debug_)
+static void writeOutput(LogWriter& current) {
+	if (current.output_.empty())
 		return;
 
-	lock_guard<mutex> guard(print_mutex_);
-	
-	switch (level_) {
-		case NONE:
-			break;
-			
-		case DEBUG: PRINT_STREAM << "[DEBUG]";
-			break;
-			
-		case INFORMATION: PRINT_STREAM << "[INFORMATION]";
-			break;
-			
-		case ERROR: PRINT_STREAM << "[ERROR]";
-			break;
-			
-		case WARNING: PRINT_STREAM << "[WARNING]";
-			break;
-			
-		case NETWORK: PRINT_STREAM << "[NETWORK]";
-			break;
-			
-		case GAME: PRINT_STREAM << "[GAME]";
-			break;
-			
-		default: PRINT_STREAM << "[UNKNOWN ENUM]";
-	}
-		
-	if (level_ != NONE)
-		PRINT_STREAM << " ";
-
-	PRINT_STREAM << str() << FLUSH_STREAM;
+	fwrite(current.output_.data(), 1, current.output_.size(), PRINT_STREAM);
+	fflush(PRINT_STREAM);
+
+	if (current.file_ != nullptr) {
+		if (current.file_size_ > 0 && current.file_size_ + current.output_.size() > current.max_size_)
+			rotate(current);
+
+		if (current.file_ != nullptr) {
+			fwrite(current.output_.data(), 1, current.output_.size(), current.file_);
+			fflush(current.file_);
+
+			current.file_size_ += current.output_.size();
+		}
+	}
+
+	current.output_.clear();
+}
+
+// Lines from all threads in the order they were submitted in, returns how many
+static size_t drainLocked(LogWriter& current) {
+	vector<shared_ptr<LogRing>> rings;
+
+	{
+		lock_guard<mutex> lock(current.rings_mutex_);
+		rings = current.rings_;
+	}
+
+	current.scratch_.clear();
+	current.records_.clear();
+
+	for (auto& ring : rings) {
+		auto head = ring->head_.load(memory_order_acquire);
+		auto tail = ring->tail_.load(memory_order_relaxed);
+
+		while (tail < head) {
+			LogRecordHeader header;
+			ring->read(tail, &header, sizeof(header));
+
+			auto offset = current.scratch_.size();
+			current.scratch_.resize(offset + header.size_);
+			ring->read(tail + sizeof(header), current.scratch_.data() + offset, header.size_);
+
+			current.records_.push_back({ header.sequence_, header.level_, offset, header.size_ });
+			tail += sizeof(header) + header.size_;
+		}
+
+		ring->tail_.store(tail, memory_order_release);
+	}
+
+	sort(current.records_.begin(), current.records_.end(), [] (auto& a, auto& b) { return a.sequence_ < b.sequence_; });
+
+	for (auto& record : current.records_)
+		current.output_.append(prefix(record.level_)).append(current.scratch_.data() + record.offset_, record.size_);
+
+	writeOutput(current);
+
+	// Rings of threads which are gone, once everything they wrote is out
+	lock_guard<mutex> lock(current.rings_mutex_);
+
+	current.rings_.erase(remove_if(current.rings_.begin(), current.rings_.end(), [] (auto& ring) {
+		return ring->retired_ && ring->tail_.load() == ring->head_.load();
+	}), current.rings_.end());
+
+	return current.records_.size();
+}
+
+static void wake(LogWriter& current, bool always) {
+	// Pairs with the fence in the writer, either it sees the line or we see it going idle
+	atomic_thread_fence(memory_order_seq_cst);
+
+	auto idle = current.idle_.load(memory_order_relaxed) && current.idle_.exchange(false);
+
+	if (!idle && !always)
+		return;
+
+	lock_guard<mutex> lock(current.wake_mutex_);
+	current.wake_.notify_one();
+}
+
+static void writerThread() {
+	auto& current = writer();
+
+	while (true) {
+		{
+			unique_lock<mutex> lock(current.wake_mutex_);
+
+			if (current.idle_)
+				current.wake_.wait(lock, [&current] { return !current.idle_; });
+			else
+				current.wake_.wait_for(lock, chrono::milliseconds(LOG_POLL_INTERVAL));
+		}
+
+		lock_guard<mutex> lock(current.drain_mutex_);
+
+		if (drainLocked(current) > 0)
+			continue;
+
+		// Nothing came since the last poll, look once more after going idle so a line is not left behind
+		current.idle_ = true;
+		atomic_thread_fence(memory_order_seq_cst);
+
+		if (drainLocked(current) > 0)
+			current.idle_ = false;
+	}
+}
+
+static void flushAtExit() {
+	Log::flush();
+}
+
+static void startWriter() {
+	static once_flag started;
+
+	call_once(started, [] {
+#ifndef WIN32
+		at_quick_exit(flushAtExit);
+#endif
+		atexit(flushAtExit);
+
+		thread(writerThread).detach();
+	});
+}
+
+static LogRing& threadRing() {
+	thread_local LogRingOwner owner;
+
+	return *owner.ring_;
+}
+
+void Log::submit(int level, const string& text) {
+	auto& current = writer();
+	auto& ring = threadRing();
+	size_t size = sizeof(LogRecordHeader) + text.size();
+
+	startWriter();
+
+	// Too large for the ring, written directly after what is queued
+	if (size > LOG_RING_SIZE / 2) {
+		lock_guard<mutex> lock(current.drain_mutex_);
+		drainLocked(current);
+
+		current.output_.append(prefix(level)).append(text);
+		writeOutput(current);
+
+		return;
+	}
+
+	LogRecordHeader header = { current.sequence_.fetch_add(1, memory_order_relaxed), static_cast<uint32_t>(text.size()), level };
+	auto head = ring.head_.load(memory_order_relaxed);
+
+	// Full, wait for the writer to catch up
+	while (LOG_RING_SIZE - (head - ring.tail_.load(memory_order_acquire)) < size) {
+		wake(current, true);
+		this_thread::yield();
+	}
+
+	ring.write(head, &header, sizeof(header));
+	ring.write(head + sizeof(header), text.data(), text.size());
+	ring.head_.store(head + size, memory_order_release);
+
+#ifdef WIN32
+	// quick_exit() is _exit() on mingw32 and skips the exit handlers, so nothing is left queued
+	flush();
+#else
+	wake(current, false);
+#endif
+}
+
+void Log::flush() {
+	auto& current = writer();
+
+	// Called from exit handlers, where the thread holding the lock might be the one exiting
+	for (size_t attempt = 0; attempt < 100; attempt++) {
+		if (current.drain_mutex_.try_lock()) {
+			drainLocked(current);
+			current.drain_mutex_.unlock();
+
+			return;
+		}
+
+		this_thread::sleep_for(chrono::milliseconds(1));
+	}
 }
 
 void Log::setDebug(bool status) {
 	enable_debug_ = status;
-}
\ No newline at end of file
+}
+
+void Log::setFile(const string& path, size_t max_size, size_t count) {
+	auto& current = writer();
+	lock_guard<mutex> lock(current.drain_mutex_);
+
+	if (current.file_ != nullptr)
+		fclose(current.file_);
+
+	current.path_ = path;
+	current.max_size_ = max_size;
+	current.count_ = count;
+	current.file_ = fopen(path.c_str(), "a");
+	current.file_size_ = 0;
+
+	if (current.file_ == nullptr) {
+		fprintf(stderr, "Could not open log file %s\n", path.c_str());
+
+		return;
+	}
+
+	fseek(current.file_, 0, SEEK_END);
+	current.file_size_ = ftell(current.file_);
+}
+
+LogLine::LogLine(int level) : level_(level) {
+	thread_local LogStream stream;
+
+	// A line formatted while formatting another one gets its own stream
+	nested_ = stream.in_use_;
+	stream_ = nested_ ? new LogStream() : &stream;
+	stream_->in_use_ = true;
+	stream_->reset();
+}
+
+LogLine::~LogLine() {
+	Log::submit(level_, stream_->buffer_.text_);
+
+	if (nested_)
+		delete stream_;
+	else
+		stream_->in_use_ = false;
+}
+
+ostream& LogLine::stream() {
+	return stream_->stream_;
+}
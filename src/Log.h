@@ -2,9 +2,9 @@
 #ifndef LOG_H
 #define LOG_H
 
-#include <mutex>
-#include <iostream>
-#include <sstream>
+#include <atomic>
+#include <ostream>
+#include <string>
 
 enum {
 	DEBUG,
@@ -16,20 +16,55 @@ enum {
 	GAME
 };
 
-class Log : public std::ostringstream {
+struct LogStream;
+
+// One line, formatted into a stream the thread reuses and queued for the writer thread when destroyed
+class LogLine {
 public:
-	Log();
-	Log(int level);
-	
-	~Log();
-	
-	static void setDebug(bool status);
+	explicit LogLine(int level);
+	~LogLine();
+
+	LogLine(const LogLine&) = delete;
+	LogLine& operator=(const LogLine&) = delete;
+
+	std::ostream& stream();
 
 private:
-	static std::mutex print_mutex_;
-	static bool enable_debug_;
-	
 	int level_;
+	LogStream* stream_;
+	bool nested_;
+};
+
+// Lines go through a lock-free ring per thread to a writer thread, which prints them to stdout and the log file
+class Log {
+public:
+	static bool enabled(int level);
+	static void setDebug(bool status);
+
+	// Also write to a file, moved to path.1 .. path.count when it grows beyond max_size bytes
+	static void setFile(const std::string& path, size_t max_size, size_t count);
+
+	// Writes everything queued so far, done on exit and quick_exit() as well
+	static void flush();
+
+private:
+	friend class LogLine;
+
+	static void submit(int level, const std::string& text);
+
+	static std::atomic<bool> enable_debug_;
 };
 
-#endif
\ No newline at end of file
+inline bool Log::enabled(int level) {
+	return level != DEBUG || enable_debug_.load(std::memory_order_relaxed);
+}
+
+// Turns the stream expression into void for the conditional below, & binds looser than << and tighter than ?:
+struct LogVoidify {
+	void operator&(std::ostream&) {}
+};
+
+// Disabled levels cost a branch, nothing after << is evaluated
+#define Log(level) !Log::enabled(level) ? (void)0 : LogVoidify() & LogLine(level).stream()
+
+#endif
@@ -0,0 +1,342 @@
+#include "Metrics.h"
+#include "Log.h"
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace std;
+
+enum MetricType {
+	METRIC_TYPE_COUNTER,
+	METRIC_TYPE_GAUGE,
+	METRIC_TYPE_LATENCY
+};
+
+struct MetricDefinition {
+	const char* name_;
+	const char* help_;
+	MetricType type_;
+};
+
+static const array<MetricDefinition, METRIC_COUNT> g_definitions_ = {{
+	{ "bytes_sent", "Bytes written to connections", METRIC_TYPE_COUNTER },
+	{ "bytes_received", "Bytes read from connections", METRIC_TYPE_COUNTER },
+	{ "packets_sent", "Packets written to connections", METRIC_TYPE_COUNTER },
+	{ "packets_received", "Packets read from connections", METRIC_TYPE_COUNTER },
+	{ "relay_bytes", "File bytes sent through the server", METRIC_TYPE_COUNTER },
+	{ "direct_bytes", "File bytes sent on direct connections", METRIC_TYPE_COUNTER },
+	{ "chunks_sent", "File chunks sent", METRIC_TYPE_COUNTER },
+	{ "chunks_written", "File chunks received and written to disk", METRIC_TYPE_COUNTER },
+	{ "files_sent", "Files sent and acknowledged, per receiver", METRIC_TYPE_COUNTER },
+	{ "files_failed", "Files which could not be sent, per receiver", METRIC_TYPE_COUNTER },
+	{ "files_received", "Files received to the end", METRIC_TYPE_COUNTER },
+	{ "retransmits", "UDP transport segments sent again", METRIC_TYPE_COUNTER },
+	{ "chunks_in_flight", "File chunks sent and waiting for the receiver to acknowledge them", METRIC_TYPE_GAUGE },
+	{ "connections", "Open connections", METRIC_TYPE_GAUGE },
+	{ "incoming_queue", "Received packets waiting to be handled", METRIC_TYPE_GAUGE },
+	{ "outgoing_queue", "Packets queued or being sent", METRIC_TYPE_GAUGE },
+	{ "outgoing_queue_bytes", "Bytes queued or being sent", METRIC_TYPE_GAUGE },
+	{ "outgoing_flows", "Transfer flows open on the connections", METRIC_TYPE_GAUGE },
+	{ "jobs_queued", "Transfer jobs waiting for their turn", METRIC_TYPE_GAUGE },
+	{ "jobs_running", "Transfer jobs being sent", METRIC_TYPE_GAUGE },
+	{ "ack_latency", "Time from sending a file chunk until the receiver acknowledges it", METRIC_TYPE_LATENCY },
+	{ "disk_write_latency", "Time to write a received file chunk", METRIC_TYPE_LATENCY },
+	{ "connect_latency", "Time to connect to the server or a peer", METRIC_TYPE_LATENCY }
+}};
+
+struct MetricQuantile {
+	double percentile_;
+	const char* json_;
+	const char* prometheus_;
+};
+
+static const array<MetricQuantile, 3> g_quantiles_ = {{
+	{ 50, "p50", "0.5" },
+	{ 99, "p99", "0.99" },
+	{ 99.9, "p999", "0.999" }
+}};
+
+// Only the owning thread writes, so adding is a plain load and store without a locked instruction
+struct MetricsShard {
+	array<atomic<int64_t>, METRIC_COUNT> values_;
+
+	mutex latency_mutex_;
+	array<Histogram, METRIC_LATENCY_COUNT> latencies_;
+
+	MetricsShard() {
+		for (auto& value : values_)
+			value.store(0, memory_order_relaxed);
+	}
+};
+
+struct MetricsRegistry {
+	mutex mutex_;
+	vector<MetricsShard*> shards_;
+
+	// What threads which are gone added
+	MetricsSnapshot retired_;
+
+	map<int, function<void(MetricsSnapshot&)>> samplers_;
+	int next_sampler_ = 1;
+
+	string path_;
+	MetricsFormat format_ = METRICS_JSON;
+	chrono::steady_clock::time_point started_ = chrono::steady_clock::now();
+};
+
+// Never destroyed since threads might end after static destruction
+static MetricsRegistry& registry() {
+	static MetricsRegistry* registry = new MetricsRegistry();
+
+	return *registry;
+}
+
+static void addShard(MetricsSnapshot& snapshot, MetricsShard& shard) {
+	for (size_t i = 0; i < METRIC_COUNT; i++)
+		snapshot.values_.at(i) += shard.values_.at(i).load(memory_order_relaxed);
+
+	lock_guard<mutex> lock(shard.latency_mutex_);
+
+	for (size_t i = 0; i < METRIC_LATENCY_COUNT; i++)
+		snapshot.latencies_.at(i).merge(shard.latencies_.at(i));
+}
+
+// Registered on first use, folded into the retired values when the thread ends
+struct MetricsShardOwner {
+	MetricsShard* shard_ = new MetricsShard();
+
+	MetricsShardOwner() {
+		auto& current = registry();
+		lock_guard<mutex> lock(current.mutex_);
+
+		current.shards_.push_back(shard_);
+	}
+
+	~MetricsShardOwner() {
+		auto& current = registry();
+		lock_guard<mutex> lock(current.mutex_);
+
+		addShard(current.retired_, *shard_);
+		current.shards_.erase(remove(current.shards_.begin(), current.shards_.end(), shard_), current.shards_.end());
+
+		delete shard_;
+	}
+};
+
+static MetricsShard& shard() {
+	thread_local MetricsShardOwner owner;
+
+	return *owner.shard_;
+}
+
+static void increase(atomic<int64_t>& value, int64_t amount) {
+	value.store(value.load(memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
+void Metrics::add(Metric metric, int64_t value) {
+	increase(shard().values_[metric], value);
+}
+
+void Metrics::record(Metric metric, chrono::steady_clock::duration latency) {
+	auto& current = shard();
+	lock_guard<mutex> lock(current.latency_mutex_);
+
+	current.latencies_[metric - METRIC_FIRST_LATENCY].record(latency);
+}
+
+int Metrics::addSampler(const function<void(MetricsSnapshot&)>& sampler) {
+	auto& current = registry();
+	lock_guard<mutex> lock(current.mutex_);
+
+	auto id = current.next_sampler_++;
+	current.samplers_[id] = sampler;
+
+	return id;
+}
+
+void Metrics::removeSampler(int id) {
+	auto& current = registry();
+	lock_guard<mutex> lock(current.mutex_);
+
+	current.samplers_.erase(id);
+}
+
+// Does not wait on quick_exit(), the thread holding the lock might be the one exiting
+static bool collect(MetricsSnapshot& snapshot, bool wait) {
+	auto& current = registry();
+	unique_lock<mutex> lock(current.mutex_, defer_lock);
+
+	if (wait)
+		lock.lock();
+	else if (!lock.try_lock())
+		return false;
+
+	snapshot = current.retired_;
+
+	for (auto* shard : current.shards_)
+		addShard(snapshot, *shard);
+
+	for (auto& sampler : current.samplers_)
+		sampler.second(snapshot);
+
+	return true;
+}
+
+const Histogram& MetricsSnapshot::latency(Metric metric) const {
+	return latencies_.at(metric - METRIC_FIRST_LATENCY);
+}
+
+MetricsSnapshot Metrics::snapshot() {
+	MetricsSnapshot snapshot;
+	collect(snapshot, true);
+
+	return snapshot;
+}
+
+static double uptime() {
+	return chrono::duration<double>(chrono::steady_clock::now() - registry().started_).count();
+}
+
+string Metrics::json(const MetricsSnapshot& snapshot) {
+	stringstream stream;
+	stream << "{\n  \"timestamp\": " << chrono::duration_cast<chrono::seconds>(chrono::system_clock::now().time_since_epoch()).count() << ",\n";
+	stream << "  \"uptime_seconds\": " << uptime();
+
+	for (size_t i = 0; i < METRIC_COUNT; i++) {
+		auto& definition = g_definitions_.at(i);
+		auto value = snapshot.values_.at(i);
+
+		stream << ",\n  \"" << definition.name_ << "\": ";
+
+		if (definition.type_ != METRIC_TYPE_LATENCY) {
+			stream << value;
+
+			continue;
+		}
+
+		auto& latency = snapshot.latency(static_cast<Metric>(i));
+
+		stream << "{ \"count\": " << latency.count() << ", \"sum_seconds\": " << latency.sum() / 1e9 << ", \"mean_seconds\": " << latency.mean() / 1e9;
+
+		for (auto& quantile : g_quantiles_)
+			stream << ", \"" << quantile.json_ << "_seconds\": " << latency.percentile(quantile.percentile_) / 1e9;
+
+		stream << ", \"max_seconds\": " << latency.max() / 1e9 << " }";
+	}
+
+	stream << "\n}\n";
+
+	return stream.str();
+}
+
+string Metrics::prometheus(const MetricsSnapshot& snapshot) {
+	stringstream stream;
+
+	for (size_t i = 0; i < METRIC_COUNT; i++) {
+		auto& definition = g_definitions_.at(i);
+		string name = string("transfer_") + definition.name_;
+
+		switch (definition.type_) {
+			case METRIC_TYPE_COUNTER:
+				name += "_total";
+				stream << "# HELP " << name << " " << definition.help_ << "\n# TYPE " << name << " counter\n";
+				stream << name << " " << snapshot.values_.at(i) << "\n";
+				break;
+
+			case METRIC_TYPE_GAUGE:
+				stream << "# HELP " << name << " " << definition.help_ << "\n# TYPE " << name << " gauge\n";
+				stream << name << " " << snapshot.values_.at(i) << "\n";
+				break;
+
+			case METRIC_TYPE_LATENCY: {
+				auto& latency = snapshot.latency(static_cast<Metric>(i));
+				name += "_seconds";
+				stream << "# HELP " << name << " " << definition.help_ << "\n# TYPE " << name << " summary\n";
+
+				for (auto& quantile : g_quantiles_)
+					stream << name << "{quantile=\"" << quantile.prometheus_ << "\"} " << latency.percentile(quantile.percentile_) / 1e9 << "\n";
+
+				stream << name << "_sum " << latency.sum() / 1e9 << "\n";
+				stream << name << "_count " << latency.count() << "\n";
+				break;
+			}
+		}
+	}
+
+	stream << "# HELP transfer_uptime_seconds Seconds since the process started\n# TYPE transfer_uptime_seconds gauge\n";
+	stream << "transfer_uptime_seconds " << uptime() << "\n";
+
+	return stream.str();
+}
+
+static bool writeFile(bool wait) {
+	auto& current = registry();
+	MetricsSnapshot snapshot;
+
+	if (current.path_.empty() || !collect(snapshot, wait))
+		return false;
+
+	auto temporary = current.path_ + ".tmp";
+
+	{
+		ofstream file(temporary);
+		file << (current.format_ == METRICS_PROMETHEUS ? Metrics::prometheus(snapshot) : Metrics::json(snapshot));
+
+		if (!file.good())
+			return false;
+	}
+
+#ifdef WIN32
+	remove(current.path_.c_str());
+#endif
+
+	return rename(temporary.c_str(), current.path_.c_str()) == 0;
+}
+
+static void writeFinal() {
+	writeFile(false);
+}
+
+bool Metrics::write() {
+	return writeFile(true);
+}
+
+void Metrics::start(const string& path, MetricsFormat format, size_t interval) {
+	auto& current = registry();
+	current.path_ = path;
+	current.format_ = format;
+
+#ifndef WIN32
+	at_quick_exit(writeFinal);
+#endif
+	atexit(writeFinal);
+
+	thread([interval] {
+		while (true) {
+			this_thread::sleep_for(chrono::seconds(max<size_t>(1, interval)));
+
+			if (!Metrics::write())
+				Log(WARNING) << "Could not write metrics to " << registry().path_ << "\n";
+		}
+	}).detach();
+
+	Log(DEBUG) << "Writing metrics to " << path << " every " << max<size_t>(1, interval) << " second(s)\n";
+}
+
+MetricsFormat Metrics::getFormat(const string& name) {
+	if (name == "prometheus")
+		return METRICS_PROMETHEUS;
+
+	if (name != "json")
+		Log(WARNING) << "Unknown metrics format " << name << ", using json\n";
+
+	return METRICS_JSON;
+}
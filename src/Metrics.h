@@ -0,0 +1,86 @@
+#pragma once
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "Histogram.h"
+
+#include <array>
+#include <string>
+#include <chrono>
+#include <functional>
+#include <cstdint>
+
+enum Metric {
+	// Counters
+	METRIC_BYTES_SENT,
+	METRIC_BYTES_RECEIVED,
+	METRIC_PACKETS_SENT,
+	METRIC_PACKETS_RECEIVED,
+	METRIC_RELAY_BYTES,
+	METRIC_DIRECT_BYTES,
+	METRIC_CHUNKS_SENT,
+	METRIC_CHUNKS_WRITTEN,
+	METRIC_FILES_SENT,
+	METRIC_FILES_FAILED,
+	METRIC_FILES_RECEIVED,
+	METRIC_RETRANSMITS,
+
+	// Gauges, changed by adding and subtracting or sampled when exporting
+	METRIC_CHUNKS_IN_FLIGHT,
+	METRIC_CONNECTIONS,
+	METRIC_INCOMING_QUEUE,
+	METRIC_OUTGOING_QUEUE,
+	METRIC_OUTGOING_QUEUE_BYTES,
+	METRIC_OUTGOING_FLOWS,
+	METRIC_JOBS_QUEUED,
+	METRIC_JOBS_RUNNING,
+
+	// Latencies, as histograms
+	METRIC_ACK_LATENCY,
+	METRIC_DISK_WRITE_LATENCY,
+	METRIC_CONNECT_LATENCY,
+
+	METRIC_COUNT,
+	METRIC_FIRST_LATENCY = METRIC_ACK_LATENCY,
+	METRIC_LATENCY_COUNT = METRIC_COUNT - METRIC_FIRST_LATENCY
+};
+
+enum MetricsFormat {
+	METRICS_JSON,
+	METRICS_PROMETHEUS
+};
+
+struct MetricsSnapshot {
+	std::array<int64_t, METRIC_COUNT> values_	= {};
+
+	// Indexed from METRIC_FIRST_LATENCY
+	std::array<Histogram, METRIC_LATENCY_COUNT> latencies_;
+
+	const Histogram& latency(Metric metric) const;
+};
+
+// Process wide metrics. Every thread adds to its own shard without locking, exporting sums the shards.
+// Latencies take a lock of the shard which only exporting contends for
+class Metrics {
+public:
+	static void add(Metric metric, int64_t value = 1);
+	static void record(Metric metric, std::chrono::steady_clock::duration latency);
+
+	// Called with the snapshot when exporting, for gauges which are cheaper to read than to keep up to date
+	static int addSampler(const std::function<void(MetricsSnapshot&)>& sampler);
+	static void removeSampler(int id);
+
+	static MetricsSnapshot snapshot();
+
+	static std::string json(const MetricsSnapshot& snapshot);
+	static std::string prometheus(const MetricsSnapshot& snapshot);
+
+	// Writes the file every interval seconds, and once more on quick_exit(). The file is replaced
+	// atomically so a collector never reads half of it
+	static void start(const std::string& path, MetricsFormat format, size_t interval);
+	static bool write();
+
+	static MetricsFormat getFormat(const std::string& name);
+};
+
+#endif
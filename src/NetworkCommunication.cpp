@@ -2,10 +2,19 @@
 #include "Log.h"
 #include "PartialPacket.h"
 #include "Packet.h"
+#include "PacketCreator.h"
+#include "UdpChannel.h"
+#include "ShmChannel.h"
+#include "Resolver.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include "Timer.h"
 
 #include <cstring>
 #include <errno.h>
 #include <array>
+#include <algorithm>
+#include <climits>
 
 #ifndef WIN32_LEAN_AND_MEAN
 #define WIN32_LEAN_AND_MEAN
@@ -25,6 +34,7 @@
 #include <unistd.h>
 #include <netdb.h>
 #include <netinet/tcp.h>
+#include <sys/uio.h>
 #endif
 
 #ifdef WIN32
@@ -37,8 +47,55 @@ constexpr auto quick_exit = _exit; // mingw32 does not support quick_exit for no
 
 using namespace std;
 
-static bool hostConnection(int& server_socket, unsigned short port) {
-	server_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+SocketProfile NetworkCommunication::socket_profile_;
+
+static void closeSocket(int socket) {
+#ifdef WIN32
+	closesocket(socket);
+#else
+	close(socket);
+#endif
+}
+
+static bool setBlocking(int socket, bool blocking) {
+#ifdef WIN32
+	unsigned long mode = blocking ? 0 : 1;
+
+	return ioctlsocket(socket, FIONBIO, &mode) == 0;
+#else
+	auto flags = fcntl(socket, F_GETFL, 0);
+
+	if (flags < 0)
+		return false;
+
+	return fcntl(socket, F_SETFL, blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK)) == 0;
+#endif
+}
+
+static bool connectInProgress() {
+#ifdef WIN32
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+	return errno == EINPROGRESS;
+#endif
+}
+
+static bool hostConnection(int& server_socket, unsigned short port, int backlog = 1) {
+	// Dual-stack when IPv6 is available, IPv4 clients show up as mapped addresses
+	server_socket = socket(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
+	bool ipv6 = server_socket >= 0;
+	
+	if (ipv6) {
+		int off = 0;
+		
+		if (setsockopt(server_socket, IPPROTO_IPV6, IPV6_V6ONLY, reinterpret_cast<char*>(&off), sizeof(off)) < 0) {
+			closeSocket(server_socket);
+			ipv6 = false;
+		}
+	}
+	
+	if (!ipv6)
+		server_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
 	
 	if (server_socket < 0) {
 		Log(ERROR) << "socket() failed\n";
@@ -46,154 +103,223 @@ static bool hostConnection(int& server_socket, unsigned short port) {
 		return false;
 	}
 	
+	// Accepted sockets inherit the options from the listening socket
+	NetworkCommunication::getSocketProfile().apply(server_socket, "hosted", false);
+	
 	int on = 1;
     
     if(setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<char*>(&on), sizeof(on)) < 0) {
         Log(ERROR) << "Not reusable address\n";
 
-#ifdef WIN32
-		closesocket(server_socket);
-#else
-		close(server_socket);
-#endif
+		closeSocket(server_socket);
+		server_socket = -1;
 
         return false;
     }
 	
-	sockaddr_in socketInformation;
-    socketInformation.sin_family = AF_INET;
-    socketInformation.sin_addr.s_addr = INADDR_ANY;
-    socketInformation.sin_port = htons(port);
+	sockaddr_storage socketInformation;
+	socklen_t socketInformationSize;
+	memset(&socketInformation, 0, sizeof(socketInformation));
+	
+	if (ipv6) {
+		auto* information = reinterpret_cast<sockaddr_in6*>(&socketInformation);
+		information->sin6_family = AF_INET6;
+		information->sin6_addr = in6addr_any;
+		information->sin6_port = htons(port);
+		socketInformationSize = sizeof(sockaddr_in6);
+	} else {
+		auto* information = reinterpret_cast<sockaddr_in*>(&socketInformation);
+		information->sin_family = AF_INET;
+		information->sin_addr.s_addr = INADDR_ANY;
+		information->sin_port = htons(port);
+		socketInformationSize = sizeof(sockaddr_in);
+	}
     
-    if(::bind(server_socket, reinterpret_cast<sockaddr*>(&socketInformation), sizeof(socketInformation)) < 0) {
+    if(::bind(server_socket, reinterpret_cast<sockaddr*>(&socketInformation), socketInformationSize) < 0) {
         Log(ERROR) << "bind() failed\n";
         
-#ifdef WIN32
-		closesocket(server_socket);
-#else
-		close(server_socket);
-#endif
+		closeSocket(server_socket);
+		server_socket = -1;
 
         return false;
     }
-	
-	size_t socketInformationSize = sizeof(socketInformation);
 
-	if(getsockname(server_socket, reinterpret_cast<sockaddr*>(&socketInformation), reinterpret_cast<socklen_t*>(&socketInformationSize)) < 0) {
+	if(getsockname(server_socket, reinterpret_cast<sockaddr*>(&socketInformation), &socketInformationSize) < 0) {
         Log(ERROR) << "Could not get address information\n";
         
-#ifdef WIN32
-		closesocket(server_socket);
-#else
-		close(server_socket);
-#endif
+		closeSocket(server_socket);
+		server_socket = -1;
 
         return false;
 	}
 	
-	listen(server_socket, 1);
+	listen(server_socket, backlog);
 	
 	return true;
 }
 
-static bool connect(const string& hostname, unsigned short port, int& server_socket, bool fast_fail) {
-    server_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    
-    if (server_socket < 0) {
-        Log(ERROR) << "socket() failed\n";
-        
-#ifdef WIN32
-		closesocket(server_socket);
-#else
-        close(server_socket);
-#endif
-
-        return false;
-    }
-    
-    sockaddr_in server;
-	server.sin_family = AF_INET;
-	hostent* hp = gethostbyname(hostname.c_str());
-    
-	if (!hp) {
-        Log(ERROR) << "Could not find host " << hostname << endl;
-        
-#ifdef WIN32
-		closesocket(server_socket);
-#else
-		close(server_socket);
-#endif
-
-		return false;
+// Starts non-blocking connects to the addresses CONNECT_STAGGER ms apart, the first one to complete wins
+// and the rest are cancelled. Returns the connected socket or -1 when every attempt failed or timed out
+static int raceConnect(const vector<ResolvedAddress>& addresses, string& connected) {
+	struct Attempt {
+		int socket_;
+		size_t index_;
+	};
+	
+	vector<Attempt> attempts;
+	size_t next = 0;
+	int winner = -1;
+	
+	auto start = chrono::steady_clock::now();
+	auto deadline = start + chrono::milliseconds(NetworkConstants::CONNECT_TIMEOUT);
+	auto next_start = start;
+	
+	while (winner < 0 && chrono::steady_clock::now() < deadline) {
+		auto now = chrono::steady_clock::now();
+		
+		// Start the next attempt when it is time, or right away when all running attempts failed
+		if (next < addresses.size() && (now >= next_start || attempts.empty())) {
+			auto& address = addresses.at(next);
+			int attempt_socket = socket(address.family_, SOCK_STREAM, IPPROTO_TCP);
+			
+			if (attempt_socket >= 0 && setBlocking(attempt_socket, false)) {
+				if (connect(attempt_socket, reinterpret_cast<const sockaddr*>(&address.address_), address.length_) == 0) {
+					winner = attempt_socket;
+					connected = address.text_;
+					next++;
+					
+					break;
+				}
+				
+				if (connectInProgress()) {
+					attempts.push_back({ attempt_socket, next });
+				} else {
+					Log(DEBUG) << "Connect to " << address.text_ << " failed: " << strerror(errno) << endl;
+					
+					closeSocket(attempt_socket);
+				}
+			} else if (attempt_socket >= 0) {
+				closeSocket(attempt_socket);
+			}
+			
+			next++;
+			next_start = now + chrono::milliseconds(NetworkConstants::CONNECT_STAGGER);
+			
+			continue;
+		}
+		
+		// Nothing left to try
+		if (attempts.empty())
+			break;
+			
+		fd_set writeSet;
+		fd_set errorSet;
+		FD_ZERO(&writeSet);
+		FD_ZERO(&errorSet);
+		
+		int highest = 0;
+		
+		for (auto& attempt : attempts) {
+			FD_SET(attempt.socket_, &writeSet);
+			FD_SET(attempt.socket_, &errorSet);
+			highest = max(highest, attempt.socket_);
+		}
+		
+		// Until the next attempt should start or the deadline
+		auto until = next < addresses.size() ? min(next_start, deadline) : deadline;
+		auto wait = max(static_cast<long long>(chrono::duration_cast<chrono::microseconds>(until - now).count()), 0LL);
+		
+		timeval timeout;
+		timeout.tv_sec = wait / 1000000;
+		timeout.tv_usec = wait % 1000000;
+		
+		if (select(highest + 1, NULL, &writeSet, &errorSet, &timeout) <= 0)
+			continue;
+			
+		for (auto iterator = attempts.begin(); iterator != attempts.end();) {
+			if (!FD_ISSET(iterator->socket_, &writeSet) && !FD_ISSET(iterator->socket_, &errorSet)) {
+				++iterator;
+				
+				continue;
+			}
+			
+			int error = 0;
+			socklen_t error_size = sizeof(error);
+			getsockopt(iterator->socket_, SOL_SOCKET, SO_ERROR, reinterpret_cast<char*>(&error), &error_size);
+			
+			if (error == 0 && winner < 0) {
+				winner = iterator->socket_;
+				connected = addresses.at(iterator->index_).text_;
+				Log(DEBUG) << "Connected to " << addresses.at(iterator->index_).text_ << " after " << chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count() << " ms\n";
+				
+				iterator = attempts.erase(iterator);
+				
+				continue;
+			}
+			
+			Log(DEBUG) << "Connect to " << addresses.at(iterator->index_).text_ << " failed: " << strerror(error) << endl;
+			
+			closeSocket(iterator->socket_);
+			iterator = attempts.erase(iterator);
+		}
 	}
 	
-	memcpy(reinterpret_cast<char*>(&server.sin_addr), reinterpret_cast<char*>(hp->h_addr), hp->h_length);
-	server.sin_port = htons(port);
-    
+	// Cancel the losing attempts
+	for (auto& attempt : attempts)
+		closeSocket(attempt.socket_);
+		
+	if (winner >= 0)
+		setBlocking(winner, true);
+		
+	return winner;
+}
+
+static bool connect(const vector<string>& hostnames, unsigned short port, int& server_socket, bool fast_fail) {
     size_t connection_try = 0;
-    auto current_time = chrono::system_clock::now() + chrono::milliseconds(1500);
+    string connected;
+    auto current_time = chrono::steady_clock::now() + chrono::milliseconds(1500);
     
-    while (connect(server_socket, reinterpret_cast<sockaddr*>(&server), sizeof(server)) < 0) {
-        if ((chrono::system_clock::now() - current_time).count() > 0) {
+    while (true) {
+        auto addresses = Resolver::resolve(hostnames, port, SOCK_STREAM);
+        
+        if (addresses.empty()) {
+            Log(ERROR) << "Could not find host " << hostnames.front() << endl;
+        } else {
+            server_socket = raceConnect(addresses, connected);
+            
+            if (server_socket >= 0)
+                break;
+        }
+        
+        // Only allow one round of connection attempts in fast fail mode
+        if (fast_fail || addresses.empty())
+            return false;
+            
+        if (chrono::steady_clock::now() > current_time) {
             connection_try++;
             Log(NETWORK) << "Could not connect, attempt #" << connection_try << endl;
             
             current_time += chrono::milliseconds(1500);
         }
-		
-		// Only allow one connection attempt in fast fail mode
-		if (fast_fail) {
-#ifdef WIN32
-			closesocket(server_socket);
-#else
-			close(server_socket);
-#endif
-			return false;
-		}
         
         // Avoid spamming the kernel with connect()
         this_thread::sleep_for(chrono::milliseconds(100));
     }
     
-    int on = 1;
-    
-    if (setsockopt(server_socket, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<char*>(&on), sizeof(on)) < 0)
-        Log(WARNING) << "Could not set TCP_NODELAY\n";
+    NetworkCommunication::getSocketProfile().apply(server_socket, "connected", true);
     
-    Log(NETWORK) << "Connected to " << hostname << endl;
+    Log(NETWORK) << "Connected to " << connected << endl;
 	
 	return true;
 }
 
 static unsigned int processBuffer(const unsigned char *buffer, const unsigned int received, PartialPacket &partialPacket) {
-    if(partialPacket.hasHeader()) {        
-        unsigned int insert = received;
-        
-        if(partialPacket.getSize() + received >= partialPacket.getFullSize()) {            
-            insert = partialPacket.getFullSize() - partialPacket.getSize();
-        }
-        
-        if(insert > received) {
-            Log(ERROR) << "Trying to insert more data than available in buffer, insert = " << insert << ", received = " << received << endl;
-        }
-        
-        partialPacket.addData(buffer, insert);
-                
-        return insert;
-    }
+    // Either the rest of the header or the rest of the payload, whichever comes first
+    unsigned int adding = min(received, partialPacket.getRemaining());
     
-    else {
-        unsigned int leftHeader = 4 - partialPacket.getSize();
-        unsigned int adding = received > leftHeader ? leftHeader : received;
-        
-        if(adding > received) {
-            Log(ERROR) << "Trying to insert more data than available in buffer, adding = " << adding << ", received = " << received << endl;
-        }
-        
-        partialPacket.addData(buffer, adding);
-        
-        return adding;
-    }
+    partialPacket.addData(buffer, adding);
+    
+    return adding;
 }
 
 static void setFileDescriptorsReceive(int main_socket, int pipe_socket, fd_set& readSet, fd_set& errorSet) {
@@ -207,77 +333,173 @@ static void setFileDescriptorsReceive(int main_socket, int pipe_socket, fd_set&
 	FD_SET(pipe_socket, &errorSet);
 }
 
-static void receiveThread(NetworkCommunication& network) {
-    array<unsigned char, NetworkConstants::BUFFER_SIZE> buffer;
+// Returns 0 on shutdown and -1 when the connection is lost
+static int receiveData(NetworkCommunication& network, unsigned char* buffer, size_t size) {
+	auto& channel = network.getChannel();
+	
+	if (channel) {
+		int received = channel->receive(buffer, size);
+		
+		if (received <= 0) {
+			Log(NETWORK) << "Receiving thread lost the channel\n";
+			
+			return -1;
+		}
+		
+		return received;
+	}
+	
 	fd_set readSet;
 	fd_set errorSet;
 	
-    while (true) {
-		setFileDescriptorsReceive(network.getSocket(), network.getPipe().getSocket(), readSet, errorSet);
-		
-		if (select(FD_SETSIZE, &readSet, NULL, &errorSet, NULL) == 0)
-			break;
+	setFileDescriptorsReceive(network.getSocket(), network.getPipe().getSocket(), readSet, errorSet);
+	
+	if (select(FD_SETSIZE, &readSet, NULL, &errorSet, NULL) == 0)
+		return 0;
 
-		// Shutdown
-		if (FD_ISSET(network.getPipe().getSocket(), &readSet)) {
-			network.getPipe().resetPipe();
+	// Shutdown
+	if (FD_ISSET(network.getPipe().getSocket(), &readSet)) {
+		network.getPipe().resetPipe();
 
-			break;
-		}
-		
+		return 0;
+	}
+	
 #ifdef WIN32
-		int received = recv(network.getSocket(), (char*)buffer.data(), NetworkConstants::BUFFER_SIZE, 0);
+	int received = recv(network.getSocket(), (char*)buffer, size, 0);
 #else
-        int received = recv(network.getSocket(), buffer.data(), NetworkConstants::BUFFER_SIZE, 0);
+	int received = recv(network.getSocket(), buffer, size, 0);
 #endif
+
+	if(received <= 0) {
+		Log(NETWORK) << "Receiving thread got error: " << strerror(errno) << endl;
+		
+		return -1;
+	}
+	
+	return received;
+}
+
+static void receiveThread(NetworkCommunication& network) {
+    array<unsigned char, NetworkConstants::BUFFER_SIZE> buffer;
+    Metrics::add(METRIC_CONNECTIONS);
+    Trace::nameThread("receive");
+	
+    while (true) {
+        auto& partial_packet = network.getPartialPacket();
         
-        if(received <= 0) {
-            Log(NETWORK) << "Receiving thread got error: " << strerror(errno) << endl;
+        // Large payloads are received straight into the packet storage, the bounce buffer
+        // is only used for headers and small packets where fewer recv() calls matter more
+        if (partial_packet.hasHeader() && partial_packet.getRemaining() >= NetworkConstants::DIRECT_RECEIVE_SIZE) {
+            int received = receiveData(network, partial_packet.getWritePointer(), partial_packet.getRemaining());
+
+            if(received <= 0)
+                break;
             
-            break;
+            TraceSpan span("reassemble", received);
+            partial_packet.addReceived(received);
+            network.moveCompletePartialPackets();
+            
+            continue;
         }
-                
-        int processed = 0;
-    
-        do {
-            processed += processBuffer(buffer.data() + processed, received - processed, network.getPartialPacket());
-        } while (processed < received);
         
-        network.moveCompletePartialPackets();
+        int received = receiveData(network, buffer.data(), NetworkConstants::BUFFER_SIZE);
+        
+        if(received <= 0)
+            break;
+            
+        TraceSpan span("reassemble", received);
+        network.processReceived(buffer.data(), received);
     }
     
     Log(NETWORK) << "receiveThread exiting\n";
+    Metrics::add(METRIC_CONNECTIONS, -1);
 	
 	// Kill the rest
 	network.kill();
 }
 
-static void sendThread(NetworkCommunication& network) {
-    while (true) {
-        auto* packet_pointer = network.getOutgoingPacket();
-
-		// Shutdown
-		if (packet_pointer == nullptr)
-			break;
-			
-		// We know it's a packet
-		auto& packet = *packet_pointer;
-
-        int sending = min((unsigned int)NetworkConstants::BUFFER_SIZE, packet.getSize() - packet.getSent());
-
+// Sends a batch of packets, gathering several packets into one system call where possible
+static bool sendPackets(int socket, vector<Packet>& packets) {
 #ifdef WIN32
-		int sent = send(network.getSocket(), (const char*)(packet.getData() + packet.getSent()), sending, 0);
+    for (auto& packet : packets) {
+        while (!packet.fullySent()) {
+            int sending = min((unsigned int)NetworkConstants::BUFFER_SIZE, packet.getSize() - packet.getSent());
+            int sent = send(socket, (const char*)(packet.getData() + packet.getSent()), sending, 0);
+            
+            if (sent <= 0)
+                return false;
+                
+            packet.addSent(sent);
+        }
+    }
 #else
-        int sent = send(network.getSocket(), packet.getData() + packet.getSent(), sending, 0);
-#endif
+    array<iovec, NetworkConstants::PACKET_BATCH_SIZE> vectors;
+    size_t current = 0;
+    
+    while (current < packets.size()) {
+        size_t count = 0;
         
-        if(sent <= 0)
-            break;
+        for (size_t i = current; i < packets.size() && count < vectors.size(); i++, count++) {
+            auto& packet = packets.at(i);
+            
+            vectors.at(count).iov_base = const_cast<unsigned char*>(packet.getData() + packet.getSent());
+            vectors.at(count).iov_len = packet.getSize() - packet.getSent();
+        }
         
-        packet.addSent(sent);
+        auto sent = writev(socket, vectors.data(), count);
         
-        if (packet.fullySent())
-            network.popOutgoingPacket();
+        if (sent <= 0)
+            return false;
+            
+        // Account the sent bytes to the packets in order
+        while (sent > 0) {
+            auto& packet = packets.at(current);
+            auto used = min<size_t>(sent, packet.getSize() - packet.getSent());
+            
+            packet.addSent(used);
+            sent -= used;
+            
+            if (packet.fullySent())
+                current++;
+        }
+    }
+#endif
+
+    return true;
+}
+
+static bool sendPackets(Channel& channel, vector<Packet>& packets) {
+    for (auto& packet : packets) {
+        while (!packet.fullySent()) {
+            int sent = channel.send(packet.getData() + packet.getSent(), packet.getSize() - packet.getSent());
+            
+            if (sent <= 0)
+                return false;
+                
+            packet.addSent(sent);
+        }
+    }
+    
+    return true;
+}
+
+static void sendThread(NetworkCommunication& network) {
+    vector<Packet> packets;
+    Trace::nameThread("send");
+    
+    // Zero packets means shutdown
+    while (network.getOutgoingPackets(packets) > 0) {
+        auto& channel = network.getChannel();
+        
+        {
+            TraceSpan span("socket send");
+            
+            if (!(channel ? sendPackets(*channel, packets) : sendPackets(network.getSocket(), packets)))
+                break;
+        }
+        
+        network.completeOutgoingPackets(packets);
+        packets.clear();
     }
     
     Log(NETWORK) << "sendThread exiting\n";
@@ -286,9 +508,19 @@ static void sendThread(NetworkCommunication& network) {
 	network.kill();
 }
 
-NetworkCommunication::NetworkCommunication() {
+NetworkCommunication::NetworkCommunication() : incoming_packets_(NetworkConstants::PACKET_QUEUE_SIZE), outgoing_packets_(NetworkConstants::PACKET_QUEUE_SIZE), outgoing_pending_(0), outgoing_bytes_(0), flow_control_(false), send_credits_(0) {
 	shutdown_ = false;
 	
+	// Queue depths are read when exporting instead of being kept up to date for every packet
+	sampler_ = Metrics::addSampler([this] (MetricsSnapshot& snapshot) {
+		snapshot.values_[METRIC_INCOMING_QUEUE] += incoming_packets_.size();
+		snapshot.values_[METRIC_OUTGOING_QUEUE] += outgoing_pending_;
+		snapshot.values_[METRIC_OUTGOING_QUEUE_BYTES] += outgoing_bytes_;
+		
+		lock_guard<mutex> lock(flows_mutex_);
+		snapshot.values_[METRIC_OUTGOING_FLOWS] += flows_.size();
+	});
+	
 #ifdef WIN32
 	WSADATA wsa_data;
 
@@ -303,6 +535,7 @@ NetworkCommunication::NetworkCommunication() {
 }
 
 NetworkCommunication::~NetworkCommunication() {	
+	Metrics::removeSampler(sampler_);
 	kill();
 	
 	if (receive_thread_.joinable())
@@ -310,6 +543,9 @@ NetworkCommunication::~NetworkCommunication() {
 				
 	if (send_thread_.joinable())
 		send_thread_.join();
+		
+	// Joins the channel threads and closes its socket
+	channel_ = nullptr;
 				
 	if (socket_ >= 0) {
 #ifdef WIN32
@@ -326,108 +562,494 @@ NetworkCommunication::~NetworkCommunication() {
 		close(host_socket_);
 #endif
 	}
+	
+	if (host_udp_socket_ >= 0) {
+#ifdef WIN32
+		closesocket(host_udp_socket_);
+#else
+		close(host_udp_socket_);
+#endif
+	}
+	
+	if (host_shm_socket_ >= 0)
+		ShmChannel::closeHost(host_shm_socket_, shm_path_);
 }
 
 void NetworkCommunication::acceptConnection() {
+	receive_thread_ = thread([this] {
+		if (!waitForConnection()) {
+			kill();
+			
+			return;
+		}
+		
+		// Joined after the receive thread by the destructor
+		send_thread_ = thread(sendThread, ref(*this));
+		receiveThread(*this);
+	});
+}
+
+bool NetworkCommunication::waitForConnection() {
 	// Do select so it's possible to interrupt
 	fd_set readSet;
 	fd_set errorSet;
 	
-	FD_ZERO(&readSet);
-	FD_ZERO(&errorSet);
-	
-	FD_SET(host_socket_, &readSet);
-	FD_SET(host_socket_, &errorSet);
-	
-	FD_SET(pipe_->getSocket(), &readSet);
-	FD_SET(pipe_->getSocket(), &errorSet);
-	
-	if (select(FD_SETSIZE, &readSet, NULL, &errorSet, NULL) <= 0) {
-		Log(WARNING) << "select() in acceptConnection failed\n";
+	while (true) {
+		FD_ZERO(&readSet);
+		FD_ZERO(&errorSet);
 		
-		Log(DEBUG) << strerror(errno) << endl;
+		FD_SET(host_socket_, &readSet);
+		FD_SET(host_socket_, &errorSet);
 		
-		return;
-	}
-	
-	if (FD_ISSET(pipe_->getSocket(), &readSet)) {
-		pipe_->resetPipe();
+		if (host_udp_socket_ >= 0)
+			FD_SET(host_udp_socket_, &readSet);
+			
+		if (host_shm_socket_ >= 0)
+			FD_SET(host_shm_socket_, &readSet);
 		
-		return;
-	}
+		FD_SET(pipe_->getSocket(), &readSet);
+		FD_SET(pipe_->getSocket(), &errorSet);
+		
+		if (select(FD_SETSIZE, &readSet, NULL, &errorSet, NULL) <= 0) {
+			Log(WARNING) << "select() in acceptConnection failed\n";
+			
+			Log(DEBUG) << strerror(errno) << endl;
+			
+			return false;
+		}
+		
+		if (FD_ISSET(pipe_->getSocket(), &readSet)) {
+			pipe_->resetPipe();
+			
+			return false;
+		}
+		
+		if (host_udp_socket_ >= 0 && FD_ISSET(host_udp_socket_, &readSet)) {
+			auto channel = UdpChannel::accept(host_udp_socket_);
+			
+			// Not a handshake, keep waiting
+			if (!channel)
+				continue;
+				
+			// The socket belongs to the channel now
+			channel_ = channel;
+			host_udp_socket_ = -1;
+			
+			Log(DEBUG) << "UDP connection accepted\n";
+			
+			break;
+		}
+		
+		if (host_shm_socket_ >= 0 && FD_ISSET(host_shm_socket_, &readSet)) {
+			auto channel = ShmChannel::accept(host_shm_socket_);
+			
+			if (!channel)
+				continue;
+				
+			// Only one connection per host, nobody else should find the socket
+			ShmChannel::closeHost(host_shm_socket_, shm_path_);
+			host_shm_socket_ = -1;
+			channel_ = channel;
+			
+			Log(DEBUG) << "Shared memory connection accepted\n";
+			
+			break;
+		}
 
-	socket_ = accept(host_socket_, 0, 0);
-	
-	if (socket_ < 0) {
-		Log(WARNING) << "accept() failed\n";
+		socket_ = accept(host_socket_, 0, 0);
 		
+		if (socket_ < 0) {
+			Log(WARNING) << "accept() failed\n";
+			
 #ifdef WIN32
-		closesocket(host_socket_);
+			closesocket(host_socket_);
 #else
-		close(host_socket_);
+			close(host_socket_);
 #endif
-		host_socket_ = -1;
-		return;
+			host_socket_ = -1;
+			return false;
+		}
+		
+		Log(DEBUG) << "Connection accepted\n";
+		
+		// Buffers are sized again now that the RTT is known
+		socket_profile_.apply(socket_, "accepted", true);
+		
+		break;
 	}
 	
-	Log(DEBUG) << "Connection accepted\n";
-	
-	receive_thread_ = thread(receiveThread, ref(*this));
-    send_thread_ = thread(sendThread, ref(*this));
+	return true;
 }
 
-bool NetworkCommunication::start(const string& hostname, unsigned short port, bool fast_fail, bool host) {
+bool NetworkCommunication::start(const string& hostname, unsigned short port, bool fast_fail, bool host, Transport transport) {
 	if (host) {
-		return hostConnection(host_socket_, port);
+		if (!hostConnection(host_socket_, port))
+			return false;
+			
+		host_udp_socket_ = UdpChannel::host(port);
+		
+		if (host_udp_socket_ < 0)
+			Log(WARNING) << "Could not host UDP at port " << port << ", only accepting TCP\n";
+			
+		host_shm_socket_ = ShmChannel::host(port, shm_address_, shm_path_);
+			
+		return true;
+	}
+	
+	return start(vector<string>{ hostname }, port, fast_fail, transport);
+}
+
+bool NetworkCommunication::start(const vector<string>& candidates, unsigned short port, bool fast_fail, Transport transport) {
+	Timer timer;
+	vector<string> hostnames;
+	
+	// A peer on the same machine is reached through shared memory, whatever the transport
+	for (auto& candidate : candidates) {
+		if (!ShmChannel::isAddress(candidate)) {
+			hostnames.push_back(candidate);
+			
+			continue;
+		}
+		
+		if (channel_ || !ShmChannel::isLocal(candidate))
+			continue;
+			
+		channel_ = ShmChannel::connect(candidate);
+		
+		if (channel_)
+			Log(DEBUG) << "Connected through shared memory\n";
+	}
+	
+	if (channel_) {
+		// Skip network
+	} else if (hostnames.empty()) {
+		return false;
+	} else if (transport == TRANSPORT_UDP) {
+		channel_ = UdpChannel::connect(Resolver::resolve(hostnames, port, SOCK_DGRAM), fast_fail);
+		
+		if (!channel_)
+			return false;
 	} else {
-		if (!connect(hostname, port, socket_, fast_fail))
+		if (!connect(hostnames, port, socket_, fast_fail))
 			return false;
 	}
 	
+	connect_time_ = timer.elapsedDuration();
+	Metrics::record(METRIC_CONNECT_LATENCY, connect_time_);
+	
     receive_thread_ = thread(receiveThread, ref(*this));
     send_thread_ = thread(sendThread, ref(*this));
 	
 	return true;
 }
 
-Packet* NetworkCommunication::waitForPacket() {
-    unique_lock<mutex> lock(incoming_mutex_);
-    incoming_cv_.wait(lock, [this] { return !incoming_packets_.empty() || shutdown_; });
+int NetworkCommunication::hostServer(unsigned short port) {
+	int server_socket = -1;
 	
-	// Shutdown
-	if (shutdown_)
-		return nullptr;
+	if (!hostConnection(server_socket, port, SOMAXCONN))
+		return -1;
 		
-	return &incoming_packets_.front();
+	return server_socket;
 }
 
-void NetworkCommunication::completePacket() {
-    lock_guard<mutex> guard(incoming_mutex_);
+int NetworkCommunication::acceptClient(int host_socket) {
+	int client = accept(host_socket, 0, 0);
+	
+	if (client >= 0)
+		socket_profile_.apply(client, "accepted", true);
+		
+	return client;
+}
+
+void NetworkCommunication::adopt(int socket) {
+	socket_ = socket;
+	
+    receive_thread_ = thread(receiveThread, ref(*this));
+    send_thread_ = thread(sendThread, ref(*this));
+}
+
+size_t NetworkCommunication::waitForPackets(vector<Packet>& packets) {
+    size_t popped = 0;
+    
+    // A packet might be claimed but not yet published by the receive thread, then just try again
+    while (popped == 0) {
+        incoming_waiter_.wait([this] { return !incoming_packets_.empty() || shutdown_; });
+        
+        // Shutdown
+        if (shutdown_)
+            return 0;
+            
+        popped = incoming_packets_.popBatch(packets, NetworkConstants::PACKET_BATCH_SIZE);
+    }
+    
+    incoming_space_waiter_.notify();
+    
+    return popped;
+}
+
+size_t NetworkCommunication::takePackets(vector<Packet>& packets) {
+    auto popped = incoming_packets_.popBatch(packets, NetworkConstants::PACKET_BATCH_SIZE);
+    
+    if (popped > 0)
+        incoming_space_waiter_.notify();
+        
+    return popped;
+}
+
+void NetworkCommunication::setPacketListener(const function<void()>& listener) {
+    listener_ = listener;
+    has_listener_.store(true, memory_order_release);
+}
+
+void NetworkCommunication::notifyPackets() {
+    incoming_waiter_.notify();
+    
+    if (has_listener_.load(memory_order_acquire))
+        listener_();
+}
+
+void NetworkCommunication::completePackets(const vector<Packet>& packets) {
+    if (!flow_control_)
+        return;
+        
+    // Hand back the credits once the packets are handled, so the sender follows the slowest stage at the receiver
+    for (auto& packet : packets)
+        pending_credits_ += packet.getSize() + 4;
+        
+    if (pending_credits_ < receive_window_ / 4)
+        return;
+        
+    grantCredits(pending_credits_);
+    pending_credits_ = 0;
+}
+
+void NetworkCommunication::grantCredits(size_t bytes) {
+    // Credits are sent as ints, larger grants are split
+    while (bytes > 0) {
+        auto grant = min<size_t>(bytes, INT_MAX);
+        queue(PacketCreator::credit(static_cast<int>(grant)));
+        
+        bytes -= grant;
+    }
+}
+
+void NetworkCommunication::enableFlowControl(size_t receive_window) {
+    // Credits that arrive before this are kept, since the other side might enable it first
+    if (receive_window > INT_MAX) {
+        Log(WARNING) << "Receive window of " << receive_window << " bytes is too large, using " << INT_MAX << "\n";
+        
+        receive_window = INT_MAX;
+    }
+    
+    receive_window_ = receive_window;
+    flow_control_ = true;
+    wait_for_credits_ = true;
+    
+    // Initial grant
+    grantCredits(receive_window_);
     
-    incoming_packets_.pop_front();
+    Log(DEBUG) << "Flow control enabled with a receive window of " << receive_window_ << " bytes\n";
 }
 
-void NetworkCommunication::send(const Packet& packet, bool wait) {
-    unique_lock<mutex> lock(outgoing_mutex_);
+void NetworkCommunication::send(const Packet& packet, int flow) {
+    if (shutdown_)
+        return;
+        
+    // Includes waiting for credits and queue space
+    TraceSpan span("enqueue", packet.getSize());
     
-    if (wait)
-        send_queue_cv_.wait(lock, [this] { return outgoing_packets_.size() < 10; });
+    // A peer without flow control never grants anything, it gets a grace period to send the first credits
+    if (wait_for_credits_ && !credits_seen_) {
+        auto granted = credit_waiter_.waitFor([this] { return credits_seen_ || shutdown_; }, chrono::milliseconds(NetworkConstants::CREDIT_GRACE));
+        
+        if (!granted && wait_for_credits_.exchange(false))
+            Log(WARNING) << "No flow control credits from the peer, sending without them\n";
+    }
     
-    outgoing_packets_.push_back(packet);
-    outgoing_cv_.notify_one();
+    if (wait_for_credits_) {
+        credit_waiter_.wait([this] { return send_credits_ > 0 || shutdown_; });
+        
+        if (shutdown_)
+            return;
+            
+        send_credits_ -= packet.getSize();
+    }
+    
+    queue(packet, flow);
+}
+
+void NetworkCommunication::queue(const Packet& packet, int flow) {
+    if (flow != 0) {
+        // Bound what one flow holds as well, so there is room left for the others
+        outgoing_space_waiter_.wait([this, flow] {
+            if (shutdown_)
+                return true;
+                
+            if (outgoing_bytes_ >= NetworkConstants::OUTGOING_QUEUE_BYTES)
+                return false;
+                
+            lock_guard<mutex> lock(flows_mutex_);
+            auto iterator = flows_.find(flow);
+            
+            return iterator == flows_.end() || iterator->second.bytes_ < NetworkConstants::FLOW_QUEUE_BYTES;
+        });
+        
+        if (shutdown_)
+            return;
+            
+        {
+            lock_guard<mutex> lock(flows_mutex_);
+            auto iterator = flows_.find(flow);
+            
+            if (iterator != flows_.end()) {
+                auto& outgoing = iterator->second;
+                
+                if (outgoing.packets_.empty())
+                    active_flows_[outgoing.priority_].push_back(flow);
+                    
+                outgoing.packets_.push_back(packet);
+                outgoing.bytes_ += packet.getSize();
+                
+                outgoing_pending_++;
+                outgoing_bytes_ += packet.getSize();
+                flow_packets_++;
+            } else {
+                Log(WARNING) << "Flow " << flow << " is not open, sending without it\n";
+                
+                flow = 0;
+            }
+        }
+        
+        if (flow != 0) {
+            outgoing_waiter_.notify();
+            
+            return;
+        }
+    }
+    
+    // Bound the memory held by queued packets
+    outgoing_space_waiter_.wait([this] { return outgoing_bytes_ < NetworkConstants::OUTGOING_QUEUE_BYTES || shutdown_; });
+    
+    if (shutdown_)
+        return;
+        
+    Packet copy = packet;
+    outgoing_pending_++;
+    outgoing_bytes_ += copy.getSize();
+    
+    // Block while the queue is full
+    while (!outgoing_packets_.tryPush(move(copy))) {
+        outgoing_space_waiter_.wait([this] { return outgoing_packets_.size() < outgoing_packets_.capacity() || shutdown_; });
+        
+        if (shutdown_) {
+            outgoing_pending_--;
+            outgoing_bytes_ -= copy.getSize();
+            
+            return;
+        }
+    }
+    
+    outgoing_waiter_.notify();
+}
+
+int NetworkCommunication::openFlow(int priority, unsigned weight) {
+    lock_guard<mutex> lock(flows_mutex_);
+    int id = next_flow_++;
+    
+    auto& flow = flows_[id];
+    flow.priority_ = priority;
+    flow.weight_ = max(weight, 1u);
+    
+    return id;
+}
+
+void NetworkCommunication::closeFlow(int flow) {
+    lock_guard<mutex> lock(flows_mutex_);
+    auto iterator = flows_.find(flow);
+    
+    if (iterator == flows_.end())
+        return;
+        
+    // What is queued is still sent
+    if (iterator->second.packets_.empty())
+        flows_.erase(iterator);
+    else
+        iterator->second.closed_ = true;
+}
+
+OutgoingState NetworkCommunication::getOutgoingState() {
+    OutgoingState state;
+    state.packets_ = outgoing_pending_;
+    state.bytes_ = outgoing_bytes_;
+    
+    lock_guard<mutex> lock(flows_mutex_);
+    
+    for (auto& flow : flows_) {
+        FlowState flow_state;
+        flow_state.id_ = flow.first;
+        flow_state.priority_ = flow.second.priority_;
+        flow_state.weight_ = flow.second.weight_;
+        flow_state.packets_ = flow.second.packets_.size();
+        flow_state.bytes_ = flow.second.bytes_;
+        flow_state.sent_ = flow.second.sent_;
+        
+        state.flows_.push_back(flow_state);
+    }
+    
+    sort(state.flows_.begin(), state.flows_.end(), [] (const FlowState& a, const FlowState& b) { return a.id_ < b.id_; });
+    
+    return state;
+}
+
+bool NetworkCommunication::handleCredit(Packet& packet) {
+    if (packet.getSize() == 0 || packet.getData()[0] != HEADER_CREDIT)
+        return false;
+        
+    int bytes = 0;
+    
+    packet.getByte();
+    
+    if (CreditMessage::decode(packet, bytes) && bytes > 0)
+        send_credits_ += bytes;
+        
+    credits_seen_ = true;
+    credit_waiter_.notify();
+    
+    return true;
+}
+
+chrono::steady_clock::duration NetworkCommunication::getConnectTime() const {
+	return connect_time_;
 }
 
 int NetworkCommunication::getSocket() const {
     return socket_;
 }
 
+const shared_ptr<Channel>& NetworkCommunication::getChannel() const {
+    return channel_;
+}
+
+const string& NetworkCommunication::getSharedMemoryAddress() const {
+    return shm_address_;
+}
+
 PartialPacket& NetworkCommunication::getPartialPacket() {
     if (partial_packets_.empty() || partial_packets_.back().isFinished())
-        pushPartialPacket(PartialPacket());
+        pushPartialPacket();
     
     return partial_packets_.back();
 }
 
+void NetworkCommunication::processReceived(const unsigned char* buffer, unsigned int size) {
+    unsigned int processed = 0;
+    
+    while (processed < size)
+        processed += processBuffer(buffer + processed, size - processed, getPartialPacket());
+        
+    moveCompletePartialPackets();
+}
+
 bool NetworkCommunication::hasFullPartialPacket() const {
     return partial_packets_.empty() ? false : partial_packets_.front().isFinished();
 }
@@ -436,18 +1058,36 @@ void NetworkCommunication::moveCompletePartialPackets() {
     if (!hasFullPartialPacket())
         return;
     
-    lock_guard<mutex> guard(incoming_mutex_);
-    
     while (hasFullPartialPacket()) {
-        incoming_packets_.push_back(move(getFullPartialPacket()));
+        Packet packet(move(getFullPartialPacket()));
+        
+        Metrics::add(METRIC_PACKETS_RECEIVED);
+        Metrics::add(METRIC_BYTES_RECEIVED, packet.getSize() + 4);
+        
+        // Credits are consumed by the network itself
+        if (handleCredit(packet)) {
+            popFullPartialPacket();
+            
+            continue;
+        }
+        
+        // Block while the packet thread is behind
+        while (!incoming_packets_.tryPush(move(packet))) {
+            notifyPackets();
+            incoming_space_waiter_.wait([this] { return incoming_packets_.size() < incoming_packets_.capacity() || shutdown_; });
+            
+            if (shutdown_)
+                return;
+        }
+        
         popFullPartialPacket();
     }
     
-    incoming_cv_.notify_one();
+    notifyPackets();
 }
 
-void NetworkCommunication::pushPartialPacket(const PartialPacket &partial) {
-    partial_packets_.push_back(partial);
+void NetworkCommunication::pushPartialPacket() {
+    partial_packets_.emplace_back();
 }
 
 PartialPacket& NetworkCommunication::getFullPartialPacket() {
@@ -458,21 +1098,98 @@ void NetworkCommunication::popFullPartialPacket() {
     partial_packets_.pop_front();
 }
 
-Packet* NetworkCommunication::getOutgoingPacket() {
-    unique_lock<mutex> lock(outgoing_mutex_);
-    outgoing_cv_.wait(lock, [this] { return !outgoing_packets_.empty() || shutdown_; });
+size_t NetworkCommunication::getOutgoingPackets(vector<Packet>& packets) {
+    size_t popped = 0;
     
-	if (shutdown_)
-		return nullptr;
+    while (popped == 0) {
+        outgoing_waiter_.wait([this] { return !outgoing_packets_.empty() || flow_packets_ > 0 || shutdown_; });
+        
+        if (shutdown_)
+            return 0;
+            
+        // Packets without a flow are answers and requests, small and waited on
+        popped = outgoing_packets_.popBatch(packets, NetworkConstants::PACKET_BATCH_SIZE);
+        
+        if (popped < NetworkConstants::PACKET_BATCH_SIZE && flow_packets_ > 0)
+            popped += takeFlowPackets(packets, NetworkConstants::PACKET_BATCH_SIZE - popped);
+    }
+    
+    outgoing_space_waiter_.notify();
+    
+    return popped;
+}
 
-    return &outgoing_packets_.front();
+size_t NetworkCommunication::takeFlowPackets(vector<Packet>& packets, size_t max) {
+    lock_guard<mutex> lock(flows_mutex_);
+    size_t taken = 0;
+    size_t bytes = 0;
+    
+    // At most a quantum per batch, a flow with higher priority does not wait long for the socket
+    while (taken < max && bytes < NetworkConstants::FLOW_QUANTUM && !active_flows_.empty()) {
+        auto level = active_flows_.begin();
+        auto& order = level->second;
+        
+        int id = order.front();
+        auto& flow = flows_.at(id);
+        
+        if (!flow.credited_) {
+            flow.deficit_ += flow.weight_ * static_cast<size_t>(NetworkConstants::FLOW_QUANTUM);
+            flow.credited_ = true;
+        }
+        
+        auto size = flow.packets_.front().getSize();
+        
+        // Turn is over, the rest of the deficit is kept for the next one
+        if (size > flow.deficit_) {
+            flow.credited_ = false;
+            order.pop_front();
+            order.push_back(id);
+            
+            continue;
+        }
+        
+        flow.deficit_ -= size;
+        flow.bytes_ -= size;
+        flow.sent_ += size;
+        
+        packets.push_back(move(flow.packets_.front()));
+        flow.packets_.pop_front();
+        
+        taken++;
+        bytes += size;
+        
+        if (flow.packets_.empty()) {
+            flow.deficit_ = 0;
+            flow.credited_ = false;
+            order.pop_front();
+            
+            if (order.empty())
+                active_flows_.erase(level);
+                
+            if (flow.closed_)
+                flows_.erase(id);
+        }
+    }
+    
+    flow_packets_ -= taken;
+    
+    return taken;
 }
 
-void NetworkCommunication::popOutgoingPacket() {
-    lock_guard<mutex> guard(outgoing_mutex_);
+void NetworkCommunication::completeOutgoingPackets(const vector<Packet>& packets) {
+    size_t bytes = 0;
     
-    outgoing_packets_.pop_front();
-    send_queue_cv_.notify_all();
+    for (auto& packet : packets)
+        bytes += packet.getSize();
+        
+    outgoing_bytes_ -= bytes;
+    outgoing_pending_ -= packets.size();
+    
+    Metrics::add(METRIC_PACKETS_SENT, packets.size());
+    Metrics::add(METRIC_BYTES_SENT, bytes);
+    
+    outgoing_space_waiter_.notify();
+    outgoing_drained_waiter_.notify();
 }
 
 void NetworkCommunication::kill(bool safe) {
@@ -488,19 +1205,31 @@ void NetworkCommunication::kill(bool safe) {
 	}
 		
 	// Safe shutdown - wait for all packets to be sent before exiting
-	if (safe) {
-		unique_lock<mutex> lock(outgoing_mutex_);
-		send_queue_cv_.wait(lock, [this] { return outgoing_packets_.empty(); });
-	}
-
-	lock_guard<mutex> in_lock(incoming_mutex_);
-	lock_guard<mutex> out_lock(outgoing_mutex_);
-	
-	shutdown_ = true;
+	if (safe)
+		outgoing_drained_waiter_.wait([this] { return outgoing_pending_ == 0 || shutdown_; });
+		
+	if (shutdown_.exchange(true))
+		return;
+		
 	pipe_->setPipe();
 	
-	incoming_cv_.notify_all();
-	outgoing_cv_.notify_all();
+	// Wakes the receive and send threads blocked in the channel
+	if (channel_)
+		channel_->close();
+	
+	incoming_waiter_.wake();
+	incoming_space_waiter_.wake();
+	outgoing_waiter_.wake();
+	outgoing_space_waiter_.wake();
+	outgoing_drained_waiter_.wake();
+	credit_waiter_.wake();
+	
+	if (has_listener_.load(memory_order_acquire))
+		listener_();
+}
+
+bool NetworkCommunication::isAlive() const {
+	return !shutdown_;
 }
 
 EventPipe& NetworkCommunication::getPipe() {
@@ -511,6 +1240,14 @@ void NetworkCommunication::setTerminateOnKill(bool status) {
 	terminate_on_kill_ = status;
 }
 
+void NetworkCommunication::setSocketProfile(const SocketProfile& profile) {
+	socket_profile_ = profile;
+}
+
+const SocketProfile& NetworkCommunication::getSocketProfile() {
+	return socket_profile_;
+}
+
 /*
     EventPipe
 */
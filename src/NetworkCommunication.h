@@ -2,19 +2,79 @@
 #ifndef NETWORK_COMMUNICATION_H
 #define NETWORK_COMMUNICATION_H
 
+#include "RingQueue.h"
+#include "Packet.h"
+#include "SocketProfile.h"
+#include "Channel.h"
+
 #include <thread>
 #include <list>
 #include <mutex>
-#include <condition_variable>
 #include <atomic>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <deque>
+#include <unordered_map>
 
 enum NetworkConstants {
-    BUFFER_SIZE = 1048576
+    BUFFER_SIZE = 1048576,
+    DIRECT_RECEIVE_SIZE = 65536,
+    PACKET_QUEUE_SIZE = 128,
+    PACKET_BATCH_SIZE = 32,
+    OUTGOING_QUEUE_BYTES = 67108864,
+    
+    // Bytes a flow of weight 1 may send per turn, and at most queued by one flow
+    FLOW_QUANTUM = 1048576,
+    FLOW_QUEUE_BYTES = 16777216,
+    
+    // Milliseconds to wait for the peer's first credits before sending without flow control
+    CREDIT_GRACE = 5000,
+    
+    // Milliseconds between starting connection attempts to the next address, and for all of them
+    CONNECT_STAGGER = 100,
+    CONNECT_TIMEOUT = 1500
+};
+
+enum Transport {
+    TRANSPORT_TCP,
+    TRANSPORT_UDP
 };
 
-class Packet;
 class PartialPacket;
 
+struct FlowState {
+    int id_ = 0;
+    int priority_ = 0;
+    unsigned weight_ = 0;
+    size_t packets_ = 0;
+    size_t bytes_ = 0;
+    size_t sent_ = 0;
+};
+
+// Packets waiting for the send thread, those without a flow included
+struct OutgoingState {
+    size_t packets_ = 0;
+    size_t bytes_ = 0;
+    std::vector<FlowState> flows_;
+};
+
+// Packets of one transfer, queued apart from the others
+struct OutgoingFlow {
+    std::deque<Packet> packets_;
+    int priority_ = 0;
+    unsigned weight_ = 1;
+    size_t bytes_ = 0;
+    size_t sent_ = 0;
+    
+    // Deficit round robin, bytes it may still send this turn
+    size_t deficit_ = 0;
+    bool credited_ = false;
+    
+    // Removed once empty
+    bool closed_ = false;
+};
+
 class EventPipe {
 public:
     explicit EventPipe();
@@ -35,55 +95,147 @@ public:
     NetworkCommunication();
     ~NetworkCommunication();
     
-    bool start(const std::string& hostname, unsigned short port, bool fast_fail = false, bool host = false);
+    // Hosting accepts both transports, the connecting side decides
+    bool start(const std::string& hostname, unsigned short port, bool fast_fail = false, bool host = false, Transport transport = TRANSPORT_TCP);
+    
+    // Connects to all candidates at once (happy eyeballs), the first one to answer is used
+    bool start(const std::vector<std::string>& hostnames, unsigned short port, bool fast_fail, Transport transport = TRANSPORT_TCP);
+    
+    // Accepts one connection when hosting, the receive thread waits for it so the caller does not block
     void acceptConnection();
     
+    // Servers with many clients accept on their own listening socket and give each connection its own instance
+    static int hostServer(unsigned short port);
+    static int acceptClient(int host_socket);
+    void adopt(int socket);
+    
     int getSocket() const;
     
-    void send(const Packet& packet, bool wait = false);
+    // How long start() took to connect
+    std::chrono::steady_clock::duration getConnectTime() const;
+    
+    // Set when the connection is not a plain TCP socket
+    const std::shared_ptr<Channel>& getChannel() const;
+    
+    // Candidate address for peers on the same machine when hosting, empty if not available
+    const std::string& getSharedMemoryAddress() const;
+    
+    // Packets without a flow, answers and requests, go before every flow
+    void send(const Packet& packet, int flow = 0);
+    
+    // The send thread serves the highest priority with packets queued, flows of the same priority share the
+    // connection by weight (deficit round robin). Packets of a flow are sent in order
+    int openFlow(int priority, unsigned weight);
+    void closeFlow(int flow);
     
-    Packet* waitForPacket();
-    void completePacket();
+    OutgoingState getOutgoingState();
+    
+    // Waits for incoming packets and moves up to PACKET_BATCH_SIZE of them into packets, returns 0 on shutdown
+    size_t waitForPackets(std::vector<Packet>& packets);
+    void completePackets(const std::vector<Packet>& packets);
+    
+    // Instead of a thread waiting for packets, called by the receive thread when packets are queued and once
+    // the network is killed. Set at most once
+    void setPacketListener(const std::function<void()>& listener);
+    
+    // Moves up to PACKET_BATCH_SIZE queued packets into packets without waiting
+    size_t takePackets(std::vector<Packet>& packets);
+    
+    // Receiver granted byte credits, both sides of the connection needs to enable it. The window is at most
+    // INT_MAX, a peer which grants nothing within CREDIT_GRACE is sent to without credits
+    void enableFlowControl(size_t receive_window);
     
     PartialPacket& getPartialPacket();
     void moveCompletePartialPackets();
     
-    Packet* getOutgoingPacket();
-    void popOutgoingPacket();
+    // Frames received bytes into packets for waitForPackets(), what the receive thread does with small reads
+    void processReceived(const unsigned char* buffer, unsigned int size);
+    
+    size_t getOutgoingPackets(std::vector<Packet>& packets);
+    void completeOutgoingPackets(const std::vector<Packet>& packets);
     
     EventPipe& getPipe();
     void kill(bool safe = false);
+    bool isAlive() const;
     
     void setTerminateOnKill(bool status);
+    
+    static void setSocketProfile(const SocketProfile& profile);
+    static const SocketProfile& getSocketProfile();
 
 private:
     bool hasFullPartialPacket() const;
-    void pushPartialPacket(const PartialPacket& partial);
+    void pushPartialPacket();
     PartialPacket& getFullPartialPacket();
     void popFullPartialPacket();
+    void queue(const Packet& packet, int flow = 0);
+    size_t takeFlowPackets(std::vector<Packet>& packets, size_t max);
+    bool handleCredit(Packet& packet);
+    void grantCredits(size_t bytes);
+    bool waitForConnection();
+    void notifyPackets();
     
     int socket_ = -1;
     int host_socket_ = -1;
+    int host_udp_socket_ = -1;
+    int host_shm_socket_ = -1;
+    
+    std::string shm_address_;
+    std::string shm_path_;
+    
+    std::shared_ptr<Channel> channel_;
     
     std::thread receive_thread_;
     std::thread send_thread_;
     
-    std::mutex incoming_mutex_;
-    std::condition_variable incoming_cv_;
-    std::list<Packet> incoming_packets_;
+    RingQueue<Packet> incoming_packets_;
+    QueueWaiter incoming_waiter_;
+    QueueWaiter incoming_space_waiter_;
     
-    std::mutex outgoing_mutex_;
-    std::condition_variable outgoing_cv_;
-    std::list<Packet> outgoing_packets_;
+    std::function<void()> listener_;
+    std::atomic<bool> has_listener_{false};
     
-    std::condition_variable send_queue_cv_;
+    // Multiple threads might send, only the send thread consumes
+    RingQueue<Packet> outgoing_packets_;
+    QueueWaiter outgoing_waiter_;
+    QueueWaiter outgoing_space_waiter_;
+    
+    // Packets queued or being sent, used for safe shutdown
+    std::atomic<size_t> outgoing_pending_;
+    std::atomic<size_t> outgoing_bytes_;
+    QueueWaiter outgoing_drained_waiter_;
+    
+    std::mutex flows_mutex_;
+    std::unordered_map<int, OutgoingFlow> flows_;
+    
+    // Flows with packets queued, in round robin order per priority, highest first
+    std::map<int, std::deque<int>, std::greater<int>> active_flows_;
+    std::atomic<size_t> flow_packets_{0};
+    int next_flow_ = 1;
+    
+    // Flow control, the credits might go negative by at most one packet
+    std::atomic<bool> flow_control_;
+    std::atomic<bool> wait_for_credits_{false};
+    std::atomic<bool> credits_seen_{false};
+    std::atomic<long long> send_credits_;
+    QueueWaiter credit_waiter_;
+    
+    size_t receive_window_ = 0;
+    size_t pending_credits_ = 0;
     
     std::list<PartialPacket> partial_packets_;
     
     std::atomic<bool> shutdown_;
     std::shared_ptr<EventPipe> pipe_;
     
-    bool terminate_on_kill_ = false;
+    // Set by the transfer using the connection while the network threads might be killing it
+    std::atomic<bool> terminate_on_kill_{false};
+    
+    int sampler_ = 0;
+    
+    std::chrono::steady_clock::duration connect_time_{};
+    
+    static SocketProfile socket_profile_;
 };
 
 #endif
\ No newline at end of file
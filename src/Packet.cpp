@@ -1,18 +1,32 @@
 #include "Packet.h"
 #include "Log.h"
 #include "PartialPacket.h"
+#include "BufferPool.h"
+#include "PacketSchema.h"
 
 #include <array>
 #include <cstring>
 
 using namespace std;
 
-Packet::Packet() : m_sent(0), m_read(0), m_finalized(false) {
-    m_packet = make_shared<vector<unsigned char>>();
+// Decodes a single field with the same bounds checks as a whole message
+template<class T>
+static typename T::type readField(Packet& packet) {
+    typename T::type value{};
+    
+    if (!Message<0, T>::decode(packet, value))
+        Log(ERROR) << "Trying to read beyond packet size, " << packet.getRemaining() << " bytes left\n";
+        
+    return value;
+}
+
+Packet::Packet() : Packet(static_cast<size_t>(0)) {}
+
+Packet::Packet(const size_t capacity) : m_sent(0), m_read(0), m_finalized(false) {
+    m_packet = BufferPool::acquire(capacity + 4);
     
     // Insert header placeholders
-    for (int i = 0; i < 4; i++)
-        m_packet->push_back(0);
+    m_packet->assign(4, 0);
 }
 
 Packet::Packet(const unsigned char *buffer, const unsigned int size) : m_sent(0), m_read(0), m_finalized(false) {
@@ -22,14 +36,10 @@ Packet::Packet(const unsigned char *buffer, const unsigned int size) : m_sent(0)
         return;
     }
     
-    m_packet = make_shared<vector<unsigned char>>();
-    
-    m_packet->reserve(size + 4);
+    m_packet = BufferPool::acquire(size + 4);
     
     // Insert header placeholders
-    for (int i = 0; i < 4; i++)
-        m_packet->push_back(0);
-    
+    m_packet->assign(4, 0);
     m_packet->insert(m_packet->end(), buffer, buffer + size);
 }
 
@@ -54,8 +64,8 @@ void Packet::addString(const string &str) {
         return;
     }
     
-    addInt(str.length());
-    m_packet->insert(m_packet->end(), str.begin(), str.end());
+    auto* out = extend(Field::String::size(str));
+    Field::String::write(out, str);
 }
 
 void Packet::addBytes(const pair<size_t, const unsigned char*>& bytes) {
@@ -65,13 +75,17 @@ void Packet::addBytes(const pair<size_t, const unsigned char*>& bytes) {
         return;
     }
     
-    addInt(bytes.first);
-    
-    if (bytes.first == 0)
-        return;
+    auto* out = extend(Field::Bytes::size(bytes));
+    Field::Bytes::write(out, bytes);
+}
 
-    m_packet->reserve(m_packet->size() + bytes.first);
-    m_packet->insert(m_packet->end(), bytes.second, bytes.second + bytes.first);
+unsigned char* Packet::extend(const size_t size) {
+    auto offset = m_packet->size();
+    
+    // Default initialized, nothing is zeroed
+    m_packet->resize(offset + size);
+    
+    return m_packet->data() + offset;
 }
 
 void Packet::addInt(const int nbr) {
@@ -81,10 +95,7 @@ void Packet::addInt(const int nbr) {
         return;
     }
     
-    m_packet->push_back((nbr >> 24) & 0xFF);
-    m_packet->push_back((nbr >> 16) & 0xFF);
-    m_packet->push_back((nbr >> 8) & 0xFF);
-    m_packet->push_back(nbr & 0xFF);
+    writeInt32(extend(4), nbr);
 }
 
 void Packet::addBool(const bool val) {
@@ -104,32 +115,20 @@ void Packet::addFloat(const float nbr) {
         return;
     }
     
-    string floatString = to_string(nbr);
-    
-    m_packet->push_back(floatString.length());
-    m_packet->insert(m_packet->end(), floatString.begin(), floatString.end());
+    auto* out = extend(Field::Float::size(nbr));
+    Field::Float::write(out, nbr);
 }
 
 float Packet::getFloat() {
-    unsigned char length = m_packet->at(m_read++);
-    
-    string str(m_packet->begin() + m_read, m_packet->begin() + length + m_read);
-    m_read += length;
-    
-    return stof(str);
+    return readField<Field::Float>(*this);
 }
 
 bool Packet::getBool() {
-    return m_packet->at(m_read++) == 1 ? true : false;
+    return readField<Field::Bool>(*this);
 }
 
 string Packet::getString() {
-    unsigned int length = getInt();
-    
-    string str(m_packet->begin() + m_read, m_packet->begin() + m_read + length);
-    m_read += length;
-    
-    return str;
+    return readField<Field::String>(*this);
 }
 
 const unsigned char* Packet::getData() const {
@@ -173,27 +172,23 @@ unsigned char Packet::getByte() {
 }
 
 int Packet::getInt() {
-    int nbr;
-    
-    try {
-        nbr = (m_packet->at(m_read) << 24) | (m_packet->at(m_read + 1) << 16) | (m_packet->at(m_read + 2) << 8) | m_packet->at(m_read + 3); 
-        m_read += 4;
-    } catch(...) {
-        Log(ERROR) << "Trying to read beyond packet size, m_read = " << m_read << " packet size = " << m_packet->size() << endl;
-        
-        return 0;
-    }
-    
-    return nbr;
+    return readField<Field::Int>(*this);
 }
 
 pair<size_t, const unsigned char*> Packet::getBytes() {
-    auto size = getInt();
-    
-    auto* iterator = m_packet->data() + m_read;
-    m_read += size;
-    
-    return { size, iterator };
+    return readField<Field::Bytes>(*this);
+}
+
+const unsigned char* Packet::getReadPointer() const {
+    return m_packet->data() + m_read;
+}
+
+size_t Packet::getRemaining() const {
+    return m_read < m_packet->size() ? m_packet->size() - m_read : 0;
+}
+
+void Packet::addRead(const size_t read) {
+    m_read += read;
 }
 
 void Packet::addSent(const int sent) {
@@ -238,12 +233,12 @@ void Packet::deepCopy(const Packet& packet) {
     m_read = packet.m_read;
     m_finalized = packet.m_finalized;
     
-    m_packet = make_shared<vector<unsigned char>>();
+    m_packet = BufferPool::acquire(packet.m_packet->size());
     
     // Deep copy vectors
     *(m_packet.get()) = *(packet.m_packet.get());
 }
 
-shared_ptr<vector<unsigned char>>& Packet::internal() {
+shared_ptr<PacketBuffer>& Packet::internal() {
     return m_packet;
 }
\ No newline at end of file
@@ -2,15 +2,16 @@
 #ifndef PACKET_H
 #define PACKET_H
 
+#include "PacketBuffer.h"
+
 #include <string>
-#include <vector>
-#include <memory>
 
 class PartialPacket;
 
 class Packet {
 public:
     Packet();
+    explicit Packet(const size_t capacity);
     Packet(const unsigned char *buffer, const unsigned int size);
     
     Packet(PartialPacket &&partialPacket);
@@ -22,6 +23,9 @@ public:
     void addBool(const bool val);
     void addBytes(const std::pair<size_t, const unsigned char*>& bytes);
     
+    // Grows the packet by size bytes and returns where to write them
+    unsigned char* extend(const size_t size);
+    
     unsigned char getByte();
     int getInt();
     float getFloat();
@@ -29,6 +33,11 @@ public:
     bool getBool();
     std::pair<size_t, const unsigned char*> getBytes();
     
+    // Unread part of the packet, for decoding several fields at once
+    const unsigned char* getReadPointer() const;
+    size_t getRemaining() const;
+    void addRead(const size_t read);
+    
     const unsigned char* getData() const;
     unsigned int getSize() const;
     unsigned int getSent() const;
@@ -40,12 +49,12 @@ public:
     
     void deepCopy(const Packet& packet);
     
-    std::shared_ptr<std::vector<unsigned char>>& internal();
+    std::shared_ptr<PacketBuffer>& internal();
     
 private:
     bool isFinalized() const;
     
-    std::shared_ptr<std::vector<unsigned char>> m_packet;
+    std::shared_ptr<PacketBuffer> m_packet;
     unsigned int m_sent, m_read;
     
     bool m_finalized;
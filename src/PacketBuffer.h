@@ -0,0 +1,45 @@
+#pragma once
+#ifndef PACKET_BUFFER_H
+#define PACKET_BUFFER_H
+
+#include <vector>
+#include <memory>
+
+// Backing memory for packet buffers, large allocations may be backed by huge pages
+void* allocatePacketMemory(size_t size);
+void freePacketMemory(void* pointer, size_t size);
+
+// Allocator which default-initializes instead of value-initializing, so resize() on a
+// byte buffer does not zero memory that is about to be overwritten by recv() or read()
+template<class T>
+class DefaultInitAllocator : public std::allocator<T> {
+public:
+	template<class U>
+	struct rebind {
+		using other = DefaultInitAllocator<U>;
+	};
+	
+	using std::allocator<T>::allocator;
+	
+	T* allocate(size_t n) {
+		return static_cast<T*>(allocatePacketMemory(n * sizeof(T)));
+	}
+	
+	void deallocate(T* pointer, size_t n) noexcept {
+		freePacketMemory(pointer, n * sizeof(T));
+	}
+	
+	template<class U>
+	void construct(U* pointer) noexcept {
+		::new (static_cast<void*>(pointer)) U;
+	}
+	
+	template<class U, class... Args>
+	void construct(U* pointer, Args&&... args) {
+		::new (static_cast<void*>(pointer)) U(std::forward<Args>(args)...);
+	}
+};
+
+using PacketBuffer = std::vector<unsigned char, DefaultInitAllocator<unsigned char>>;
+
+#endif
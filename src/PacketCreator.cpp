@@ -4,83 +4,66 @@
 using namespace std;
 
 Packet PacketCreator::join(const string& name) {
-	Packet packet;
-	packet.addHeader(HEADER_JOIN);
-	packet.addString(name);
-	packet.finalize();
-	
-	return packet;
+	return JoinMessage::encode(name);
 }
 
 Packet PacketCreator::available() {
-	Packet packet;
-	packet.addHeader(HEADER_AVAILABLE);
-	packet.finalize();
-	
-	return packet;
+	return AvailableMessage::encode();
 }
 
-Packet PacketCreator::inform(const string& to, const string& file, const string& directory, bool direct) {
-	Packet packet;
-	packet.addHeader(HEADER_INFORM);
-	packet.addString(to);
-	packet.addString(file);
-	packet.addString(directory);
-	packet.addBool(direct);
-	packet.finalize();
-	
-	return packet;
+Packet PacketCreator::inform(const string& to, const string& file, const string& directory, bool direct, int correlation) {
+	if (correlation > 0)
+		return CorrelatedInformMessage::encode(to, file, directory, direct, correlation);
+		
+	return InformMessage::encode(to, file, directory, direct);
 }
 
-Packet PacketCreator::informResult(bool accept, int id, int port, const vector<string>& addresses) {
-	Packet packet;
-	packet.addHeader(HEADER_INFORM_RESULT);
-	packet.addBool(accept);
-	packet.addInt(id);
-	packet.addInt(addresses.size());
-	packet.addInt(port);
-	
-	for (auto& address : addresses)
-		packet.addString(address);
+Packet PacketCreator::informResult(bool accept, int id, int port, const vector<string>& addresses, int correlation) {
+	if (correlation > 0)
+		return CorrelatedInformResultMessage::encode(accept, id, addresses.size(), port, addresses, correlation);
 		
-	packet.finalize();
-	
-	return packet;
+	return InformResultMessage::encode(accept, id, addresses.size(), port, addresses);
 }
 
-Packet PacketCreator::send(const string& to, const string& file, const string& directory, const pair<size_t, const unsigned char*>& data, bool first, bool direct_connected, int id) {
-	Packet packet;
-	packet.addHeader(HEADER_SEND);
+Packet PacketCreator::send(const string& to, const string& file, const string& directory, const pair<size_t, const unsigned char*>& data, bool first, bool direct_connected, int id, int correlation) {
+	if (correlation > 0) {
+		if (direct_connected)
+			return CorrelatedSendByIdMessage::encode(id, file, directory, data, first, correlation);
+			
+		return CorrelatedSendMessage::encode(to, file, directory, data, first, correlation);
+	}
 	
 	if (direct_connected)
-		packet.addInt(id);
-	else
-		packet.addString(to);
+		return SendByIdMessage::encode(id, file, directory, data, first);
 		
-	packet.addString(file);
-	packet.addString(directory);
-	packet.addBytes(data);
-	packet.addBool(first);
-	packet.finalize();
-	
-	return packet;
+	return SendMessage::encode(to, file, directory, data, first);
 }
 
-Packet PacketCreator::sendResult(int id, bool result) {
-	Packet packet;
-	packet.addHeader(HEADER_SEND_RESULT);
-	packet.addInt(id);
-	packet.addBool(result);
-	packet.finalize();
-	
-	return packet;
+Packet PacketCreator::sendResult(int id, bool result, int correlation) {
+	if (correlation > 0)
+		return CorrelatedSendResultMessage::encode(id, result, correlation);
+		
+	return SendResultMessage::encode(id, result);
 }
 
 Packet PacketCreator::initialize(const string& version) {
-	Packet packet;
-	packet.addHeader(HEADER_INITIALIZE);
-	packet.addString(version);
-	packet.finalize();
+	return InitializeMessage::encode(version);
+}
+
+Packet PacketCreator::credit(int bytes) {
+	return CreditMessage::encode(bytes);
+}
+
+Packet PacketCreator::job(const vector<string>& receivers, const vector<string>& files, bool recursive, int priority) {
+	auto names = receivers;
+	names.insert(names.end(), files.begin(), files.end());
 	
-	return packet;
+	if (priority != 0)
+		return PrioritizedJobMessage::encode(priority, recursive, receivers.size(), files.size(), names);
+		
+	return JobMessage::encode(recursive, receivers.size(), files.size(), names);
+}
+
+Packet PacketCreator::jobResult(bool result, int sent, int failed, const vector<string>& report) {
+	return JobResultMessage::encode(result, sent, failed, report);
 }
\ No newline at end of file
@@ -2,6 +2,8 @@
 #ifndef PACKET_CREATOR_H
 #define PACKET_CREATOR_H
 
+#include "PacketSchema.h"
+
 #include <string>
 #include <vector>
 
@@ -13,20 +15,58 @@ enum {
 	HEADER_SEND_RESULT,
 	HEADER_INITIALIZE,
 	HEADER_INFORM_RESULT,
-	HEADER_CLIENT_DISCONNECT
+	HEADER_CLIENT_DISCONNECT,
+	HEADER_CREDIT,
+	
+	// Local daemon socket only
+	HEADER_JOB,
+	HEADER_JOB_RESULT,
+	HEADER_PRIORITIZED_JOB
 };
 
-class Packet;
+// Layouts of the messages this client creates, decoding uses the same declarations. Answers from
+// the server are laid out by the server and are read field by field
+using JoinMessage = Message<HEADER_JOIN, Field::String>;
+using AvailableMessage = Message<HEADER_AVAILABLE>;
+using InformMessage = Message<HEADER_INFORM, Field::String, Field::String, Field::String, Field::Bool>;
+using InformResultMessage = Message<HEADER_INFORM_RESULT, Field::Bool, Field::Int, Field::Int, Field::Int, Field::Strings>;
+using SendMessage = Message<HEADER_SEND, Field::String, Field::String, Field::String, Field::Bytes, Field::Bool>;
+// Direct connections and the server forwarding to the receiver use the file ID instead of the name
+using SendByIdMessage = Message<HEADER_SEND, Field::Int, Field::String, Field::String, Field::Bytes, Field::Bool>;
+using SendResultMessage = Message<HEADER_SEND_RESULT, Field::Int, Field::Bool>;
+// Chunks may carry a correlation ID last, which the answer repeats. Older peers ignore it
+using CorrelatedSendMessage = Message<HEADER_SEND, Field::String, Field::String, Field::String, Field::Bytes, Field::Bool, Field::Int>;
+using CorrelatedSendByIdMessage = Message<HEADER_SEND, Field::Int, Field::String, Field::String, Field::Bytes, Field::Bool, Field::Int>;
+using CorrelatedSendResultMessage = Message<HEADER_SEND_RESULT, Field::Int, Field::Bool, Field::Int>;
+// Informs carry one too, the server passes it to the receiver and back. The addresses are counted, so the ID
+// can follow them for readers going field by field. Only for encoding, decoding would take the ID as an address
+using CorrelatedInformMessage = Message<HEADER_INFORM, Field::String, Field::String, Field::String, Field::Bool, Field::Int>;
+using CorrelatedInformResultMessage = Message<HEADER_INFORM_RESULT, Field::Bool, Field::Int, Field::Int, Field::Int, Field::Strings, Field::Int>;
+using InitializeMessage = Message<HEADER_INITIALIZE, Field::String>;
+using CreditMessage = Message<HEADER_CREDIT, Field::Int>;
+// Receivers first, then files. The result repeats the counts per receiver as text
+using JobMessage = Message<HEADER_JOB, Field::Bool, Field::Int, Field::Int, Field::Strings>;
+// Only sent with a priority other than 0, so older daemons still take the other jobs
+using PrioritizedJobMessage = Message<HEADER_PRIORITIZED_JOB, Field::Int, Field::Bool, Field::Int, Field::Int, Field::Strings>;
+using JobResultMessage = Message<HEADER_JOB_RESULT, Field::Bool, Field::Int, Field::Int, Field::Strings>;
+// Sent by the server unasked, the relay encodes them with the same declarations
+using InformForwardMessage = Message<HEADER_INFORM_RESULT, Field::Int, Field::String, Field::String, Field::Bool>;
+using CorrelatedInformForwardMessage = Message<HEADER_INFORM_RESULT, Field::Int, Field::String, Field::String, Field::Bool, Field::Int>;
+using DisconnectMessage = Message<HEADER_CLIENT_DISCONNECT, Field::Int>;
 
 class PacketCreator {
 public:
 	static Packet join(const std::string& name);
 	static Packet available();
-	static Packet inform(const std::string& to, const std::string& file, const std::string& directory, bool direct);
-	static Packet informResult(bool accept, int id, int port, const std::vector<std::string>& addresses);
-	static Packet send(const std::string& to, const std::string& file, const std::string& directory, const std::pair<size_t, const unsigned char*>& data, bool first, bool direct_connected = false, int id = -1);
-	static Packet sendResult(int id, bool result);
+	static Packet inform(const std::string& to, const std::string& file, const std::string& directory, bool direct, int correlation = 0);
+	static Packet informResult(bool accept, int id, int port, const std::vector<std::string>& addresses, int correlation = 0);
+	// A correlation ID of 0 is left out
+	static Packet send(const std::string& to, const std::string& file, const std::string& directory, const std::pair<size_t, const unsigned char*>& data, bool first, bool direct_connected = false, int id = -1, int correlation = 0);
+	static Packet sendResult(int id, bool result, int correlation = 0);
 	static Packet initialize(const std::string& version);
+	static Packet credit(int bytes);
+	static Packet job(const std::vector<std::string>& receivers, const std::vector<std::string>& files, bool recursive, int priority = 0);
+	static Packet jobResult(bool result, int sent, int failed, const std::vector<std::string>& report);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,95 @@
+#include "PacketPump.h"
+#include "NetworkCommunication.h"
+#include "Executor.h"
+#include "CLI.h"
+#include "Log.h"
+#include "Trace.h"
+
+using namespace std;
+
+PacketPump::PacketPump(CLI& cli, const shared_ptr<NetworkCommunication>& network) : cli_(cli), network_(network), strand_(make_shared<Strand>(cli.executor())) {}
+
+shared_ptr<PacketPump> PacketPump::start(CLI& cli, const shared_ptr<NetworkCommunication>& network, bool accept) {
+	shared_ptr<PacketPump> pump(new PacketPump(cli, network));
+	pump->self_ = pump;
+
+	// Weak since the network outlives the pump, the receive thread only holds it while scheduling
+	weak_ptr<PacketPump> weak = pump;
+
+	network->setPacketListener([weak] {
+		if (auto current = weak.lock())
+			current->schedule();
+	});
+
+	if (accept)
+		network->acceptConnection();
+
+	// Packets might have been queued before the listener was set
+	pump->schedule();
+
+	return pump;
+}
+
+void PacketPump::wait() {
+	unique_lock<mutex> lock(mutex_);
+	closed_.wait(lock, [this] { return done_; });
+}
+
+void PacketPump::schedule() {
+	if (scheduled_.exchange(true))
+		return;
+
+	strand_->post([self = shared_from_this()] { self->pump(); });
+}
+
+void PacketPump::pump() {
+	scheduled_ = false;
+
+	{
+		lock_guard<mutex> lock(mutex_);
+
+		if (done_)
+			return;
+	}
+
+	// Zero packets means shutdown is ordered
+	if (!network_->isAlive()) {
+		close();
+
+		return;
+	}
+
+	if (network_->takePackets(packets_) == 0)
+		return;
+
+	for (auto& packet : packets_) {
+		TraceSpan span("process", packet.getSize());
+		cli_.process(*network_, packet);
+	}
+
+	// Return flow control credits for the handled packets
+	network_->completePackets(packets_);
+
+	// A full batch might have more behind it, handled after what other connections have queued
+	if (packets_.size() >= NetworkConstants::PACKET_BATCH_SIZE)
+		schedule();
+
+	packets_.clear();
+}
+
+void PacketPump::close() {
+	cli_.networkClosed(*network_);
+
+	Log(NETWORK) << "Packet handling stopped\n";
+
+	{
+		lock_guard<mutex> lock(mutex_);
+		done_ = true;
+	}
+
+	closed_.notify_all();
+
+	// Might be the last reference to the network, the running task keeps the pump itself alive
+	network_ = nullptr;
+	self_ = nullptr;
+}
@@ -0,0 +1,50 @@
+#pragma once
+#ifndef PACKET_PUMP_H
+#define PACKET_PUMP_H
+
+#include "Packet.h"
+
+#include <memory>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+class NetworkCommunication;
+class Strand;
+class CLI;
+
+// Hands the packets of one connection to the CLI in order, through a strand on its executor. An idle
+// connection costs no thread, and none is started or joined when connections come and go
+class PacketPump : public std::enable_shared_from_this<PacketPump> {
+public:
+	// Keeps the network alive until it is closed and the CLI is told. A hosted network accepts in the background
+	static std::shared_ptr<PacketPump> start(CLI& cli, const std::shared_ptr<NetworkCommunication>& network, bool accept = false);
+
+	// Until the connection is closed, not to be called while handling a packet of the same connection
+	void wait();
+
+private:
+	PacketPump(CLI& cli, const std::shared_ptr<NetworkCommunication>& network);
+
+	void schedule();
+	void pump();
+	void close();
+
+	CLI& cli_;
+	std::shared_ptr<NetworkCommunication> network_;
+	std::shared_ptr<Strand> strand_;
+	std::vector<Packet> packets_;
+
+	// Set while a pump is queued, so a burst of packets is handled by one task
+	std::atomic<bool> scheduled_{false};
+
+	std::mutex mutex_;
+	std::condition_variable closed_;
+	bool done_ = false;
+
+	// Dropped once closed, until then packets can come without anyone else holding the pump
+	std::shared_ptr<PacketPump> self_;
+};
+
+#endif
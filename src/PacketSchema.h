@@ -0,0 +1,286 @@
+#pragma once
+#ifndef PACKET_SCHEMA_H
+#define PACKET_SCHEMA_H
+
+#include "Packet.h"
+#include "PacketView.h"
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+
+// Big endian, compilers turn these into a byte swap and a single load or store
+inline void writeInt32(unsigned char* data, uint32_t value) {
+	data[0] = (value >> 24) & 0xFF;
+	data[1] = (value >> 16) & 0xFF;
+	data[2] = (value >> 8) & 0xFF;
+	data[3] = value & 0xFF;
+}
+
+inline uint32_t readInt32(const unsigned char* data) {
+	return (uint32_t(data[0]) << 24) | (uint32_t(data[1]) << 16) | (uint32_t(data[2]) << 8) | uint32_t(data[3]);
+}
+
+// Position while decoding. reserved_ is the fixed size of the fields not read yet, which is checked
+// once up front, so only variable length fields need to check their length
+struct SchemaReader {
+	const unsigned char* position_;
+	const unsigned char* end_;
+	size_t reserved_;
+	bool valid_;
+
+	// After the fixed part of the current field is consumed
+	bool take(size_t size) {
+		if (!valid_ || size > size_t(end_ - position_) - reserved_) {
+			valid_ = false;
+
+			return false;
+		}
+
+		return true;
+	}
+};
+
+// Field types of the wire format, each knows its encoded size, the part of it which is fixed, and
+// how to write and read it
+namespace Field {
+	struct Bool {
+		using type = bool;
+		static constexpr size_t fixed = 1;
+
+		static size_t size(bool) { return fixed; }
+
+		static void write(unsigned char*& out, bool value) {
+			*out++ = value ? 1 : 0;
+		}
+
+		static void read(SchemaReader& reader, bool& value) {
+			reader.reserved_ -= fixed;
+			value = *reader.position_++ == 1;
+		}
+	};
+
+	struct Int {
+		using type = int;
+		static constexpr size_t fixed = 4;
+
+		static size_t size(int) { return fixed; }
+
+		static void write(unsigned char*& out, int value) {
+			writeInt32(out, value);
+			out += fixed;
+		}
+
+		static void read(SchemaReader& reader, int& value) {
+			reader.reserved_ -= fixed;
+			value = readInt32(reader.position_);
+			reader.position_ += fixed;
+		}
+	};
+
+	// Length as an int followed by the characters
+	struct String {
+		using type = std::string;
+		static constexpr size_t fixed = 4;
+
+		static size_t size(const std::string& value) { return fixed + value.size(); }
+
+		static void write(unsigned char*& out, const std::string& value) {
+			writeInt32(out, value.size());
+			memcpy(out + fixed, value.data(), value.size());
+			out += fixed + value.size();
+		}
+
+		// Points into the packet
+		static void read(SchemaReader& reader, std::string_view& value) {
+			reader.reserved_ -= fixed;
+			auto length = readInt32(reader.position_);
+			reader.position_ += fixed;
+
+			if (!reader.take(length))
+				return;
+
+			value = std::string_view(reinterpret_cast<const char*>(reader.position_), length);
+			reader.position_ += length;
+		}
+
+		static void read(SchemaReader& reader, std::string& value) {
+			std::string_view view;
+			read(reader, view);
+
+			value.assign(view.data(), view.size());
+		}
+	};
+
+	// Same as String on the wire, the data is not copied when reading
+	struct Bytes {
+		using type = std::pair<size_t, const unsigned char*>;
+		static constexpr size_t fixed = 4;
+
+		static size_t size(const type& value) { return fixed + value.first; }
+
+		static void write(unsigned char*& out, const type& value) {
+			writeInt32(out, value.first);
+
+			if (value.first > 0)
+				memcpy(out + fixed, value.second, value.first);
+
+			out += fixed + value.first;
+		}
+
+		static void read(SchemaReader& reader, type& value) {
+			reader.reserved_ -= fixed;
+			auto length = readInt32(reader.position_);
+			reader.position_ += fixed;
+
+			if (!reader.take(length))
+				return;
+
+			value = { length, reader.position_ };
+			reader.position_ += length;
+		}
+	};
+
+	// Text as printed by to_string, with a one byte length
+	struct Float {
+		using type = float;
+		static constexpr size_t fixed = 1;
+
+		static size_t format(char (&text)[64], float value) {
+			auto length = snprintf(text, sizeof(text), "%f", value);
+
+			return length < 0 ? 0 : std::min<size_t>(length, 255);
+		}
+
+		static size_t size(float value) {
+			char text[64];
+
+			return fixed + format(text, value);
+		}
+
+		static void write(unsigned char*& out, float value) {
+			char text[64];
+			auto length = format(text, value);
+
+			*out++ = length;
+			memcpy(out, text, length);
+			out += length;
+		}
+
+		static void read(SchemaReader& reader, float& value) {
+			reader.reserved_ -= fixed;
+			size_t length = *reader.position_++;
+
+			if (!reader.take(length))
+				return;
+
+			char text[256];
+			memcpy(text, reader.position_, length);
+			text[length] = '\0';
+
+			value = strtof(text, nullptr);
+			reader.position_ += length;
+		}
+	};
+
+	// Repeated strings filling the rest of the message, the count is sent as a separate field
+	struct Strings {
+		using type = std::vector<std::string>;
+		static constexpr size_t fixed = 0;
+
+		static size_t size(const type& values) {
+			size_t total = 0;
+
+			for (auto& value : values)
+				total += String::size(value);
+
+			return total;
+		}
+
+		static void write(unsigned char*& out, const type& values) {
+			for (auto& value : values)
+				String::write(out, value);
+		}
+
+		static void read(SchemaReader& reader, type& values) {
+			values.clear();
+
+			while (reader.valid_ && reader.position_ < reader.end_) {
+				values.emplace_back();
+
+				if (!reader.take(String::fixed))
+					return;
+
+				reader.reserved_ += String::fixed;
+				String::read(reader, values.back());
+			}
+		}
+	};
+}
+
+// Layout of one message, declared once and used for both directions. Encoding computes the exact
+// size first so the buffer is allocated once, decoding starts after the header byte
+template<unsigned char Header, class... Fields>
+class Message {
+public:
+	static Packet encode(const typename Fields::type&... values) {
+		size_t size = (1 + ... + Fields::size(values));
+
+		Packet packet(size);
+		auto* out = packet.extend(size);
+
+		*out++ = Header;
+		(Fields::write(out, values), ...);
+
+		packet.finalize();
+
+		return packet;
+	}
+
+	// False if the message is too short or a length is out of range, the view is failed and not advanced then.
+	// Strings can be decoded as std::string_view to avoid copying
+	template<class... Values>
+	static bool decode(PacketView& view, Values&... values) {
+		static_assert(sizeof...(Values) == sizeof...(Fields), "One value per field");
+
+		SchemaReader reader = { view.getReadPointer(), view.getReadPointer() + view.getRemaining(), fixedSize(), !view.failed() };
+
+		if (view.getRemaining() < reader.reserved_)
+			reader.valid_ = false;
+
+		if (reader.valid_)
+			(Fields::read(reader, values), ...);
+
+		if (!reader.valid_) {
+			view.fail();
+
+			return false;
+		}
+
+		view.addRead(reader.position_ - view.getReadPointer());
+
+		return true;
+	}
+
+	template<class... Values>
+	static bool decode(Packet& packet, Values&... values) {
+		PacketView view(packet);
+
+		if (!decode(view, values...))
+			return false;
+
+		packet.addRead(view.getReadPointer() - packet.getReadPointer());
+
+		return true;
+	}
+
+	static constexpr size_t fixedSize() {
+		return (size_t(0) + ... + Fields::fixed);
+	}
+};
+
+#endif
@@ -0,0 +1,63 @@
+#include "PacketView.h"
+#include "PacketSchema.h"
+
+using namespace std;
+
+// Single field, same checks as decoding a whole message
+template<class T, class V>
+static V readField(PacketView& view) {
+	V value{};
+	Message<0, T>::decode(view, value);
+
+	return value;
+}
+
+PacketView::PacketView(const unsigned char* data, size_t size) : position_(data), end_(data + size) {}
+
+PacketView::PacketView(const Packet& packet) : PacketView(packet.getReadPointer(), packet.getRemaining()) {}
+
+unsigned char PacketView::getByte() {
+	if (failed_ || position_ == end_) {
+		failed_ = true;
+
+		return 0;
+	}
+
+	return *position_++;
+}
+
+int PacketView::getInt() {
+	return readField<Field::Int, int>(*this);
+}
+
+bool PacketView::getBool() {
+	return readField<Field::Bool, bool>(*this);
+}
+
+string_view PacketView::getString() {
+	return readField<Field::String, string_view>(*this);
+}
+
+pair<size_t, const unsigned char*> PacketView::getBytes() {
+	return readField<Field::Bytes, pair<size_t, const unsigned char*>>(*this);
+}
+
+bool PacketView::failed() const {
+	return failed_;
+}
+
+void PacketView::fail() {
+	failed_ = true;
+}
+
+const unsigned char* PacketView::getReadPointer() const {
+	return position_;
+}
+
+size_t PacketView::getRemaining() const {
+	return end_ - position_;
+}
+
+void PacketView::addRead(size_t read) {
+	position_ += read;
+}
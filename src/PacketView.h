@@ -0,0 +1,41 @@
+#pragma once
+#ifndef PACKET_VIEW_H
+#define PACKET_VIEW_H
+
+#include <string_view>
+#include <utility>
+#include <cstddef>
+
+class Packet;
+
+// Read-only cursor over received data which never copies or allocates. Reading past the end
+// sets a sticky error and returns empty values, check failed() once after reading
+class PacketView {
+public:
+	PacketView() = default;
+	PacketView(const unsigned char* data, size_t size);
+
+	// The unread part of the packet, the packet has to outlive the view
+	explicit PacketView(const Packet& packet);
+
+	unsigned char getByte();
+	int getInt();
+	bool getBool();
+	std::string_view getString();
+	std::pair<size_t, const unsigned char*> getBytes();
+
+	bool failed() const;
+	void fail();
+
+	const unsigned char* getReadPointer() const;
+	size_t getRemaining() const;
+	void addRead(size_t read);
+
+private:
+	const unsigned char* position_	= nullptr;
+	const unsigned char* end_		= nullptr;
+
+	bool failed_					= false;
+};
+
+#endif
@@ -1,26 +1,36 @@
 #include "PartialPacket.h"
 #include "Log.h"
+#include "BufferPool.h"
+
+#include <cstring>
+#include <algorithm>
 
 using namespace std;
 
-PartialPacket::PartialPacket() : m_size(0) {
-    m_packet = make_shared<vector<unsigned char>>();
-}
+PartialPacket::PartialPacket() : m_header_size(0), m_received(0), m_size(0) {}
 
 unsigned int PartialPacket::getSize() const {
-    return m_header.size() + m_packet->size();
+    return m_header_size + m_received;
 }
 
 void PartialPacket::setFullSize() {
-    if(m_header.size() < 4) {
+    if(m_header_size < 4) {
         Log(ERROR) << "Trying to set full size at partial packet when size < 4\n";
         
         return;
     }
     
-    m_size = (m_header.front() << 24) | (m_header.at(1) << 16) | (m_header.at(2) << 8) | m_header.at(3);
+    m_size = (m_header[0] << 24) | (m_header[1] << 16) | (m_header[2] << 8) | m_header[3];
+    
+    if (m_size < 4) {
+        Log(ERROR) << "Received packet with invalid size " << m_size << endl;
+        
+        m_size = 4;
+    }
     
-    m_packet->reserve(m_size);
+    // Storage for the whole payload, which is written in place by addData() or recv()
+    m_packet = BufferPool::acquire(m_size - 4);
+    m_packet->resize(m_size - 4);
 }
 
 unsigned int PartialPacket::getFullSize() const {
@@ -34,15 +44,35 @@ void PartialPacket::addData(const unsigned char *buffer, const unsigned int size
         return;
     }
     
-    // Insert into m_header if the size is not obtained
-    if (m_size == 0)
-        m_header.insert(m_header.end(), buffer, buffer + size);
-    else
-        m_packet->insert(m_packet->end(), buffer, buffer + size);
+    auto* current = buffer;
+    auto left = size;
     
-    if(m_size == 0 && m_header.size() >= 4) {
+    // Fill the header first if the size is not obtained
+    if (m_size == 0) {
+        auto adding = min(left, 4 - m_header_size);
+        
+        memcpy(m_header.data() + m_header_size, current, adding);
+        m_header_size += adding;
+        current += adding;
+        left -= adding;
+        
+        if (m_header_size < 4)
+            return;
+            
         setFullSize();
     }
+    
+    if (left == 0)
+        return;
+        
+    if (left > getRemaining()) {
+        Log(ERROR) << "Trying to insert more data than the packet can hold, size = " << left << ", remaining = " << getRemaining() << endl;
+        
+        left = getRemaining();
+    }
+    
+    memcpy(getWritePointer(), current, left);
+    m_received += left;
 }
 
 bool PartialPacket::hasHeader() const {
@@ -50,9 +80,27 @@ bool PartialPacket::hasHeader() const {
 }
 
 bool PartialPacket::isFinished() const {
-    return m_size != 0 ? (m_header.size() + m_packet->size()) == m_size : false;
+    return m_size != 0 ? getSize() == m_size : false;
 }
 
-shared_ptr<vector<unsigned char>>& PartialPacket::getData() {
+shared_ptr<PacketBuffer>& PartialPacket::getData() {
     return m_packet;
-}
\ No newline at end of file
+}
+
+unsigned char* PartialPacket::getWritePointer() {
+    return m_packet->data() + m_received;
+}
+
+unsigned int PartialPacket::getRemaining() const {
+    return m_size != 0 ? m_size - getSize() : 4 - m_header_size;
+}
+
+void PartialPacket::addReceived(const unsigned int size) {
+    if (size > getRemaining()) {
+        Log(ERROR) << "Received more data than the packet can hold, size = " << size << ", remaining = " << getRemaining() << endl;
+        
+        return;
+    }
+    
+    m_received += size;
+}
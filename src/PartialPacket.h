@@ -2,8 +2,9 @@
 #ifndef PARTIAL_PACKET_H
 #define PARTIAL_PACKET_H
 
-#include <vector>
-#include <memory>
+#include "PacketBuffer.h"
+
+#include <array>
 
 class PartialPacket {
 public:
@@ -14,15 +15,22 @@ public:
     void addData(const unsigned char *buffer, const unsigned int size);
     bool hasHeader() const;
     bool isFinished() const;
-    std::shared_ptr<std::vector<unsigned char>>& getData();
+    std::shared_ptr<PacketBuffer>& getData();
+    
+    // Receive directly into the packet storage once the header is known
+    unsigned char* getWritePointer();
+    unsigned int getRemaining() const;
+    void addReceived(const unsigned int size);
     
 private:
     void setFullSize();
     
-    std::shared_ptr<std::vector<unsigned char>> m_packet;
-    std::vector<unsigned char> m_header;
+    std::shared_ptr<PacketBuffer> m_packet;
+    std::array<unsigned char, 4> m_header;
     
+    unsigned int m_header_size;
+    unsigned int m_received;
     unsigned int m_size;
 };
 
-#endif
\ No newline at end of file
+#endif
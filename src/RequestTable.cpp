@@ -0,0 +1,176 @@
+#include "RequestTable.h"
+
+#include <climits>
+#include <algorithm>
+
+using namespace std;
+
+PendingRequest::PendingRequest(RequestTable* table, int id, NetworkCommunication* network, future<Packet>&& answer) : table_(table), id_(id), network_(network), answer_(move(answer)) {}
+
+PendingRequest::PendingRequest(PendingRequest&& other) noexcept : table_(other.table_), id_(other.id_), network_(other.network_), answer_(move(other.answer_)) {
+	other.table_ = nullptr;
+}
+
+PendingRequest& PendingRequest::operator=(PendingRequest&& other) noexcept {
+	if (this != &other) {
+		cancel();
+
+		table_ = other.table_;
+		id_ = other.id_;
+		network_ = other.network_;
+		answer_ = move(other.answer_);
+		other.table_ = nullptr;
+	}
+
+	return *this;
+}
+
+PendingRequest::~PendingRequest() {
+	cancel();
+}
+
+int PendingRequest::getId() const {
+	return id_;
+}
+
+bool PendingRequest::wait(Packet& answer, chrono::milliseconds timeout) {
+	if (!answer_.valid())
+		return false;
+
+	if (timeout.count() > 0 && answer_.wait_for(timeout) != future_status::ready) {
+		cancel();
+
+		return false;
+	}
+
+	answer = answer_.get();
+
+	// Completed, nothing left to cancel
+	table_ = nullptr;
+
+	return true;
+}
+
+void PendingRequest::cancel() {
+	if (table_ != nullptr)
+		table_->cancel(id_, network_);
+
+	table_ = nullptr;
+}
+
+int RequestTable::nextId() {
+	// IDs are sent as positive ints, 0 means no ID. Skip IDs still waiting on any network
+	while (true) {
+		if (next_id_ <= 0 || next_id_ >= INT_MAX)
+			next_id_ = 1;
+
+		auto iterator = pending_.lower_bound({ next_id_, nullptr });
+
+		if (iterator == pending_.end() || iterator->first.first != next_id_)
+			break;
+
+		next_id_++;
+	}
+
+	return next_id_++;
+}
+
+PendingRequest RequestTable::add(unsigned char answer_header, NetworkCommunication* network, int id) {
+	lock_guard<mutex> lock(mutex_);
+
+	if (id <= 0)
+		id = nextId();
+
+	auto& entry = pending_[{ id, network }];
+	entry.header_ = answer_header;
+	entry.network_ = network;
+
+	return PendingRequest(this, id, network, entry.promise_.get_future());
+}
+
+PendingRequest RequestTable::addOrdered(unsigned char answer_header, NetworkCommunication* network) {
+	lock_guard<mutex> lock(mutex_);
+	auto id = nextId();
+
+	auto& entry = pending_[{ id, network }];
+	entry.header_ = answer_header;
+	entry.network_ = network;
+
+	ordered_[{ network, answer_header }].push_back(id);
+
+	return PendingRequest(this, id, network, entry.promise_.get_future());
+}
+
+int RequestTable::reserve() {
+	lock_guard<mutex> lock(mutex_);
+
+	return nextId();
+}
+
+bool RequestTable::complete(unsigned char header, int id, NetworkCommunication* network, const Packet& answer) {
+	lock_guard<mutex> lock(mutex_);
+	auto iterator = pending_.end();
+
+	if (id > 0) {
+		iterator = pending_.find({ id, network });
+
+		// An ordered request answered by its ID is not in line for answers without one anymore
+		auto ordered = ordered_.find({ network, header });
+
+		if (ordered != ordered_.end()) {
+			auto& ids = ordered->second;
+			ids.erase(remove(ids.begin(), ids.end(), id), ids.end());
+
+			if (ids.empty())
+				ordered_.erase(ordered);
+		}
+	} else {
+		// Correlated requests never take an answer without an ID, they might have been sent in any order
+		auto ordered = ordered_.find({ network, header });
+
+		if (ordered == ordered_.end())
+			return false;
+
+		iterator = pending_.find({ ordered->second.front(), network });
+		ordered->second.pop_front();
+
+		if (ordered->second.empty())
+			ordered_.erase(ordered);
+	}
+
+	if (iterator == pending_.end() || iterator->second.header_ != header)
+		return false;
+
+	iterator->second.promise_.set_value(answer);
+	pending_.erase(iterator);
+
+	return true;
+}
+
+size_t RequestTable::completeAll(NetworkCommunication* network, const Packet& answer) {
+	lock_guard<mutex> lock(mutex_);
+	size_t completed = 0;
+
+	for (auto iterator = pending_.begin(); iterator != pending_.end();) {
+		if (iterator->second.network_ != network) {
+			++iterator;
+
+			continue;
+		}
+
+		iterator->second.promise_.set_value(answer);
+		iterator = pending_.erase(iterator);
+		completed++;
+	}
+
+	for (auto iterator = ordered_.begin(); iterator != ordered_.end();)
+		iterator = iterator->first.first == network ? ordered_.erase(iterator) : next(iterator);
+
+	return completed;
+}
+
+void RequestTable::cancel(int id, NetworkCommunication* network) {
+	lock_guard<mutex> lock(mutex_);
+
+	pending_.erase({ id, network });
+}
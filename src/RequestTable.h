@@ -0,0 +1,82 @@
+#pragma once
+#ifndef REQUEST_TABLE_H
+#define REQUEST_TABLE_H
+
+#include "Packet.h"
+
+#include <map>
+#include <deque>
+#include <mutex>
+#include <future>
+#include <chrono>
+#include <utility>
+
+class NetworkCommunication;
+class RequestTable;
+
+// Handle to an outstanding request, cancels it when dropped without an answer
+class PendingRequest {
+public:
+	PendingRequest() = default;
+	PendingRequest(RequestTable* table, int id, NetworkCommunication* network, std::future<Packet>&& answer);
+	PendingRequest(PendingRequest&& other) noexcept;
+	PendingRequest& operator=(PendingRequest&& other) noexcept;
+	~PendingRequest();
+
+	int getId() const;
+
+	// Zero timeout waits forever. Returns false on timeout, the request is cancelled then
+	bool wait(Packet& answer, std::chrono::milliseconds timeout);
+
+private:
+	void cancel();
+
+	RequestTable* table_ = nullptr;
+	int id_ = 0;
+	NetworkCommunication* network_ = nullptr;
+	std::future<Packet> answer_;
+};
+
+// Requests waiting for an answer, by correlation ID and network. Requests whose answers carry no ID are
+// answered in the order they were added on the network
+class RequestTable {
+public:
+	// A new ID is picked unless one is given, a packet sent on several networks is one ID on each
+	PendingRequest add(unsigned char answer_header, NetworkCommunication* network, int id = 0);
+	
+	// For a request whose answer might have no ID, its ID is still matched if the answer repeats it. Requests with the
+	// same header have to be sent in the order they were added
+	PendingRequest addOrdered(unsigned char answer_header, NetworkCommunication* network);
+	
+	// ID for add() which is not waiting on any network
+	int reserve();
+
+	// The answer is read past its header. Without an ID it goes to the oldest ordered request for the header,
+	// one which was cancelled still takes its answer. False if no request was waiting for it
+	bool complete(unsigned char header, int id, NetworkCommunication* network, const Packet& answer);
+
+	// Every request sent on the network gets the answer, used when the connection is gone. Returns how many
+	size_t completeAll(NetworkCommunication* network, const Packet& answer);
+
+	// A late answer is dropped
+	void cancel(int id, NetworkCommunication* network);
+
+private:
+	struct Entry {
+		unsigned char header_;
+		NetworkCommunication* network_;
+		std::promise<Packet> promise_;
+	};
+
+	std::mutex mutex_;
+	int nextId();
+	
+	std::map<std::pair<int, NetworkCommunication*>, Entry> pending_;
+	
+	// IDs of requests answered without an ID, oldest first per network and header
+	std::map<std::pair<NetworkCommunication*, unsigned char>, std::deque<int>> ordered_;
+
+	int next_id_ = 1;
+};
+
+#endif
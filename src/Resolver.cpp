@@ -0,0 +1,148 @@
+#include "Resolver.h"
+#include "Log.h"
+
+#include <cstring>
+#include <chrono>
+#include <mutex>
+#include <map>
+#include <deque>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+
+using namespace std;
+
+struct CachedLookup {
+	vector<ResolvedAddress> addresses_;
+	chrono::steady_clock::time_point time_;
+};
+
+static mutex g_cache_mutex_;
+static map<pair<string, int>, CachedLookup> g_cache_;
+
+static void setPort(ResolvedAddress& address, unsigned short port) {
+	if (address.family_ == AF_INET6)
+		reinterpret_cast<sockaddr_in6*>(&address.address_)->sin6_port = htons(port);
+	else
+		reinterpret_cast<sockaddr_in*>(&address.address_)->sin_port = htons(port);
+}
+
+static vector<ResolvedAddress> lookup(const string& hostname, int type) {
+	vector<ResolvedAddress> addresses;
+
+	addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = type;
+
+	addrinfo* result = nullptr;
+	auto error = getaddrinfo(hostname.c_str(), nullptr, &hints, &result);
+
+	if (error != 0) {
+		Log(DEBUG) << "getaddrinfo() for " << hostname << " failed: " << gai_strerror(error) << endl;
+
+		return addresses;
+	}
+
+	for (auto* current = result; current != nullptr; current = current->ai_next) {
+		if (current->ai_family != AF_INET && current->ai_family != AF_INET6)
+			continue;
+
+		ResolvedAddress address;
+		memset(&address.address_, 0, sizeof(address.address_));
+		memcpy(&address.address_, current->ai_addr, current->ai_addrlen);
+		address.length_ = current->ai_addrlen;
+		address.family_ = current->ai_family;
+
+		char text[INET6_ADDRSTRLEN] = {0};
+
+#ifdef WIN32
+		DWORD text_size = sizeof(text);
+		WSAAddressToStringA(current->ai_addr, current->ai_addrlen, nullptr, text, &text_size);
+#else
+		if (current->ai_family == AF_INET6)
+			inet_ntop(AF_INET6, &reinterpret_cast<sockaddr_in6*>(current->ai_addr)->sin6_addr, text, sizeof(text));
+		else
+			inet_ntop(AF_INET, &reinterpret_cast<sockaddr_in*>(current->ai_addr)->sin_addr, text, sizeof(text));
+#endif
+
+		address.text_ = text;
+		addresses.push_back(address);
+	}
+
+	freeaddrinfo(result);
+
+	return addresses;
+}
+
+vector<ResolvedAddress> Resolver::resolve(const string& hostname, unsigned short port, int type) {
+	auto key = make_pair(hostname, type);
+	auto now = chrono::steady_clock::now();
+	vector<ResolvedAddress> addresses;
+	bool cached = false;
+
+	{
+		lock_guard<mutex> lock(g_cache_mutex_);
+		auto iterator = g_cache_.find(key);
+
+		if (iterator != g_cache_.end() && now - iterator->second.time_ < chrono::seconds(RESOLVER_CACHE_TIME)) {
+			addresses = iterator->second.addresses_;
+			cached = true;
+		}
+	}
+
+	if (!cached) {
+		// Not holding the lock, lookups might take a while
+		addresses = lookup(hostname, type);
+
+		// Failures are not cached so a network coming up is noticed
+		if (!addresses.empty()) {
+			lock_guard<mutex> lock(g_cache_mutex_);
+			g_cache_[key] = { addresses, now };
+		}
+	}
+
+	for (auto& address : addresses)
+		setPort(address, port);
+
+	return addresses;
+}
+
+vector<ResolvedAddress> Resolver::resolve(const vector<string>& hostnames, unsigned short port, int type) {
+	deque<ResolvedAddress> ipv4;
+	deque<ResolvedAddress> ipv6;
+	int first_family = 0;
+
+	for (auto& hostname : hostnames) {
+		for (auto& address : resolve(hostname, port, type)) {
+			if (first_family == 0)
+				first_family = address.family_;
+
+			(address.family_ == AF_INET6 ? ipv6 : ipv4).push_back(address);
+		}
+	}
+
+	// Start with whatever family came first
+	auto& first = first_family == AF_INET6 ? ipv6 : ipv4;
+	auto& second = first_family == AF_INET6 ? ipv4 : ipv6;
+	vector<ResolvedAddress> addresses;
+
+	while (!first.empty() || !second.empty()) {
+		if (!first.empty()) {
+			addresses.push_back(first.front());
+			first.pop_front();
+		}
+
+		if (!second.empty()) {
+			addresses.push_back(second.front());
+			second.pop_front();
+		}
+	}
+
+	return addresses;
+}
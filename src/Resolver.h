@@ -0,0 +1,39 @@
+#pragma once
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include <string>
+#include <vector>
+
+#ifdef WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#endif
+
+enum ResolverConstants {
+	// Seconds a lookup is reused
+	RESOLVER_CACHE_TIME = 60
+};
+
+struct ResolvedAddress {
+	sockaddr_storage address_;
+	socklen_t length_;
+	int family_;
+
+	// Numeric form, for logging
+	std::string text_;
+};
+
+// Cached getaddrinfo(), both IPv4 and IPv6
+class Resolver {
+public:
+	// Socket type is SOCK_STREAM or SOCK_DGRAM
+	static std::vector<ResolvedAddress> resolve(const std::string& hostname, unsigned short port, int type);
+
+	// Resolves every hostname and alternates between the address families while keeping the order (RFC 8305)
+	static std::vector<ResolvedAddress> resolve(const std::vector<std::string>& hostnames, unsigned short port, int type);
+};
+
+#endif
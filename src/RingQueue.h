@@ -0,0 +1,206 @@
+#pragma once
+#ifndef RING_QUEUE_H
+#define RING_QUEUE_H
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <vector>
+#include <type_traits>
+#include <cstdint>
+
+enum RingQueueConstants {
+	CACHE_LINE_SIZE = 64
+};
+
+// Bounded lock-free queue (Vyukov), safe for any number of producers and consumers
+template<class T>
+class RingQueue {
+public:
+	explicit RingQueue(size_t capacity) {
+		size_t size = 2;
+
+		// Capacity needs to be a power of two for the index mask
+		while (size < capacity)
+			size *= 2;
+
+		cells_.reset(new Cell[size]);
+		mask_ = size - 1;
+
+		for (size_t i = 0; i < size; i++)
+			cells_[i].sequence_.store(i, std::memory_order_relaxed);
+
+		enqueue_.store(0, std::memory_order_relaxed);
+		dequeue_.store(0, std::memory_order_relaxed);
+	}
+
+	~RingQueue() {
+		while (pop([] (T&&) {}))
+			;
+	}
+
+	RingQueue(const RingQueue&) = delete;
+	RingQueue& operator=(const RingQueue&) = delete;
+
+	bool tryPush(T&& value) {
+		auto position = enqueue_.load(std::memory_order_relaxed);
+		Cell* cell;
+
+		while (true) {
+			cell = &cells_[position & mask_];
+			auto sequence = cell->sequence_.load(std::memory_order_acquire);
+			auto difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+
+			if (difference == 0) {
+				if (enqueue_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+					break;
+			} else if (difference < 0) {
+				// Full
+				return false;
+			} else {
+				position = enqueue_.load(std::memory_order_relaxed);
+			}
+		}
+
+		new (&cell->storage_) T(std::move(value));
+		cell->sequence_.store(position + 1, std::memory_order_release);
+
+		return true;
+	}
+
+	bool tryPop(T& value) {
+		return pop([&value] (T&& item) { value = std::move(item); });
+	}
+
+	// Pops up to max elements, returns the amount popped
+	size_t popBatch(std::vector<T>& values, size_t max) {
+		size_t popped = 0;
+
+		while (popped < max && pop([&values] (T&& item) { values.push_back(std::move(item)); }))
+			popped++;
+
+		return popped;
+	}
+
+	// Approximate while other threads are pushing or popping
+	size_t size() const {
+		auto enqueued = enqueue_.load(std::memory_order_acquire);
+		auto dequeued = dequeue_.load(std::memory_order_acquire);
+
+		return enqueued > dequeued ? enqueued - dequeued : 0;
+	}
+
+	bool empty() const {
+		return size() == 0;
+	}
+
+	size_t capacity() const {
+		return mask_ + 1;
+	}
+
+private:
+	template<class Sink>
+	bool pop(Sink sink) {
+		auto position = dequeue_.load(std::memory_order_relaxed);
+		Cell* cell;
+
+		while (true) {
+			cell = &cells_[position & mask_];
+			auto sequence = cell->sequence_.load(std::memory_order_acquire);
+			auto difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position + 1);
+
+			if (difference == 0) {
+				if (dequeue_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+					break;
+			} else if (difference < 0) {
+				// Empty
+				return false;
+			} else {
+				position = dequeue_.load(std::memory_order_relaxed);
+			}
+		}
+
+		auto* item = reinterpret_cast<T*>(&cell->storage_);
+		sink(std::move(*item));
+		item->~T();
+
+		cell->sequence_.store(position + mask_ + 1, std::memory_order_release);
+
+		return true;
+	}
+
+	struct Cell {
+		std::atomic<size_t> sequence_;
+		typename std::aligned_storage<sizeof(T), alignof(T)>::type storage_;
+	};
+
+	std::unique_ptr<Cell[]> cells_;
+	size_t mask_;
+
+	// Keep producer and consumer positions on separate cache lines
+	char padding_front_[CACHE_LINE_SIZE];
+	std::atomic<size_t> enqueue_;
+	char padding_middle_[CACHE_LINE_SIZE];
+	std::atomic<size_t> dequeue_;
+	char padding_back_[CACHE_LINE_SIZE];
+};
+
+// Sleeping side of a queue, notify() only takes the lock when someone is actually waiting
+class QueueWaiter {
+public:
+	template<class Predicate>
+	void wait(Predicate ready) {
+		if (ready())
+			return;
+
+		std::unique_lock<std::mutex> lock(mutex_);
+		sleeping_.fetch_add(1);
+
+		// Pairs with the fence in notify(), either we see the new state or the notifier sees us sleeping
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+
+		cv_.wait(lock, ready);
+		sleeping_.fetch_sub(1);
+	}
+
+	// False if the predicate still does not hold after timeout
+	template<class Predicate, class Duration>
+	bool waitFor(Predicate ready, Duration timeout) {
+		if (ready())
+			return true;
+
+		std::unique_lock<std::mutex> lock(mutex_);
+		sleeping_.fetch_add(1);
+
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+
+		auto result = cv_.wait_for(lock, timeout, ready);
+		sleeping_.fetch_sub(1);
+
+		return result;
+	}
+
+	void notify() {
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+
+		if (sleeping_.load(std::memory_order_relaxed) == 0)
+			return;
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		cv_.notify_all();
+	}
+
+	// Always wake, used when the predicate changed without a queue operation (e.g shutdown)
+	void wake() {
+		std::lock_guard<std::mutex> lock(mutex_);
+		cv_.notify_all();
+	}
+
+private:
+	std::mutex mutex_;
+	std::condition_variable cv_;
+	std::atomic<int> sleeping_{0};
+};
+
+#endif
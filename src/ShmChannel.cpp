@@ -0,0 +1,525 @@
+#include "ShmChannel.h"
+#include "Log.h"
+
+#include <cstring>
+#include <algorithm>
+#include <fstream>
+
+#ifdef __linux__
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+using namespace std;
+
+enum ShmConstants {
+	CONTROL_SIZE = 4096,
+	MINIMUM_RING_SIZE = 65536,
+
+	// Checks before going to sleep, a busy peer usually frees space or adds data within this
+	SPIN_COUNT = 256,
+
+	// Milliseconds
+	HANDSHAKE_TIMEOUT = 1000
+};
+
+static const unsigned char g_magic_[] = { 'T', 'C', 'S', '1' };
+static const string g_address_prefix_ = "shm:";
+
+ShmOptions ShmChannel::options_;
+
+// Lives in the shared memory, the producer only writes head_ and the consumer only writes tail_
+struct ShmChannel::Ring {
+	alignas(64) atomic<uint64_t> head_;
+	alignas(64) atomic<uint64_t> tail_;
+	alignas(64) atomic<uint32_t> reader_waiting_;
+	atomic<uint32_t> writer_waiting_;
+
+	// Set by either side when closing, the reader still drains what is left
+	atomic<uint32_t> closed_;
+};
+
+static_assert(sizeof(atomic<uint64_t>) == sizeof(uint64_t), "Ring atomics must be plain memory to be shared");
+
+void ShmChannel::setOptions(const ShmOptions& options) {
+	options_ = options;
+
+	size_t ring_size = MINIMUM_RING_SIZE;
+
+	while (ring_size < options.ring_size_)
+		ring_size <<= 1;
+
+	options_.ring_size_ = ring_size;
+}
+
+bool ShmChannel::isAddress(const string& address) {
+	return address.compare(0, g_address_prefix_.size(), g_address_prefix_) == 0;
+}
+
+#ifdef __linux__
+// Same kernel means memfds and eventfds can be passed, which is what matters for containers as well
+static string getBootId() {
+	static string boot_id = [] {
+		ifstream file("/proc/sys/kernel/random/boot_id");
+		string id;
+
+		if (!getline(file, id))
+			return string();
+
+		return id;
+	}();
+
+	return boot_id;
+}
+
+static bool fillAddress(sockaddr_un& address, const string& path) {
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+
+	if (path.size() >= sizeof(address.sun_path)) {
+		Log(WARNING) << "Shared memory socket path " << path << " is too long\n";
+
+		return false;
+	}
+
+	strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+
+	return true;
+}
+
+// Address is shm:<boot id>:<socket path>
+static bool parseAddress(const string& address, string& boot_id, string& path) {
+	if (!ShmChannel::isAddress(address))
+		return false;
+
+	auto separator = address.find(':', g_address_prefix_.size());
+
+	if (separator == string::npos)
+		return false;
+
+	boot_id = address.substr(g_address_prefix_.size(), separator - g_address_prefix_.size());
+	path = address.substr(separator + 1);
+
+	return !boot_id.empty() && !path.empty();
+}
+
+static bool waitReadable(int socket, int timeout) {
+	pollfd poll_fd = { socket, POLLIN, 0 };
+
+	return poll(&poll_fd, 1, timeout) == 1 && (poll_fd.revents & POLLIN);
+}
+
+static void closeFds(const int* fds, size_t amount) {
+	for (size_t i = 0; i < amount; i++)
+		if (fds[i] >= 0)
+			::close(fds[i]);
+}
+#endif
+
+bool ShmChannel::isLocal(const string& address) {
+#ifdef __linux__
+	string boot_id, path;
+
+	if (!options_.enabled_ || !parseAddress(address, boot_id, path))
+		return false;
+
+	return boot_id == getBootId() && access(path.c_str(), F_OK) == 0;
+#else
+	(void)address;
+
+	return false;
+#endif
+}
+
+int ShmChannel::host(unsigned short port, string& address, string& path) {
+#ifdef __linux__
+	auto boot_id = getBootId();
+
+	if (!options_.enabled_ || boot_id.empty())
+		return -1;
+
+	path = options_.directory_ + "/transfer-client-" + to_string(getpid()) + "-" + to_string(port) + ".sock";
+
+	sockaddr_un socket_address;
+
+	if (!fillAddress(socket_address, path))
+		return -1;
+
+	int host_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+	if (host_socket < 0)
+		return -1;
+
+	unlink(path.c_str());
+
+	if (::bind(host_socket, reinterpret_cast<sockaddr*>(&socket_address), sizeof(socket_address)) < 0 || listen(host_socket, 1) < 0) {
+		Log(DEBUG) << "Could not host shared memory at " << path << ": " << strerror(errno) << endl;
+
+		::close(host_socket);
+		return -1;
+	}
+
+	address = g_address_prefix_ + boot_id + ":" + path;
+
+	return host_socket;
+#else
+	(void)port;
+	(void)address;
+	(void)path;
+
+	return -1;
+#endif
+}
+
+void ShmChannel::closeHost(int socket, const string& path) {
+#ifdef __linux__
+	::close(socket);
+	unlink(path.c_str());
+#else
+	(void)socket;
+	(void)path;
+#endif
+}
+
+shared_ptr<ShmChannel> ShmChannel::accept(int socket) {
+#ifdef __linux__
+	int client = ::accept4(socket, nullptr, nullptr, SOCK_CLOEXEC);
+
+	if (client < 0)
+		return nullptr;
+
+	if (!waitReadable(client, HANDSHAKE_TIMEOUT)) {
+		::close(client);
+		return nullptr;
+	}
+
+	// Magic and ring size, with the memfd and four eventfds attached
+	unsigned char message[sizeof(g_magic_) + sizeof(uint64_t)];
+	alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * 5)];
+	iovec io = { message, sizeof(message) };
+
+	msghdr header;
+	memset(&header, 0, sizeof(header));
+	header.msg_iov = &io;
+	header.msg_iovlen = 1;
+	header.msg_control = control;
+	header.msg_controllen = sizeof(control);
+
+	auto received = recvmsg(client, &header, MSG_CMSG_CLOEXEC);
+	auto* control_message = CMSG_FIRSTHDR(&header);
+	int fds[5] = { -1, -1, -1, -1, -1 };
+
+	if (control_message != nullptr && control_message->cmsg_level == SOL_SOCKET && control_message->cmsg_type == SCM_RIGHTS && control_message->cmsg_len == CMSG_LEN(sizeof(fds)))
+		memcpy(fds, CMSG_DATA(control_message), sizeof(fds));
+
+	uint64_t ring_size = 0;
+
+	if (received == sizeof(message))
+		memcpy(&ring_size, message + sizeof(g_magic_), sizeof(ring_size));
+
+	if (received != sizeof(message) || memcmp(message, g_magic_, sizeof(g_magic_)) != 0 || fds[0] < 0 || ring_size < MINIMUM_RING_SIZE || (ring_size & (ring_size - 1)) != 0) {
+		Log(WARNING) << "Invalid shared memory handshake\n";
+
+		closeFds(fds, 5);
+		::close(client);
+		return nullptr;
+	}
+
+	size_t memory_size = 2 * CONTROL_SIZE + 2 * ring_size;
+	auto* memory = mmap(nullptr, memory_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+	::close(fds[0]);
+
+	if (memory == MAP_FAILED) {
+		Log(WARNING) << "Could not map shared memory: " << strerror(errno) << endl;
+
+		closeFds(fds + 1, 4);
+		::close(client);
+		return nullptr;
+	}
+
+	unsigned char ack = 1;
+
+	if (write(client, &ack, 1) != 1) {
+		munmap(memory, memory_size);
+		closeFds(fds + 1, 4);
+		::close(client);
+		return nullptr;
+	}
+
+	return shared_ptr<ShmChannel>(new ShmChannel(client, memory, memory_size, ring_size, fds + 1, false));
+#else
+	(void)socket;
+
+	return nullptr;
+#endif
+}
+
+shared_ptr<ShmChannel> ShmChannel::connect(const string& address) {
+#ifdef __linux__
+	string boot_id, path;
+
+	if (!isLocal(address) || !parseAddress(address, boot_id, path))
+		return nullptr;
+
+	sockaddr_un socket_address;
+
+	if (!fillAddress(socket_address, path))
+		return nullptr;
+
+	int client = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+	if (client < 0)
+		return nullptr;
+
+	if (::connect(client, reinterpret_cast<sockaddr*>(&socket_address), sizeof(socket_address)) < 0) {
+		Log(DEBUG) << "Could not connect to shared memory socket " << path << ": " << strerror(errno) << endl;
+
+		::close(client);
+		return nullptr;
+	}
+
+	uint64_t ring_size = options_.ring_size_;
+	size_t memory_size = 2 * CONTROL_SIZE + 2 * ring_size;
+	int fds[5] = { -1, -1, -1, -1, -1 };
+
+	fds[0] = memfd_create("transfer-client", MFD_CLOEXEC);
+
+	for (int i = 1; i < 5; i++)
+		fds[i] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+	void* memory = MAP_FAILED;
+
+	if (all_of(fds, fds + 5, [] (int fd) { return fd >= 0; }) && ftruncate(fds[0], memory_size) == 0)
+		memory = mmap(nullptr, memory_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+
+	if (memory == MAP_FAILED) {
+		Log(WARNING) << "Could not create shared memory: " << strerror(errno) << endl;
+
+		closeFds(fds, 5);
+		::close(client);
+		return nullptr;
+	}
+
+	// A fresh memfd is zeroed, which is a valid empty ring
+	unsigned char message[sizeof(g_magic_) + sizeof(uint64_t)];
+	memcpy(message, g_magic_, sizeof(g_magic_));
+	memcpy(message + sizeof(g_magic_), &ring_size, sizeof(ring_size));
+
+	alignas(cmsghdr) char control[CMSG_SPACE(sizeof(fds))];
+	memset(control, 0, sizeof(control));
+	iovec io = { message, sizeof(message) };
+
+	msghdr header;
+	memset(&header, 0, sizeof(header));
+	header.msg_iov = &io;
+	header.msg_iovlen = 1;
+	header.msg_control = control;
+	header.msg_controllen = sizeof(control);
+
+	auto* control_message = CMSG_FIRSTHDR(&header);
+	control_message->cmsg_level = SOL_SOCKET;
+	control_message->cmsg_type = SCM_RIGHTS;
+	control_message->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(control_message), fds, sizeof(fds));
+
+	auto sent = sendmsg(client, &header, MSG_NOSIGNAL);
+	::close(fds[0]);
+
+	unsigned char ack = 0;
+
+	if (sent != sizeof(message) || !waitReadable(client, HANDSHAKE_TIMEOUT) || read(client, &ack, 1) != 1 || ack != 1) {
+		Log(DEBUG) << "Shared memory handshake with " << path << " failed\n";
+
+		munmap(memory, memory_size);
+		closeFds(fds + 1, 4);
+		::close(client);
+		return nullptr;
+	}
+
+	return shared_ptr<ShmChannel>(new ShmChannel(client, memory, memory_size, ring_size, fds + 1, true));
+#else
+	(void)address;
+
+	return nullptr;
+#endif
+}
+
+// Memory layout is [control A][control B][data A][data B], A is written by the side that created it.
+// The events are data A, space A, data B, space B
+ShmChannel::ShmChannel(int socket, void* memory, size_t memory_size, size_t ring_size, const int events[4], bool creator) :
+	socket_(socket), memory_(memory), memory_size_(memory_size), ring_size_(ring_size) {
+	auto* base = static_cast<unsigned char*>(memory);
+	auto* ring_a = reinterpret_cast<Ring*>(base);
+	auto* ring_b = reinterpret_cast<Ring*>(base + CONTROL_SIZE);
+	auto* data_a = base + 2 * CONTROL_SIZE;
+	auto* data_b = data_a + ring_size;
+
+	tx_ = creator ? ring_a : ring_b;
+	rx_ = creator ? ring_b : ring_a;
+	tx_data_ = creator ? data_a : data_b;
+	rx_data_ = creator ? data_b : data_a;
+
+	tx_data_event_ = creator ? events[0] : events[2];
+	tx_space_event_ = creator ? events[1] : events[3];
+	rx_data_event_ = creator ? events[2] : events[0];
+	rx_space_event_ = creator ? events[3] : events[1];
+}
+
+ShmChannel::~ShmChannel() {
+#ifdef __linux__
+	close();
+
+	munmap(memory_, memory_size_);
+	::close(socket_);
+
+	for (auto event : { rx_data_event_, tx_space_event_, tx_data_event_, rx_space_event_ })
+		::close(event);
+#endif
+}
+
+void ShmChannel::signal(int event) {
+#ifdef __linux__
+	uint64_t value = 1;
+
+	if (write(event, &value, sizeof(value)) < 0 && errno != EAGAIN)
+		Log(DEBUG) << "eventfd write failed: " << strerror(errno) << endl;
+#else
+	(void)event;
+#endif
+}
+
+bool ShmChannel::waitFor(Ring* ring, bool data) {
+#ifdef __linux__
+	auto ready = [this, ring, data] {
+		auto used = ring->head_.load(memory_order_acquire) - ring->tail_.load(memory_order_acquire);
+
+		return data ? used > 0 : used < ring_size_;
+	};
+
+	for (int i = 0; i < SPIN_COUNT; i++) {
+		if (ready())
+			return true;
+
+		if (closed_ || ring->closed_.load(memory_order_acquire))
+			return false;
+	}
+
+	auto& waiting = data ? ring->reader_waiting_ : ring->writer_waiting_;
+	auto event = data ? rx_data_event_ : tx_space_event_;
+
+	while (true) {
+		// Same as QueueWaiter, announce then check again so a wakeup is not lost
+		waiting.store(1, memory_order_seq_cst);
+		atomic_thread_fence(memory_order_seq_cst);
+
+		if (ready() || closed_ || ring->closed_.load(memory_order_acquire)) {
+			waiting.store(0, memory_order_relaxed);
+
+			return ready();
+		}
+
+		// The socket becomes readable when the peer is gone without closing
+		pollfd poll_fds[2] = { { event, POLLIN, 0 }, { socket_, POLLIN, 0 } };
+
+		if (poll(poll_fds, 2, -1) < 0 && errno != EINTR) {
+			waiting.store(0, memory_order_relaxed);
+
+			return false;
+		}
+
+		uint64_t value;
+
+		if (poll_fds[0].revents & POLLIN)
+			while (read(event, &value, sizeof(value)) > 0) {}
+
+		waiting.store(0, memory_order_relaxed);
+
+		if (poll_fds[1].revents) {
+			tx_->closed_.store(1, memory_order_release);
+			rx_->closed_.store(1, memory_order_release);
+		}
+	}
+#else
+	(void)ring;
+	(void)data;
+
+	return false;
+#endif
+}
+
+int ShmChannel::receive(unsigned char* buffer, size_t size) {
+	if (size == 0)
+		return 0;
+
+	if (!waitFor(rx_, true))
+		return closed_ ? -1 : 0;
+
+	auto tail = rx_->tail_.load(memory_order_relaxed);
+	auto head = rx_->head_.load(memory_order_acquire);
+	auto amount = min<size_t>(min<size_t>(head - tail, size), INT32_MAX);
+	auto offset = tail & (ring_size_ - 1);
+	auto first = min(amount, ring_size_ - offset);
+
+	memcpy(buffer, rx_data_ + offset, first);
+	memcpy(buffer + first, rx_data_, amount - first);
+
+	rx_->tail_.store(tail + amount, memory_order_release);
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if (rx_->writer_waiting_.load(memory_order_relaxed))
+		signal(rx_space_event_);
+
+	return amount;
+}
+
+int ShmChannel::send(const unsigned char* buffer, size_t size) {
+	size_t written = 0;
+
+	// Everything is written before returning, like a blocking socket
+	while (written < size) {
+		if (!waitFor(tx_, false) || tx_->closed_.load(memory_order_acquire))
+			return -1;
+
+		auto head = tx_->head_.load(memory_order_relaxed);
+		auto tail = tx_->tail_.load(memory_order_acquire);
+		auto amount = min(ring_size_ - (head - tail), size - written);
+		auto offset = head & (ring_size_ - 1);
+		auto first = min(amount, ring_size_ - offset);
+
+		memcpy(tx_data_ + offset, buffer + written, first);
+		memcpy(tx_data_, buffer + written + first, amount - first);
+
+		tx_->head_.store(head + amount, memory_order_release);
+		atomic_thread_fence(memory_order_seq_cst);
+
+		if (tx_->reader_waiting_.load(memory_order_relaxed))
+			signal(tx_data_event_);
+
+		written += amount;
+	}
+
+	return written;
+}
+
+void ShmChannel::close() {
+	if (closed_.exchange(true))
+		return;
+
+	// What is already in the ring stays readable by the peer, the memory outlives our mapping
+	tx_->closed_.store(1, memory_order_release);
+	rx_->closed_.store(1, memory_order_release);
+
+	// Wakes both our own threads and the peer
+	for (auto event : { rx_data_event_, tx_space_event_, tx_data_event_, rx_space_event_ })
+		signal(event);
+
+#ifdef __linux__
+	shutdown(socket_, SHUT_RDWR);
+#endif
+}
@@ -0,0 +1,79 @@
+#pragma once
+#ifndef SHM_CHANNEL_H
+#define SHM_CHANNEL_H
+
+#include "Channel.h"
+
+#include <string>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+
+struct ShmOptions {
+	bool enabled_				= true;
+	// Where the handshake sockets are created, containers need to share it
+	std::string directory_		= "/tmp";
+	// Bytes per direction, rounded up to a power of two
+	size_t ring_size_			= 67108864;
+};
+
+// Byte stream between two processes on the same machine through a pair of rings in a memfd,
+// with eventfds to wake a sleeping side. Set up over a Unix domain socket, which is kept to
+// notice the peer dying. Only available on Linux
+//
+// A payload is copied twice, into the ring by the writer and out of it by the reader, the same
+// count as a socket but without the system calls. The reader copies straight into the packet
+// storage for large payloads. Handing out views into the ring instead would pin ring space until
+// the packet is written to disk and would need payloads that never wrap around the ring end
+class ShmChannel : public Channel {
+public:
+	~ShmChannel();
+
+	static void setOptions(const ShmOptions& options);
+
+	// Listens for a handshake, returns -1 if disabled or not supported. The address is what the
+	// other side needs to find the socket, it is only usable on the same machine
+	static int host(unsigned short port, std::string& address, std::string& path);
+	static std::shared_ptr<ShmChannel> accept(int socket);
+	static void closeHost(int socket, const std::string& path);
+
+	// True for addresses from host(), connect() only works if isLocal() is
+	static bool isAddress(const std::string& address);
+	static bool isLocal(const std::string& address);
+	static std::shared_ptr<ShmChannel> connect(const std::string& address);
+
+	int receive(unsigned char* buffer, size_t size) override;
+	int send(const unsigned char* buffer, size_t size) override;
+	void close() override;
+
+private:
+	struct Ring;
+
+	ShmChannel(int socket, void* memory, size_t memory_size, size_t ring_size, const int events[4], bool creator);
+
+	// Sleeps until there is data or space, returns false when the channel is closed
+	bool waitFor(Ring* ring, bool data);
+	void signal(int event);
+
+	int socket_;
+	void* memory_;
+	size_t memory_size_;
+	size_t ring_size_;
+
+	Ring* tx_;
+	Ring* rx_;
+	unsigned char* tx_data_;
+	unsigned char* rx_data_;
+
+	// Peer wakes us when there is data to read or space to write, we wake the peer the same way
+	int rx_data_event_;
+	int tx_space_event_;
+	int tx_data_event_;
+	int rx_space_event_;
+
+	std::atomic<bool> closed_{false};
+
+	static ShmOptions options_;
+};
+
+#endif
@@ -0,0 +1,236 @@
+#include "SocketProfile.h"
+#include "Config.h"
+#include "Log.h"
+
+#include <algorithm>
+
+#ifdef WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+
+using namespace std;
+
+enum {
+	MINIMUM_BUFFER_SIZE = 65536
+};
+
+static SocketProfile builtinProfile(const string& name) {
+	SocketProfile profile;
+	profile.name_ = name;
+	
+	if (name == "lan") {
+		// 1 Gbit/s, short RTT
+		profile.bandwidth_ = 125000000;
+		profile.rtt_ = 1;
+		profile.keepalive_ = true;
+		profile.keepalive_idle_ = 30;
+		profile.keepalive_interval_ = 10;
+		profile.keepalive_count_ = 3;
+	} else if (name == "wan") {
+		// 100 Mbit/s over long distance
+		profile.bandwidth_ = 12500000;
+		profile.rtt_ = 150;
+		profile.notsent_lowat_ = 131072;
+		profile.congestion_ = { "bbr", "cubic" };
+		profile.keepalive_ = true;
+		profile.keepalive_idle_ = 60;
+		profile.keepalive_interval_ = 10;
+		profile.keepalive_count_ = 6;
+		profile.user_timeout_ = 120000;
+	} else if (name != "default") {
+		Log(WARNING) << "No built-in socket profile " << name << ", starting from default\n";
+	}
+	
+	return profile;
+}
+
+static vector<string> splitList(const string& input) {
+	vector<string> values;
+	size_t start = 0;
+	
+	while (start <= input.size()) {
+		auto end = input.find(',', start);
+		
+		if (end == string::npos)
+			end = input.size();
+			
+		if (end > start)
+			values.push_back(input.substr(start, end - start));
+			
+		start = end + 1;
+	}
+	
+	return values;
+}
+
+SocketProfile SocketProfile::get(const string& name, Config& config) {
+	auto profile = builtinProfile(name);
+	auto key = "socket_profile_" + name;
+	
+	if (!config.has(key))
+		return profile;
+	
+	// Options are given as pairs, e.g socket_profile_wan: bandwidth 12500000 rtt 150 congestion bbr,cubic
+	auto options = config.getAll<string>(key, {});
+	
+	for (size_t i = 0; i + 1 < options.size(); i += 2) {
+		auto& option = options.at(i);
+		auto& value = options.at(i + 1);
+		
+		try {
+			if (option == "bandwidth")
+				profile.bandwidth_ = stoull(value);
+			else if (option == "rtt")
+				profile.rtt_ = stoull(value);
+			else if (option == "send_buffer")
+				profile.send_buffer_ = stoull(value);
+			else if (option == "receive_buffer")
+				profile.receive_buffer_ = stoull(value);
+			else if (option == "notsent_lowat")
+				profile.notsent_lowat_ = stoull(value);
+			else if (option == "congestion")
+				profile.congestion_ = splitList(value);
+			else if (option == "nodelay")
+				profile.nodelay_ = stoi(value) != 0;
+			else if (option == "keepalive")
+				profile.keepalive_ = stoi(value) != 0;
+			else if (option == "keepalive_idle")
+				profile.keepalive_idle_ = stoi(value);
+			else if (option == "keepalive_interval")
+				profile.keepalive_interval_ = stoi(value);
+			else if (option == "keepalive_count")
+				profile.keepalive_count_ = stoi(value);
+			else if (option == "user_timeout")
+				profile.user_timeout_ = stoull(value);
+			else
+				Log(WARNING) << "Unknown socket option " << option << " in " << key << endl;
+		} catch (...) {
+			Log(WARNING) << "Invalid value " << value << " for socket option " << option << " in " << key << endl;
+		}
+	}
+	
+	if (options.size() % 2 != 0)
+		Log(WARNING) << "Socket option " << options.back() << " in " << key << " is missing a value\n";
+	
+	return profile;
+}
+
+template<class T>
+static bool setOption(int socket, int level, int option, const T& value) {
+	return setsockopt(socket, level, option, reinterpret_cast<const char*>(&value), sizeof(value)) == 0;
+}
+
+template<class T>
+static T getOption(int socket, int level, int option) {
+	T value = T();
+	socklen_t length = sizeof(value);
+	
+	getsockopt(socket, level, option, reinterpret_cast<char*>(&value), &length);
+	
+	return value;
+}
+
+// Smoothed RTT of a connected socket in microseconds, 0 if not available
+static size_t measureRTT(int socket) {
+#if defined(TCP_INFO) && !defined(WIN32)
+	tcp_info info;
+	socklen_t length = sizeof(info);
+	
+	if (getsockopt(socket, IPPROTO_TCP, TCP_INFO, &info, &length) == 0)
+		return info.tcpi_rtt;
+#else
+	if (socket) {}
+#endif
+
+	return 0;
+}
+
+void SocketProfile::apply(int socket, const string& role, bool connected) const {
+	if (nodelay_ && !setOption<int>(socket, IPPROTO_TCP, TCP_NODELAY, 1))
+		Log(WARNING) << "Could not set TCP_NODELAY\n";
+		
+	// Size buffers from the bandwidth-delay product
+	size_t rtt_us = connected ? measureRTT(socket) : 0;
+	
+	if (rtt_us == 0)
+		rtt_us = rtt_ * 1000;
+		
+	size_t bdp = static_cast<size_t>(static_cast<double>(bandwidth_) * rtt_us / 1e6);
+	size_t send_buffer = send_buffer_ ? send_buffer_ : (bandwidth_ ? max(bdp, (size_t)MINIMUM_BUFFER_SIZE) : 0);
+	size_t receive_buffer = receive_buffer_ ? receive_buffer_ : send_buffer;
+	
+	// Setting the buffers disables the kernel auto-tuning, so only do it when the profile asks for it
+	if (send_buffer && !setOption<int>(socket, SOL_SOCKET, SO_SNDBUF, static_cast<int>(send_buffer)))
+		Log(WARNING) << "Could not set SO_SNDBUF to " << send_buffer << endl;
+		
+	if (receive_buffer && !setOption<int>(socket, SOL_SOCKET, SO_RCVBUF, static_cast<int>(receive_buffer)))
+		Log(WARNING) << "Could not set SO_RCVBUF to " << receive_buffer << endl;
+		
+#ifdef TCP_NOTSENT_LOWAT
+	if (notsent_lowat_ && !setOption<int>(socket, IPPROTO_TCP, TCP_NOTSENT_LOWAT, static_cast<int>(notsent_lowat_)))
+		Log(WARNING) << "Could not set TCP_NOTSENT_LOWAT\n";
+#endif
+
+#ifdef TCP_CONGESTION
+	// Use the first available algorithm
+	for (auto& algorithm : congestion_)
+		if (setsockopt(socket, IPPROTO_TCP, TCP_CONGESTION, algorithm.c_str(), algorithm.size()) == 0)
+			break;
+#endif
+
+	if (keepalive_) {
+		setOption<int>(socket, SOL_SOCKET, SO_KEEPALIVE, 1);
+		
+#ifdef TCP_KEEPIDLE
+		if (keepalive_idle_)
+			setOption<int>(socket, IPPROTO_TCP, TCP_KEEPIDLE, keepalive_idle_);
+			
+		if (keepalive_interval_)
+			setOption<int>(socket, IPPROTO_TCP, TCP_KEEPINTVL, keepalive_interval_);
+			
+		if (keepalive_count_)
+			setOption<int>(socket, IPPROTO_TCP, TCP_KEEPCNT, keepalive_count_);
+#endif
+	}
+	
+#ifdef TCP_USER_TIMEOUT
+	if (user_timeout_ && !setOption<unsigned int>(socket, IPPROTO_TCP, TCP_USER_TIMEOUT, static_cast<unsigned int>(user_timeout_)))
+		Log(WARNING) << "Could not set TCP_USER_TIMEOUT\n";
+#endif
+
+	// Log what the kernel actually uses, it might clamp the buffers
+	LogLine line(NETWORK);
+	auto& log = line.stream();
+	log << "Socket profile " << name_ << " (" << role << "):";
+	
+	if (connected)
+		log << " rtt " << rtt_us / 1000.0 << " ms,";
+		
+	log << " send buffer " << getOption<int>(socket, SOL_SOCKET, SO_SNDBUF);
+	log << ", receive buffer " << getOption<int>(socket, SOL_SOCKET, SO_RCVBUF);
+	
+#ifdef TCP_NOTSENT_LOWAT
+	log << ", notsent_lowat " << getOption<int>(socket, IPPROTO_TCP, TCP_NOTSENT_LOWAT);
+#endif
+
+#ifdef TCP_CONGESTION
+	char congestion[16] = { 0 };
+	socklen_t length = sizeof(congestion) - 1;
+	
+	if (getsockopt(socket, IPPROTO_TCP, TCP_CONGESTION, congestion, &length) == 0)
+		log << ", congestion " << congestion;
+#endif
+
+	log << ", keepalive " << getOption<int>(socket, SOL_SOCKET, SO_KEEPALIVE);
+	
+#ifdef TCP_USER_TIMEOUT
+	log << ", user timeout " << getOption<unsigned int>(socket, IPPROTO_TCP, TCP_USER_TIMEOUT) << " ms";
+#endif
+
+	log << endl;
+}
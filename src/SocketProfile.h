@@ -0,0 +1,41 @@
+#pragma once
+#ifndef SOCKET_PROFILE_H
+#define SOCKET_PROFILE_H
+
+#include <string>
+#include <vector>
+
+class Config;
+
+// Named set of socket options, applied to every socket NetworkCommunication creates
+struct SocketProfile {
+	std::string name_				= "default";
+	
+	// Expected bottleneck bandwidth (bytes/s) used for sizing buffers from the BDP, 0 leaves them to the OS
+	size_t bandwidth_				= 0;
+	// Round trip time (ms) used until it can be measured on the connection
+	size_t rtt_						= 0;
+	
+	// Fixed buffer sizes (bytes), overrides the BDP sizing
+	size_t send_buffer_				= 0;
+	size_t receive_buffer_			= 0;
+	
+	size_t notsent_lowat_			= 0;
+	std::vector<std::string> congestion_;
+	
+	bool nodelay_					= true;
+	bool keepalive_					= false;
+	int keepalive_idle_				= 0;
+	int keepalive_interval_			= 0;
+	int keepalive_count_			= 0;
+	
+	// Milliseconds unacknowledged data may stay in flight before the connection is dropped
+	size_t user_timeout_			= 0;
+	
+	static SocketProfile get(const std::string& name, Config& config);
+	
+	// Applies the profile, connected sockets also get their buffers sized from the measured RTT
+	void apply(int socket, const std::string& role, bool connected) const;
+};
+
+#endif
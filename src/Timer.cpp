@@ -11,7 +11,7 @@ Timer::Timer(size_t ms) {
 }
 
 void Timer::start() {
-	start_time_ = chrono::system_clock::now();
+	start_time_ = Clock::now();
 	elapsed_time_ = start_time_;
 }
 
@@ -23,7 +23,7 @@ void Timer::start(size_t ms) {
 
 // Get current elapsed time and restart timer
 double Timer::restart() {
-	auto now = chrono::system_clock::now();
+	auto now = Clock::now();
 	auto nanoseconds = chrono::duration_cast<chrono::nanoseconds>(now - start_time_);
 	start_time_ = now;
 	
@@ -32,15 +32,17 @@ double Timer::restart() {
 }
 
 double Timer::elapsedTime() const {
-	auto now = chrono::system_clock::now();
-	auto nanoseconds = chrono::duration_cast<chrono::nanoseconds>(now - start_time_);
-	
-	return (double)nanoseconds.count() / 1e09;
+	return (double)elapsedNanoseconds() / 1e09;
+}
+
+Timer::Clock::duration Timer::elapsedDuration() const {
+	return Clock::now() - start_time_;
+}
+
+int64_t Timer::elapsedNanoseconds() const {
+	return chrono::duration_cast<chrono::nanoseconds>(elapsedDuration()).count();
 }
 
 bool Timer::elapsed() const {
-	auto now = chrono::system_clock::now();
-	auto nanoseconds = chrono::duration_cast<chrono::nanoseconds>(now - elapsed_time_);
-	
-	return nanoseconds.count() > 0;
-}
\ No newline at end of file
+	return Clock::now() > elapsed_time_;
+}
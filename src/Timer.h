@@ -3,9 +3,13 @@
 #define TIMER_H
 
 #include <chrono>
+#include <cstdint>
 
+// Monotonic, so speeds are not thrown off when the system clock is adjusted
 class Timer {
 public:
+	using Clock = std::chrono::steady_clock;
+
 	Timer();
 	Timer(size_t ms);
 	
@@ -17,9 +21,13 @@ public:
 	
 	double elapsedTime() const;
 	
+	// The same without rounding to seconds, for histograms
+	Clock::duration elapsedDuration() const;
+	int64_t elapsedNanoseconds() const;
+	
 private:
-	std::chrono::time_point<std::chrono::system_clock> start_time_;
-	std::chrono::time_point<std::chrono::system_clock> elapsed_time_;
+	Clock::time_point start_time_;
+	Clock::time_point elapsed_time_;
 };
 
-#endif
\ No newline at end of file
+#endif
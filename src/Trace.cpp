@@ -0,0 +1,189 @@
+#include "Trace.h"
+#include "Log.h"
+
+#include <mutex>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <thread>
+#include <fstream>
+#include <cstdio>
+#include <cstdlib>
+
+#ifdef WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+atomic<bool> Trace::enabled_(false);
+
+struct TraceEvent {
+	const char* name_;
+	int64_t start_;
+	int64_t end_;
+	int64_t bytes_;
+};
+
+// Only the owning thread appends, the lock is for writing the file while it runs
+struct TraceThread {
+	mutex mutex_;
+	vector<TraceEvent> events_;
+	string name_;
+	int id_ = 0;
+};
+
+struct TraceState {
+	mutex mutex_;
+
+	// Kept when the threads end, their events are written at exit
+	vector<shared_ptr<TraceThread>> threads_;
+	int next_thread_ = 1;
+
+	string path_;
+	size_t max_events_ = 0;
+	atomic<size_t> events_{0};
+	atomic<size_t> dropped_{0};
+};
+
+// Never destroyed since threads might end after static destruction
+static TraceState& state() {
+	static TraceState* state = new TraceState();
+
+	return *state;
+}
+
+static TraceThread& traceThread() {
+	thread_local shared_ptr<TraceThread> current;
+
+	if (!current) {
+		auto& trace = state();
+		lock_guard<mutex> lock(trace.mutex_);
+
+		current = make_shared<TraceThread>();
+		current->id_ = trace.next_thread_++;
+		trace.threads_.push_back(current);
+	}
+
+	return *current;
+}
+
+int64_t Trace::now() {
+	return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Trace::record(const char* name, int64_t start, int64_t end, int64_t bytes) {
+	auto& trace = state();
+
+	if (trace.events_.fetch_add(1, memory_order_relaxed) >= trace.max_events_) {
+		trace.dropped_.fetch_add(1, memory_order_relaxed);
+
+		return;
+	}
+
+	auto& current = traceThread();
+	lock_guard<mutex> lock(current.mutex_);
+
+	current.events_.push_back({ name, start, end, bytes });
+}
+
+void Trace::nameThread(const char* name) {
+	if (!enabled())
+		return;
+
+	auto& current = traceThread();
+	lock_guard<mutex> lock(current.mutex_);
+
+	current.name_ = name;
+}
+
+static int processId() {
+#ifdef WIN32
+	return _getpid();
+#else
+	return getpid();
+#endif
+}
+
+// Does not wait on quick_exit(), the thread holding the lock might be the one exiting
+static bool writeFile(bool wait) {
+	auto& trace = state();
+	unique_lock<mutex> lock(trace.mutex_, defer_lock);
+
+	if (wait)
+		lock.lock();
+	else if (!lock.try_lock())
+		return false;
+
+	if (trace.path_.empty())
+		return false;
+
+	ofstream file(trace.path_);
+	char buffer[512];
+	auto pid = processId();
+	bool first = true;
+
+	auto separator = [&file, &first] {
+		file << (first ? "\n" : ",\n");
+		first = false;
+	};
+
+	file << "{\"traceEvents\":[";
+
+	for (auto& thread : trace.threads_) {
+		lock_guard<mutex> thread_lock(thread->mutex_);
+
+		if (!thread->name_.empty()) {
+			separator();
+			file << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid << ",\"tid\":" << thread->id_ << ",\"args\":{\"name\":\"" << thread->name_ << "\"}}";
+		}
+
+		for (auto& event : thread->events_) {
+			separator();
+
+			snprintf(buffer, sizeof(buffer), "{\"name\":\"%s\",\"cat\":\"transfer\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d",
+				event.name_, event.start_ / 1e3, (event.end_ - event.start_) / 1e3, pid, thread->id_);
+
+			file << buffer;
+
+			if (event.bytes_ > 0)
+				file << ",\"args\":{\"bytes\":" << event.bytes_ << "}";
+
+			file << "}";
+		}
+	}
+
+	file << "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped_events\":" << trace.dropped_.load() << "}}\n";
+
+	return file.good();
+}
+
+static void writeFinal() {
+	writeFile(false);
+}
+
+bool Trace::write() {
+	return writeFile(true);
+}
+
+void Trace::start(const string& path, size_t max_events) {
+	auto& trace = state();
+
+	{
+		lock_guard<mutex> lock(trace.mutex_);
+
+		trace.path_ = path;
+		trace.max_events_ = max_events;
+	}
+
+#ifndef WIN32
+	at_quick_exit(writeFinal);
+#endif
+	atexit(writeFinal);
+
+	enabled_ = true;
+
+	Log(DEBUG) << "Tracing to " << path << ", at most " << max_events << " events\n";
+}
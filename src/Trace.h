@@ -0,0 +1,64 @@
+#pragma once
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <string>
+#include <cstdint>
+
+// Timeline of what each thread does, written as Chrome trace event JSON (chrome://tracing, ui.perfetto.dev).
+// Off unless started, then a span costs two clock reads and an append to a buffer owned by the thread
+class Trace {
+public:
+	static bool enabled();
+
+	// At most max_events are kept, the file is written on exit and quick_exit()
+	static void start(const std::string& path, size_t max_events);
+	static bool write();
+
+	// Shown instead of the thread ID
+	static void nameThread(const char* name);
+
+	// Name has to outlive the trace, e.g a string literal
+	static void record(const char* name, int64_t start, int64_t end, int64_t bytes);
+
+	// Monotonic nanoseconds, the same clock for every process on the machine so their traces line up
+	static int64_t now();
+
+private:
+	static std::atomic<bool> enabled_;
+};
+
+inline bool Trace::enabled() {
+	return enabled_.load(std::memory_order_relaxed);
+}
+
+// Records the time from construction to destruction
+class TraceSpan {
+public:
+	explicit TraceSpan(const char* name, int64_t bytes = 0);
+	~TraceSpan();
+
+	TraceSpan(const TraceSpan&) = delete;
+	TraceSpan& operator=(const TraceSpan&) = delete;
+
+	void setBytes(int64_t bytes);
+
+private:
+	const char* name_;
+	int64_t bytes_;
+	int64_t start_;
+};
+
+inline TraceSpan::TraceSpan(const char* name, int64_t bytes) : name_(name), bytes_(bytes), start_(Trace::enabled() ? Trace::now() : -1) {}
+
+inline TraceSpan::~TraceSpan() {
+	if (start_ >= 0)
+		Trace::record(name_, start_, Trace::now(), bytes_);
+}
+
+inline void TraceSpan::setBytes(int64_t bytes) {
+	bytes_ = bytes;
+}
+
+#endif
@@ -5,8 +5,16 @@
 #include "Config.h"
 #include "CLI.h"
 #include "Parameter.h"
+#include "Daemon.h"
+#include "Trace.h"
+#include "Histogram.h"
+#include "PacketPump.h"
+#include "TransferSession.h"
+#include "IO.h"
 
+#include <cstdlib>
 #include <signal.h>
+#include <sys/stat.h>
 
 using namespace std;
 
@@ -14,38 +22,123 @@ using namespace std;
 constexpr auto quick_exit = _exit; // mingw32 does not support quick_exit for now
 #endif
 
-string g_protocol_standard = "a10";
-static mutex g_cli_sync_;
+extern string g_protocol_standard;
 
 static void printStart() {
 	Log(NONE) << "Transfer-Client [alpha] [" << __DATE__ << " @ " << __TIME__ << "]\n";
 	Log(NONE) << "Protocol standard: " << g_protocol_standard << "\n";
 }
 
-void packetThread(NetworkCommunication& network, int id, bool do_accept) {
-	if (do_accept)
-		network.acceptConnection();
+static void autoUpdate(Packet& answer) {
+	auto url = answer.getString();
+	auto url_script = answer.getString();
+	auto url_windows = answer.getString();
 
-	while (true) {
-		// Wait until the Server sends something
-		auto* packet = network.waitForPacket();
-		
-		// Is shutdown ordered?
-		if (packet == nullptr)
-			break;
-			
-		// Remove old networks if there are any
-		Base::cli().removeOldNetworks(id);
+	Log(INFORMATION) << "Downloading new binaries\n";
 
-		// Protect CLI using single threading since there might be multiple packet threads
-		g_cli_sync_.lock();
-		Base::cli().process(network, *packet);
-		g_cli_sync_.unlock();
-		
-		network.completePacket();
+#ifdef WIN32
+	Log(INFORMATION) << "If the download fail due to Powershell being below version 3.0, the URL is " << url_windows << endl;
+
+	IO::download(url_windows, "client.zip");
+
+	Log(INFORMATION) << "Auto-update for Windows is not available for now, the new binaries are in client.zip\n";
+#else
+	IO::download(url, "client.zip");
+	IO::download(url_script, "update.sh");
+
+	Log(INFORMATION) << "Initiating auto-update\n";
+
+	// Make update script executable
+	chmod("update.sh", 0755);
+
+	// Don't need to call it in background since it's possible to overwrite running files
+	if (system("./update.sh")) {}
+#endif
+}
+
+static void join() {
+	if (!Base::cli().join())
+		quick_exit(-1);
+}
+
+static void run() {
+	auto& cli = Base::cli();
+
+	// Remove old update files if they exist
+	remove("client.zip");
+#ifndef WIN32
+	remove("update.sh");
+#endif
+
+	// Register at Server
+	auto answer = cli.initialize();
+
+	if (answer.getBool()) {
+		Log(DEBUG) << "Server accepted our protocol version\n";
+	} else {
+		auto code = answer.getInt();
+
+		Log(ERROR) << "Client was not accepted, code " << code << "\n";
+
+		if (code == ERROR_OLD_PROTOCOL)
+			autoUpdate(answer);
+
+		quick_exit(-1);
 	}
-	
-	Log(NETWORK) << "packetThread exiting\n";
+
+	// Check options
+	// Daemon mode, receive like monitoring mode and take send jobs from the local socket
+	if (Base::parameter().has("-d")) {
+		cli.setPersistent(true);
+		join();
+
+		// Nothing works without the server session, let a supervisor restart us
+		Base::network().setTerminateOnKill(true);
+
+		Daemon::run(Base::config(), Base::config().get<string>("daemon_socket", "/tmp/transfer-client.sock"));
+
+		// Keep receiving even if the socket failed
+		return;
+	}
+
+	// Monitoring mode, wait for packets
+	if (Base::parameter().has("-m")) {
+		join();
+
+		return;
+	}
+
+	// List available hosts
+	if (Base::parameter().has("-l")) {
+		Log(DEBUG) << "Hosts:\n";
+
+		for (auto& host : cli.listHosts())
+			Log(DEBUG) << "Host " << host.first << " : " << host.second << endl;
+
+		// Quit since it's CLI
+		quick_exit(0);
+	}
+
+	// Send files
+	if (Base::parameter().has("-s")) {
+		// We need a receiver
+		if (!Base::parameter().has("-t")) {
+			Log(ERROR) << "Specify receiver with \"-t\" option\n";
+
+			quick_exit(-1);
+		}
+
+		// Set terminate on network kill
+		Base::network().setTerminateOnKill(true);
+
+		// To whom? Every receiver gets the same chunks, read once
+		cli.sendFiles(Base::parameter().get("-t"), Base::parameter().get("-s"), Base::parameter().has("-r"));
+
+		quick_exit(0);
+	}
+
+	// If no option has been specified at the end, default to monitoring mode
+	join();
 }
 
 static void process() {
@@ -57,18 +150,19 @@ static void process() {
 	Base::network().start(hostname, port);
 	
 	auto& network = Base::network();
-	thread network_thread = thread(packetThread, ref(network), -1, false);
+	Log(DEBUG) << "Connected to the server after " << Histogram::format(network.getConnectTime()) << "\n";
+	Trace::nameThread("main");
+	
+	// The server connection lives as long as the process, the pump does not own it
+	auto pump = PacketPump::start(Base::cli(), shared_ptr<NetworkCommunication>(shared_ptr<NetworkCommunication>(), &network));
 	
 	// Run CLI
-	Base::cli().start();
+	run();
 	
-	network_thread.join();
+	pump->wait();
 	
 	// Kill all networks
 	Base::cli().shutdown();
-	
-	// Kill any remaining old networks
-	Base::cli().removeOldNetworks(-1);
 }
 
 void handler(int unused) {
@@ -97,6 +191,37 @@ int main(int argc, char** argv) {
 	
 	Base::parameter().set(argc, argv);
 	
+	// Debug lines are dropped before they are formatted when disabled
+	Log::setDebug(Base::config().get<bool>("debug", true));
+	
+	auto log_file = Base::config().get<string>("log_file", "");
+	
+	if (!log_file.empty())
+		Log::setFile(log_file, Base::config().get<size_t>("log_file_size", 10485760), Base::config().get<size_t>("log_file_count", 3));
+	
+	// Hand the files to a running daemon instead of connecting ourselves
+	if (Base::parameter().has("-c")) {
+		if (!Base::parameter().has("-s") || !Base::parameter().has("-t")) {
+			Log(ERROR) << "Specify files with \"-s\" and receiver with \"-t\"\n";
+			
+			return -1;
+		}
+		
+		auto path = Base::parameter().get("-c").front();
+		
+		if (path.empty())
+			path = Base::config().get<string>("daemon_socket", "/tmp/transfer-client.sock");
+			
+		// Jobs with a higher priority go first at the daemon
+		auto priority = Base::parameter().has("-p") ? atoi(Base::parameter().get("-p").front().c_str()) : 0;
+		auto result = Daemon::submit(path, Base::parameter().get("-t"), Base::parameter().get("-s"), Base::parameter().has("-r"), priority);
+		
+		return result ? 0 : 1;
+	}
+	
+	// Buffer pool, transports, metrics and tracing
+	TransferSession::setup(Base::config());
+	
 	process();
 	
 	return 0;
@@ -0,0 +1,400 @@
+#include "TransferSession.h"
+#include "NetworkCommunication.h"
+#include "PacketPump.h"
+#include "BufferPool.h"
+#include "UdpChannel.h"
+#include "ShmChannel.h"
+#include "SocketProfile.h"
+#include "Histogram.h"
+#include "Timer.h"
+#include "Trace.h"
+#include "Log.h"
+
+#include <algorithm>
+#include <unordered_set>
+
+using namespace std;
+
+TransferSession::TransferSession(const Config& config) : config_(config), server_(make_shared<NetworkCommunication>()) {
+	cli_ = make_unique<CLI>(config_, *server_);
+
+	// Lost connections fail the jobs on them, the process is not ours to end
+	cli_->setPersistent(true);
+	cli_->setReceiveHandler([this] (const ReceivedFile& file) { received(file); });
+
+	concurrency_ = max<size_t>(1, config_.get<size_t>("job_concurrency", 2));
+
+	sampler_ = Metrics::addSampler([this] (MetricsSnapshot& snapshot) {
+		lock_guard<mutex> lock(mutex_);
+
+		snapshot.values_[METRIC_JOBS_QUEUED] += jobs_.size();
+		snapshot.values_[METRIC_JOBS_RUNNING] += running_.size();
+	});
+}
+
+TransferSession::~TransferSession() {
+	Metrics::removeSampler(sampler_);
+	close();
+}
+
+void TransferSession::setup(Config& config) {
+	// Recycled packet buffers
+	BufferPool::setLimit(config.get<size_t>("buffer_pool_size", 128 * 1024 * 1024));
+	BufferPool::setHugePages(config.get<bool>("huge_pages", false));
+
+	// Socket options for all connections
+	NetworkCommunication::setSocketProfile(SocketProfile::get(config.get<string>("socket_profile", "default"), config));
+
+	// UDP transport for direct connections
+	UdpOptions udp_options;
+	udp_options.window_ = config.get<size_t>("udp_window", udp_options.window_);
+	udp_options.fec_group_ = config.get<size_t>("udp_fec", udp_options.fec_group_);
+	udp_options.max_rate_ = config.get<size_t>("udp_max_rate", udp_options.max_rate_);
+	udp_options.timeout_ = config.get<size_t>("udp_timeout", udp_options.timeout_);
+	UdpChannel::setOptions(udp_options);
+
+	ShmOptions shm_options;
+	shm_options.enabled_ = config.get<bool>("shared_memory", shm_options.enabled_);
+	shm_options.directory_ = config.get<string>("shared_memory_dir", shm_options.directory_);
+	shm_options.ring_size_ = config.get<size_t>("shared_memory_ring", shm_options.ring_size_);
+	ShmChannel::setOptions(shm_options);
+
+	// Counters and gauges for monitoring
+	auto metrics_file = config.get<string>("metrics_file", "");
+
+	if (!metrics_file.empty())
+		Metrics::start(metrics_file, Metrics::getFormat(config.get<string>("metrics_format", "json")), config.get<size_t>("metrics_interval", 10));
+
+	// Timeline of the transfer pipeline
+	auto trace_file = config.get<string>("trace_file", "");
+
+	if (!trace_file.empty())
+		Trace::start(trace_file, config.get<size_t>("trace_max_events", 1000000));
+}
+
+bool TransferSession::start(bool receive) {
+	auto hostname = config_.get<string>("host", "localhost");
+	auto port = config_.get<unsigned short>("port", 12000);
+
+	if (!server_->start(hostname, port, true)) {
+		Log(ERROR) << "Could not connect to the server at " << hostname << ":" << port << "\n";
+
+		return false;
+	}
+
+	Log(DEBUG) << "Connected to the server after " << Histogram::format(server_->getConnectTime()) << "\n";
+
+	pump_ = PacketPump::start(*cli_, server_);
+
+	auto answer = cli_->initialize();
+
+	if (!answer.getBool()) {
+		Log(ERROR) << "Client was not accepted, code " << answer.getInt() << "\n";
+
+		return false;
+	}
+
+	if (receive && !cli_->join())
+		return false;
+
+	// Jobs sent before now start
+	lock_guard<mutex> lock(mutex_);
+	started_ = true;
+	schedule();
+
+	return true;
+}
+
+static void finish(TransferJob& job, promise<TransferResult>& promise, const TransferResult& result) {
+	if (job.done_)
+		job.done_(result);
+
+	promise.set_value(result);
+}
+
+future<TransferResult> TransferSession::send(TransferJob job) {
+	QueuedJob queued;
+	queued.job_ = move(job);
+
+	auto result = queued.result_.get_future();
+
+	{
+		lock_guard<mutex> lock(mutex_);
+
+		if (!closed_) {
+			queued.id_ = next_job_++;
+			jobs_.push_back(move(queued));
+
+			if (started_)
+				schedule();
+
+			return result;
+		}
+	}
+
+	jobs_failed_++;
+	finish(queued.job_, queued.result_, TransferResult());
+
+	return result;
+}
+
+deque<TransferSession::QueuedJob>::iterator TransferSession::pickJob() {
+	unordered_set<string> busy;
+
+	for (auto& running : running_)
+		busy.insert(running.second.receivers_.begin(), running.second.receivers_.end());
+
+	auto idle = [&busy] (const QueuedJob& queued) {
+		return none_of(queued.job_.receivers_.begin(), queued.job_.receivers_.end(), [&busy] (auto& to) { return busy.count(to) > 0; });
+	};
+
+	// Highest priority, then receivers which are idle, then the oldest
+	auto best = jobs_.begin();
+
+	for (auto iterator = next(jobs_.begin()); iterator != jobs_.end(); iterator++) {
+		auto priority = iterator->job_.priority_;
+
+		if (priority > best->job_.priority_ || (priority == best->job_.priority_ && idle(*iterator) && !idle(*best)))
+			best = iterator;
+	}
+
+	return best;
+}
+
+void TransferSession::schedule() {
+	for (auto iterator = threads_.begin(); iterator != threads_.end();) {
+		if (!iterator->exited_) {
+			iterator++;
+
+			continue;
+		}
+
+		iterator->thread_.join();
+		iterator = threads_.erase(iterator);
+	}
+
+	while (!closed_ && !jobs_.empty()) {
+		auto queued = pickJob();
+
+		// A job more urgent than every running one does not wait for a free slot, its chunks go first
+		if (running_.size() >= concurrency_) {
+			auto urgent = all_of(running_.begin(), running_.end(), [&queued] (auto& running) { return queued->job_.priority_ > running.second.priority_; });
+
+			if (!urgent)
+				break;
+		}
+
+		auto& running = running_[queued->id_];
+		running.priority_ = queued->job_.priority_;
+		running.weight_ = queued->job_.weight_;
+		running.receivers_ = queued->job_.receivers_;
+
+		// The thread waits for the lock before it looks at itself
+		threads_.emplace_back();
+		auto self = prev(threads_.end());
+		self->thread_ = thread(&TransferSession::runJob, this, self, move(*queued));
+
+		jobs_.erase(queued);
+	}
+}
+
+void TransferSession::runJob(list<JobThread>::iterator self, QueuedJob queued) {
+	Trace::nameThread("job");
+
+	auto& job = queued.job_;
+	auto id = queued.id_;
+
+	SendOptions options;
+	options.recursive_ = job.recursive_;
+	options.priority_ = job.priority_;
+	options.weight_ = job.weight_;
+
+	options.progress_ = [this, &job, id] (const SendProgress& progress) {
+		{
+			lock_guard<mutex> lock(mutex_);
+			running_.at(id).bytes_ = progress.bytes_;
+		}
+
+		if (job.progress_)
+			job.progress_(progress);
+	};
+
+	Timer timer;
+	auto sent = cli_->sendFiles(job.receivers_, job.sources_, options);
+
+	TransferResult result;
+	result.success_ = sent.success();
+	result.files_sent_ = sent.files_sent_;
+	result.files_failed_ = sent.files_failed_;
+	result.bytes_ = sent.bytes_;
+	result.time_ = timer.elapsedDuration();
+	result.receivers_ = move(sent.receivers_);
+
+	bytes_sent_ += result.bytes_;
+	(result.success_ ? jobs_done_ : jobs_failed_)++;
+
+	finish(job, queued.result_, result);
+
+	lock_guard<mutex> lock(mutex_);
+	running_.erase(id);
+	schedule();
+
+	self->exited_ = true;
+}
+
+future<ReceivedFile> TransferSession::receive(ReceiveJob job) {
+	Expected expected;
+	expected.done_ = job.done_;
+
+	auto result = expected.file_.get_future();
+
+	{
+		lock_guard<mutex> lock(mutex_);
+
+		if (!closed_ && expected_.count(job.name_) == 0 && cli_->receiveInto(job.name_, job.buffer_, job.capacity_)) {
+			expected_.emplace(job.name_, move(expected));
+
+			return result;
+		}
+	}
+
+	Log(WARNING) << "Already receiving " << job.name_ << " into memory\n";
+
+	ReceivedFile failed;
+	failed.path_ = job.name_;
+
+	if (expected.done_)
+		expected.done_(failed);
+
+	expected.file_.set_value(failed);
+
+	return result;
+}
+
+void TransferSession::setReceiveHandler(const function<void(const ReceivedFile&)>& handler) {
+	receive_handler_ = handler;
+}
+
+void TransferSession::setTerminateOnKill(bool status) {
+	server_->setTerminateOnKill(status);
+}
+
+void TransferSession::received(const ReceivedFile& file) {
+	if (file.complete_) {
+		files_received_++;
+		bytes_received_ += file.bytes_;
+	}
+
+	if (file.buffer_ != nullptr) {
+		Expected expected;
+		bool found = false;
+
+		{
+			lock_guard<mutex> lock(mutex_);
+			auto iterator = expected_.find(file.path_);
+
+			if (iterator != expected_.end()) {
+				expected = move(iterator->second);
+				expected_.erase(iterator);
+				found = true;
+			}
+		}
+
+		if (found) {
+			if (expected.done_)
+				expected.done_(file);
+
+			expected.file_.set_value(file);
+		}
+	}
+
+	if (receive_handler_)
+		receive_handler_(file);
+}
+
+TransferStats TransferSession::stats() {
+	TransferStats stats;
+
+	{
+		lock_guard<mutex> lock(mutex_);
+		stats.jobs_queued_ = jobs_.size();
+		stats.jobs_running_ = running_.size();
+
+		for (auto& running : running_)
+			stats.jobs_.push_back({ running.first, running.second.priority_, running.second.weight_, true, running.second.bytes_ });
+
+		sort(stats.jobs_.begin(), stats.jobs_.end(), [] (const JobState& a, const JobState& b) {
+			return a.priority_ != b.priority_ ? a.priority_ > b.priority_ : a.id_ < b.id_;
+		});
+
+		vector<JobState> queued;
+
+		for (auto& job : jobs_)
+			queued.push_back({ job.id_, job.job_.priority_, job.job_.weight_, false, 0 });
+
+		stable_sort(queued.begin(), queued.end(), [] (const JobState& a, const JobState& b) { return a.priority_ > b.priority_; });
+		stats.jobs_.insert(stats.jobs_.end(), queued.begin(), queued.end());
+	}
+
+	stats.connections_ = cli_->getConnections();
+
+	stats.jobs_done_ = jobs_done_;
+	stats.jobs_failed_ = jobs_failed_;
+	stats.bytes_sent_ = bytes_sent_;
+	stats.files_received_ = files_received_;
+	stats.bytes_received_ = bytes_received_;
+	stats.metrics_ = Metrics::snapshot();
+
+	return stats;
+}
+
+void TransferSession::close() {
+	deque<QueuedJob> jobs;
+	unordered_map<string, Expected> expected;
+
+	{
+		lock_guard<mutex> lock(mutex_);
+
+		if (closed_)
+			return;
+
+		closed_ = true;
+		jobs.swap(jobs_);
+		expected.swap(expected_);
+	}
+
+	for (auto& queued : jobs) {
+		jobs_failed_++;
+		finish(queued.job_, queued.result_, TransferResult());
+	}
+
+	for (auto& file : expected) {
+		cli_->cancelReceive(file.first);
+
+		ReceivedFile failed;
+		failed.path_ = file.first;
+
+		if (file.second.done_)
+			file.second.done_(failed);
+
+		file.second.file_.set_value(failed);
+	}
+
+	// Requests on the server connection are answered with failures, so the running jobs give up
+	server_->kill();
+	cli_->shutdown();
+
+	// The last jobs to finish leave their threads behind
+	list<JobThread> threads;
+
+	{
+		lock_guard<mutex> lock(mutex_);
+		threads.swap(threads_);
+	}
+
+	for (auto& thread : threads)
+		thread.thread_.join();
+
+	if (pump_)
+		pump_->wait();
+}
@@ -0,0 +1,180 @@
+#pragma once
+#ifndef TRANSFER_SESSION_H
+#define TRANSFER_SESSION_H
+
+#include "Config.h"
+#include "CLI.h"
+#include "Metrics.h"
+
+#include <memory>
+#include <future>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <deque>
+#include <list>
+#include <unordered_map>
+#include <atomic>
+#include <chrono>
+
+class NetworkCommunication;
+class PacketPump;
+
+struct TransferResult {
+	bool success_ = false;
+	size_t files_sent_ = 0;
+	size_t files_failed_ = 0;
+	size_t bytes_ = 0;
+	std::chrono::steady_clock::duration time_{};
+
+	std::vector<ReceiverResult> receivers_;
+};
+
+// Files, directories and memory to send to every receiver
+struct TransferJob {
+	std::vector<std::string> receivers_;
+	std::vector<SendSource> sources_;
+	bool recursive_ = false;
+
+	// Higher priorities start first and their chunks go first, a job with a higher priority than every
+	// running one starts even when job_concurrency jobs are running. Jobs of the same priority share the
+	// connections by weight
+	int priority_ = 0;
+	unsigned weight_ = 1;
+
+	// Called from the job's thread, progress after every chunk
+	std::function<void(const SendProgress&)> progress_;
+	std::function<void(const TransferResult&)> done_;
+};
+
+// Memory for the next file with this name, directory included, done when it is complete or given up on
+struct ReceiveJob {
+	std::string name_;
+	unsigned char* buffer_ = nullptr;
+	size_t capacity_ = 0;
+
+	// Called from a packet worker, must not block
+	std::function<void(const ReceivedFile&)> done_;
+};
+
+struct JobState {
+	size_t id_ = 0;
+	int priority_ = 0;
+	unsigned weight_ = 0;
+	bool running_ = false;
+	size_t bytes_ = 0;
+};
+
+struct TransferStats {
+	size_t jobs_queued_ = 0;
+	size_t jobs_running_ = 0;
+	size_t jobs_done_ = 0;
+	size_t jobs_failed_ = 0;
+	size_t bytes_sent_ = 0;
+	size_t files_received_ = 0;
+	size_t bytes_received_ = 0;
+
+	// Running jobs, then the queued ones by priority
+	std::vector<JobState> jobs_;
+
+	// What the jobs have queued on each connection
+	std::vector<ConnectionState> connections_;
+
+	// Process wide, every session adds to the same metrics
+	MetricsSnapshot metrics_;
+};
+
+// The client as a library, one server session with its own CLI and connections. Jobs are queued and up to
+// job_concurrency of them are sent at once, each on its own thread. The next job is the one with the highest
+// priority, preferring receivers no running job sends to so more links are kept busy. Results come through
+// futures and callbacks
+class TransferSession {
+public:
+	// The settings the config file would have, e.g host, port, name and output_folder
+	explicit TransferSession(const Config& config);
+	~TransferSession();
+
+	TransferSession(const TransferSession&) = delete;
+	TransferSession& operator=(const TransferSession&) = delete;
+
+	// Connects and registers at the server, as a receiver as well when receive is set. Blocks until
+	// the server has answered
+	bool start(bool receive = false);
+
+	std::future<TransferResult> send(TransferJob job);
+	std::future<ReceivedFile> receive(ReceiveJob job);
+
+	// Every file received, to disk or memory. Called from a packet worker, must not block. Set before start()
+	void setReceiveHandler(const std::function<void(const ReceivedFile&)>& handler);
+
+	// Ends the process when the server connection is lost, for a service which is restarted by a supervisor
+	void setTerminateOnKill(bool status);
+
+	TransferStats stats();
+
+	// Fails the queued jobs and closes the connections, the running jobs fail once they are gone
+	void close();
+
+	// Process wide settings from the config, the buffer pool, socket profile, UDP and shared memory
+	// transports and the metrics and trace files. Logging is left to the caller
+	static void setup(Config& config);
+
+private:
+	struct QueuedJob {
+		size_t id_ = 0;
+		TransferJob job_;
+		std::promise<TransferResult> result_;
+	};
+
+	struct RunningJob {
+		int priority_ = 0;
+		unsigned weight_ = 0;
+		std::vector<std::string> receivers_;
+		size_t bytes_ = 0;
+	};
+
+	// Set by the thread under the lock once it is done, joined by the next schedule()
+	struct JobThread {
+		std::thread thread_;
+		bool exited_ = false;
+	};
+
+	struct Expected {
+		std::promise<ReceivedFile> file_;
+		std::function<void(const ReceivedFile&)> done_;
+	};
+
+	// Starts the jobs which may run, with the lock held
+	void schedule();
+	std::deque<QueuedJob>::iterator pickJob();
+	void runJob(std::list<JobThread>::iterator self, QueuedJob queued);
+
+	void received(const ReceivedFile& file);
+
+	Config config_;
+	std::shared_ptr<NetworkCommunication> server_;
+	std::unique_ptr<CLI> cli_;
+	std::shared_ptr<PacketPump> pump_;
+
+	std::function<void(const ReceivedFile&)> receive_handler_;
+
+	std::mutex mutex_;
+	std::deque<QueuedJob> jobs_;
+	std::unordered_map<size_t, RunningJob> running_;
+	std::list<JobThread> threads_;
+	std::unordered_map<std::string, Expected> expected_;
+	size_t next_job_ = 1;
+	size_t concurrency_ = 0;
+	bool started_ = false;
+	bool closed_ = false;
+
+	std::atomic<size_t> jobs_done_{0};
+	std::atomic<size_t> jobs_failed_{0};
+	std::atomic<size_t> bytes_sent_{0};
+	std::atomic<size_t> files_received_{0};
+	std::atomic<size_t> bytes_received_{0};
+
+	int sampler_ = 0;
+};
+
+#endif
@@ -0,0 +1,1106 @@
+#include "UdpChannel.h"
+#include "Log.h"
+#include "Metrics.h"
+
+#include <cstring>
+#include <algorithm>
+#include <random>
+#include <chrono>
+
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+
+#include <sys/types.h>
+
+#ifdef WIN32
+#include <windows.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <netdb.h>
+#endif
+
+using namespace std;
+
+enum UdpType {
+	UDP_HANDSHAKE = 1,
+	UDP_HANDSHAKE_ACK,
+	UDP_DATA,
+	UDP_ACK,
+	UDP_FEC,
+	UDP_CLOSE
+};
+
+enum UdpTiming {
+	// Microseconds
+	ACK_INTERVAL = 2000,
+	TIMEOUT_CHECK_INTERVAL = 10000,
+	KEEPALIVE_INTERVAL = 1000000,
+	MINIMUM_RTO = 200000,
+	HANDSHAKE_RESEND = 200000,
+	HANDSHAKE_STAGGER = 100000,
+
+	// Milliseconds
+	IO_POLL_INTERVAL = 50,
+	LINGER_TIME = 3000
+};
+
+enum UdpLimits {
+	HEADER_SIZE = 5,
+	DATA_HEADER_SIZE = HEADER_SIZE + 8,
+	FEC_HEADER_SIZE = HEADER_SIZE + 7,
+	ACK_EVERY = 8,
+	REORDER_THRESHOLD = 3,
+	MINIMUM_CWND = 64,
+	INITIAL_CWND = 64,
+	MINIMUM_RATE = 65536,
+	SEND_BATCH = 32,
+	MAXIMUM_SOCKET_BUFFER = 8388608
+};
+
+static const array<double, 8> g_probe_gains_ = {{ 1.25, 0.75, 1, 1, 1, 1, 1, 1 }};
+static const unsigned char g_magic_[] = { 'T', 'C', 'U', '1' };
+
+UdpOptions UdpChannel::default_options_;
+
+static void write16(unsigned char* data, uint16_t value) {
+	data[0] = (value >> 8) & 0xFF;
+	data[1] = value & 0xFF;
+}
+
+static void write32(unsigned char* data, uint32_t value) {
+	data[0] = (value >> 24) & 0xFF;
+	data[1] = (value >> 16) & 0xFF;
+	data[2] = (value >> 8) & 0xFF;
+	data[3] = value & 0xFF;
+}
+
+static uint16_t read16(const unsigned char* data) {
+	return (data[0] << 8) | data[1];
+}
+
+static uint32_t read32(const unsigned char* data) {
+	return (static_cast<uint32_t>(data[0]) << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+}
+
+static void writeHeader(unsigned char* data, UdpType type, uint32_t session) {
+	data[0] = type;
+	write32(data + 1, session);
+}
+
+static uint64_t steadyMicroseconds() {
+	return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void closeSocket(int socket) {
+#ifdef WIN32
+	closesocket(socket);
+#else
+	::close(socket);
+#endif
+}
+
+static int sendDatagram(int socket, const unsigned char* data, size_t size) {
+#ifdef WIN32
+	return ::send(socket, (const char*)data, size, 0);
+#else
+	return ::send(socket, data, size, 0);
+#endif
+}
+
+static int receiveDatagram(int socket, unsigned char* data, size_t size) {
+#ifdef WIN32
+	return recv(socket, (char*)data, size, 0);
+#else
+	return recv(socket, data, size, 0);
+#endif
+}
+
+// Waits for the socket to be readable
+static bool waitReadable(int socket, size_t microseconds) {
+	fd_set read_set;
+	FD_ZERO(&read_set);
+	FD_SET(socket, &read_set);
+
+	timeval timeout;
+	timeout.tv_sec = microseconds / 1000000;
+	timeout.tv_usec = microseconds % 1000000;
+
+	return select(socket + 1, &read_set, NULL, NULL, &timeout) > 0;
+}
+
+static void setSocketBuffers(int socket, size_t size) {
+	int value = static_cast<int>(min(size, (size_t)MAXIMUM_SOCKET_BUFFER));
+
+	setsockopt(socket, SOL_SOCKET, SO_SNDBUF, reinterpret_cast<const char*>(&value), sizeof(value));
+	setsockopt(socket, SOL_SOCKET, SO_RCVBUF, reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+UdpChannel::UdpChannel(int socket, uint32_t session, size_t rtt_us) : socket_(socket), session_(session), options_(default_options_) {
+	options_.window_ = max(options_.window_, (size_t)MINIMUM_CWND);
+	options_.fec_group_ = min(options_.fec_group_, (size_t)255);
+
+	send_segments_.resize(options_.window_);
+	receive_segments_.resize(options_.window_);
+	round_bandwidth_.fill(0);
+
+	setSocketBuffers(socket_, options_.window_ * UDP_DATAGRAM_SIZE);
+
+	auto current = now();
+	srtt_ = rtt_us;
+	rttvar_ = rtt_us / 2;
+	min_rtt_ = rtt_us;
+	min_rtt_time_ = current;
+	last_receive_time_ = current;
+	last_ack_time_ = current;
+	tokens_time_ = current;
+	cycle_start_ = current;
+
+	// Until the peer tells us, assume it has the same window
+	peer_limit_ = options_.window_;
+	advertised_limit_ = options_.window_;
+
+	// Start out with an initial window per estimated RTT
+	rate_ = max((double)MINIMUM_RATE, INITIAL_CWND * UDP_MSS * 1e6 / max(srtt_, (uint64_t)1000));
+
+	if (options_.max_rate_)
+		rate_ = min(rate_, (double)options_.max_rate_);
+
+	io_thread_ = thread(&UdpChannel::ioLoop, this);
+	sender_thread_ = thread(&UdpChannel::senderLoop, this);
+
+	Log(NETWORK) << "UDP channel " << session_ << " started, window " << options_.window_ << " segments, FEC group " << options_.fec_group_ << ", handshake RTT " << rtt_us / 1000.0 << " ms\n";
+}
+
+UdpChannel::~UdpChannel() {
+	close();
+
+	if (io_thread_.joinable())
+		io_thread_.join();
+
+	if (sender_thread_.joinable())
+		sender_thread_.join();
+
+	closeSocket(socket_);
+
+	auto stats = getStats();
+
+	Log(NETWORK) << "UDP channel " << session_ << " closed, sent " << stats.sent_ << ", retransmitted " << stats.retransmitted_ << ", received " << stats.received_ << ", duplicates " << stats.duplicates_ << ", FEC sent " << stats.fec_sent_ << ", FEC recovered " << stats.fec_recovered_ << endl;
+}
+
+shared_ptr<UdpChannel> UdpChannel::connect(const vector<ResolvedAddress>& addresses, bool fast_fail) {
+	struct Attempt {
+		int socket_;
+		size_t index_;
+		uint64_t sent_time_;
+	};
+
+	random_device device;
+	uint32_t session = 0;
+
+	while (session == 0)
+		session = device();
+
+	array<unsigned char, HEADER_SIZE + 8> handshake;
+	writeHeader(handshake.data(), UDP_HANDSHAKE, session);
+	memcpy(handshake.data() + HEADER_SIZE, g_magic_, sizeof(g_magic_));
+
+	// Same as for TCP, handshakes to the next address start a bit later and the first answer wins
+	vector<Attempt> attempts;
+	size_t next = 0;
+
+	auto start = steadyMicroseconds();
+	auto deadline = start + (fast_fail ? 1500000 : 10000000);
+	uint64_t next_start = start;
+
+	array<unsigned char, UDP_DATAGRAM_SIZE> buffer;
+	shared_ptr<UdpChannel> channel;
+
+	while (!channel && steadyMicroseconds() < deadline) {
+		auto current = steadyMicroseconds();
+
+		if (next < addresses.size() && current >= next_start) {
+			auto& address = addresses.at(next);
+			int udp_socket = socket(address.family_, SOCK_DGRAM, IPPROTO_UDP);
+
+			if (udp_socket >= 0 && ::connect(udp_socket, reinterpret_cast<const sockaddr*>(&address.address_), address.length_) == 0)
+				attempts.push_back({ udp_socket, next, 0 });
+			else if (udp_socket >= 0)
+				closeSocket(udp_socket);
+
+			next++;
+			next_start = current + HANDSHAKE_STAGGER;
+		}
+
+		fd_set read_set;
+		FD_ZERO(&read_set);
+		int highest = 0;
+
+		for (auto& attempt : attempts) {
+			if (current - attempt.sent_time_ >= HANDSHAKE_RESEND) {
+				attempt.sent_time_ = current;
+				write32(handshake.data() + HEADER_SIZE + 4, static_cast<uint32_t>(current));
+				sendDatagram(attempt.socket_, handshake.data(), handshake.size());
+			}
+
+			FD_SET(attempt.socket_, &read_set);
+			highest = max(highest, attempt.socket_);
+		}
+
+		timeval timeout;
+		timeout.tv_sec = 0;
+		timeout.tv_usec = HANDSHAKE_STAGGER / 2;
+
+		if (select(highest + 1, &read_set, NULL, NULL, &timeout) <= 0)
+			continue;
+
+		for (auto iterator = attempts.begin(); iterator != attempts.end(); ++iterator) {
+			if (!FD_ISSET(iterator->socket_, &read_set))
+				continue;
+
+			auto received = receiveDatagram(iterator->socket_, buffer.data(), buffer.size());
+
+			if (received < HEADER_SIZE + 4 || buffer[0] != UDP_HANDSHAKE_ACK || read32(buffer.data() + 1) != session)
+				continue;
+
+			auto rtt = static_cast<uint32_t>(steadyMicroseconds()) - read32(buffer.data() + HEADER_SIZE);
+
+			Log(NETWORK) << "UDP handshake with " << addresses.at(iterator->index_).text_ << " completed\n";
+
+			channel = make_shared<UdpChannel>(iterator->socket_, session, rtt);
+			attempts.erase(iterator);
+
+			break;
+		}
+	}
+
+	// Cancel the others
+	for (auto& attempt : attempts)
+		closeSocket(attempt.socket_);
+
+	if (!channel)
+		Log(NETWORK) << "UDP handshake timed out\n";
+
+	return channel;
+}
+
+int UdpChannel::host(unsigned short port) {
+	// Dual-stack when IPv6 is available
+	int udp_socket = socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP);
+
+	if (udp_socket >= 0) {
+		int off = 0;
+		sockaddr_in6 information;
+		memset(&information, 0, sizeof(information));
+		information.sin6_family = AF_INET6;
+		information.sin6_addr = in6addr_any;
+		information.sin6_port = htons(port);
+
+		if (setsockopt(udp_socket, IPPROTO_IPV6, IPV6_V6ONLY, reinterpret_cast<const char*>(&off), sizeof(off)) == 0 &&
+			::bind(udp_socket, reinterpret_cast<sockaddr*>(&information), sizeof(information)) == 0)
+			return udp_socket;
+
+		closeSocket(udp_socket);
+	}
+
+	udp_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+	if (udp_socket < 0)
+		return -1;
+
+	sockaddr_in information;
+	memset(&information, 0, sizeof(information));
+	information.sin_family = AF_INET;
+	information.sin_addr.s_addr = INADDR_ANY;
+	information.sin_port = htons(port);
+
+	if (::bind(udp_socket, reinterpret_cast<sockaddr*>(&information), sizeof(information)) < 0) {
+		closeSocket(udp_socket);
+
+		return -1;
+	}
+
+	return udp_socket;
+}
+
+shared_ptr<UdpChannel> UdpChannel::accept(int socket) {
+	array<unsigned char, UDP_DATAGRAM_SIZE> buffer;
+	sockaddr_storage from;
+	socklen_t from_length = sizeof(from);
+
+#ifdef WIN32
+	auto received = recvfrom(socket, (char*)buffer.data(), buffer.size(), 0, reinterpret_cast<sockaddr*>(&from), &from_length);
+#else
+	auto received = recvfrom(socket, buffer.data(), buffer.size(), 0, reinterpret_cast<sockaddr*>(&from), &from_length);
+#endif
+
+	if (received < HEADER_SIZE + 8 || buffer[0] != UDP_HANDSHAKE || memcmp(buffer.data() + HEADER_SIZE, g_magic_, sizeof(g_magic_)) != 0) {
+		Log(WARNING) << "Ignoring invalid UDP handshake\n";
+
+		return nullptr;
+	}
+
+	// The socket now only talks to this peer
+	if (::connect(socket, reinterpret_cast<sockaddr*>(&from), from_length) < 0) {
+		Log(WARNING) << "Could not connect UDP socket to peer\n";
+
+		return nullptr;
+	}
+
+	auto session = read32(buffer.data() + 1);
+
+	array<unsigned char, HEADER_SIZE + 4> answer;
+	writeHeader(answer.data(), UDP_HANDSHAKE_ACK, session);
+	memcpy(answer.data() + HEADER_SIZE, buffer.data() + HEADER_SIZE + 4, 4);
+	sendDatagram(socket, answer.data(), answer.size());
+
+	return make_shared<UdpChannel>(socket, session, 0);
+}
+
+void UdpChannel::setOptions(const UdpOptions& options) {
+	default_options_ = options;
+}
+
+int UdpChannel::receive(unsigned char* buffer, size_t size) {
+	unique_lock<mutex> lock(mutex_);
+	app_cv_.wait(lock, [this] { return receive_read_ < receive_next_ || peer_closed_ || closed_; });
+
+	if (receive_read_ == receive_next_)
+		return 0;
+
+	size_t copied = 0;
+
+	while (copied < size && receive_read_ < receive_next_) {
+		auto& segment = receive_segments_.at(receive_read_ % options_.window_);
+		auto amount = min(size - copied, (size_t)segment.length_ - receive_offset_);
+
+		memcpy(buffer + copied, segment.data_.data() + receive_offset_, amount);
+		copied += amount;
+		receive_offset_ += amount;
+
+		if (receive_offset_ == segment.length_) {
+			segment.present_ = false;
+			receive_read_++;
+			receive_offset_ = 0;
+		}
+	}
+
+	// Tell the sender about the freed space before it runs out of window
+	if (receive_read_ + options_.window_ - advertised_limit_ >= options_.window_ / 4) {
+		ack_pending_ = max(ack_pending_, (size_t)ACK_EVERY);
+		sender_cv_.notify_one();
+	}
+
+	return copied;
+}
+
+int UdpChannel::send(const unsigned char* buffer, size_t size) {
+	unique_lock<mutex> lock(mutex_);
+	size_t copied = 0;
+
+	while (copied < size) {
+		if (send_next_ - send_base_ >= options_.window_) {
+			sender_cv_.notify_one();
+			app_cv_.wait(lock, [this] { return send_next_ - send_base_ < options_.window_ || closed_ || peer_closed_; });
+		}
+
+		if (closed_ || peer_closed_)
+			return -1;
+
+		auto& segment = send_segments_.at(send_next_ % options_.window_);
+		auto amount = min(size - copied, (size_t)UDP_MSS);
+
+		memcpy(segment.data_.data(), buffer + copied, amount);
+		segment.length_ = amount;
+		segment.acked_ = false;
+		segment.in_flight_ = false;
+		segment.retransmitted_ = false;
+
+		send_next_++;
+		copied += amount;
+	}
+
+	sender_cv_.notify_one();
+
+	return copied;
+}
+
+void UdpChannel::close() {
+	{
+		unique_lock<mutex> lock(mutex_);
+
+		if (closing_)
+			return;
+
+		closing_ = true;
+
+		// Linger until the peer has everything we sent
+		sender_cv_.notify_one();
+		app_cv_.wait_for(lock, chrono::milliseconds(LINGER_TIME), [this] { return send_base_ >= send_next_ || closed_ || peer_closed_; });
+
+		closed_ = true;
+	}
+
+	array<unsigned char, HEADER_SIZE> datagram;
+	writeHeader(datagram.data(), UDP_CLOSE, session_);
+
+	// Several times since it might be lost
+	for (int i = 0; i < 3; i++)
+		sendDatagram(socket_, datagram.data(), datagram.size());
+
+	app_cv_.notify_all();
+	sender_cv_.notify_all();
+}
+
+UdpStats UdpChannel::getStats() {
+	lock_guard<mutex> lock(mutex_);
+
+	auto stats = stats_;
+	stats.rate_ = rate_;
+	stats.bandwidth_ = bandwidth_;
+	stats.rtt_ = srtt_ / 1000.0;
+
+	return stats;
+}
+
+uint64_t UdpChannel::now() const {
+	return steadyMicroseconds();
+}
+
+// Sequence numbers are 32 bits on the wire, find the 64 bit sequence closest to the reference
+uint64_t UdpChannel::unwrap(uint32_t wire, uint64_t reference) const {
+	uint64_t candidate = (reference & ~static_cast<uint64_t>(0xFFFFFFFF)) | wire;
+
+	if (candidate + 0x80000000ULL < reference)
+		candidate += 0x100000000ULL;
+	else if (candidate > reference + 0x80000000ULL && candidate >= 0x100000000ULL)
+		candidate -= 0x100000000ULL;
+
+	return candidate;
+}
+
+void UdpChannel::transmit(const unsigned char* datagram, size_t size) {
+	if (sendDatagram(socket_, datagram, size) < 0)
+		Log(DEBUG) << "UDP send failed: " << strerror(errno) << endl;
+}
+
+void UdpChannel::ioLoop() {
+	array<unsigned char, UDP_DATAGRAM_SIZE + 64> buffer;
+
+	while (true) {
+		{
+			lock_guard<mutex> lock(mutex_);
+
+			if (closed_)
+				break;
+		}
+
+		if (!waitReadable(socket_, IO_POLL_INTERVAL * 1000))
+			continue;
+
+		auto received = receiveDatagram(socket_, buffer.data(), buffer.size());
+
+		if (received < HEADER_SIZE)
+			continue;
+
+		handleDatagram(buffer.data(), received);
+	}
+}
+
+void UdpChannel::handleDatagram(const unsigned char* data, size_t size) {
+	if (read32(data + 1) != session_)
+		return;
+
+	array<unsigned char, UDP_DATAGRAM_SIZE> answer;
+	size_t answer_size = 0;
+
+	{
+		lock_guard<mutex> lock(mutex_);
+		last_receive_time_ = now();
+
+		switch (data[0]) {
+			case UDP_HANDSHAKE:
+				// Our handshake answer was lost
+				if (size >= HEADER_SIZE + 8) {
+					writeHeader(answer.data(), UDP_HANDSHAKE_ACK, session_);
+					memcpy(answer.data() + HEADER_SIZE, data + HEADER_SIZE + 4, 4);
+					answer_size = HEADER_SIZE + 4;
+				}
+
+				break;
+
+			case UDP_DATA: handleData(data, size);
+				break;
+
+			case UDP_ACK: handleAck(data, size);
+				break;
+
+			case UDP_FEC: handleFec(data, size);
+				break;
+
+			case UDP_CLOSE:
+				peer_closed_ = true;
+				app_cv_.notify_all();
+				break;
+
+			default:
+				break;
+		}
+
+		if (answer_size == 0 && ack_pending_ >= ACK_EVERY)
+			answer_size = buildAck(answer.data());
+	}
+
+	if (answer_size > 0)
+		transmit(answer.data(), answer_size);
+}
+
+bool UdpChannel::storeSegment(uint64_t sequence, const unsigned char* data, size_t length) {
+	auto& segment = receive_segments_.at(sequence % options_.window_);
+
+	// Never overwrite a segment the application has not read yet
+	if (sequence < receive_next_ || (segment.present_ && segment.sequence_ != sequence))
+		return false;
+
+	memcpy(segment.data_.data(), data, length);
+	segment.length_ = length;
+	segment.present_ = true;
+	segment.sequence_ = sequence;
+
+	receive_highest_ = max(receive_highest_, sequence + 1);
+
+	auto previous = receive_next_;
+
+	while (receive_next_ < receive_highest_) {
+		auto& next = receive_segments_.at(receive_next_ % options_.window_);
+
+		if (!next.present_ || next.sequence_ != receive_next_)
+			break;
+
+		receive_next_++;
+	}
+
+	if (receive_next_ != previous)
+		app_cv_.notify_all();
+
+	return true;
+}
+
+void UdpChannel::handleData(const unsigned char* data, size_t size) {
+	if (size <= DATA_HEADER_SIZE || size - DATA_HEADER_SIZE > UDP_MSS)
+		return;
+
+	auto sequence = unwrap(read32(data + HEADER_SIZE), receive_next_);
+	echo_timestamp_ = read32(data + HEADER_SIZE + 4);
+	ack_pending_++;
+
+	auto& segment = receive_segments_.at(sequence % options_.window_);
+
+	if (sequence < receive_next_ || (segment.present_ && segment.sequence_ == sequence)) {
+		stats_.duplicates_++;
+
+		return;
+	}
+
+	// No room until the application reads
+	if (sequence >= receive_read_ + options_.window_)
+		return;
+
+	stats_.received_++;
+	storeSegment(sequence, data + DATA_HEADER_SIZE, size - DATA_HEADER_SIZE);
+
+	// The segment might complete a FEC group with one segment missing
+	auto group = fec_groups_.upper_bound(sequence);
+
+	if (group != fec_groups_.begin()) {
+		group--;
+
+		if (sequence < group->first + group->second.count_)
+			tryRecover(group->first);
+	}
+}
+
+void UdpChannel::handleFec(const unsigned char* data, size_t size) {
+	if (size < FEC_HEADER_SIZE || size - FEC_HEADER_SIZE > UDP_MSS)
+		return;
+
+	auto start = unwrap(read32(data + HEADER_SIZE), receive_next_);
+	auto count = data[HEADER_SIZE + 4];
+
+	// Prune groups which are already complete
+	while (!fec_groups_.empty() && fec_groups_.begin()->first + fec_groups_.begin()->second.count_ <= receive_next_)
+		fec_groups_.erase(fec_groups_.begin());
+
+	if (start + count <= receive_next_ || count == 0)
+		return;
+
+	auto& group = fec_groups_[start];
+	group.count_ = count;
+	group.length_xor_ = read16(data + HEADER_SIZE + 5);
+	group.parity_.fill(0);
+	memcpy(group.parity_.data(), data + FEC_HEADER_SIZE, size - FEC_HEADER_SIZE);
+	group.present_ = true;
+
+	tryRecover(start);
+}
+
+void UdpChannel::tryRecover(uint64_t start) {
+	auto iterator = fec_groups_.find(start);
+
+	if (iterator == fec_groups_.end() || !iterator->second.present_)
+		return;
+
+	auto& group = iterator->second;
+	uint64_t missing = 0;
+	size_t missing_count = 0;
+	bool delivered_gone = false;
+
+	for (uint64_t sequence = start; sequence < start + group.count_; sequence++) {
+		auto& segment = receive_segments_.at(sequence % options_.window_);
+
+		if (segment.present_ && segment.sequence_ == sequence)
+			continue;
+
+		// Members before receive_next_ are delivered, their slot is gone once the application read them
+		if (sequence < receive_next_) {
+			delivered_gone = true;
+
+			continue;
+		}
+
+		missing = sequence;
+		missing_count++;
+	}
+
+	if (missing_count == 0) {
+		fec_groups_.erase(iterator);
+
+		return;
+	}
+
+	if (missing_count > 1 || missing >= receive_read_ + options_.window_)
+		return;
+
+	// The parity cannot be undone without every other member, leave the gap to retransmission
+	if (delivered_gone) {
+		fec_groups_.erase(iterator);
+
+		return;
+	}
+
+	// XOR of the parity and every other segment gives the missing one
+	array<unsigned char, UDP_MSS> data = group.parity_;
+	uint16_t length = group.length_xor_;
+
+	for (uint64_t sequence = start; sequence < start + group.count_; sequence++) {
+		if (sequence == missing)
+			continue;
+
+		auto& segment = receive_segments_.at(sequence % options_.window_);
+		length ^= segment.length_;
+
+		for (size_t i = 0; i < segment.length_; i++)
+			data[i] ^= segment.data_[i];
+	}
+
+	fec_groups_.erase(iterator);
+
+	if (length == 0 || length > UDP_MSS)
+		return;
+
+	if (storeSegment(missing, data.data(), length))
+		stats_.fec_recovered_++;
+}
+
+size_t UdpChannel::buildAck(unsigned char* datagram) {
+	writeHeader(datagram, UDP_ACK, session_);
+
+	advertised_limit_ = receive_read_ + options_.window_;
+
+	write32(datagram + HEADER_SIZE, static_cast<uint32_t>(receive_next_));
+	write32(datagram + HEADER_SIZE + 4, static_cast<uint32_t>(advertised_limit_));
+	write32(datagram + HEADER_SIZE + 8, echo_timestamp_);
+
+	// Selective acknowledgement of the segments received beyond the first gap
+	size_t size = HEADER_SIZE + 13;
+	unsigned char ranges = 0;
+	uint64_t sequence = receive_next_;
+
+	while (sequence < receive_highest_ && ranges < UDP_MAX_SACK_RANGES) {
+		auto present = [this] (uint64_t current) {
+			auto& segment = receive_segments_.at(current % options_.window_);
+
+			return segment.present_ && segment.sequence_ == current;
+		};
+
+		while (sequence < receive_highest_ && !present(sequence))
+			sequence++;
+
+		if (sequence >= receive_highest_)
+			break;
+
+		auto start = sequence;
+
+		while (sequence < receive_highest_ && present(sequence))
+			sequence++;
+
+		write32(datagram + size, static_cast<uint32_t>(start));
+		write32(datagram + size + 4, static_cast<uint32_t>(sequence));
+		size += 8;
+		ranges++;
+	}
+
+	datagram[HEADER_SIZE + 12] = ranges;
+
+	ack_pending_ = 0;
+	last_ack_time_ = now();
+
+	return size;
+}
+
+void UdpChannel::acknowledge(uint64_t sequence, uint64_t current) {
+	auto& segment = send_segments_.at(sequence % options_.window_);
+
+	if (segment.acked_)
+		return;
+
+	segment.acked_ = true;
+
+	if (segment.in_flight_) {
+		segment.in_flight_ = false;
+		in_flight_--;
+	}
+
+	delivered_ += segment.length_;
+	delivered_time_ = current;
+
+	// Delivery rate since the segment was sent
+	if (current > segment.delivered_time_) {
+		double sample = (delivered_ - segment.delivered_) * 1e6 / (current - segment.delivered_time_);
+
+		if (segment.delivered_ >= next_round_delivered_) {
+			round_++;
+			next_round_delivered_ = delivered_;
+			round_bandwidth_[round_ % UDP_BANDWIDTH_ROUNDS] = 0;
+		}
+
+		auto& round_max = round_bandwidth_[round_ % UDP_BANDWIDTH_ROUNDS];
+		round_max = max(round_max, sample);
+	}
+}
+
+void UdpChannel::handleAck(const unsigned char* data, size_t size) {
+	if (size < HEADER_SIZE + 13)
+		return;
+
+	auto current = now();
+	auto cumulative = min(unwrap(read32(data + HEADER_SIZE), send_base_), send_transmit_);
+	auto limit = unwrap(read32(data + HEADER_SIZE + 4), send_base_);
+	auto ranges = min((size_t)data[HEADER_SIZE + 12], (size - HEADER_SIZE - 13) / 8);
+
+	peer_limit_ = max(peer_limit_, limit);
+
+	auto highest = cumulative;
+	auto previous_delivered = delivered_;
+
+	for (auto sequence = send_base_; sequence < cumulative; sequence++)
+		acknowledge(sequence, current);
+
+	send_base_ = max(send_base_, cumulative);
+
+	for (size_t i = 0; i < ranges; i++) {
+		auto start = max(unwrap(read32(data + HEADER_SIZE + 13 + i * 8), send_base_), send_base_);
+		auto end = min(unwrap(read32(data + HEADER_SIZE + 17 + i * 8), send_base_), send_transmit_);
+
+		for (auto sequence = start; sequence < end; sequence++)
+			acknowledge(sequence, current);
+
+		highest = max(highest, end);
+	}
+
+	// RTT from the echoed timestamp (RFC 6298 smoothing), only when the ACK answers new data since keepalive and
+	// window update ACKs echo the timestamp of whatever data segment arrived last
+	uint64_t rtt = static_cast<uint32_t>(static_cast<uint32_t>(current) - read32(data + HEADER_SIZE + 8));
+
+	if (delivered_ != previous_delivered && rtt < 60000000) {
+		if (srtt_ == 0) {
+			srtt_ = rtt;
+			rttvar_ = rtt / 2;
+		} else {
+			rttvar_ = (3 * rttvar_ + (srtt_ > rtt ? srtt_ - rtt : rtt - srtt_)) / 4;
+			srtt_ = (7 * srtt_ + rtt) / 8;
+		}
+
+		// The minimum expires so route changes are picked up
+		if (min_rtt_ == 0 || rtt < min_rtt_ || current - min_rtt_time_ > 10000000) {
+			min_rtt_ = rtt;
+			min_rtt_time_ = current;
+		}
+	}
+
+	// Anything delivered means the path works, only back off while nothing gets through
+	if (delivered_ != previous_delivered)
+		rto_backoff_ = 1;
+
+	detectLoss(highest);
+	updateCongestion(current);
+
+	app_cv_.notify_all();
+	sender_cv_.notify_one();
+}
+
+// Segments far enough behind an acknowledged one are lost
+void UdpChannel::detectLoss(uint64_t highest_acked) {
+	if (highest_acked < REORDER_THRESHOLD)
+		return;
+
+	auto end = highest_acked - REORDER_THRESHOLD;
+
+	for (auto sequence = max(loss_scanned_, send_base_); sequence < end; sequence++) {
+		auto& segment = send_segments_.at(sequence % options_.window_);
+
+		if (segment.in_flight_ && !segment.acked_) {
+			segment.in_flight_ = false;
+			in_flight_--;
+			retransmit_.push_back(sequence);
+		}
+	}
+
+	loss_scanned_ = max(loss_scanned_, end);
+}
+
+void UdpChannel::checkTimeouts(uint64_t current) {
+	// Backs off while timeouts repeat without progress, queues along the path inflate the RTT quickly
+	auto rto = max((uint64_t)MINIMUM_RTO, srtt_ + 4 * rttvar_ + 2 * ACK_INTERVAL) * rto_backoff_;
+	bool timed_out = false;
+
+	for (auto sequence = send_base_; sequence < send_transmit_; sequence++) {
+		auto& segment = send_segments_.at(sequence % options_.window_);
+
+		if (segment.in_flight_ && !segment.acked_ && current - segment.sent_time_ > rto) {
+			segment.in_flight_ = false;
+			in_flight_--;
+			retransmit_.push_back(sequence);
+			timed_out = true;
+		}
+	}
+
+	if (timed_out)
+		rto_backoff_ = min(rto_backoff_ * 2, (uint64_t)64);
+
+	if (current - last_receive_time_ > options_.timeout_ * 1000) {
+		Log(NETWORK) << "UDP channel " << session_ << " timed out\n";
+
+		closed_ = true;
+		peer_closed_ = true;
+		app_cv_.notify_all();
+	}
+}
+
+void UdpChannel::updateCongestion(uint64_t current) {
+	bandwidth_ = *max_element(round_bandwidth_.begin(), round_bandwidth_.end());
+
+	double bdp = bandwidth_ * min_rtt_ / 1e6;
+
+	switch (state_) {
+		case STATE_STARTUP:
+			// Leave startup when the bandwidth stops growing for three rounds
+			if (round_ != checked_round_ && bandwidth_ > 0) {
+				checked_round_ = round_;
+
+				if (bandwidth_ >= full_bandwidth_ * 1.25) {
+					full_bandwidth_ = bandwidth_;
+					full_bandwidth_rounds_ = 0;
+				} else if (++full_bandwidth_rounds_ >= 3) {
+					state_ = STATE_DRAIN;
+					pacing_gain_ = 1 / 2.885;
+				}
+			}
+
+			break;
+
+		case STATE_DRAIN:
+			if (in_flight_ * UDP_MSS <= bdp) {
+				state_ = STATE_PROBE_BANDWIDTH;
+				cycle_index_ = 0;
+				cycle_start_ = current;
+				pacing_gain_ = g_probe_gains_[cycle_index_];
+				cwnd_gain_ = 2;
+			}
+
+			break;
+
+		case STATE_PROBE_BANDWIDTH:
+			if (current - cycle_start_ > max(min_rtt_, (uint64_t)ACK_INTERVAL)) {
+				cycle_index_ = (cycle_index_ + 1) % g_probe_gains_.size();
+				cycle_start_ = current;
+				pacing_gain_ = g_probe_gains_[cycle_index_];
+			}
+
+			break;
+	}
+
+	if (bandwidth_ > 0)
+		rate_ = max((double)MINIMUM_RATE, pacing_gain_ * bandwidth_);
+
+	if (options_.max_rate_)
+		rate_ = min(rate_, (double)options_.max_rate_);
+}
+
+bool UdpChannel::hasWork() const {
+	// Acknowledgement delay and aggregation needs room in the window as well
+	double bdp = bandwidth_ * (min_rtt_ + 2 * ACK_INTERVAL) / 1e6;
+	size_t cwnd = bandwidth_ > 0 ? max((size_t)(cwnd_gain_ * bdp / UDP_MSS), (size_t)MINIMUM_CWND) : (size_t)INITIAL_CWND;
+
+	if (fec_ready_)
+		return true;
+
+	if (in_flight_ >= cwnd)
+		return false;
+
+	return !retransmit_.empty() || (send_transmit_ < send_next_ && send_transmit_ < peer_limit_);
+}
+
+size_t UdpChannel::buildData(uint64_t sequence, unsigned char* datagram, uint64_t current) {
+	auto& segment = send_segments_.at(sequence % options_.window_);
+
+	// Nothing in flight, the delivery rate should not include the idle time
+	if (in_flight_ == 0)
+		delivered_time_ = current;
+
+	segment.in_flight_ = true;
+	segment.sent_time_ = current;
+	segment.delivered_ = delivered_;
+	segment.delivered_time_ = delivered_time_;
+	in_flight_++;
+
+	writeHeader(datagram, UDP_DATA, session_);
+	write32(datagram + HEADER_SIZE, static_cast<uint32_t>(sequence));
+	write32(datagram + HEADER_SIZE + 4, static_cast<uint32_t>(current));
+	memcpy(datagram + DATA_HEADER_SIZE, segment.data_.data(), segment.length_);
+
+	return DATA_HEADER_SIZE + segment.length_;
+}
+
+void UdpChannel::addToFec(const SendSegment& segment, uint64_t sequence) {
+	if (fec_count_ == 0) {
+		fec_group_start_ = sequence;
+		fec_parity_.fill(0);
+		fec_length_xor_ = 0;
+		fec_max_length_ = 0;
+	}
+
+	for (size_t i = 0; i < segment.length_; i++)
+		fec_parity_[i] ^= segment.data_[i];
+
+	fec_length_xor_ ^= segment.length_;
+	fec_max_length_ = max(fec_max_length_, segment.length_);
+	fec_count_++;
+
+	if (fec_count_ >= options_.fec_group_)
+		fec_ready_ = true;
+}
+
+size_t UdpChannel::buildFec(unsigned char* datagram) {
+	writeHeader(datagram, UDP_FEC, session_);
+	write32(datagram + HEADER_SIZE, static_cast<uint32_t>(fec_group_start_));
+	datagram[HEADER_SIZE + 4] = fec_count_;
+	write16(datagram + HEADER_SIZE + 5, fec_length_xor_);
+	memcpy(datagram + FEC_HEADER_SIZE, fec_parity_.data(), fec_max_length_);
+
+	auto size = FEC_HEADER_SIZE + fec_max_length_;
+
+	fec_count_ = 0;
+	fec_ready_ = false;
+	stats_.fec_sent_++;
+
+	return size;
+}
+
+void UdpChannel::senderLoop() {
+	vector<array<unsigned char, UDP_DATAGRAM_SIZE>> datagrams(SEND_BATCH);
+	vector<size_t> sizes(SEND_BATCH);
+
+	unique_lock<mutex> lock(mutex_);
+
+	while (!closed_) {
+		auto current = now();
+		size_t count = 0;
+
+		if (current - last_timeout_check_ >= TIMEOUT_CHECK_INTERVAL) {
+			checkTimeouts(current);
+			last_timeout_check_ = current;
+
+			if (closed_)
+				break;
+		}
+
+		// Delayed acknowledgements, window updates and keepalive
+		if ((ack_pending_ > 0 && current - last_ack_time_ >= ACK_INTERVAL) || ack_pending_ >= ACK_EVERY || current - last_ack_time_ >= KEEPALIVE_INTERVAL)
+			sizes[count++] = buildAck(datagrams[0].data());
+
+		// Pacing, allow bursts of about a millisecond
+		tokens_ = min(tokens_ + rate_ * (current - tokens_time_) / 1e6, max(2.0 * UDP_DATAGRAM_SIZE, rate_ / 1000));
+		tokens_time_ = current;
+
+		while (count < SEND_BATCH && tokens_ >= UDP_DATAGRAM_SIZE && hasWork()) {
+			auto* datagram = datagrams[count].data();
+
+			if (fec_ready_) {
+				sizes[count] = buildFec(datagram);
+			} else if (!retransmit_.empty()) {
+				auto sequence = retransmit_.front();
+				retransmit_.pop_front();
+
+				auto& segment = send_segments_.at(sequence % options_.window_);
+
+				if (sequence < send_base_ || segment.acked_ || segment.in_flight_)
+					continue;
+
+				segment.retransmitted_ = true;
+				sizes[count] = buildData(sequence, datagram, current);
+				stats_.retransmitted_++;
+				Metrics::add(METRIC_RETRANSMITS);
+			} else {
+				auto sequence = send_transmit_++;
+				sizes[count] = buildData(sequence, datagram, current);
+
+				if (options_.fec_group_ > 0)
+					addToFec(send_segments_.at(sequence % options_.window_), sequence);
+			}
+
+			tokens_ -= sizes[count];
+			stats_.sent_++;
+			count++;
+		}
+
+		// Flush a partial FEC group when there is nothing more to send right now
+		if (fec_count_ > 0 && !fec_ready_ && send_transmit_ >= send_next_)
+			fec_ready_ = true;
+
+		if (count > 0) {
+			lock.unlock();
+
+			for (size_t i = 0; i < count; i++)
+				transmit(datagrams[i].data(), sizes[i]);
+
+			lock.lock();
+
+			continue;
+		}
+
+		// Sleep until there are tokens for the next datagram, or the next timer
+		uint64_t wait = TIMEOUT_CHECK_INTERVAL;
+
+		if (hasWork())
+			wait = max((uint64_t)20, static_cast<uint64_t>((UDP_DATAGRAM_SIZE - tokens_) * 1e6 / rate_));
+		else if (ack_pending_ > 0)
+			wait = ACK_INTERVAL;
+
+		sender_cv_.wait_for(lock, chrono::microseconds(wait));
+	}
+}
@@ -0,0 +1,211 @@
+#pragma once
+#ifndef UDP_CHANNEL_H
+#define UDP_CHANNEL_H
+
+#include "Channel.h"
+#include "Resolver.h"
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <array>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <cstdint>
+
+enum UdpConstants {
+	UDP_MSS = 1380,
+	UDP_DATAGRAM_SIZE = 1472,
+	UDP_MAX_SACK_RANGES = 32,
+	UDP_BANDWIDTH_ROUNDS = 10
+};
+
+struct UdpOptions {
+	// Segments in flight or waiting to be read, per direction
+	size_t window_			= 8192;
+	// Data segments per XOR parity segment, 0 disables forward error correction
+	size_t fec_group_		= 0;
+	// Pacing rate cap (bytes/s), 0 is unlimited
+	size_t max_rate_		= 0;
+	// Milliseconds without hearing from the peer before the channel is closed
+	size_t timeout_			= 10000;
+};
+
+struct UdpStats {
+	size_t sent_			= 0;
+	size_t retransmitted_	= 0;
+	size_t received_		= 0;
+	size_t duplicates_		= 0;
+	size_t fec_sent_		= 0;
+	size_t fec_recovered_	= 0;
+
+	double rate_			= 0;
+	double bandwidth_		= 0;
+	double rtt_				= 0;
+};
+
+// Reliable byte stream over UDP with rate-based congestion control (BBR-like), selective
+// acknowledgements and optional XOR forward error correction
+class UdpChannel : public Channel {
+public:
+	UdpChannel(int socket, uint32_t session, size_t rtt_us);
+	~UdpChannel();
+
+	// Handshakes with all addresses of a hosted channel, the first one to answer is used
+	static std::shared_ptr<UdpChannel> connect(const std::vector<ResolvedAddress>& addresses, bool fast_fail);
+
+	// Binds a socket for incoming handshakes, returns -1 on failure
+	static int host(unsigned short port);
+
+	// Reads a handshake from a hosting socket, which then belongs to the channel
+	static std::shared_ptr<UdpChannel> accept(int socket);
+
+	static void setOptions(const UdpOptions& options);
+
+	int receive(unsigned char* buffer, size_t size) override;
+	int send(const unsigned char* buffer, size_t size) override;
+	void close() override;
+
+	UdpStats getStats();
+
+private:
+	struct SendSegment {
+		std::array<unsigned char, UDP_MSS> data_;
+		uint16_t length_		= 0;
+
+		bool acked_				= false;
+		bool in_flight_			= false;
+		bool retransmitted_		= false;
+
+		uint64_t sent_time_		= 0;
+		uint64_t delivered_		= 0;
+		uint64_t delivered_time_ = 0;
+	};
+
+	struct ReceiveSegment {
+		std::array<unsigned char, UDP_MSS> data_;
+		uint16_t length_		= 0;
+		bool present_			= false;
+		// Slots are reused, data is only valid for this sequence
+		uint64_t sequence_		= 0;
+	};
+
+	struct FecGroup {
+		std::array<unsigned char, UDP_MSS> parity_;
+		uint16_t length_xor_	= 0;
+		uint8_t count_			= 0;
+		bool present_			= false;
+	};
+
+	enum CongestionState {
+		STATE_STARTUP,
+		STATE_DRAIN,
+		STATE_PROBE_BANDWIDTH
+	};
+
+	void ioLoop();
+	void senderLoop();
+
+	void handleDatagram(const unsigned char* data, size_t size);
+	void handleData(const unsigned char* data, size_t size);
+	void handleAck(const unsigned char* data, size_t size);
+	void handleFec(const unsigned char* data, size_t size);
+
+	bool storeSegment(uint64_t sequence, const unsigned char* data, size_t length);
+	void tryRecover(uint64_t group);
+	void acknowledge(uint64_t sequence, uint64_t now);
+	void updateCongestion(uint64_t now);
+	void detectLoss(uint64_t highest_acked);
+	void checkTimeouts(uint64_t now);
+
+	size_t buildAck(unsigned char* datagram);
+	size_t buildData(uint64_t sequence, unsigned char* datagram, uint64_t now);
+	size_t buildFec(unsigned char* datagram);
+	void addToFec(const SendSegment& segment, uint64_t sequence);
+
+	bool hasWork() const;
+	uint64_t now() const;
+	uint64_t unwrap(uint32_t wire, uint64_t reference) const;
+	void transmit(const unsigned char* datagram, size_t size);
+
+	int socket_;
+	uint32_t session_;
+	UdpOptions options_;
+
+	std::mutex mutex_;
+	std::condition_variable app_cv_;
+	std::condition_variable sender_cv_;
+
+	std::thread io_thread_;
+	std::thread sender_thread_;
+
+	bool closing_				= false;
+	bool closed_				= false;
+	bool peer_closed_			= false;
+
+	// Sender
+	std::vector<SendSegment> send_segments_;
+	uint64_t send_base_			= 0;
+	uint64_t send_next_			= 0;
+	uint64_t send_transmit_		= 0;
+	uint64_t peer_limit_		= 0;
+	uint64_t loss_scanned_		= 0;
+	std::deque<uint64_t> retransmit_;
+	size_t in_flight_			= 0;
+
+	// Congestion control
+	CongestionState state_		= STATE_STARTUP;
+	uint64_t delivered_			= 0;
+	uint64_t delivered_time_	= 0;
+	uint64_t round_				= 0;
+	uint64_t next_round_delivered_ = 0;
+	std::array<double, UDP_BANDWIDTH_ROUNDS> round_bandwidth_;
+	double bandwidth_			= 0;
+	double full_bandwidth_		= 0;
+	size_t full_bandwidth_rounds_ = 0;
+	uint64_t checked_round_		= 0;
+	size_t cycle_index_			= 0;
+	uint64_t cycle_start_		= 0;
+	double pacing_gain_			= 2.885;
+	double cwnd_gain_			= 2.885;
+	double rate_				= 0;
+	double tokens_				= 0;
+	uint64_t tokens_time_		= 0;
+
+	uint64_t srtt_				= 0;
+	uint64_t rttvar_			= 0;
+	uint64_t min_rtt_			= 0;
+	uint64_t min_rtt_time_		= 0;
+	uint64_t last_timeout_check_ = 0;
+	uint64_t rto_backoff_		= 1;
+
+	// Forward error correction (sender)
+	std::array<unsigned char, UDP_MSS> fec_parity_;
+	uint16_t fec_length_xor_	= 0;
+	uint16_t fec_max_length_	= 0;
+	uint8_t fec_count_			= 0;
+	uint64_t fec_group_start_	= 0;
+	bool fec_ready_				= false;
+
+	// Receiver
+	std::vector<ReceiveSegment> receive_segments_;
+	uint64_t receive_read_		= 0;
+	size_t receive_offset_		= 0;
+	uint64_t receive_next_		= 0;
+	uint64_t receive_highest_	= 0;
+	uint64_t advertised_limit_	= 0;
+	std::map<uint64_t, FecGroup> fec_groups_;
+	size_t ack_pending_			= 0;
+	uint32_t echo_timestamp_	= 0;
+	uint64_t last_ack_time_		= 0;
+	uint64_t last_receive_time_	= 0;
+
+	UdpStats stats_;
+
+	static UdpOptions default_options_;
+};
+
+#endif